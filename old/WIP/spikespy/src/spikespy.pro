@@ -80,8 +80,8 @@ HEADERS += get_pca_features.h get_principal_components.h eigenvalue_decompositio
 SOURCES += get_pca_features.cpp get_principal_components.cpp eigenvalue_decomposition.cpp
 HEADERS += affinetransformation.h
 SOURCES += affinetransformation.cpp
-HEADERS += compute_templates_0.h
-SOURCES += compute_templates_0.cpp
+HEADERS += compute_templates_0.h template_accumulator.h
+SOURCES += compute_templates_0.cpp template_accumulator.cpp
 
 #DEFINES += USE_REMOTE_MDA
 INCLUDEPATH += ../../common/mda
@@ -286,4 +286,12 @@ private:
     Operator m_operator;
 };
 
+/*!
+ * Returns the integer counter "<name>_thread_<k>" belonging to the calling thread,
+ * where k numbers threads in order of first use. The counter is created and
+ * registered with the ObjectRegistry on first use. Returns 0 when there is no
+ * ICounterManager or it has no counter called name.
+ */
+IIntCounter* perThreadIntCounter(const QString& name);
+
 #endif // ICOUNTER_H
@@ -0,0 +1,58 @@
+/******************************************************
+** See the accompanying README and LICENSE files
+*******************************************************/
+
+#ifndef CHUNKPIPELINE_H
+#define CHUNKPIPELINE_H
+
+#include "diskreadmda32.h"
+#include "diskwritemda.h"
+#include <functional>
+
+struct ChunkPipelineOpts {
+    bigint chunk_size = 100000; //number of timepoints per chunk (excluding the overlap)
+    bigint overlap_size = 0; //number of extra timepoints read on each side of a chunk
+    int num_threads = 0; //number of kernel threads, 0 means QThread::idealThreadCount()
+    int queue_size = 0; //maximum number of chunks in flight (read but not yet written), 0 means 2*num_threads
+    bool verbose = true; //print progress every few seconds
+};
+
+struct ChunkPipelineChunk {
+    bigint index = 0; //0-based chunk number
+    bigint t1 = 0; //first timepoint of the chunk, not counting the overlap
+    bigint size = 0; //number of timepoints of the chunk, not counting the overlap (smaller for the last chunk)
+    int thread_index = 0; //in [0,num_threads), stable for a given kernel thread -- use it to index per-thread state
+    ///Input: M x (chunk_size + 2*overlap_size), starting at timepoint t1-overlap_size and zero-padded past either end of the array
+    Mda32 data;
+    ///Output: when the pipeline has an output, the kernel sets this to the M2 x size chunk that gets written at timepoint t1
+    Mda32 output;
+};
+
+class ChunkPipelinePrivate;
+/**
+ * \class ChunkPipeline
+ * @brief Runs a kernel over consecutive (overlapping) time chunks of a timeseries, overlapping I/O with computation.
+ *
+ * A reader thread reads ahead into a bounded queue, the kernel runs on num_threads worker threads,
+ * and (if setOutput() was called) the outputs are written in order by the thread that called run().
+ */
+class ChunkPipeline {
+public:
+    friend class ChunkPipelinePrivate;
+    typedef std::function<bool(ChunkPipelineChunk& chunk)> Kernel;
+
+    ChunkPipeline(const DiskReadMda32& X, const ChunkPipelineOpts& opts);
+    virtual ~ChunkPipeline();
+
+    ///The number of kernel threads that run() will use
+    int numThreads() const;
+    ///Write the kernel outputs in order through Y (which must already be open)
+    void setOutput(DiskWriteMda* Y);
+    ///Blocks until every chunk has been processed (and written). Returns false if a read, the kernel or a write fails.
+    bool run(Kernel kernel);
+
+private:
+    ChunkPipelinePrivate* d;
+};
+
+#endif // CHUNKPIPELINE_H
@@ -0,0 +1,52 @@
+/******************************************************
+** See the accompanying README and LICENSE files
+*******************************************************/
+
+#ifndef CLIPEXTRACTOR_H
+#define CLIPEXTRACTOR_H
+
+#include "diskreadmda32.h"
+#include "diskwritemda.h"
+
+struct ClipExtractorOpts {
+    bigint max_block_bytes = 64 * 1024 * 1024; //maximum size of a single coalesced read (all channels), a block always holds at least one clip
+    bigint max_gap = 20000; //clips separated by more than this many timepoints are not read together
+    bigint batch_size = 0; //number of clips per batch in writeClips(), 0 means about 256 MB worth of clips
+    int num_threads = 0; //number of reading/gathering threads, 0 means QThread::idealThreadCount() -- pass 1 when calling from inside a parallel loop
+};
+
+class ClipExtractorPrivate;
+/**
+ * \class ClipExtractor
+ * @brief Extracts M x T clips centered at a list of event times, using a few large reads instead of one read per clip.
+ *
+ * The events of a batch are sorted by time and nearby events are coalesced into blocks.
+ * The blocks are read concurrently and the clips gathered from them in parallel, into the original event order.
+ * As in extract_clips, clip i covers timepoints t-Tmid..t-Tmid+T-1 with t=times[i] and Tmid=(T+1)/2-1,
+ * and is zero-padded past either end of the timeseries.
+ */
+class ClipExtractor {
+public:
+    friend class ClipExtractorPrivate;
+    ClipExtractor(const DiskReadMda32& X, const QVector<double>& times, bigint clip_size, const ClipExtractorOpts& opts = ClipExtractorOpts());
+    virtual ~ClipExtractor();
+
+    ///Restrict the clips to these (1-based) channels. By default all channels are used.
+    void setChannels(const QList<int>& channels);
+
+    bigint numClips() const;
+    ///The number of clips per batch used by writeClips() -- also a sensible batch size for callers that accumulate over the clips
+    bigint batchSize() const;
+
+    ///Clips i1..i2-1 as an M2 x T x (i2-i1) array
+    bool extractClips(Mda32& clips, bigint i1, bigint i2);
+    ///All the clips, M2 x T x L
+    bool extractClips(Mda32& clips);
+    ///Write all the clips through Y (which must already be open with size M2 x T x L), one contiguous batch at a time
+    bool writeClips(DiskWriteMda& Y);
+
+private:
+    ClipExtractorPrivate* d;
+};
+
+#endif // CLIPEXTRACTOR_H
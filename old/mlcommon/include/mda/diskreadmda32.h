@@ -14,10 +14,19 @@ class DiskReadMda32Private;
  * \class DiskReadMda32
  * @brief Read-only access to a .mda file, especially useful for huge arrays that cannot be practically loaded into memory.
  *
+ * The readChunk() and value() methods may be called concurrently from several threads on the same object.
+ *
  * See also Mda32
  */
 class DiskReadMda32 {
 public:
+    ///Hint passed to the kernel (via madvise) when the file is memory-mapped
+    enum AccessPattern {
+        NormalAccess,
+        SequentialAccess,
+        RandomAccess
+    };
+
     friend class DiskReadMda32Private;
     DiskReadMda32(const QString& path = ""); ///Constructor pointing to the .mda file specified by path (file name).
     DiskReadMda32(const DiskReadMda32& other); ///Copy constructor
@@ -34,6 +43,12 @@ public:
     void setConcatPaths(int concat_dimension, const QStringList& paths);
     void setConcatDirectory(int concat_dimension, const QString& dir_path);
 
+    ///Read through a read-only memory mapping of the file rather than fseeko/fread. Off by default.
+    void setMemoryMapped(bool val);
+    bool isMemoryMapped() const;
+    ///Only has an effect when memory-mapped
+    void setAccessPattern(AccessPattern pattern);
+
     QString makePath() const; //not capturing the reshaping
     QJsonObject toPrvObject() const;
 
@@ -58,6 +73,9 @@ public:
     bool readChunk(Mda32& X, bigint i1, bigint i2, bigint size1, bigint size2) const;
     ///Retrieve a chunk of the vectorized data of size N1xN2xN3 starting at position (i1,i2,i3)
     bool readChunk(Mda32& X, bigint i1, bigint i2, bigint i3, bigint size1, bigint size2, bigint size3) const;
+    ///Zero-copy read-only view of size entries of the vectorized data starting at position i. Returns 0 (use readChunk() instead) unless the array is in memory or memory-mapped with on-disk type float32.
+    ///The pointer is valid until this object is destroyed or its path is changed.
+    const dtype32* readChunkView(bigint i, bigint size) const;
 
     ///A slow method to retrieve the value at location i of the vectorized array for example value(3+4*N1())==value(3,4). Consider using readChunk() instead
     dtype32 value(bigint i) const;
@@ -38,6 +38,8 @@ public:
     virtual ~Mda32();
     ///Allocate an array of size N1xN2x...xN6
     bool allocate(bigint N1, bigint N2, bigint N3 = 1, bigint N4 = 1, bigint N5 = 1, bigint N6 = 1);
+    ///Like allocate, but without zero-filling: keeps the current buffer if it already has this shape (and is not shared), so the contents are undefined
+    bool reallocate(bigint N1, bigint N2, bigint N3 = 1, bigint N4 = 1, bigint N5 = 1, bigint N6 = 1);
 #ifdef QT_CORE_LIB
     ///Create an array with content read from the .mda file specified by path
     bool read(const QString& path);
@@ -6,6 +6,7 @@
 #include <objectregistry.h>
 #include <cstring>
 #include "mlcommon.h"
+#include "mdaarena.h"
 
 #define MDA_MAX_DIMS 6
 
@@ -28,6 +29,7 @@ public:
             freedCounter = static_cast<IIntCounter*>(manager->counter("freed_bytes"));
             bytesReadCounter = static_cast<IIntCounter*>(manager->counter("bytes_read"));
             bytesWrittenCounter = static_cast<IIntCounter*>(manager->counter("bytes_written"));
+            reusedCounter = static_cast<IIntCounter*>(manager->counter("arena_reused_bytes"));
         }
     }
     MdaData(const MdaData& other)
@@ -39,6 +41,7 @@ public:
         , freedCounter(other.freedCounter)
         , bytesReadCounter(other.bytesReadCounter)
         , bytesWrittenCounter(other.bytesWrittenCounter)
+        , reusedCounter(other.reusedCounter)
     {
         allocate(total_size);
         std::copy(other.m_data, other.m_data + other.totalSize(), m_data);
@@ -48,6 +51,31 @@ public:
         deallocate();
     }
     bool allocate(T value, bigint N1, bigint N2, bigint N3 = 1, bigint N4 = 1, bigint N5 = 1, bigint N6 = 1)
+    {
+        if (!allocate_uninitialized(N1, N2, N3, N4, N5, N6))
+            return false;
+        if (totalSize() > 0) {
+            if (value == 0.0) {
+                std::memset(data(), 0, totalSize() * sizeof(value_type));
+            }
+            else
+                std::fill(data(), data() + totalSize(), value);
+        }
+        return true;
+    }
+    //like allocate, but the contents are undefined, and the current buffer is kept when it already has this shape
+    bool reallocate(bigint N1, bigint N2, bigint N3 = 1, bigint N4 = 1, bigint N5 = 1, bigint N6 = 1)
+    {
+        if ((m_data) && ((bigint)m_dims.size() == MDA_MAX_DIMS)
+            && (N1 == m_dims[0]) && (N2 == m_dims[1]) && (N3 == m_dims[2])
+            && (N4 == m_dims[3]) && (N5 == m_dims[4]) && (N6 == m_dims[5])) {
+            MdaArena::recordReuse(totalSize() * sizeof(value_type));
+            incrementBytesReusedCounter(totalSize() * sizeof(value_type));
+            return true;
+        }
+        return allocate_uninitialized(N1, N2, N3, N4, N5, N6);
+    }
+    bool allocate_uninitialized(bigint N1, bigint N2, bigint N3, bigint N4, bigint N5, bigint N6)
     {
         deallocate();
         setDims(N1, N2, N3, N4, N5, N6);
@@ -62,11 +90,6 @@ public:
                 qCritical() << QString("Unable to allocate Mda of size %1x%2x%3x%4x%5x%6 (total=%7)").arg(N1).arg(N2).arg(N3).arg(N4).arg(N5).arg(N6).arg(totalSize());
                 exit(-1);
             }
-            if (value == 0.0) {
-                std::memset(data(), 0, totalSize() * sizeof(value_type));
-            }
-            else
-                std::fill(data(), data() + totalSize(), value);
         }
         return true;
     }
@@ -78,16 +101,19 @@ public:
     void allocate(bigint size)
     {
         //m_data = (value_type*)::allocate(size * sizeof(value_type));
-        m_data = (value_type*)malloc(size * sizeof(value_type));
+        bool reused = false;
+        m_data = (value_type*)MdaArena::acquire(size * sizeof(value_type), &reused);
         if (!m_data)
             return;
         incrementBytesAllocatedCounter(totalSize() * sizeof(value_type));
+        if (reused)
+            incrementBytesReusedCounter(totalSize() * sizeof(value_type));
     }
     void deallocate()
     {
         if (!m_data)
             return;
-        free(m_data);
+        MdaArena::release(m_data, totalSize() * sizeof(value_type));
         incrementBytesFreedCounter(totalSize() * sizeof(value_type));
         m_data = 0;
     }
@@ -230,6 +256,11 @@ public:
         if (freedCounter)
             freedCounter->add(size);
     }
+    void incrementBytesReusedCounter(int64_t size) const
+    {
+        if (reusedCounter)
+            reusedCounter->add(size);
+    }
     void incrementBytesReadCounter(int64_t size) const
     {
         if (bytesReadCounter)
@@ -249,6 +280,7 @@ private:
     mutable IIntCounter* freedCounter = nullptr;
     mutable IIntCounter* bytesReadCounter = nullptr;
     mutable IIntCounter* bytesWrittenCounter = nullptr;
+    mutable IIntCounter* reusedCounter = nullptr;
 };
 
 #endif // MDA_P_H
@@ -0,0 +1,43 @@
+/******************************************************
+** See the accompanying README and LICENSE files
+*******************************************************/
+
+#ifndef MDAARENA_H
+#define MDAARENA_H
+
+#include "mlcommon.h"
+
+/**
+ * \class MdaArena
+ * @brief Opt-in pool for the buffers behind Mda and Mda32.
+ *
+ * When enabled, a freed buffer is kept on a free list of the thread that freed it (keyed by its
+ * size in bytes) and handed out again by the next allocation of the same size on that thread,
+ * so loops that create a same-sized temporary on every iteration stop going through malloc/free.
+ * The free lists of a thread are released when the thread exits. Disabled by default.
+ *
+ * Use Mda::reallocate()/Mda32::reallocate() to also skip the zero-fill when a buffer is reused.
+ */
+class MdaArena {
+public:
+    static void setEnabled(bool val);
+    static bool isEnabled();
+    ///Upper bound on the bytes held in the free lists of any one thread; larger buffers are freed right away
+    static void setMaxCachedBytesPerThread(bigint nbytes);
+    static bigint maxCachedBytesPerThread();
+
+    ///A buffer of nbytes, taken from the free list of the calling thread if possible (then *reused is set to true)
+    static void* acquire(bigint nbytes, bool* reused = 0);
+    ///Hands back a buffer obtained from acquire(), with the same nbytes
+    static void release(void* ptr, bigint nbytes);
+    ///Frees everything on the free lists of the calling thread
+    static void releaseThreadCache();
+    ///Counts a buffer of nbytes that was kept in place (by reallocate) as acquired and reused
+    static void recordReuse(bigint nbytes);
+
+    ///Totals since startup, for reporting: bytes requested through acquire() or kept in place by reallocate, and how many of those were reused
+    static bigint acquiredBytes();
+    static bigint reusedBytes();
+};
+
+#endif // MDAARENA_H
@@ -80,6 +80,14 @@ bigint mda_read_uint16(uint16_t* data, struct MDAIO_HEADER* H, bigint n, FILE* i
 bigint mda_read_float64(double* data, struct MDAIO_HEADER* H, bigint n, FILE* input_file);
 bigint mda_read_uint32(uint32_t* data, struct MDAIO_HEADER* H, bigint n, FILE* input_file);
 
+//same as above, but converting n entries already in memory (e.g. a memory-mapped file) laid out as described by H
+bigint mda_convert_float32(float* data, const struct MDAIO_HEADER* H, bigint n, const void* source);
+bigint mda_convert_float64(double* data, const struct MDAIO_HEADER* H, bigint n, const void* source);
+
+//same as above, but reading n entries starting at entry i with pread, so there is no shared file position and concurrent calls on the same descriptor are safe
+bigint mda_pread_float32(float* data, const struct MDAIO_HEADER* H, bigint n, int fd, bigint i);
+bigint mda_pread_float64(double* data, const struct MDAIO_HEADER* H, bigint n, int fd, bigint i);
+
 //the following can be used no matter what the underlying data type is
 bigint mda_write_byte(unsigned char* data, struct MDAIO_HEADER* H, bigint n, FILE* output_file);
 bigint mda_write_float32(const float* data, struct MDAIO_HEADER* H, bigint n, FILE* output_file);
@@ -36,6 +36,7 @@ QString computeSha1SumOfFile(const QString& path);
 QString computeSha1SumOfFileHead(const QString& path, bigint num_bytes);
 QString computeSha1SumOfString(const QString& str);
 QString computeSha1SumOfDirectory(const QString& path);
+QString computeTreeHashOfFile(const QString& path); //chunked sha256, computed in parallel (see sumit.h)
 bool matchesFastChecksum(QString path, QString fcs);
 QList<int> stringListToIntList(const QStringList& list);
 QList<bigint> stringListToBigIntList(const QStringList& list);
@@ -0,0 +1,29 @@
+/******************************************************
+** See the accompanying README and LICENSE files
+*******************************************************/
+
+#ifndef PROCESSORPLUGIN_H
+#define PROCESSORPLUGIN_H
+
+/*
+ * A processor package that is an executable (for example mountainsort2.mp) may also be built as
+ * a shared library, lib<name>_plugin.so next to the executable (libmountainsort2_plugin.so for
+ * mountainsort2.mp). When the "use_processor_plugins" setting of mountainprocess is on, the
+ * processors of the package are then run inside mountainprocess instead of by launching the
+ * executable for every step.
+ *
+ * The library exports two C functions:
+ *   spec: the same json as "<exe> spec", used to check that the library matches the executable
+ *   run:  the same as main() of the executable, with argv = <exe> <processor_name> --name=value ...
+ *         but without creating a QCoreApplication. Returns the exit code.
+ */
+
+#define PROCESSOR_PLUGIN_SPEC_SYMBOL "mountainprocess_plugin_spec"
+#define PROCESSOR_PLUGIN_RUN_SYMBOL "mountainprocess_plugin_run"
+
+extern "C" {
+typedef const char* (*ProcessorPluginSpecFunction)();
+typedef int (*ProcessorPluginRunFunction)(int argc, char* argv[]);
+}
+
+#endif // PROCESSORPLUGIN_H
@@ -1,6 +1,8 @@
 #include "icounter.h"
 #include <QHash>
 #include <objectregistry.h>
+#include <QThreadStorage>
+#include <QAtomicInt>
 
 /*!
  * \class ICounterBase
@@ -267,3 +269,37 @@ void CounterProxy::updateValue()
 {
     emit valueChanged();
 }
+
+struct PerThreadCounters {
+    int thread_index = -1;
+    QHash<QString, IIntCounter*> counters;
+};
+
+/*!
+ * \brief perThreadIntCounter
+ * \param name
+ * \return
+ */
+IIntCounter* perThreadIntCounter(const QString& name)
+{
+    static QAtomicInt num_threads_seen;
+    static QThreadStorage<PerThreadCounters> storage;
+
+    PerThreadCounters& local = storage.localData();
+    if (local.counters.contains(name))
+        return local.counters.value(name);
+
+    ICounterManager* manager = ObjectRegistry::getObject<ICounterManager>();
+    if ((!manager) || (!manager->counter(name))) {
+        local.counters[name] = nullptr;
+        return nullptr;
+    }
+    if (local.thread_index < 0)
+        local.thread_index = num_threads_seen.fetchAndAddOrdered(1);
+    IIntCounter* counter = new IIntCounter(QString("%1_thread_%2").arg(name).arg(local.thread_index));
+    // worker threads typically have no event loop, so hand the counter over to the registry's thread
+    counter->moveToThread(ObjectRegistry::instance()->thread());
+    ObjectRegistry::addAutoReleasedObject(counter);
+    local.counters[name] = counter;
+    return counter;
+}
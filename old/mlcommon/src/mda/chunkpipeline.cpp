@@ -0,0 +1,250 @@
+/******************************************************
+** See the accompanying README and LICENSE files
+*******************************************************/
+
+#include "chunkpipeline.h"
+
+#include <QMap>
+#include <QMutex>
+#include <QQueue>
+#include <QThread>
+#include <QTime>
+#include <QWaitCondition>
+
+class ChunkPipelineThread : public QThread {
+public:
+    std::function<void()> func;
+
+protected:
+    void run() { func(); }
+};
+
+class ChunkPipelinePrivate {
+public:
+    ChunkPipeline* q;
+    DiskReadMda32 m_X;
+    ChunkPipelineOpts m_opts;
+    DiskWriteMda* m_output = 0;
+
+    QMutex m_mutex;
+    QWaitCondition m_condition;
+    QQueue<ChunkPipelineChunk*> m_queue; //read, waiting for a kernel thread
+    QMap<bigint, ChunkPipelineChunk*> m_finished; //processed, waiting to be written in order
+    QList<Mda32> m_free_inputs; //input buffers handed back by the kernel threads, for the reader to read into again
+    bigint m_num_chunks = 0;
+    bigint m_num_read = 0;
+    bigint m_num_done = 0; //processed, and written if there is an output
+    bigint m_num_timepoints_done = 0;
+    bool m_error = false;
+
+    int num_threads() const;
+    int queue_size() const;
+    void read_chunks();
+    void run_kernel(ChunkPipeline::Kernel kernel, int thread_index);
+    bool write_chunks();
+    void set_error();
+};
+
+ChunkPipeline::ChunkPipeline(const DiskReadMda32& X, const ChunkPipelineOpts& opts)
+{
+    d = new ChunkPipelinePrivate;
+    d->q = this;
+    d->m_X = X;
+    d->m_opts = opts;
+}
+
+ChunkPipeline::~ChunkPipeline()
+{
+    delete d;
+}
+
+int ChunkPipeline::numThreads() const
+{
+    return d->num_threads();
+}
+
+void ChunkPipeline::setOutput(DiskWriteMda* Y)
+{
+    d->m_output = Y;
+}
+
+bool ChunkPipeline::run(Kernel kernel)
+{
+    //read the header here, before any of the threads need it
+    bigint N = d->m_X.N2();
+    if (d->m_opts.chunk_size <= 0) {
+        qWarning() << "Invalid chunk size in ChunkPipeline" << d->m_opts.chunk_size;
+        return false;
+    }
+    d->m_num_chunks = (N + d->m_opts.chunk_size - 1) / d->m_opts.chunk_size;
+    d->m_num_read = 0;
+    d->m_num_done = 0;
+    d->m_num_timepoints_done = 0;
+    d->m_error = false;
+    if (!d->m_num_chunks)
+        return true;
+
+    ChunkPipelineThread reader;
+    reader.func = [this]() { d->read_chunks(); };
+    QList<ChunkPipelineThread*> workers;
+    for (int j = 0; j < d->num_threads(); j++) {
+        ChunkPipelineThread* worker = new ChunkPipelineThread;
+        worker->func = [this, kernel, j]() { d->run_kernel(kernel, j); };
+        workers << worker;
+    }
+    reader.start();
+    foreach (ChunkPipelineThread* worker, workers) {
+        worker->start();
+    }
+
+    bool ret = d->write_chunks();
+
+    reader.wait();
+    foreach (ChunkPipelineThread* worker, workers) {
+        worker->wait();
+        delete worker;
+    }
+    //only non-empty if something went wrong
+    qDeleteAll(d->m_queue);
+    d->m_queue.clear();
+    qDeleteAll(d->m_finished);
+    d->m_finished.clear();
+    d->m_free_inputs.clear();
+
+    return ((ret) && (!d->m_error));
+}
+
+int ChunkPipelinePrivate::num_threads() const
+{
+    if (m_opts.num_threads > 0)
+        return m_opts.num_threads;
+    return qMax(1, QThread::idealThreadCount());
+}
+
+int ChunkPipelinePrivate::queue_size() const
+{
+    //we need at least one chunk per kernel thread plus the one the writer is waiting for
+    if (m_opts.queue_size > num_threads())
+        return m_opts.queue_size;
+    return 2 * num_threads();
+}
+
+void ChunkPipelinePrivate::read_chunks()
+{
+    bigint M = m_X.N1();
+    bigint N = m_X.N2();
+    bigint chunk_size = m_opts.chunk_size;
+    bigint overlap_size = m_opts.overlap_size;
+    for (bigint index = 0; index < m_num_chunks; index++) {
+        ChunkPipelineChunk* chunk = new ChunkPipelineChunk;
+        {
+            QMutexLocker locker(&m_mutex);
+            while ((!m_error) && (m_num_read - m_num_done >= queue_size())) {
+                m_condition.wait(&m_mutex);
+            }
+            if (m_error) {
+                delete chunk;
+                return;
+            }
+            //readChunk reuses a buffer of the right shape without zero-filling it
+            if (!m_free_inputs.isEmpty())
+                chunk->data = m_free_inputs.takeLast();
+        }
+        chunk->index = index;
+        chunk->t1 = index * chunk_size;
+        chunk->size = qMin(chunk_size, N - chunk->t1);
+        if (!m_X.readChunk(chunk->data, 0, chunk->t1 - overlap_size, M, chunk_size + 2 * overlap_size)) {
+            qWarning() << "Problem reading chunk in ChunkPipeline" << chunk->t1;
+            delete chunk;
+            set_error();
+            return;
+        }
+        QMutexLocker locker(&m_mutex);
+        m_queue.enqueue(chunk);
+        m_num_read++;
+        m_condition.wakeAll();
+    }
+}
+
+void ChunkPipelinePrivate::run_kernel(ChunkPipeline::Kernel kernel, int thread_index)
+{
+    while (true) {
+        ChunkPipelineChunk* chunk = 0;
+        {
+            QMutexLocker locker(&m_mutex);
+            while ((!m_error) && (m_queue.isEmpty()) && (m_num_read < m_num_chunks)) {
+                m_condition.wait(&m_mutex);
+            }
+            if ((m_error) || (m_queue.isEmpty()))
+                return;
+            chunk = m_queue.dequeue();
+        }
+        chunk->thread_index = thread_index;
+        if (!kernel(*chunk)) {
+            qWarning() << "Kernel failed in ChunkPipeline" << chunk->t1;
+            delete chunk;
+            set_error();
+            return;
+        }
+        QMutexLocker locker(&m_mutex);
+        //recycle the input now rather than freeing it when the chunk is written
+        m_free_inputs << chunk->data;
+        chunk->data = Mda32();
+        if (m_output) {
+            m_finished[chunk->index] = chunk;
+        }
+        else {
+            m_num_done++;
+            m_num_timepoints_done += chunk->size;
+            delete chunk;
+        }
+        m_condition.wakeAll();
+    }
+}
+
+bool ChunkPipelinePrivate::write_chunks()
+{
+    QTime timer;
+    timer.start();
+    bigint N = m_X.N2();
+    bigint next_index = 0;
+    QMutexLocker locker(&m_mutex);
+    while (true) {
+        if (m_error)
+            return false;
+        if ((m_opts.verbose) && ((timer.elapsed() > 5000) || (m_num_done == m_num_chunks))) {
+            printf("%ld/%ld (%d%%)\n", m_num_timepoints_done, N, (int)(m_num_timepoints_done * 1.0 / N * 100));
+            timer.restart();
+        }
+        if (m_num_done == m_num_chunks)
+            return true;
+        if ((m_output) && (m_finished.contains(next_index))) {
+            ChunkPipelineChunk* chunk = m_finished.take(next_index);
+            locker.unlock();
+            bool ok = (chunk->output.N2() == chunk->size) && (m_output->writeChunk(chunk->output, 0, chunk->t1));
+            if (!ok)
+                qWarning() << "Problem writing chunk in ChunkPipeline" << chunk->t1 << chunk->output.N1() << chunk->output.N2() << chunk->size;
+            locker.relock();
+            if (!ok) {
+                delete chunk;
+                m_error = true;
+                m_condition.wakeAll();
+                return false;
+            }
+            m_num_done++;
+            m_num_timepoints_done += chunk->size;
+            next_index++;
+            delete chunk;
+            m_condition.wakeAll();
+            continue;
+        }
+        m_condition.wait(&m_mutex);
+    }
+}
+
+void ChunkPipelinePrivate::set_error()
+{
+    QMutexLocker locker(&m_mutex);
+    m_error = true;
+    m_condition.wakeAll();
+}
@@ -0,0 +1,246 @@
+/******************************************************
+** See the accompanying README and LICENSE files
+*******************************************************/
+
+#include "clipextractor.h"
+
+#include <QAtomicInt>
+#include <QThread>
+#include <QTime>
+#include <algorithm>
+#include <functional>
+#include <string.h>
+
+class ClipExtractorThread : public QThread {
+public:
+    std::function<void()> func;
+
+protected:
+    void run() { func(); }
+};
+
+struct ClipExtractorBlock {
+    bigint t1 = 0; //first timepoint read
+    bigint size = 0; //number of timepoints read
+    bigint j1 = 0, j2 = 0; //range in the sorted order of the events of the batch
+};
+
+class ClipExtractorPrivate {
+public:
+    ClipExtractor* q;
+    DiskReadMda32 m_X;
+    QVector<double> m_times;
+    bigint m_clip_size = 0;
+    ClipExtractorOpts m_opts;
+    QList<int> m_channels;
+
+    int num_threads() const;
+    bigint num_channels() const;
+    bigint clip_start(bigint i) const;
+    QVector<ClipExtractorBlock> get_blocks(const QVector<bigint>& order) const;
+    bool read_block(const ClipExtractorBlock& block, const QVector<bigint>& order, bigint i1, float* clips_ptr) const;
+};
+
+ClipExtractor::ClipExtractor(const DiskReadMda32& X, const QVector<double>& times, bigint clip_size, const ClipExtractorOpts& opts)
+{
+    d = new ClipExtractorPrivate;
+    d->q = this;
+    d->m_X = X;
+    d->m_times = times;
+    d->m_clip_size = clip_size;
+    d->m_opts = opts;
+}
+
+ClipExtractor::~ClipExtractor()
+{
+    delete d;
+}
+
+void ClipExtractor::setChannels(const QList<int>& channels)
+{
+    d->m_channels = channels;
+}
+
+bigint ClipExtractor::numClips() const
+{
+    return d->m_times.count();
+}
+
+bigint ClipExtractor::batchSize() const
+{
+    if (d->m_opts.batch_size > 0)
+        return d->m_opts.batch_size;
+    bigint clip_bytes = qMax((bigint)1, d->num_channels() * d->m_clip_size * (bigint)sizeof(float));
+    return qMax((bigint)1, (bigint)(256 * 1024 * 1024) / clip_bytes);
+}
+
+bool ClipExtractor::extractClips(Mda32& clips, bigint i1, bigint i2)
+{
+    bigint M = d->m_X.N1();
+    bigint M2 = d->num_channels();
+    bigint T = d->m_clip_size;
+    if (T <= 0) {
+        qWarning() << "Invalid clip size in ClipExtractor" << T;
+        return false;
+    }
+    foreach (int ch, d->m_channels) {
+        if ((ch < 1) || (ch > M)) {
+            qWarning() << "Channel out of range in ClipExtractor" << ch << M;
+            return false;
+        }
+    }
+    i1 = qMax(i1, (bigint)0);
+    i2 = qMin(i2, numClips());
+    bigint n = qMax(i2 - i1, (bigint)0);
+    if (!clips.allocate(M2, T, n))
+        return false;
+    if (!n)
+        return true;
+
+    //sort the events of the batch by time so that nearby clips are read together
+    QVector<bigint> order(n);
+    for (bigint j = 0; j < n; j++)
+        order[j] = i1 + j;
+    std::stable_sort(order.begin(), order.end(), [this](bigint a, bigint b) {
+        return d->clip_start(a) < d->clip_start(b);
+    });
+    QVector<ClipExtractorBlock> blocks = d->get_blocks(order);
+
+    float* clips_ptr = clips.dataPtr();
+    int num_threads = qMin((bigint)d->num_threads(), (bigint)blocks.count());
+    QAtomicInt next_block(0);
+    QAtomicInt error(0);
+    auto worker = [&]() {
+        while (!error.load()) {
+            int b = next_block.fetchAndAddOrdered(1);
+            if (b >= blocks.count())
+                return;
+            if (!d->read_block(blocks[b], order, i1, clips_ptr))
+                error.store(1);
+        }
+    };
+    if (num_threads <= 1) {
+        worker();
+    }
+    else {
+        QList<ClipExtractorThread*> threads;
+        for (int j = 0; j < num_threads; j++) {
+            ClipExtractorThread* thread = new ClipExtractorThread;
+            thread->func = worker;
+            threads << thread;
+            thread->start();
+        }
+        foreach (ClipExtractorThread* thread, threads) {
+            thread->wait();
+            delete thread;
+        }
+    }
+    if (error.load()) {
+        qWarning() << "Problem reading clips in ClipExtractor";
+        return false;
+    }
+    return true;
+}
+
+bool ClipExtractor::extractClips(Mda32& clips)
+{
+    return extractClips(clips, 0, numClips());
+}
+
+bool ClipExtractor::writeClips(DiskWriteMda& Y)
+{
+    bigint L = numClips();
+    bigint batch_size = batchSize();
+    QTime timer;
+    timer.start();
+    for (bigint i1 = 0; i1 < L; i1 += batch_size) {
+        bigint i2 = qMin(i1 + batch_size, L);
+        Mda32 clips;
+        if (!extractClips(clips, i1, i2))
+            return false;
+        if (!Y.writeChunk(clips, 0, 0, i1)) {
+            qWarning() << "Problem writing clips in ClipExtractor" << i1 << i2;
+            return false;
+        }
+        if (timer.elapsed() > 5000) {
+            printf("%ld/%ld clips (%d%%)\n", i2, L, (int)(i2 * 1.0 / L * 100));
+            timer.restart();
+        }
+    }
+    return true;
+}
+
+int ClipExtractorPrivate::num_threads() const
+{
+    if (m_opts.num_threads > 0)
+        return m_opts.num_threads;
+    return qMax(1, QThread::idealThreadCount());
+}
+
+bigint ClipExtractorPrivate::num_channels() const
+{
+    if (!m_channels.isEmpty())
+        return m_channels.count();
+    return m_X.N1();
+}
+
+bigint ClipExtractorPrivate::clip_start(bigint i) const
+{
+    bigint Tmid = (bigint)((m_clip_size + 1) / 2) - 1;
+    return (bigint)(m_times[i] - Tmid);
+}
+
+QVector<ClipExtractorBlock> ClipExtractorPrivate::get_blocks(const QVector<bigint>& order) const
+{
+    //coalesce consecutive (sorted) clips while the gap between them and the total size stay small
+    QVector<ClipExtractorBlock> blocks;
+    bigint T = m_clip_size;
+    bigint max_block_size = qMax(T, m_opts.max_block_bytes / qMax((bigint)1, m_X.N1() * (bigint)sizeof(float))); //in timepoints
+    ClipExtractorBlock block;
+    for (bigint j = 0; j < order.count(); j++) {
+        bigint t1 = clip_start(order[j]);
+        if (j > 0) {
+            bigint block_end = block.t1 + block.size;
+            if ((t1 - block_end <= m_opts.max_gap) && (t1 + T - block.t1 <= max_block_size)) {
+                block.size = qMax(block_end, t1 + T) - block.t1;
+                block.j2 = j + 1;
+                continue;
+            }
+            blocks << block;
+        }
+        block.t1 = t1;
+        block.size = T;
+        block.j1 = j;
+        block.j2 = j + 1;
+    }
+    if (!order.isEmpty())
+        blocks << block;
+    return blocks;
+}
+
+bool ClipExtractorPrivate::read_block(const ClipExtractorBlock& block, const QVector<bigint>& order, bigint i1, float* clips_ptr) const
+{
+    bigint M = m_X.N1();
+    bigint M2 = num_channels();
+    bigint T = m_clip_size;
+    Mda32 data;
+    if (!m_X.readChunk(data, 0, block.t1, M, block.size))
+        return false;
+    const float* data_ptr = data.constDataPtr();
+    for (bigint j = block.j1; j < block.j2; j++) {
+        bigint i = order[j];
+        const float* src = data_ptr + M * (clip_start(i) - block.t1);
+        float* dst = clips_ptr + M2 * T * (i - i1);
+        if (m_channels.isEmpty()) {
+            memcpy(dst, src, sizeof(float) * M * T);
+        }
+        else {
+            for (bigint t = 0; t < T; t++) {
+                for (bigint m2 = 0; m2 < M2; m2++) {
+                    dst[m2 + M2 * t] = src[(m_channels[m2] - 1) + M * t];
+                }
+            }
+        }
+    }
+    return true;
+}
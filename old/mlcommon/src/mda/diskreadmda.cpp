@@ -1,5 +1,6 @@
 #include "diskreadmda.h"
 #include <stdio.h>
+#include <string.h>
 #include "mdaio.h"
 #include <math.h>
 #include <QFile>
@@ -12,6 +13,10 @@
 #include <QJsonArray>
 #include <icounter.h>
 #include <objectregistry.h>
+#include <QMutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define MAX_PATH_LEN 10000
 #define DEFAULT_CHUNK_SIZE 1e5
@@ -35,9 +40,21 @@ public:
     int m_concat_dimension = 2;
     QList<DiskReadMda> m_concat_list;
 
+    //memory-mapped backend (settings are kept across setPath)
+    bool m_use_mmap = false;
+    DiskReadMda::AccessPattern m_access_pattern = DiskReadMda::NormalAccess;
+    unsigned char* m_map = 0;
+    bigint m_map_size = 0;
+    bool m_map_failed = false;
+
     QString m_path;
     QJsonObject m_prv_object;
 
+    //readChunk may be called concurrently from several threads: the lazy open/map state is guarded by
+    //m_mutex and the reads themselves go through pread (or the mapping) so no file position is shared
+    QMutex m_mutex{ QMutex::Recursive };
+    QMutex m_internal_chunk_mutex;
+
     IIntCounter* allocatedCounter = nullptr;
     IIntCounter* freedCounter = nullptr;
     IIntCounter* bytesReadCounter = nullptr;
@@ -48,6 +65,10 @@ public:
     bool open_file_if_needed();
     void copy_from(const DiskReadMda& other);
     bigint total_size();
+    bool map_file_if_needed();
+    void unmap_file();
+    void apply_access_pattern();
+    bigint read_entries(double* data, bigint i, bigint n);
     static QStringList find_all_mda_files_in_directory(QString dir_path, bool recursive);
 };
 
@@ -165,6 +186,7 @@ DiskReadMda::DiskReadMda(int concat_dimension, const QStringList& array_paths)
 
 DiskReadMda::~DiskReadMda()
 {
+    d->unmap_file();
     if (d->m_file) {
         fclose(d->m_file);
     }
@@ -245,7 +267,10 @@ void DiskReadMda::setConcatPaths(int concat_dimension, const QStringList& paths)
     d->m_concat_dimension = concat_dimension;
     d->m_concat_list.clear();
     foreach (QString path0, paths) {
-        d->m_concat_list << DiskReadMda(path0);
+        DiskReadMda X(path0);
+        X.setMemoryMapped(d->m_use_mmap);
+        X.setAccessPattern(d->m_access_pattern);
+        d->m_concat_list << X;
     }
 }
 
@@ -256,6 +281,31 @@ void DiskReadMda::setConcatDirectory(int concat_dimension, const QString& dir_pa
     d->m_path = dir_path;
 }
 
+void DiskReadMda::setMemoryMapped(bool val)
+{
+    if (d->m_use_mmap == val)
+        return;
+    d->unmap_file();
+    d->m_use_mmap = val;
+    for (int i = 0; i < d->m_concat_list.count(); i++) {
+        d->m_concat_list[i].setMemoryMapped(val);
+    }
+}
+
+bool DiskReadMda::isMemoryMapped() const
+{
+    return d->m_use_mmap;
+}
+
+void DiskReadMda::setAccessPattern(AccessPattern pattern)
+{
+    d->m_access_pattern = pattern;
+    d->apply_access_pattern();
+    for (int i = 0; i < d->m_concat_list.count(); i++) {
+        d->m_concat_list[i].setAccessPattern(pattern);
+    }
+}
+
 QString compute_memory_checksum(bigint nbytes, void* ptr)
 {
     QByteArray X((char*)ptr, nbytes);
@@ -545,6 +595,17 @@ bool read_chunk_from_concat_list(Mda& chunk, const QList<DiskReadMda>& list, big
     return true;
 }
 
+//the chunk is reallocated without zero-filling, so only the entries outside of the array (which are not read) get zeroed
+static void zero_pad_chunk(double* X, bigint total_size, bigint offset, bigint count)
+{
+    if (count <= 0) {
+        memset(X, 0, sizeof(double) * total_size);
+        return;
+    }
+    memset(X, 0, sizeof(double) * offset);
+    memset(X + offset + count, 0, sizeof(double) * (total_size - offset - count));
+}
+
 bool DiskReadMda::readChunk(Mda& X, bigint i, bigint size) const
 {
     if (d->m_use_memory_mda) {
@@ -556,15 +617,13 @@ bool DiskReadMda::readChunk(Mda& X, bigint i, bigint size) const
     }
     if (!d->open_file_if_needed())
         return false;
-    X.allocate(size, 1);
+    X.reallocate(size, 1);
     bigint jA = qMax(i, (bigint)0);
     bigint jB = qMin(i + size - 1, d->total_size() - 1);
     bigint size_to_read = jB - jA + 1;
+    zero_pad_chunk(X.dataPtr(), size, jA - i, size_to_read);
     if (size_to_read > 0) {
-        fseeko(d->m_file, d->m_header.header_size + d->m_header.num_bytes_per_entry * (jA), SEEK_SET);
-        bigint bytes_read = mda_read_float64(&X.dataPtr()[jA - i], &d->m_header, size_to_read, d->m_file);
-        if (d->bytesReadCounter)
-            d->bytesReadCounter->add(bytes_read);
+        bigint bytes_read = d->read_entries(&X.dataPtr()[jA - i], jA, size_to_read);
         if (bytes_read != size_to_read) {
             printf("Warning problem reading chunk in diskreadmda: %ld<>%ld\n", (bigint)bytes_read, (bigint)size_to_read);
             return false;
@@ -591,15 +650,13 @@ bool DiskReadMda::readChunk(Mda& X, bigint i1, bigint i2, bigint size1, bigint s
         return false;
     if ((size1 == N1()) && (i1 == 0)) {
         //easy case
-        X.allocate(size1, size2);
+        X.reallocate(size1, size2);
         bigint jA = qMax(i2, (bigint)0);
         bigint jB = qMin(i2 + size2 - 1, N2() - 1);
         bigint size2_to_read = jB - jA + 1;
+        zero_pad_chunk(X.dataPtr(), size1 * size2, (jA - i2) * size1, size1 * size2_to_read);
         if (size2_to_read > 0) {
-            fseeko(d->m_file, d->m_header.header_size + d->m_header.num_bytes_per_entry * (i1 + N1() * jA), SEEK_SET);
-            bigint bytes_read = mda_read_float64(&X.dataPtr()[(jA - i2) * size1], &d->m_header, size1 * size2_to_read, d->m_file);
-            if (d->bytesReadCounter)
-                d->bytesReadCounter->add(bytes_read);
+            bigint bytes_read = d->read_entries(&X.dataPtr()[(jA - i2) * size1], i1 + N1() * jA, size1 * size2_to_read);
             if (bytes_read != size1 * size2_to_read) {
                 printf("Warning problem reading 2d chunk in diskreadmda: %ld<>%ld\n", (bigint)bytes_read, (bigint)(size1 * size2));
                 return false;
@@ -636,15 +693,13 @@ bool DiskReadMda::readChunk(Mda& X, bigint i1, bigint i2, bigint i3, bigint size
         return false;
     if ((size1 == N1()) && (size2 == N2())) {
         //easy case
-        X.allocate(size1, size2, size3);
+        X.reallocate(size1, size2, size3);
         bigint jA = qMax(i3, (bigint)0);
         bigint jB = qMin(i3 + size3 - 1, N3() - 1);
         bigint size3_to_read = jB - jA + 1;
+        zero_pad_chunk(X.dataPtr(), size1 * size2 * size3, (jA - i3) * size1 * size2, size1 * size2 * size3_to_read);
         if (size3_to_read > 0) {
-            fseeko(d->m_file, d->m_header.header_size + d->m_header.num_bytes_per_entry * (i1 + N1() * i2 + N1() * N2() * jA), SEEK_SET);
-            bigint bytes_read = mda_read_float64(&X.dataPtr()[(jA - i3) * size1 * size2], &d->m_header, size1 * size2 * size3_to_read, d->m_file);
-            if (d->bytesReadCounter)
-                d->bytesReadCounter->add(bytes_read);
+            bigint bytes_read = d->read_entries(&X.dataPtr()[(jA - i3) * size1 * size2], i1 + N1() * i2 + N1() * N2() * jA, size1 * size2 * size3_to_read);
             if (bytes_read != size1 * size2 * size3_to_read) {
                 printf("Warning problem reading 3d chunk in diskreadmda: %ld<>%ld\n", (bigint)bytes_read, (bigint)(size1 * size2 * size3_to_read));
                 return false;
@@ -658,6 +713,39 @@ bool DiskReadMda::readChunk(Mda& X, bigint i1, bigint i2, bigint i3, bigint size
     }
 }
 
+const double* DiskReadMda::readChunkView(bigint i, bigint size) const
+{
+    if ((i < 0) || (size <= 0) || (i + size > d->total_size()))
+        return 0;
+    if (d->m_use_memory_mda) {
+        return d->m_memory_mda.constDataPtr() + i;
+    }
+    if ((!d->m_use_mmap) || (d->m_use_concat))
+        return 0;
+    if (!d->open_file_if_needed())
+        return 0;
+    if (!d->map_file_if_needed())
+        return 0;
+    if (d->m_header.data_type != MDAIO_TYPE_FLOAT64)
+        return 0;
+    bigint offset = d->m_header.header_size + d->m_header.num_bytes_per_entry * i;
+    if (offset + d->m_header.num_bytes_per_entry * size > d->m_map_size)
+        return 0;
+    const unsigned char* ptr = d->m_map + offset;
+    if (((quintptr)ptr) % sizeof(double) != 0)
+        return 0; //unaligned (depends on the header size), so we can't hand out a typed pointer
+    if (d->m_access_pattern == SequentialAccess) {
+        quintptr page_start = ((quintptr)ptr) & ~((quintptr)sysconf(_SC_PAGESIZE) - 1);
+        madvise((void*)page_start, ((quintptr)ptr) - page_start + d->m_header.num_bytes_per_entry * size, MADV_WILLNEED);
+    }
+    if (d->bytesReadCounter) {
+        d->bytesReadCounter->add(size);
+        if (IIntCounter* thread_counter = perThreadIntCounter("bytes_read"))
+            thread_counter->add(size);
+    }
+    return (const double*)ptr;
+}
+
 double DiskReadMda::value(bigint i) const
 {
     if (d->m_use_memory_mda)
@@ -666,6 +754,7 @@ double DiskReadMda::value(bigint i) const
         return 0;
     bigint chunk_index = i / DEFAULT_CHUNK_SIZE;
     bigint offset = i - DEFAULT_CHUNK_SIZE * chunk_index;
+    QMutexLocker locker(&d->m_internal_chunk_mutex);
     if (d->m_current_internal_chunk_index != chunk_index) {
         bigint size_to_read = DEFAULT_CHUNK_SIZE;
         if (chunk_index * DEFAULT_CHUNK_SIZE + size_to_read > d->total_size())
@@ -706,6 +795,8 @@ void DiskReadMdaPrivate::construct_and_clear()
 {
     m_file_open_failed = false;
     m_file = 0;
+    unmap_file();
+    m_map_failed = false;
     m_current_internal_chunk_index = -1;
     m_use_memory_mda = false;
     m_use_concat = false;
@@ -719,6 +810,7 @@ void DiskReadMdaPrivate::construct_and_clear()
 
 bool DiskReadMdaPrivate::read_header_if_needed()
 {
+    QMutexLocker locker(&m_mutex);
     if (m_header_read)
         return true;
     if (m_use_memory_mda) {
@@ -768,6 +860,7 @@ bool DiskReadMdaPrivate::read_header_if_needed()
 
 bool DiskReadMdaPrivate::open_file_if_needed()
 {
+    QMutexLocker locker(&m_mutex);
     if (m_use_memory_mda)
         return true;
     if (m_use_concat) {
@@ -809,6 +902,7 @@ void DiskReadMdaPrivate::copy_from(const DiskReadMda& other)
 {
     /// TODO (LOW) think about copying over additional information such as internal chunks
 
+    this->unmap_file();
     if (this->m_file) {
         fclose(this->m_file);
         this->m_file = 0;
@@ -831,6 +925,8 @@ void DiskReadMdaPrivate::copy_from(const DiskReadMda& other)
     this->m_use_concat = other.d->m_use_concat;
     this->m_concat_dimension = other.d->m_concat_dimension;
     this->m_concat_list = other.d->m_concat_list;
+    this->m_use_mmap = other.d->m_use_mmap;
+    this->m_access_pattern = other.d->m_access_pattern;
 }
 
 bigint DiskReadMdaPrivate::total_size()
@@ -920,6 +1016,79 @@ void diskreadmda_unit_test()
     printf("%.20f\n", sum5);
 }
 
+bool DiskReadMdaPrivate::map_file_if_needed()
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_map)
+        return true;
+    if (m_map_failed)
+        return false;
+    if (!m_file)
+        return false;
+    struct stat st;
+    if (fstat(fileno(m_file), &st) != 0) {
+        m_map_failed = true;
+        return false;
+    }
+    if (st.st_size <= m_header.header_size) {
+        //nothing to map (empty array), fall back to fread
+        m_map_failed = true;
+        return false;
+    }
+    void* ptr = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fileno(m_file), 0);
+    if (ptr == MAP_FAILED) {
+        qWarning() << "Unable to memory-map file, falling back to buffered reads: " + m_path;
+        m_map_failed = true;
+        return false;
+    }
+    m_map = (unsigned char*)ptr;
+    m_map_size = st.st_size;
+    apply_access_pattern();
+    return true;
+}
+
+void DiskReadMdaPrivate::unmap_file()
+{
+    if (m_map) {
+        munmap(m_map, m_map_size);
+        m_map = 0;
+        m_map_size = 0;
+    }
+}
+
+void DiskReadMdaPrivate::apply_access_pattern()
+{
+    if (!m_map)
+        return;
+    int advice = MADV_NORMAL;
+    if (m_access_pattern == DiskReadMda::SequentialAccess)
+        advice = MADV_SEQUENTIAL;
+    else if (m_access_pattern == DiskReadMda::RandomAccess)
+        advice = MADV_RANDOM;
+    madvise(m_map, m_map_size, advice);
+}
+
+bigint DiskReadMdaPrivate::read_entries(double* data, bigint i, bigint n)
+{
+    //i is the (vectorized) entry offset in the file, the file must be open
+    bigint bytes_read = 0;
+    if ((m_use_mmap) && (map_file_if_needed())) {
+        bigint offset = m_header.header_size + m_header.num_bytes_per_entry * i;
+        bigint n_available = (m_map_size - offset) / m_header.num_bytes_per_entry;
+        if (n_available > 0)
+            bytes_read = mda_convert_float64(data, &m_header, qMin(n, n_available), m_map + offset);
+    }
+    else {
+        bytes_read = mda_pread_float64(data, &m_header, n, fileno(m_file), i);
+    }
+    if (bytesReadCounter) {
+        bytesReadCounter->add(bytes_read);
+        if (IIntCounter* thread_counter = perThreadIntCounter("bytes_read"))
+            thread_counter->add(bytes_read);
+    }
+    return bytes_read;
+}
+
 QStringList DiskReadMdaPrivate::find_all_mda_files_in_directory(QString dir_path, bool recursive)
 {
     QStringList ret;
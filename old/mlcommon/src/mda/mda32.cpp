@@ -46,6 +46,15 @@ bool Mda32::allocate(bigint N1, bigint N2, bigint N3, bigint N4, bigint N5, bigi
     return d->allocate((float)0, N1, N2, N3, N4, N5, N6);
 }
 
+bool Mda32::reallocate(bigint N1, bigint N2, bigint N3, bigint N4, bigint N5, bigint N6)
+{
+    if (d.constData()->ref.load() > 1) {
+        //don't let d-> detach (copy) the shared data only to replace it
+        d = new MdaDataFloat;
+    }
+    return d->reallocate(N1, N2, N3, N4, N5, N6);
+}
+
 bool Mda32::read(const QString& path)
 {
     return read(path.toLatin1().data());
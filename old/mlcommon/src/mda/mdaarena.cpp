@@ -0,0 +1,122 @@
+/******************************************************
+** See the accompanying README and LICENSE files
+*******************************************************/
+
+#include "mdaarena.h"
+
+#include <QAtomicInt>
+#include <QMap>
+#include <QThreadStorage>
+#include <QVector>
+#include <stdlib.h>
+
+namespace {
+
+struct MdaArenaThreadCache {
+    ~MdaArenaThreadCache()
+    {
+        clear();
+    }
+    void clear()
+    {
+        for (QMap<bigint, QVector<void*> >::iterator it = free_lists.begin(); it != free_lists.end(); ++it) {
+            foreach (void* ptr, it.value()) {
+                free(ptr);
+            }
+        }
+        free_lists.clear();
+        cached_bytes = 0;
+    }
+
+    QMap<bigint, QVector<void*> > free_lists; //by size in bytes
+    bigint cached_bytes = 0;
+};
+
+QAtomicInt s_enabled(0);
+QAtomicInteger<qint64> s_max_cached_bytes_per_thread(256 * 1024 * 1024);
+QAtomicInteger<qint64> s_acquired_bytes(0);
+QAtomicInteger<qint64> s_reused_bytes(0);
+
+MdaArenaThreadCache& thread_cache()
+{
+    //never deleted, so that buffers released by static objects at exit still find it
+    static QThreadStorage<MdaArenaThreadCache>* storage = new QThreadStorage<MdaArenaThreadCache>;
+    return storage->localData();
+}
+}
+
+void MdaArena::setEnabled(bool val)
+{
+    s_enabled.storeRelease(val ? 1 : 0);
+}
+
+bool MdaArena::isEnabled()
+{
+    return (s_enabled.loadAcquire() != 0);
+}
+
+void MdaArena::setMaxCachedBytesPerThread(bigint nbytes)
+{
+    s_max_cached_bytes_per_thread.storeRelease(nbytes);
+}
+
+bigint MdaArena::maxCachedBytesPerThread()
+{
+    return s_max_cached_bytes_per_thread.loadAcquire();
+}
+
+void* MdaArena::acquire(bigint nbytes, bool* reused)
+{
+    if (reused)
+        *reused = false;
+    s_acquired_bytes.fetchAndAddRelaxed(nbytes);
+    if ((isEnabled()) && (nbytes > 0)) {
+        MdaArenaThreadCache& cache = thread_cache();
+        QMap<bigint, QVector<void*> >::iterator it = cache.free_lists.find(nbytes);
+        if ((it != cache.free_lists.end()) && (!it.value().isEmpty())) {
+            void* ptr = it.value().takeLast();
+            cache.cached_bytes -= nbytes;
+            s_reused_bytes.fetchAndAddRelaxed(nbytes);
+            if (reused)
+                *reused = true;
+            return ptr;
+        }
+    }
+    return malloc(nbytes);
+}
+
+void MdaArena::release(void* ptr, bigint nbytes)
+{
+    if (!ptr)
+        return;
+    if ((isEnabled()) && (nbytes > 0)) {
+        MdaArenaThreadCache& cache = thread_cache();
+        if (cache.cached_bytes + nbytes <= maxCachedBytesPerThread()) {
+            cache.free_lists[nbytes] << ptr;
+            cache.cached_bytes += nbytes;
+            return;
+        }
+    }
+    free(ptr);
+}
+
+void MdaArena::releaseThreadCache()
+{
+    thread_cache().clear();
+}
+
+void MdaArena::recordReuse(bigint nbytes)
+{
+    s_acquired_bytes.fetchAndAddRelaxed(nbytes);
+    s_reused_bytes.fetchAndAddRelaxed(nbytes);
+}
+
+bigint MdaArena::acquiredBytes()
+{
+    return s_acquired_bytes.loadAcquire();
+}
+
+bigint MdaArena::reusedBytes()
+{
+    return s_reused_bytes.loadAcquire();
+}
@@ -3,6 +3,8 @@
 #include <vector>
 #include <cstring>
 #include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
 
 //can be replaced by std::is_same when C++11 is enabled
 template <class T, class U>
@@ -228,6 +230,112 @@ bigint mdaReadData(Type* data, const struct MDAIO_HEADER* header, const bigint s
         return 0;
 }
 
+template <typename SourceType, typename TargetType>
+bigint mdaConvertData_impl(TargetType* data, const bigint size, const void* source)
+{
+    if (is_same<TargetType, SourceType>::value) {
+        std::memcpy(data, source, size * sizeof(SourceType));
+    }
+    else {
+        //the source may not be aligned for SourceType (e.g. float64 data following a 20 byte header)
+        const unsigned char* src = (const unsigned char*)source;
+        for (bigint i = 0; i < size; i++) {
+            SourceType val;
+            std::memcpy(&val, src + i * sizeof(SourceType), sizeof(SourceType));
+            data[i] = val;
+        }
+    }
+    return size;
+}
+
+template <typename Type>
+bigint mdaConvertData(Type* data, const struct MDAIO_HEADER* header, const bigint size, const void* source)
+{
+    if (header->data_type == MDAIO_TYPE_BYTE) {
+        return mdaConvertData_impl<unsigned char>(data, size, source);
+    }
+    else if (header->data_type == MDAIO_TYPE_FLOAT32) {
+        return mdaConvertData_impl<float>(data, size, source);
+    }
+    else if (header->data_type == MDAIO_TYPE_INT16) {
+        return mdaConvertData_impl<int16_t>(data, size, source);
+    }
+    else if (header->data_type == MDAIO_TYPE_INT32) {
+        return mdaConvertData_impl<int32_t>(data, size, source);
+    }
+    else if (header->data_type == MDAIO_TYPE_UINT16) {
+        return mdaConvertData_impl<uint16_t>(data, size, source);
+    }
+    else if (header->data_type == MDAIO_TYPE_FLOAT64) {
+        return mdaConvertData_impl<double>(data, size, source);
+    }
+    else if (header->data_type == MDAIO_TYPE_UINT32) {
+        return mdaConvertData_impl<uint32_t>(data, size, source);
+    }
+    else
+        return 0;
+}
+
+static bigint jpread(void* data, bigint num_bytes, int fd, bigint offset)
+{
+    bigint num_read = 0;
+    while (num_read < num_bytes) {
+        ssize_t ret = pread(fd, ((unsigned char*)data) + num_read, num_bytes - num_read, offset + num_read);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (ret == 0)
+            break; //end of file
+        num_read += ret;
+    }
+    return num_read;
+}
+
+template <typename SourceType, typename TargetType>
+bigint mdaPreadData_impl(TargetType* data, const bigint size, int fd, bigint offset)
+{
+    if (is_same<TargetType, SourceType>::value) {
+        return jpread(data, size * sizeof(SourceType), fd, offset) / sizeof(SourceType);
+    }
+    else {
+        std::vector<SourceType> tmp(size);
+        const bigint ret = jpread(&tmp[0], size * sizeof(SourceType), fd, offset) / sizeof(SourceType);
+        std::copy(tmp.begin(), tmp.begin() + ret, data);
+        return ret;
+    }
+}
+
+template <typename Type>
+bigint mdaPreadData(Type* data, const struct MDAIO_HEADER* header, const bigint size, int fd, bigint i)
+{
+    bigint offset = header->header_size + header->num_bytes_per_entry * i;
+    if (header->data_type == MDAIO_TYPE_BYTE) {
+        return mdaPreadData_impl<unsigned char>(data, size, fd, offset);
+    }
+    else if (header->data_type == MDAIO_TYPE_FLOAT32) {
+        return mdaPreadData_impl<float>(data, size, fd, offset);
+    }
+    else if (header->data_type == MDAIO_TYPE_INT16) {
+        return mdaPreadData_impl<int16_t>(data, size, fd, offset);
+    }
+    else if (header->data_type == MDAIO_TYPE_INT32) {
+        return mdaPreadData_impl<int32_t>(data, size, fd, offset);
+    }
+    else if (header->data_type == MDAIO_TYPE_UINT16) {
+        return mdaPreadData_impl<uint16_t>(data, size, fd, offset);
+    }
+    else if (header->data_type == MDAIO_TYPE_FLOAT64) {
+        return mdaPreadData_impl<double>(data, size, fd, offset);
+    }
+    else if (header->data_type == MDAIO_TYPE_UINT32) {
+        return mdaPreadData_impl<uint32_t>(data, size, fd, offset);
+    }
+    else
+        return 0;
+}
+
 template <typename TargetType, typename DataType>
 bigint mdaWriteData_impl(DataType* data, const bigint size, FILE* outputFile)
 {
@@ -304,6 +412,26 @@ bigint mda_read_uint32(uint32_t* data, struct MDAIO_HEADER* H, bigint n, FILE* i
     return mdaReadData(data, H, n, input_file);
 }
 
+bigint mda_convert_float32(float* data, const struct MDAIO_HEADER* H, bigint n, const void* source)
+{
+    return mdaConvertData(data, H, n, source);
+}
+
+bigint mda_convert_float64(double* data, const struct MDAIO_HEADER* H, bigint n, const void* source)
+{
+    return mdaConvertData(data, H, n, source);
+}
+
+bigint mda_pread_float32(float* data, const struct MDAIO_HEADER* H, bigint n, int fd, bigint i)
+{
+    return mdaPreadData(data, H, n, fd, i);
+}
+
+bigint mda_pread_float64(double* data, const struct MDAIO_HEADER* H, bigint n, int fd, bigint i)
+{
+    return mdaPreadData(data, H, n, fd, i);
+}
+
 bigint mda_write_byte(unsigned char* data, struct MDAIO_HEADER* H, bigint n, FILE* output_file)
 {
     return mdaWriteData(data, n, H, output_file);
@@ -251,6 +251,11 @@ QString MLUtil::computeSha1SumOfDirectory(const QString& path)
     return sumit_dir(path, MLUtil::tempPath());
 }
 
+QString MLUtil::computeTreeHashOfFile(const QString& path)
+{
+    return sumit_tree(path, MLUtil::tempPath());
+}
+
 static QString s_temp_path = "";
 QString MLUtil::tempPath()
 {
@@ -1013,12 +1018,22 @@ QJsonObject MLUtil::createPrvObject(const QString& file_or_dir_path)
     qDebug().noquote() << "Creating prv object for: " + file_or_dir_path;
     QString path = file_or_dir_path;
     if (QFileInfo(path).isFile()) {
+        SumitStats stats0 = sumit_stats();
         QJsonObject obj;
         obj["prv_version"] = PRV_VERSION;
         obj["original_path"] = path;
         obj["original_checksum"] = MLUtil::computeSha1SumOfFile(path);
         obj["original_fcs"] = "head1000-" + MLUtil::computeSha1SumOfFileHead(path, 1000);
         obj["original_size"] = QFileInfo(path).size();
+        if (MLUtil::configValue("prv", "tree_checksum").toBool()) {
+            obj["original_tree_checksum"] = MLUtil::computeTreeHashOfFile(path);
+        }
+        SumitStats stats1 = sumit_stats();
+        if (stats1.msec_hashing - stats0.msec_hashing >= 1000) {
+            double mb = (stats1.bytes_hashed - stats0.bytes_hashed) * 1.0 / (1024 * 1024);
+            double sec = (stats1.msec_hashing - stats0.msec_hashing) * 1.0 / 1000;
+            qDebug().noquote() << QString("Checksums: hashed %1 MB in %2 sec (%3 MB/sec)").arg(mb, 0, 'f', 1).arg(sec, 0, 'f', 1).arg(mb / sec, 0, 'f', 1);
+        }
         return obj;
     }
     else if (QFileInfo(path).isDir()) {
@@ -5,6 +5,8 @@ DEFINES += USE_REMOTE_READ_MDA
 CONFIG += c++11
 CONFIG -= app_bundle
 CONFIG += staticlib
+#so that it can also be linked into the processor plugins (see processorplugin.h)
+unix:QMAKE_CXXFLAGS += -fPIC
 
 DESTDIR = ../lib
 OBJECTS_DIR = ../build
@@ -26,7 +28,8 @@ HEADERS += mlcommon.h sumit.h \
     ../include/icounter.h \
     ../include/qprocessmanager.h \
     ../include/signalhandler.h \
-    ../include/mllog.h
+    ../include/mllog.h \
+    ../include/processorplugin.h
 
 SOURCES += \
     mlcommon.cpp sumit.cpp \
@@ -43,8 +46,8 @@ SOURCES += \
 INCLUDEPATH += ../include/mda
 VPATH += ../include/mda
 VPATH += mda
-HEADERS += diskreadmda.h diskwritemda.h mda.h mdaio.h remotereadmda.h usagetracking.h
-SOURCES += diskreadmda.cpp diskwritemda.cpp mda.cpp mdaio.cpp remotereadmda.cpp usagetracking.cpp
+HEADERS += diskreadmda.h diskwritemda.h mda.h mdaio.h remotereadmda.h usagetracking.h chunkpipeline.h clipextractor.h mdaarena.h
+SOURCES += diskreadmda.cpp diskwritemda.cpp mda.cpp mdaio.cpp remotereadmda.cpp usagetracking.cpp chunkpipeline.cpp clipextractor.cpp mdaarena.cpp
 
 INCLUDEPATH += ../include/cachemanager
 VPATH += ../include/cachemanager
@@ -5,6 +5,8 @@
 *******************************************************/
 
 #include "sumit.h"
+#include "icounter.h"
+#include "objectregistry.h"
 
 #include <QDebug>
 #include <QFile>
@@ -14,28 +16,171 @@
 #include <QStringList>
 #include <QTime>
 #include <QDataStream>
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QThread>
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <future>
 #include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
-QString compute_the_file_hash(const QString& path, int num_bytes)
+#define SUMIT_READ_BUFFER_SIZE (4 * 1024 * 1024)
+#define SUMIT_TREE_CHUNK_SIZE (4 * 1024 * 1024)
+
+static QAtomicInteger<qint64> s_bytes_hashed(0);
+static QAtomicInteger<qint64> s_msec_hashing(0);
+static QAtomicInteger<qint64> s_num_files_hashed(0);
+static QAtomicInteger<qint64> s_num_cache_hits(0);
+
+//also report to the counters, when the application has registered them
+static void add_to_counter(const QString& name, qint64 value)
+{
+    ICounterManager* manager = ObjectRegistry::getObject<ICounterManager>();
+    if (!manager)
+        return;
+    IIntCounter* counter = static_cast<IIntCounter*>(manager->counter(name));
+    if (counter)
+        counter->add(value);
+}
+
+static void record_hashing(qint64 num_bytes, const QElapsedTimer& timer)
+{
+    qint64 msec = timer.elapsed();
+    s_bytes_hashed.fetchAndAddRelaxed(num_bytes);
+    s_msec_hashing.fetchAndAddRelaxed(msec);
+    s_num_files_hashed.fetchAndAddRelaxed(1);
+    add_to_counter("bytes_hashed", num_bytes);
+    add_to_counter("msec_hashing", msec);
+}
+
+//reads n bytes at offset (or at the current position if offset<0), fewer only at the end of the file. Returns -1 on error.
+static qint64 read_fully(int fd, char* buf, qint64 n, qint64 offset = -1)
+{
+    qint64 total = 0;
+    while (total < n) {
+        ssize_t ret;
+        if (offset >= 0)
+            ret = ::pread(fd, buf + total, n - total, offset + total);
+        else
+            ret = ::read(fd, buf + total, n - total);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (ret == 0)
+            break;
+        total += ret;
+    }
+    return total;
+}
+
+QString compute_the_file_hash(const QString& path, qint64 num_bytes)
 {
     // Do not printf here!
+    // Large blocks, and the next block is read while the current one is hashed
+    QElapsedTimer timer;
+    timer.start();
+    int fd = ::open(path.toUtf8().data(), O_RDONLY);
+    if (fd < 0)
+        return "";
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    qint64 block_size = SUMIT_READ_BUFFER_SIZE;
+    if ((num_bytes > 0) && (num_bytes < block_size))
+        block_size = num_bytes;
+    std::vector<char> buffers[2];
+    buffers[0].resize(block_size);
     QCryptographicHash hash(QCryptographicHash::Sha1);
-    QFile FF(path);
-    if (!FF.open(QFile::ReadOnly))
+    qint64 num_bytes_processed = 0;
+    int current = 0;
+    qint64 len = read_fully(fd, buffers[current].data(), block_size);
+    while (len > 0) {
+        qint64 next_size = block_size;
+        if (num_bytes > 0)
+            next_size = qMin(next_size, num_bytes - num_bytes_processed - len);
+        if (len < block_size)
+            next_size = 0; //end of file
+        std::future<qint64> next;
+        if (next_size > 0) {
+            if (buffers[1 - current].empty())
+                buffers[1 - current].resize(block_size);
+            next = std::async(std::launch::async, read_fully, fd, buffers[1 - current].data(), next_size, (qint64)-1);
+        }
+        hash.addData(buffers[current].data(), len);
+        num_bytes_processed += len;
+        len = (next_size > 0) ? next.get() : 0;
+        current = 1 - current;
+    }
+    ::close(fd);
+    if (len < 0)
         return "";
-    int num_bytes_processed = 0;
-    while ((!FF.atEnd()) && ((num_bytes == 0) || (num_bytes_processed < num_bytes))) {
-        QByteArray tmp = FF.read(10000);
-        if (num_bytes != 0) {
-            if (num_bytes_processed + tmp.count() > num_bytes) {
-                tmp = tmp.mid(0, num_bytes - num_bytes_processed);
+
+    record_hashing(num_bytes_processed, timer);
+    QString ret = QString(hash.result().toHex());
+    return ret;
+}
+
+QString compute_the_file_tree_hash(const QString& path)
+{
+    // Do not printf here!
+    // The chunks are read and hashed by all cores at once, each with its own reads
+    QElapsedTimer timer;
+    timer.start();
+    int fd = ::open(path.toUtf8().data(), O_RDONLY);
+    if (fd < 0)
+        return "";
+    struct stat SS;
+    if (fstat(fd, &SS) != 0) {
+        ::close(fd);
+        return "";
+    }
+    qint64 size = SS.st_size;
+    qint64 num_chunks = (size + SUMIT_TREE_CHUNK_SIZE - 1) / SUMIT_TREE_CHUNK_SIZE;
+    std::vector<QByteArray> chunk_hashes(num_chunks);
+    std::atomic<qint64> next_chunk(0);
+    std::atomic<bool> failed(false);
+    auto hash_chunks = [&]() {
+        std::vector<char> buf(SUMIT_TREE_CHUNK_SIZE);
+        while (!failed) {
+            qint64 i = next_chunk++;
+            if (i >= num_chunks)
+                break;
+            qint64 offset = i * SUMIT_TREE_CHUNK_SIZE;
+            qint64 len = qMin((qint64)SUMIT_TREE_CHUNK_SIZE, size - offset);
+            if (read_fully(fd, buf.data(), len, offset) != len) {
+                failed = true;
+                break;
             }
+            QCryptographicHash hash(QCryptographicHash::Sha256);
+            hash.addData(buf.data(), len);
+            chunk_hashes[i] = hash.result();
         }
-        hash.addData(tmp);
-        num_bytes_processed += tmp.count();
+    };
+    qint64 num_threads = qMin((qint64)qMax(1, QThread::idealThreadCount()), num_chunks);
+    std::vector<std::thread> threads;
+    for (qint64 j = 1; j < num_threads; j++) {
+        threads.push_back(std::thread(hash_chunks));
+    }
+    hash_chunks();
+    for (size_t j = 0; j < threads.size(); j++) {
+        threads[j].join();
     }
+    ::close(fd);
+    if (failed)
+        return "";
 
-    QString ret = QString(hash.result().toHex());
+    QCryptographicHash root(QCryptographicHash::Sha256);
+    for (qint64 i = 0; i < num_chunks; i++) {
+        root.addData(chunk_hashes[i]);
+    }
+    record_hashing(size, timer);
+    QString ret = QString(root.result().toHex());
     return ret;
 }
 
@@ -76,46 +221,60 @@ void write_text_file(const QString& path, const QString& txt)
     out << txt;
 }
 
-void create_hash_file(const QString& path, const QString& hash_path)
-{
-    QString the_hash = compute_the_file_hash(path, 0);
-    write_text_file(hash_path, the_hash);
-}
-
-QString sumit(const QString& path, int num_bytes, const QString& temporary_path)
+//the file id is a hashed function of path, size, and modification time, so the cache stays valid until the file changes
+static QString cached_hash(const QString& path, const QString& temporary_path, const QString& algorithm, QString (*compute_hash)(const QString& path), int hash_length)
 {
-    if (num_bytes != 0) {
-        return compute_the_file_hash(path, num_bytes);
-    }
-    //the file id is a hashed function of device,inode,size, and modification time (in seconds)
-    //note that it is not dependent on the file name
-    struct stat SS;
-    stat(path.toLatin1().data(), &SS);
-
     //didn't compile on mac so using the following which only depends on size and modification date
-
     QFileInfo info(path);
     QString id_string = QString("%1:%2:%3:%4").arg(path).arg(info.size()).arg(info.lastModified().toMSecsSinceEpoch()).arg(info.size());
 
     //QString id_string = QString("%1:%2:%3:%4").arg(SS.st_dev).arg(SS.st_ino).arg(SS.st_size).arg(SS.st_mtim.tv_sec);
     QString file_id = compute_the_string_hash(id_string);
 
-    QString dirname = QString(temporary_path + "/sumit/sha1/%1").arg(file_id.mid(0, 4));
+    QString dirname = QString(temporary_path + "/sumit/%1/%2").arg(algorithm).arg(file_id.mid(0, 4));
     create_directory_if_doesnt_exist(dirname);
     QString hash_path = QString("%1/%2").arg(dirname).arg(file_id);
 
     QString hash_sum = read_text_file(hash_path);
-    if (hash_sum.isEmpty()) {
-        create_hash_file(path, hash_path);
-        hash_sum = read_text_file(hash_path);
-    }
-    if (hash_sum.count() != 40) {
-        create_hash_file(path, hash_path);
-        hash_sum = read_text_file(hash_path);
+    if (hash_sum.count() == hash_length) {
+        s_num_cache_hits.fetchAndAddRelaxed(1);
+        add_to_counter("hash_cache_hits", 1);
+        return hash_sum;
     }
+    hash_sum = compute_hash(path);
+    if (hash_sum.count() == hash_length)
+        write_text_file(hash_path, hash_sum);
     return hash_sum;
 }
 
+static QString compute_the_whole_file_hash(const QString& path)
+{
+    return compute_the_file_hash(path, 0);
+}
+
+QString sumit(const QString& path, int num_bytes, const QString& temporary_path)
+{
+    if (num_bytes != 0) {
+        return compute_the_file_hash(path, num_bytes);
+    }
+    return cached_hash(path, temporary_path, "sha1", compute_the_whole_file_hash, 40);
+}
+
+QString sumit_tree(const QString& path, const QString& temporary_path)
+{
+    return cached_hash(path, temporary_path, "sha256tree", compute_the_file_tree_hash, 64);
+}
+
+SumitStats sumit_stats()
+{
+    SumitStats ret;
+    ret.bytes_hashed = s_bytes_hashed.loadAcquire();
+    ret.msec_hashing = s_msec_hashing.loadAcquire();
+    ret.num_files_hashed = s_num_files_hashed.loadAcquire();
+    ret.num_cache_hits = s_num_cache_hits.loadAcquire();
+    return ret;
+}
+
 QString sumit_dir(const QString& path, const QString& temporary_path)
 {
     QStringList files = QDir(path).entryList(QStringList("*"), QDir::Files, QDir::Name);
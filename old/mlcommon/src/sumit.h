@@ -15,9 +15,22 @@ Computation of hash checksums. Like sha1sum except applies to folders as well as
 In the case of files, outputs the sha1 checksum, equivalent to the output of sha1sum. Local caching is performed (in /tmp/sumit/sha1) so that checksums do not need to be recomputed on subsequent calls with large files. The cache indexing is by device/inode/size/modification_time so there is no problem if files are moved or renamed within the same file system.
 
 In the case of directories, outputs a unique sha1 checksum that depends only on the contents of the directory (not the name or location of the directory). The computation depends on the checksum of each and every file within the directory tree, but again checksums do not need to be recomputed for the files in subsequent calls.
+
+sumit_tree outputs a different checksum of a file that can be computed by all cores at once: the sha256 of the concatenated (binary) sha256 checksums of the consecutive 4 MB chunks of the file. It is cached in the same way (in /tmp/sumit/sha256tree).
 */
 
 QString sumit(const QString& path, int num_bytes, const QString& temporary_path);
 QString sumit_dir(const QString& path, const QString& temporary_path);
+QString sumit_tree(const QString& path, const QString& temporary_path);
+
+//Totals for this process, over the checksums that were actually computed (not found in the cache).
+//They are also added to the bytes_hashed, msec_hashing and hash_cache_hits counters, if registered.
+struct SumitStats {
+    qint64 bytes_hashed = 0;
+    qint64 msec_hashing = 0; //wall time, summed over the files
+    qint64 num_files_hashed = 0;
+    qint64 num_cache_hits = 0;
+};
+SumitStats sumit_stats();
 
 #endif // SUMIT_H
@@ -30,11 +30,13 @@ SOURCES += \
 
 HEADERS += \
     processmanager.h \
+    resultcache.h \
     scriptcontroller2.h \
     unit_tests/unit_tests.h
 
 SOURCES += \
     processmanager.cpp \
+    resultcache.cpp \
     scriptcontroller2.cpp \
     unit_tests/unit_tests.cpp
 
@@ -114,7 +114,7 @@ struct run_script_opts {
 };
 
 QJsonArray monitor_stats_to_json_array(const QList<MonitorStats>& stats);
-int compute_peak_mem_bytes(const QList<MonitorStats>& stats);
+qint64 compute_peak_mem_bytes(const QList<MonitorStats>& stats);
 double compute_peak_cpu_pct(const QList<MonitorStats>& stats);
 double compute_avg_cpu_pct(const QList<MonitorStats>& stats);
 //void log_begin(int argc,char* argv[]);
@@ -344,7 +344,7 @@ int main(int argc, char* argv[])
             printf("PROCESS COMPLETED (exit code = %d): %s\n", info.exit_code, info.processor_name.toLatin1().data());
             if (!error_message.isEmpty())
                 printf("ERROR: %s\n", error_message.toLatin1().data());
-            int mb = compute_peak_mem_bytes(info.monitor_stats) / 1000000;
+            int mb = (int)(compute_peak_mem_bytes(info.monitor_stats) / 1000000);
             double cpu = compute_peak_cpu_pct(info.monitor_stats);
             double cpu_avg = compute_avg_cpu_pct(info.monitor_stats);
             double sec = info.start_time.msecsTo(info.finish_time) * 1.0 / 1000;
@@ -365,7 +365,7 @@ int main(int argc, char* argv[])
         obj["standard_error"] = QString(info.standard_error);
         obj["success"] = error_message.isEmpty();
         obj["error"] = error_message;
-        obj["peak_mem_bytes"] = (int)compute_peak_mem_bytes(info.monitor_stats);
+        obj["peak_mem_bytes"] = (double)compute_peak_mem_bytes(info.monitor_stats); //used by the daemon for its memory estimates
         obj["peak_cpu_pct"] = compute_peak_cpu_pct(info.monitor_stats);
         obj["avg_cpu_pct"] = compute_avg_cpu_pct(info.monitor_stats);
         obj["start_time"] = info.start_time.toString("yyyy-MM-dd:hh-mm-ss.zzz");
@@ -417,7 +417,7 @@ int main(int argc, char* argv[])
             return -1;
         }
 
-        ProcessManager::globalInstance()->cleanUpCompletedProcessRecords(); //those .json files in completed_process tmp directory
+        ProcessManager::globalInstance()->cleanUpCompletedProcessRecords(); //the index of completed processes in the completed_processes tmp directory
 
         QString output_fname = CLP.named_parameters.value("_script_output").toString(); //maybe the user or framework specified where output is to be saved
         if (!output_fname.isEmpty()) {
@@ -752,10 +752,14 @@ int main(int argc, char* argv[])
         server.setLogPath(log_path);
 
         ProcessResources RR; // these are the rules for determining how many processes to run simultaneously
-        //RR.num_threads = qMax(0.0, MLUtil::configValue("mountainprocess", "max_num_simultaneous_threads").toDouble());
-        //RR.memory_gb = qMax(0.0, MLUtil::configValue("mountainprocess", "max_total_memory_gb").toDouble());
-        RR.num_threads = 0;
-        RR.memory_gb = 0;
+        RR.num_threads = qMax(0.0, MLUtil::configValue("mountainprocess", "max_num_simultaneous_threads").toDouble());
+        RR.memory_gb = qMax(0.0, MLUtil::configValue("mountainprocess", "max_total_memory_gb").toDouble());
+        if (!RR.memory_gb) {
+            //default to the physical memory of this machine
+            double phys_bytes = (double)sysconf(_SC_PHYS_PAGES) * (double)sysconf(_SC_PAGE_SIZE);
+            if (phys_bytes > 0)
+                RR.memory_gb = phys_bytes / (1024.0 * 1024 * 1024);
+        }
         RR.num_processes = MLUtil::configValue("mountainprocess", "max_num_simultaneous_processes").toDouble();
         server.setTotalResourcesAvailable(RR);
         qDebug().noquote() << "Starting server...";
@@ -937,6 +941,7 @@ bool initialize_process_manager()
     }
     ProcessManager* PM = ProcessManager::globalInstance();
 
+    PM->setUseProcessorPlugins(MLUtil::configValue("mountainprocess", "use_processor_plugins").toBool());
     PM->setProcessorPaths(processor_paths);
     return true;
 
@@ -1075,7 +1080,7 @@ void print_usage()
     printf("mp-get-default-daemon\n");
     printf("mp-set-default-daemon [some daemon id]\n");
     printf("mountainprocess clear-processing [some daemon id]\n");
-    printf("mp-queue-process [processor_name] --_process_output=[optional_output_fname] --[param1]=[val1] --[param2]=[val2] ... [--_force_run]\n");
+    printf("mp-queue-process [processor_name] --_process_output=[optional_output_fname] --[param1]=[val1] --[param2]=[val2] ... [--_force_run] [--_priority=0]\n");
     printf("mp-list-processors\n");
     printf("mp-spec [processor_name]\n");
     printf("mp-cleanup-cache\n");
@@ -1138,6 +1143,7 @@ bool queue_pript(PriptType prtype, const CLParams& CLP, QString working_path)
         int request_num_threads = CLP.named_parameters.value("_request_num_threads", 0).toInt();
         PP.prtype = ProcessType;
         PP.RPR.request_num_threads = request_num_threads;
+        PP.priority = CLP.named_parameters.value("_priority", 0).toInt(); //higher is launched first by the daemon
         PP.processor_name = CLP.unnamed_parameters.value(1); //arg2 -- the name of the processor
         ProcessManager* PM = ProcessManager::globalInstance();
         if (!PM->processorNames().contains(PP.processor_name)) {
@@ -1278,15 +1284,15 @@ QJsonArray monitor_stats_to_json_array(const QList<MonitorStats>& stats)
         MonitorStats X = stats[i];
         QJsonObject obj;
         obj["timestamp"] = X.timestamp.toMSecsSinceEpoch();
-        obj["mem_bytes"] = (int)X.mem_bytes;
+        obj["mem_bytes"] = (double)X.mem_bytes;
         obj["cpu_pct"] = X.cpu_pct;
         ret << obj;
     }
     return ret;
 }
-int compute_peak_mem_bytes(const QList<MonitorStats>& stats)
+qint64 compute_peak_mem_bytes(const QList<MonitorStats>& stats)
 {
-    int ret = 0;
+    qint64 ret = 0;
     for (int i = 0; i < stats.count(); i++) {
         ret = qMax(ret, stats[i].mem_bytes);
     }
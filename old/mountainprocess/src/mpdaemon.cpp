@@ -163,6 +163,7 @@ QJsonObject pript_struct_to_obj(MPDaemonPript S, RecordType rt)
     ret["timestamp_started"] = S.timestamp_started.toString("yyyy-MM-dd|hh:mm:ss.zzz");
     ret["timestamp_finished"] = S.timestamp_finished.toString("yyyy-MM-dd|hh:mm:ss.zzz");
     ret["request_num_threads"] = S.RPR.request_num_threads;
+    ret["priority"] = S.priority;
     if (S.prtype == ScriptType) {
         ret["prtype"] = "script";
         if (rt != AbbreviatedRecord) {
@@ -204,6 +205,7 @@ MPDaemonPript pript_obj_to_struct(QJsonObject obj)
     ret.timestamp_started = QDateTime::fromString(obj.value("timestamp_started").toString(), "yyyy-MM-dd|hh:mm:ss.zzz");
     ret.timestamp_finished = QDateTime::fromString(obj.value("timestamp_finished").toString(), "yyyy-MM-dd|hh:mm:ss.zzz");
     ret.RPR.request_num_threads = obj.value("request_num_threads").toInt();
+    ret.priority = obj.value("priority").toInt();
     if (obj.value("prtype").toString() == "script") {
         ret.prtype = ScriptType;
         ret.script_paths = json_array_to_stringlist(obj.value("script_paths").toArray());
@@ -377,7 +379,9 @@ bool MountainProcessServer::queueScript(const MPDaemonPript& script)
     }
     writeLogRecord("queue-script", "pript_id", script.id);
     m_pripts[script.id] = script;
+    m_pending_scripts << script.id;
     write_pript_file(script);
+    request_iterate();
     return true;
 }
 
@@ -393,6 +397,33 @@ bool MountainProcessServer::queueProcess(const MPDaemonPript& process)
     writeLogRecord("queue-process", process.id);
     m_pripts[process.id] = process;
     write_pript_file(process);
+    //check the processor and parameters once, here, rather than on every scheduling pass
+    if (!check_process_parameters(process.id)) {
+        writeLogRecord("unqueue-process", "pript_id", process.id, "reason", "processor not found or parameters are incorrect.");
+        remove_pript(process.id);
+        return false;
+    }
+    MPDaemonPript* P = &m_pripts[process.id];
+    P->input_paths = get_input_paths(*P);
+    P->output_paths = get_output_paths(*P);
+    foreach (QString path, P->input_paths) {
+        P->input_gb += QFileInfo(path).size() * 1.0 / (1024 * 1024 * 1024);
+    }
+    ProcessResources& RR = P->resources_needed;
+    RR.num_threads = qMax(1, P->RPR.request_num_threads);
+    RR.memory_gb = estimate_memory_gb(*P);
+    RR.num_processes = 1;
+    //a process that asks for more than the whole machine would otherwise never start
+    if (m_total_resources_available.num_threads)
+        RR.num_threads = qMin(RR.num_threads, m_total_resources_available.num_threads);
+    if (m_total_resources_available.memory_gb)
+        RR.memory_gb = qMin(RR.memory_gb, m_total_resources_available.memory_gb);
+    //pending processes are kept in order of priority, and first come first served within a priority
+    int index = m_pending_processes.count();
+    while ((index > 0) && (m_pripts.constFind(m_pending_processes[index - 1]).value().priority < P->priority))
+        index--;
+    m_pending_processes.insert(index, process.id);
+    request_iterate();
     return true;
 }
 
@@ -418,12 +449,28 @@ bool MountainProcessServer::start()
 
     m_is_running = true;
 
+    // hack by jfm to temporarily implement mp-list-daemons
+    {
+        QString daemon_id = qgetenv("MP_DAEMON_ID");
+        QSettings settings(QSettings::UserScope, "Magland", "MountainLab");
+        QStringList list = settings.value("mp-list-daemons-candidates").toStringList();
+        if (!list.contains(daemon_id)) {
+            list.append(daemon_id);
+            settings.setValue("mp-list-daemons-candidates", list);
+        }
+    }
+
+    //loaded again only when a queued process doesn't match (see check_process_parameters)
+    ProcessManager::globalInstance()->reloadProcessors();
+    load_memory_history();
+
     writeLogRecord("start-daemon");
-    QTimer timer;
-    connect(&timer, &QTimer::timeout, [this]() {
-        iterate();
-    });
-    timer.start(100);
+    //Launching is driven by events (queueing, and processes finishing). There is no signal for a
+    //parent process going away, so that is the only thing we still poll for.
+    QTimer orphan_timer;
+    connect(&orphan_timer, SIGNAL(timeout()), this, SLOT(slot_check_orphans()));
+    orphan_timer.start(1000);
+    request_iterate();
     qApp->exec();
     m_is_running = false;
     writeLogRecord("stop-daemon");
@@ -569,22 +616,32 @@ bool MountainProcessServer::releaseSocket()
 
 void MountainProcessServer::iterate()
 {
-    // hack by jfm to temporarily implement mp-list-daemons
-    {
-        QString daemon_id = qgetenv("MP_DAEMON_ID");
-        QSettings settings(QSettings::UserScope, "Magland", "MountainLab");
-        QStringList list = settings.value("mp-list-daemons-candidates").toStringList();
-        if (!list.contains(daemon_id)) {
-            list.append(daemon_id);
-            settings.setValue("mp-list-daemons-candidates", list);
-        }
-    }
-
-    stop_orphan_processes_and_scripts();
     handle_scripts();
     handle_processes();
 }
 
+void MountainProcessServer::request_iterate()
+{
+    //several requests within one pass of the event loop result in a single iteration
+    if (m_iterate_requested)
+        return;
+    m_iterate_requested = true;
+    QMetaObject::invokeMethod(this, "slot_iterate", Qt::QueuedConnection);
+}
+
+void MountainProcessServer::slot_iterate()
+{
+    m_iterate_requested = false;
+    if (!m_is_running)
+        return;
+    iterate();
+}
+
+void MountainProcessServer::slot_check_orphans()
+{
+    stop_orphan_processes_and_scripts();
+}
+
 void MountainProcessServer::writeLogRecord(QString record_type, QString key1, QVariant val1, QString key2, QVariant val2, QString key3, QVariant val3)
 {
     QVariantMap map;
@@ -651,15 +708,17 @@ bool MountainProcessServer::stop_or_remove_pript(const QString& key)
             }
         }
         finish_and_finalize(*PP);
-        m_pripts.remove(key);
-        if (PP->prtype == ScriptType)
+        PriptType prtype = PP->prtype;
+        remove_pript(key);
+        if (prtype == ScriptType)
             writeLogRecord("stop-script", "pript_id", key, "reason", "requested");
         else
             writeLogRecord("stop-process", "pript_id", key, "reason", "requested");
     }
     else {
-        m_pripts.remove(key);
-        if (PP->prtype == ScriptType)
+        PriptType prtype = PP->prtype;
+        remove_pript(key);
+        if (prtype == ScriptType)
             writeLogRecord("unqueue-script", "pript_id", key, "reason", "requested");
         else
             writeLogRecord("unqueue-process", "pript_id", key, "reason", "requested");
@@ -669,6 +728,8 @@ bool MountainProcessServer::stop_or_remove_pript(const QString& key)
 
 void MountainProcessServer::finish_and_finalize(MPDaemonPript& P)
 {
+    if (P.is_running)
+        remove_running_pript(P);
     P.is_finished = true;
     P.is_running = false;
     P.timestamp_finished = QDateTime::currentDateTime();
@@ -678,6 +739,61 @@ void MountainProcessServer::finish_and_finalize(MPDaemonPript& P)
     write_pript_file(P);
 }
 
+void MountainProcessServer::remove_pript(const QString& key)
+{
+    if (!m_pripts.contains(key))
+        return;
+    const MPDaemonPript& P = m_pripts[key];
+    if (P.is_running)
+        remove_running_pript(P);
+    if (P.prtype == ScriptType)
+        m_pending_scripts.removeOne(key);
+    else
+        m_pending_processes.removeOne(key);
+    m_blocked_since.remove(key);
+    m_pripts.remove(key);
+}
+
+void MountainProcessServer::add_running_pript(const MPDaemonPript& P)
+{
+    if (P.prtype == ScriptType) {
+        m_running_scripts.insert(P.id);
+        return;
+    }
+    m_running_processes.insert(P.id);
+    m_resources_in_use.num_threads += P.runtime_opts.num_threads_allotted;
+    m_resources_in_use.memory_gb += P.runtime_opts.memory_gb_allotted;
+    m_resources_in_use.num_processes += 1;
+    foreach (QString path, P.input_paths) {
+        m_running_input_paths[path]++;
+    }
+    foreach (QString path, P.output_paths) {
+        m_running_output_paths[path]++;
+    }
+}
+
+void MountainProcessServer::remove_running_pript(const MPDaemonPript& P)
+{
+    if (P.prtype == ScriptType) {
+        m_running_scripts.remove(P.id);
+    }
+    else if (m_running_processes.remove(P.id)) {
+        m_resources_in_use.num_threads -= P.runtime_opts.num_threads_allotted;
+        m_resources_in_use.memory_gb -= P.runtime_opts.memory_gb_allotted;
+        m_resources_in_use.num_processes -= 1;
+        foreach (QString path, P.input_paths) {
+            if (--m_running_input_paths[path] <= 0)
+                m_running_input_paths.remove(path);
+        }
+        foreach (QString path, P.output_paths) {
+            if (--m_running_output_paths[path] <= 0)
+                m_running_output_paths.remove(path);
+        }
+    }
+    //something was freed up, so there may be more to launch
+    request_iterate();
+}
+
 void MountainProcessServer::stop_orphan_processes_and_scripts()
 {
     QStringList keys = m_pripts.keys();
@@ -700,7 +816,7 @@ void MountainProcessServer::stop_orphan_processes_and_scripts()
                     kill_process_and_children(m_pripts[key].qprocess);
                     delete m_pripts[key].qprocess;
                     finish_and_finalize(m_pripts[key]);
-                    m_pripts.remove(key);
+                    remove_pript(key);
                 }
                 else {
                     if (m_pripts[key].prtype == ScriptType) {
@@ -712,7 +828,7 @@ void MountainProcessServer::stop_orphan_processes_and_scripts()
                         qWarning() << "Removing orphan process: " + key + " " + m_pripts[key].processor_name;
                     }
                     finish_and_finalize(m_pripts[key]);
-                    m_pripts.remove(key);
+                    remove_pript(key);
                 }
             }
         }
@@ -722,94 +838,79 @@ void MountainProcessServer::stop_orphan_processes_and_scripts()
 bool MountainProcessServer::handle_scripts()
 {
     int max_simultaneous_scripts = 100;
-    if (num_running_scripts() < max_simultaneous_scripts) {
-        int old_num_pending_scripts = num_pending_scripts();
-        if (num_pending_scripts() > 0) {
-            if (launch_next_script()) {
-                printf("%d scripts running.\n", num_running_scripts());
-            }
-            else {
-                if (num_pending_scripts() == old_num_pending_scripts) {
-                    qCritical() << "Failed to launch_next_script and the number of pending scripts has not decreased (unexpected). This has potential for infinite loop. So we are aborting.";
-                    abort();
-                }
-            }
+    QStringList still_pending;
+    foreach (QString key, m_pending_scripts) {
+        if (!m_pripts.contains(key))
+            continue;
+        if (num_running_scripts() >= max_simultaneous_scripts) {
+            still_pending << key;
+            continue;
+        }
+        //if the launch fails, the script has been removed
+        if (launch_pript(key)) {
+            printf("%d scripts running.\n", num_running_scripts());
         }
     }
+    m_pending_scripts = still_pending;
     return true;
 }
 
 bool MountainProcessServer::handle_processes()
 {
-    ProcessManager* PM = ProcessManager::globalInstance();
-    PM->reloadProcessors();
-
+    if (m_pending_processes.isEmpty())
+        return true;
     ProcessResources pr_available = compute_process_resources_available();
-    QStringList keys = m_pripts.keys();
-    foreach (QString key, keys) {
-        if (m_pripts[key].prtype == ProcessType) {
-            if ((!m_pripts[key].is_running) && (!m_pripts[key].is_finished)) {
-                ProcessResources pr_needed = compute_process_resources_needed(m_pripts[key]);
-                if (is_at_most(pr_needed, pr_available, m_total_resources_available)) {
-                    if (process_parameters_are_okay(key)) {
-                        if (okay_to_run_process(key)) { //check whether there are io file conflicts at the moment
-                            if (launch_pript(key)) {
-                                pr_available.num_threads -= m_pripts[key].runtime_opts.num_threads_allotted;
-                                pr_available.memory_gb -= m_pripts[key].runtime_opts.memory_gb_allotted;
-                                pr_available.num_processes -= 1;
-                            }
-                        }
-                    }
-                    else {
-                        writeLogRecord("unqueue-process", "pript_id", key, "reason", "processor not found or parameters are incorrect.");
-                        m_pripts.remove(key);
-                    }
-                }
-            }
+    QDateTime now = QDateTime::currentDateTime();
+    //The pending processes are in order of priority. When one does not fit in the resources that
+    //are left, the smaller ones behind it may still go ahead (backfill) -- but once it has been
+    //passed over for too long we stop launching until enough has finished for it to fit.
+    bool backfill = true;
+    QStringList still_pending;
+    foreach (QString key, m_pending_processes) {
+        if (!m_pripts.contains(key))
+            continue;
+        //every process needs at least one thread and counts as one process
+        bool exhausted = ((m_total_resources_available.num_processes != 0) && (pr_available.num_processes < 1))
+            || ((m_total_resources_available.num_threads != 0) && (pr_available.num_threads < 1));
+        if ((exhausted) || (!backfill)) {
+            still_pending << key;
+            continue;
+        }
+        if (!okay_to_run_process(key)) { //check whether there are io file conflicts at the moment
+            still_pending << key;
+            continue;
+        }
+        ProcessResources pr_needed = compute_process_resources_needed(m_pripts[key]);
+        if (!is_at_most(pr_needed, pr_available, m_total_resources_available)) {
+            still_pending << key;
+            if (!m_blocked_since.contains(key))
+                m_blocked_since[key] = now;
+            if (m_blocked_since[key].secsTo(now) > m_max_backfill_wait_sec)
+                backfill = false;
+            continue;
+        }
+        m_blocked_since.remove(key);
+        //if the launch fails, the process has been removed
+        if (launch_pript(key)) {
+            pr_available = compute_process_resources_available();
         }
     }
+    m_pending_processes = still_pending;
     return true;
 }
 
 int MountainProcessServer::num_running_pripts(PriptType prtype) const
 {
-    int ret = 0;
-    QStringList keys = m_pripts.keys();
-    foreach (QString key, keys) {
-        if (m_pripts[key].is_running) {
-            if (m_pripts[key].prtype == prtype)
-                ret++;
-        }
-    }
-    return ret;
+    if (prtype == ScriptType)
+        return m_running_scripts.count();
+    return m_running_processes.count();
 }
 
 int MountainProcessServer::num_pending_pripts(PriptType prtype) const
 {
-    int ret = 0;
-    QStringList keys = m_pripts.keys();
-    foreach (QString key, keys) {
-        if ((!m_pripts[key].is_running) && (!m_pripts[key].is_finished)) {
-            if (m_pripts[key].prtype == prtype)
-                ret++;
-        }
-    }
-    return ret;
-}
-
-bool MountainProcessServer::launch_next_script()
-{
-    QStringList keys = m_pripts.keys();
-    foreach (QString key, keys) {
-        if (m_pripts[key].prtype == ScriptType) {
-            if ((!m_pripts[key].is_running) && (!m_pripts[key].is_finished)) {
-                if (launch_pript(key)) {
-                    return true;
-                }
-            }
-        }
-    }
-    return false;
+    if (prtype == ScriptType)
+        return m_pending_scripts.count();
+    return m_pending_processes.count();
 }
 
 bool MountainProcessServer::launch_pript(QString pript_id)
@@ -849,7 +950,7 @@ bool MountainProcessServer::launch_pript(QString pript_id)
                 qWarning() << message;
                 writeLogRecord("error", "message", message);
                 writeLogRecord("unqueue-script", "pript_id", pript_id, "reason", message);
-                m_pripts.remove(pript_id);
+                remove_pript(pript_id);
                 return false;
             }
             if (MLUtil::computeSha1SumOfFile(fname) != S->script_path_checksums.value(ii)) {
@@ -858,7 +959,7 @@ bool MountainProcessServer::launch_pript(QString pript_id)
                 qWarning() << MLUtil::computeSha1SumOfFile(fname) << "<>" << S->script_path_checksums.value(ii);
                 writeLogRecord("error", "message", message);
                 writeLogRecord("unqueue-script", "pript_id", pript_id, "reason", "Script file has changed: " + fname);
-                m_pripts.remove(pript_id);
+                remove_pript(pript_id);
                 return false;
             }
             args << fname;
@@ -889,8 +990,8 @@ bool MountainProcessServer::launch_pript(QString pript_id)
         if (S->RPR.request_num_threads) {
             args << QString("--_request_num_threads=%1").arg(S->RPR.request_num_threads);
         }
-        //S->runtime_opts.num_threads_allotted = S->num_threads_requested;
-        //S->runtime_opts.memory_gb_allotted = S->memory_gb_requested;
+        S->runtime_opts.num_threads_allotted = S->resources_needed.num_threads;
+        S->runtime_opts.memory_gb_allotted = S->resources_needed.memory_gb;
     }
     if (S->force_run) {
         args << "--_force_run";
@@ -956,6 +1057,7 @@ bool MountainProcessServer::launch_pript(QString pript_id)
         }
         S->is_running = true;
         S->timestamp_started = QDateTime::currentDateTime();
+        add_running_pript(*S);
         write_pript_file(*S);
         return true;
     }
@@ -972,7 +1074,7 @@ bool MountainProcessServer::launch_pript(QString pript_id)
         qprocess->disconnect();
         delete qprocess;
         write_pript_file(*S);
-        m_pripts.remove(pript_id);
+        remove_pript(pript_id);
         return false;
     }
 }
@@ -980,30 +1082,89 @@ bool MountainProcessServer::launch_pript(QString pript_id)
 ProcessResources MountainProcessServer::compute_process_resources_available() const
 {
     ProcessResources ret = m_total_resources_available;
-    QStringList keys = m_pripts.keys();
-    foreach (QString key, keys) {
-        if (m_pripts[key].prtype == ProcessType) {
-            if (m_pripts[key].is_running) {
-                ProcessRuntimeOpts rtopts = m_pripts[key].runtime_opts;
-                ret.num_threads -= rtopts.num_threads_allotted;
-                ret.memory_gb -= rtopts.memory_gb_allotted;
-                ret.num_processes -= 1;
-            }
-        }
-    }
+    ret.num_threads -= m_resources_in_use.num_threads;
+    ret.memory_gb -= m_resources_in_use.memory_gb;
+    ret.num_processes -= m_resources_in_use.num_processes;
     return ret;
 }
 
 ProcessResources MountainProcessServer::compute_process_resources_needed(MPDaemonPript P) const
 {
-    ProcessResources ret;
-    ret.num_threads = P.RPR.request_num_threads;
-    if (ret.num_threads < 1)
-        ret.num_threads = 1;
-    //ret.memory_gb = P.memory_gb_requested;
-    ret.memory_gb = 1;
-    ret.num_processes = 1;
-    return ret;
+    //estimated when the process was queued
+    return P.resources_needed;
+}
+
+double MountainProcessServer::estimate_memory_gb(const MPDaemonPript& P) const
+{
+    //prefer what this processor actually used in earlier runs, scaled up for larger inputs
+    const QList<MemoryRecord> records = m_memory_history.value(P.processor_name);
+    if (!records.isEmpty()) {
+        double ret = 0;
+        foreach (MemoryRecord rec, records) {
+            double scale = 1;
+            if ((rec.input_gb > 0) && (P.input_gb > rec.input_gb))
+                scale = P.input_gb / rec.input_gb;
+            ret = qMax(ret, rec.peak_gb * scale);
+        }
+        return ret * 1.2; //some headroom
+    }
+    //otherwise the estimate the processor gives in its spec, if any
+    QJsonObject estimate = P.processor_spec.value("memory_estimate").toObject();
+    if (!estimate.isEmpty()) {
+        return estimate.value("base_gb").toDouble() + estimate.value("per_input_gb").toDouble() * P.input_gb;
+    }
+    return 1;
+}
+
+void MountainProcessServer::record_peak_memory(const MPDaemonPript& P)
+{
+    double peak_bytes = P.runtime_results.value("peak_mem_bytes").toDouble();
+    if (peak_bytes <= 0)
+        return;
+    MemoryRecord rec;
+    rec.input_gb = P.input_gb;
+    rec.peak_gb = peak_bytes / (1024.0 * 1024 * 1024);
+    QList<MemoryRecord>& records = m_memory_history[P.processor_name];
+    records << rec;
+    while (records.count() > 20)
+        records.removeFirst();
+    save_memory_history();
+}
+
+void MountainProcessServer::load_memory_history()
+{
+    m_memory_history.clear();
+    QString fname = MPDaemon::daemonPath() + "/memory_history.json";
+    if (!QFile::exists(fname))
+        return;
+    QJsonObject obj = QJsonDocument::fromJson(TextFile::read(fname).toUtf8()).object();
+    foreach (QString processor_name, obj.keys()) {
+        QJsonArray array = obj[processor_name].toArray();
+        for (int i = 0; i < array.count(); i++) {
+            MemoryRecord rec;
+            rec.input_gb = array[i].toObject().value("input_gb").toDouble();
+            rec.peak_gb = array[i].toObject().value("peak_gb").toDouble();
+            m_memory_history[processor_name] << rec;
+        }
+    }
+}
+
+void MountainProcessServer::save_memory_history() const
+{
+    QJsonObject obj;
+    foreach (QString processor_name, m_memory_history.keys()) {
+        QJsonArray array;
+        foreach (MemoryRecord rec, m_memory_history[processor_name]) {
+            QJsonObject obj0;
+            obj0["input_gb"] = rec.input_gb;
+            obj0["peak_gb"] = rec.peak_gb;
+            array << obj0;
+        }
+        obj[processor_name] = array;
+    }
+    QString fname = MPDaemon::daemonPath() + "/memory_history.json";
+    if (!TextFile::write(fname, QJsonDocument(obj).toJson()))
+        qWarning() << "Unable to write memory history: " + fname;
 }
 
 bool MountainProcessServer::process_parameters_are_okay(const QString& key) const
@@ -1029,40 +1190,29 @@ bool MountainProcessServer::process_parameters_are_okay(const QString& key) cons
     return true;
 }
 
+bool MountainProcessServer::check_process_parameters(const QString& key)
+{
+    if (process_parameters_are_okay(key))
+        return true;
+    //the processor may have been added or changed since we last loaded them
+    ProcessManager::globalInstance()->reloadProcessors();
+    return process_parameters_are_okay(key);
+}
+
 bool MountainProcessServer::okay_to_run_process(const QString& key) const
 {
     //next we check that there are no running processes where the input or output files conflict with the proposed input or output files
     //but note that it is okay for the same input file to be used in more than one simultaneous process
-    QSet<QString> pending_input_paths;
-    QSet<QString> pending_output_paths;
-    QStringList pripts_keys = m_pripts.keys();
-    foreach (QString key0, pripts_keys) {
-        if (m_pripts[key0].prtype == ProcessType) {
-            if (m_pripts[key0].is_running) {
-                QStringList input_paths = get_input_paths(m_pripts[key0]);
-                foreach (QString path0, input_paths) {
-                    pending_input_paths.insert(path0);
-                }
-                QStringList output_paths = get_output_paths(m_pripts[key0]);
-                foreach (QString path0, output_paths) {
-                    pending_output_paths.insert(path0);
-                }
-            }
-        }
+    const MPDaemonPript& P = m_pripts.constFind(key).value();
+    foreach (QString path0, P.input_paths) {
+        if (m_running_output_paths.contains(path0))
+            return false;
     }
-    {
-        QStringList proposed_input_paths = get_input_paths(m_pripts[key]);
-        QStringList proposed_output_paths = get_output_paths(m_pripts[key]);
-        foreach (QString path0, proposed_input_paths) {
-            if (pending_output_paths.contains(path0))
-                return false;
-        }
-        foreach (QString path0, proposed_output_paths) {
-            if (pending_input_paths.contains(path0))
-                return false;
-            if (pending_output_paths.contains(path0))
-                return false;
-        }
+    foreach (QString path0, P.output_paths) {
+        if (m_running_input_paths.contains(path0))
+            return false;
+        if (m_running_output_paths.contains(path0))
+            return false;
     }
     return true;
 }
@@ -1139,6 +1289,8 @@ void MountainProcessServer::slot_pript_qprocess_finished()
             else {
                 S->success = S->runtime_results["success"].toBool();
                 S->error = S->runtime_results["error"].toString();
+                if ((S->success) && (S->prtype == ProcessType))
+                    record_peak_memory(*S);
             }
         }
     }
@@ -15,6 +15,8 @@
 #include <QProcess>
 #include <QFile>
 #include <QJsonArray>
+#include <QSet>
+#include <QHash>
 #include "localserver.h"
 #include "mpdaemoninterface.h"
 #include "processmanager.h" //for RequestProcessResources
@@ -108,6 +110,7 @@ protected:
     bool acquireSocket();
     bool releaseSocket();
     void iterate();
+    void request_iterate();
 
     void writeLogRecord(QString record_type, QString key1 = "", QVariant val1 = QVariant(), QString key2 = "", QVariant val2 = QVariant(), QString key3 = "", QVariant val3 = QVariant());
     void writeLogRecord(QString record_type, const QJsonObject& obj);
@@ -116,6 +119,9 @@ protected:
     void write_pript_file(const MPDaemonPript& P);
     bool stop_or_remove_pript(const QString& key);
     void finish_and_finalize(MPDaemonPript& P);
+    void remove_pript(const QString& key);
+    void add_running_pript(const MPDaemonPript& P);
+    void remove_running_pript(const MPDaemonPript& P);
 
     void stop_orphan_processes_and_scripts();
     bool handle_scripts();
@@ -140,11 +146,15 @@ protected:
 
     int num_running_pripts(PriptType prtype) const;
     int num_pending_pripts(PriptType prtype) const;
-    bool launch_next_script();
     bool launch_pript(QString id);
     ProcessResources compute_process_resources_available() const;
     ProcessResources compute_process_resources_needed(MPDaemonPript P) const;
     bool process_parameters_are_okay(const QString& key) const;
+    bool check_process_parameters(const QString& key);
+    double estimate_memory_gb(const MPDaemonPript& P) const;
+    void record_peak_memory(const MPDaemonPript& P);
+    void load_memory_history();
+    void save_memory_history() const;
     bool okay_to_run_process(const QString& key) const;
     QStringList get_input_paths(MPDaemonPript P) const;
     QStringList get_output_paths(MPDaemonPript P) const;
@@ -152,6 +162,8 @@ protected:
 private slots:
     void slot_pript_qprocess_finished();
     void slot_qprocess_output();
+    void slot_iterate();
+    void slot_check_orphans();
 
 private:
     QList<LocalServer::Client*> m_listeners;
@@ -162,6 +174,27 @@ private:
     QString m_logPath;
     ProcessResources m_total_resources_available;
     QString m_daemon_id;
+
+    //The scheduler state, kept up to date as pripts are queued, launched and finished
+    //so that a scheduling pass does not need to scan all of m_pripts
+    QStringList m_pending_scripts; //in the order they were queued
+    QStringList m_pending_processes;
+    QSet<QString> m_running_scripts;
+    QSet<QString> m_running_processes;
+    ProcessResources m_resources_in_use; //allotted to the running processes
+    QHash<QString, int> m_running_input_paths; //how many running processes use each path
+    QHash<QString, int> m_running_output_paths;
+    bool m_iterate_requested = false;
+
+    //Peak memory of past runs by processor name, used to estimate what a queued process will need
+    struct MemoryRecord {
+        double input_gb = 0;
+        double peak_gb = 0;
+    };
+    QMap<QString, QList<MemoryRecord> > m_memory_history;
+    //When a pending process that does not fit first got passed over by smaller ones behind it
+    QHash<QString, QDateTime> m_blocked_since;
+    double m_max_backfill_wait_sec = 600;
 };
 
 struct ProcessRuntimeOpts {
@@ -209,6 +242,11 @@ struct MPDaemonPript {
     RequestProcessResources RPR;
     ProcessRuntimeOpts runtime_opts; //defined at run time
     QJsonObject processor_spec;
+    QStringList input_paths; //determined from the processor spec when queued
+    QStringList output_paths;
+    double input_gb = 0; //total size of the input files when queued
+    ProcessResources resources_needed; //estimated when queued
+    int priority = 0; //higher runs first, e.g. the number of pipeline steps waiting on this one
 };
 
 enum RecordType {
@@ -18,17 +18,57 @@
 #include "mlcommon.h"
 
 #include <QCoreApplication>
+#include <QLibrary>
+#include <QRunnable>
 #include <QThread>
+#include <QThreadPool>
 #include <QTimer>
+#include <QVector>
 #include <cachemanager.h>
 #include "mpdaemon.h"
+#include "processorplugin.h"
+#include "resultcache.h"
+
+//Runs a processor from a plugin library, on a thread of the plugin pool
+class PMPluginRunner : public QRunnable {
+public:
+    ProcessorPluginRunFunction run_function = 0;
+    QList<QByteArray> args; //as for main() of the executable
+    QString id;
+    ProcessManager* manager = 0;
+    int exit_code = 0;
+    QAtomicInt finished;
+    bool handled = false; //set (on the main thread) by slot_plugin_run_finished
+
+    void run() override
+    {
+        QVector<char*> argv;
+        for (int i = 0; i < args.count(); i++) {
+            argv << args[i].data();
+        }
+        exit_code = run_function(argv.count(), argv.data());
+        //marked finished before the event is posted, so that the exit code is there whenever the main thread looks
+        finished.storeRelease(1);
+        QMetaObject::invokeMethod(manager, "slot_plugin_run_finished", Qt::QueuedConnection, Q_ARG(QString, id));
+    }
+};
 
 struct PMProcess {
     MLProcessInfo info;
     QString tempdir = "";
     bool preserve_tempdir = true; // for debugging set to true, otherwise will clean up the tempdir when process has finished
     bool exec_mode = false;
-    QProcess* qprocess;
+    QProcess* qprocess = 0;
+    PMPluginRunner* plugin_runner = 0; //instead of qprocess, when running in-process
+};
+
+//The processors loaded from a processor file, reused until the file (or its plugin) changes
+struct PMProcessorFile {
+    QDateTime last_modified;
+    qint64 size = 0;
+    QString plugin_path;
+    QDateTime plugin_last_modified;
+    QList<MLProcessor> processors;
 };
 
 class ProcessManagerPrivate {
@@ -38,6 +78,11 @@ public:
     QStringList m_processor_paths;
     QMap<QString, MLProcessor> m_processors;
     QMap<QString, PMProcess> m_processes;
+    QMap<QString, PMProcessorFile> m_processor_files; //by path
+    bool m_use_plugins = false;
+    QMap<QString, QLibrary*> m_plugins; //by path, loaded when first used (null if it could not be)
+    QThreadPool* m_plugin_pool = 0;
+    ResultCache* m_result_cache = 0; //created when first used
     //QStringList m_server_urls;
     //QString m_server_base_path;
 
@@ -45,11 +90,14 @@ public:
     void update_process_info(QString id);
     QString resolve_file_name_p(QString fname);
     QVariantMap resolve_file_names_in_parameters(QString processor_name, const QVariantMap& parameters);
-    QString compute_unique_object_code(QJsonObject obj);
-    QJsonObject compute_unique_process_object(MLProcessor P, const QVariantMap& parameters, bool rprv_inputs);
-    bool all_input_and_output_files_exist(MLProcessor P, const QVariantMap& parameters, bool allow_rprv_inputs, bool allow_rprv_outputs);
-    QJsonObject create_file_object(const QString& fname, bool allow_rprv_inputs);
+    ResultCache* result_cache();
+    QString compute_result_key(MLProcessor P, const QVariantMap& parameters, bool allow_rprv_inputs, QMap<QString, ResultCacheFile>& input_files);
+    QJsonObject create_result_record(MLProcessor P, const QVariantMap& parameters, const QMap<QString, ResultCacheFile>& input_files);
+    bool result_is_still_valid(const QJsonObject& record, const QMap<QString, ResultCacheFile>& input_files, bool allow_rprv_outputs);
     void reload_processors();
+    QString plugin_path_for(const QString& path) const;
+    ProcessorPluginRunFunction plugin_run_function(const MLProcessor& P);
+    void handle_process_finished(const QString& id);
 
     static MLProcessor create_processor_from_json_object(QJsonObject obj);
     static MLParameter create_parameter_from_json_object(QJsonObject obj);
@@ -59,6 +107,7 @@ ProcessManager::ProcessManager()
 {
     d = new ProcessManagerPrivate;
     d->q = this;
+    d->m_plugin_pool = new QThreadPool;
 
     QTimer::singleShot(1000, this, SLOT(slot_monitor()));
 }
@@ -66,6 +115,11 @@ ProcessManager::ProcessManager()
 ProcessManager::~ProcessManager()
 {
     d->clear_all_processes();
+    //a processor still running in-process cannot be stopped, so in that case we leave the pool to the end of the process
+    if (d->m_plugin_pool->activeThreadCount() == 0)
+        delete d->m_plugin_pool;
+    qDeleteAll(d->m_plugins);
+    delete d->m_result_cache;
     delete d;
 }
 
@@ -75,6 +129,11 @@ void ProcessManager::setProcessorPaths(const QStringList& paths)
     d->reload_processors();
 }
 
+void ProcessManager::setUseProcessorPlugins(bool val)
+{
+    d->m_use_plugins = val;
+}
+
 void ProcessManager::reloadProcessors()
 {
     d->reload_processors();
@@ -112,10 +171,26 @@ bool ProcessManager::loadProcessors(const QString& path, bool recursive)
 
 bool ProcessManager::loadProcessorFile(const QString& path)
 {
+    QFileInfo finfo(path);
+    QString plugin_path = d->plugin_path_for(path);
+    QDateTime plugin_last_modified;
+    if (!plugin_path.isEmpty())
+        plugin_last_modified = QFileInfo(plugin_path).lastModified();
+    if (d->m_processor_files.contains(path)) {
+        //unchanged since we last loaded it, so no need to read or parse it again
+        const PMProcessorFile& F = d->m_processor_files[path];
+        if ((F.last_modified == finfo.lastModified()) && (F.size == finfo.size()) && (F.plugin_path == plugin_path) && (F.plugin_last_modified == plugin_last_modified)) {
+            foreach (MLProcessor P, F.processors) {
+                d->m_processors[P.name] = P;
+            }
+            return true;
+        }
+    }
+
     QString json;
-    if (QFileInfo(path).isExecutable()) {
-        if ((QFile::exists(path + ".spec")) && (QFileInfo(path).lastModified().secsTo(QFileInfo(path + ".spec").lastModified()) >= 0) && (QFileInfo(path + ".spec").lastModified().secsTo(QDateTime::currentDateTime()) <= 60)) {
-            json = TextFile::read(path + ".spec"); // read the saved spec so we don't need to make the system call next time, but let's be careful about it... regenerate every 60 seconds
+    if (finfo.isExecutable()) {
+        if ((QFile::exists(path + ".spec")) && (QFileInfo(path + ".spec").lastModified() >= finfo.lastModified())) {
+            json = TextFile::read(path + ".spec"); // read the saved spec so we don't need to make the system call next time. It is regenerated whenever the executable changes
         }
         else {
             QProcess pp;
@@ -170,6 +245,11 @@ bool ProcessManager::loadProcessorFile(const QString& path)
         return false;
     }
     QJsonArray processors = obj["processors"].toArray();
+    PMProcessorFile F;
+    F.last_modified = finfo.lastModified();
+    F.size = finfo.size();
+    F.plugin_path = plugin_path;
+    F.plugin_last_modified = plugin_last_modified;
     for (int i = 0; i < processors.count(); i++) {
         if (!processors[i].isObject()) {
             qWarning() << "Problem with processor file: processor is not an object: " + path;
@@ -177,12 +257,15 @@ bool ProcessManager::loadProcessorFile(const QString& path)
         }
         MLProcessor P = d->create_processor_from_json_object(processors[i].toObject());
         P.basepath = QFileInfo(path).path();
+        P.plugin_path = plugin_path;
         if (P.name.isEmpty()) {
             qWarning() << "Problem with processor file: processor error: " + path;
             return false;
         }
         d->m_processors[P.name] = P;
+        F.processors << P;
     }
+    d->m_processor_files[path] = F;
     return true;
 }
 
@@ -270,6 +353,7 @@ QString ProcessManager::startProcess(const QString& processor_name, const QVaria
     QString exe_command = P.exe_command;
     exe_command.replace(QRegExp("\\$\\(basepath\\)"), P.basepath);
     exe_command.replace(QRegExp("\\$\\(tempdir\\)"), tempdir);
+    QStringList plugin_args; //the same arguments, for running in-process
     {
         QString ppp;
         {
@@ -279,6 +363,7 @@ QString ProcessManager::startProcess(const QString& processor_name, const QVaria
                 exe_command.replace(QRegExp(QString("\\$%1\\$").arg(key)), list.value(0)); //note that only the first file name is inserted here
                 foreach (QString str, list) {
                     ppp += QString("--%1=%2 ").arg(key).arg(str);
+                    plugin_args << QString("--%1=%2").arg(key).arg(str);
                 }
             }
         }
@@ -289,6 +374,7 @@ QString ProcessManager::startProcess(const QString& processor_name, const QVaria
                 exe_command.replace(QRegExp(QString("\\$%1\\$").arg(key)), list.value(0)); //note that only the first file name is inserted here
                 foreach (QString str, list) {
                     ppp += QString("--%1=%2 ").arg(key).arg(str);
+                    plugin_args << QString("--%1=%2").arg(key).arg(str);
                 }
             }
         }
@@ -297,13 +383,16 @@ QString ProcessManager::startProcess(const QString& processor_name, const QVaria
             foreach (QString key, keys) {
                 exe_command.replace(QRegExp(QString("\\$%1\\$").arg(key)), parameters[key].toString());
                 ppp += QString("--%1=%2 ").arg(key).arg(parameters[key].toString());
+                plugin_args << QString("--%1=%2").arg(key).arg(parameters[key].toString());
             }
         }
 
         if (RPR.request_num_threads) {
             ppp += QString("--_request_num_threads=%1 ").arg(RPR.request_num_threads);
+            plugin_args << QString("--_request_num_threads=%1").arg(RPR.request_num_threads);
         }
         ppp += QString("--_tempdir=%1 ").arg(tempdir);
+        plugin_args << QString("--_tempdir=%1").arg(tempdir);
 
         exe_command.replace(QRegExp("\\$\\(arguments\\)"), ppp);
     }
@@ -318,6 +407,27 @@ QString ProcessManager::startProcess(const QString& processor_name, const QVaria
     PP.tempdir = tempdir;
     PP.preserve_tempdir = preserve_tempdir;
     PP.exec_mode = exec_mode;
+
+    ProcessorPluginRunFunction run_function = d->plugin_run_function(P);
+    if (run_function) {
+        //no need to launch the executable, we run the processor here on a thread of the plugin pool
+        PMPluginRunner* runner = new PMPluginRunner;
+        runner->setAutoDelete(false);
+        runner->run_function = run_function;
+        runner->args << P.plugin_path.toUtf8() << processor_name.toUtf8();
+        foreach (QString arg, plugin_args) {
+            runner->args << arg.toUtf8();
+        }
+        runner->id = id;
+        runner->manager = this;
+        PP.plugin_runner = runner;
+        printf("STARTING (in-process): %s.\n", PP.info.exe_command.toLatin1().data());
+        PP.info.start_time = QDateTime::currentDateTime();
+        d->m_processes[id] = PP;
+        d->m_plugin_pool->start(runner);
+        return id;
+    }
+
     PP.qprocess = new QProcess;
     PP.qprocess->setProcessChannelMode(QProcess::MergedChannels);
     //connect(PP.qprocess,SIGNAL(readyRead()),this,SLOT(slot_qprocess_output()));
@@ -344,6 +454,18 @@ bool ProcessManager::waitForFinished(const QString& process_id, int parent_pid)
 {
     if (!d->m_processes.contains(process_id))
         return false;
+    if (d->m_processes[process_id].plugin_runner) {
+        //until slot_plugin_run_finished has recorded the result (or the process has been cleared in the meantime)
+        while ((d->m_processes.contains(process_id)) && (!d->m_processes[process_id].plugin_runner->handled)) {
+            qApp->processEvents();
+            if ((parent_pid) && (!MPDaemon::pidExists(parent_pid))) {
+                qWarning() << "Parent pid does not exist. The process is running in-process and will end with this one.";
+                return false;
+            }
+            QThread::msleep(20);
+        }
+        return true;
+    }
     QProcess* qprocess = d->m_processes[process_id].qprocess;
     return MPDaemon::waitForFinishedAndWriteOutput(qprocess, parent_pid);
 }
@@ -422,16 +544,16 @@ bool ProcessManager::processAlreadyCompleted(const QString& processor_name, cons
 
     MLProcessor P = d->m_processors[processor_name];
 
-    if (!d->all_input_and_output_files_exist(P, parameters, allow_rprv_inputs, allow_rprv_outputs))
-        return false;
-
-    QJsonObject obj = d->compute_unique_process_object(P, parameters, allow_rprv_inputs);
+    QMap<QString, ResultCacheFile> input_files;
+    QString key = d->compute_result_key(P, parameters, allow_rprv_inputs, input_files);
+    if (key.isEmpty())
+        return false; //an input is missing
 
-    QString code = d->compute_unique_object_code(obj);
-
-    QString path = MPDaemon::daemonPath() + "/completed_processes/" + code + ".json";
+    QJsonObject record = d->result_cache()->record(key);
+    if (record.isEmpty())
+        return false;
 
-    return QFile::exists(path);
+    return d->result_is_still_valid(record, input_files, allow_rprv_outputs);
 }
 
 QStringList ProcessManager::allProcessIds() const
@@ -444,7 +566,14 @@ void ProcessManager::clearProcess(const QString& id)
     if (!d->m_processes.contains(id))
         return;
     QProcess* qprocess = d->m_processes[id].qprocess;
+    PMPluginRunner* runner = d->m_processes[id].plugin_runner;
     d->m_processes.remove(id);
+    if (runner) {
+        //a processor running in-process cannot be stopped, in that case the runner is left to finish
+        if (runner->finished.loadAcquire())
+            delete runner;
+        return;
+    }
     if (qprocess->state() == QProcess::Running) {
         qprocess->kill();
     }
@@ -474,29 +603,25 @@ bool ProcessManager::isFinished(const QString& id)
     return processInfo(id).finished;
 }
 
-bool output_object_still_exists(const QJsonObject& obj)
+bool output_still_exists(ResultCache* cache, const QString& path, const QJsonObject& obj, bool allow_rprv)
 {
-    QString path = obj["path"].toString();
-    QDateTime last_modified = QDateTime::fromString(obj["last_modified"].toString(), "yyyy-MM-dd-hh-mm-ss-zzz");
-    bigint size = obj["size"].toDouble();
-    if (QFile::exists(path)) {
-        if (QFileInfo(path).size() == size) {
-            if (QFileInfo(path).lastModified().secsTo(last_modified) == 0) { //round to nearest second is important i think
-                return true;
-            }
-        }
+    ResultCacheFile F = cache->file(path);
+    if (F.exists)
+        return (F.fingerprint == obj["fingerprint"].toString());
+    if ((allow_rprv) && (QFile::exists(path + ".rprv"))) {
+        //removed as an intermediate file, with a record of what it was
+        QJsonObject rprv = QJsonDocument::fromJson(TextFile::read(path + ".rprv").toUtf8()).object();
+        return (((qint64)rprv["original_size"].toDouble() == (qint64)obj["size"].toDouble()) && (rprv["original_last_modified"].toString() == obj["last_modified"].toString()));
     }
-    else {
-        if (QFile::exists(path + ".rprv")) {
-            QJsonObject rprv = QJsonDocument::fromJson(TextFile::read(path + ".rprv").toUtf8()).object();
-            QDateTime last_modified0 = QDateTime::fromString(rprv["original_last_modified"].toString(), "yyyy-MM-dd-hh-mm-ss-zzz");
-            bigint size0 = rprv["original_size"].toDouble();
-            if (size0 == size) {
-                if (last_modified0.secsTo(last_modified) == 0) { //round to nearest second is important i think
-                    return true;
-                }
-            }
-        }
+    return false;
+}
+
+bool result_outputs_are_gone(ResultCache* cache, const QJsonObject& record)
+{
+    QJsonObject outputs = record["outputs"].toObject();
+    foreach (QString path, outputs.keys()) {
+        if (!output_still_exists(cache, path, outputs[path].toObject(), true))
+            return true;
     }
     return false;
 }
@@ -504,22 +629,13 @@ bool output_object_still_exists(const QJsonObject& obj)
 void ProcessManager::cleanUpCompletedProcessRecords()
 {
     qDebug().noquote() << "Cleaning up completed process records...";
+    d->result_cache()->compact(result_outputs_are_gone);
+
+    //from before the index, when there was a .json file for each completed process
     QString path = MPDaemon::daemonPath() + "/completed_processes";
     QStringList list = QDir(path).entryList(QStringList("*.json"), QDir::Files, QDir::Name);
     foreach (QString fname, list) {
-        QString path2 = path + "/" + fname;
-        QJsonObject obj = QJsonDocument::fromJson(TextFile::read(path2).toUtf8()).object();
-        QJsonObject outputs = obj["outputs"].toObject();
-        QStringList output_pnames = outputs.keys();
-        foreach (QString pname, output_pnames) {
-            QJsonObject A = outputs[pname].toObject();
-            if (A["size"].toDouble()) { //maybe there is no such output
-                if (!output_object_still_exists(A)) {
-                    qDebug().noquote() << "Removing completed process record: " + path2;
-                    QFile::remove(path2);
-                }
-            }
-        }
+        QFile::remove(path + "/" + fname);
     }
 }
 
@@ -548,33 +664,41 @@ void ProcessManager::slot_process_finished()
         qWarning() << "Process not found in slot_process_finished. It was probably cleared beforehand: " + id;
         return;
     }
-    d->update_process_info(id);
-    if ((qprocess->exitCode() == 0) && (qprocess->exitStatus() == QProcess::NormalExit)) {
-        QString processor_name = d->m_processes[id].info.processor_name;
-        QVariantMap parameters = d->m_processes[id].info.parameters;
-        if (!d->m_processors.contains(processor_name)) {
+    d->handle_process_finished(id);
+}
+
+void ProcessManager::slot_plugin_run_finished(QString id)
+{
+    if (!d->m_processes.contains(id))
+        return; //it was cleared beforehand
+    d->m_processes[id].plugin_runner->handled = true;
+    d->handle_process_finished(id);
+}
+
+void ProcessManagerPrivate::handle_process_finished(const QString& id)
+{
+    update_process_info(id);
+    const MLProcessInfo& info = m_processes[id].info;
+    if ((info.exit_code == 0) && (info.exit_status == QProcess::NormalExit)) {
+        QString processor_name = info.processor_name;
+        QVariantMap parameters = info.parameters;
+        if (!m_processors.contains(processor_name)) {
             qCritical() << "Unexpected problem in slot_process_finished. processor not found!!! " + processor_name;
         }
         else {
-            MLProcessor processor = d->m_processors[processor_name];
-            if (!d->m_processes[id].exec_mode) { //in exec_mode we don't keep track of which processes have already completed
-                QJsonObject obj = d->compute_unique_process_object(processor, parameters, false);
-                QString code = d->compute_unique_object_code(obj);
-                QString fname = MPDaemon::daemonPath() + "/completed_processes/" + code + ".json";
-                QString json = QJsonDocument(obj).toJson();
-                if (QFile::exists(fname))
-                    QFile::remove(fname); //shouldn't be needed
-                if (TextFile::write(fname + ".tmp", json)) {
-                    QFile::rename(fname + ".tmp", fname);
-                    QFile::Permissions perm = QFileDevice::ReadUser | QFileDevice::WriteUser | QFileDevice::ExeUser | QFileDevice::ReadGroup | QFileDevice::WriteGroup | QFileDevice::ExeGroup | QFileDevice::ReadOther | QFileDevice::WriteOther | QFileDevice::ExeOther;
-                    QFile::setPermissions(fname, perm);
+            MLProcessor processor = m_processors[processor_name];
+            if (!m_processes[id].exec_mode) { //in exec_mode we don't keep track of which processes have already completed
+                QMap<QString, ResultCacheFile> input_files;
+                QString key = compute_result_key(processor, parameters, false, input_files);
+                if (!key.isEmpty()) {
+                    result_cache()->insert(key, create_result_record(processor, parameters, input_files));
                 }
             }
         }
     }
-    if (!d->m_processes[id].preserve_tempdir)
-        delete_tempdir(d->m_processes[id].tempdir);
-    emit this->processFinished(id);
+    if (!m_processes[id].preserve_tempdir)
+        delete_tempdir(m_processes[id].tempdir);
+    emit q->processFinished(id);
 }
 
 void ProcessManager::slot_qprocess_output()
@@ -602,13 +726,18 @@ void ProcessManager::slot_monitor()
     QStringList ids = d->m_processes.keys();
     foreach (QString id, ids) {
         PMProcess* PP = &d->m_processes[id];
-        if (PP->qprocess) {
-            QString cmd = QString("ps -p %1 -o rss,%cpu --noheader").arg(PP->qprocess->pid());
+        qint64 pid = 0;
+        if (PP->qprocess)
+            pid = PP->qprocess->pid();
+        else if ((PP->plugin_runner) && (!PP->plugin_runner->finished.loadAcquire()))
+            pid = QCoreApplication::applicationPid(); //running in-process
+        if (pid) {
+            QString cmd = QString("ps -p %1 -o rss,%cpu --noheader").arg(pid);
             QString str = execute_and_read_stdout(cmd);
             QStringList list = str.split(" ", QString::SkipEmptyParts);
             MonitorStats MS;
             MS.timestamp = QDateTime::currentDateTime();
-            MS.mem_bytes = list.value(0).toLong() * 1000;
+            MS.mem_bytes = list.value(0).toLongLong() * 1000; //kB, so this does not fit in an int for processes above 2 GB
             MS.cpu_pct = list.value(1).toDouble();
             PP->info.monitor_stats << MS;
         }
@@ -621,6 +750,9 @@ void ProcessManagerPrivate::clear_all_processes()
 {
     foreach (PMProcess P, m_processes) {
         delete P.qprocess;
+        //one still running in-process cannot be stopped, and is left to finish
+        if ((P.plugin_runner) && (P.plugin_runner->finished.loadAcquire()))
+            delete P.plugin_runner;
     }
     m_processes.clear();
 }
@@ -630,6 +762,15 @@ void ProcessManagerPrivate::update_process_info(QString id)
     if (!m_processes.contains(id))
         return;
     PMProcess* PP = &m_processes[id];
+    if (PP->plugin_runner) {
+        if ((!PP->info.finished) && (PP->plugin_runner->finished.loadAcquire())) {
+            PP->info.finish_time = QDateTime::currentDateTime();
+            PP->info.finished = true;
+            PP->info.exit_code = PP->plugin_runner->exit_code;
+            PP->info.exit_status = QProcess::NormalExit;
+        }
+        return;
+    }
     QProcess* qprocess = PP->qprocess;
     if (qprocess->state() == QProcess::NotRunning) {
         PP->info.finish_time = QDateTime::currentDateTime();
@@ -759,180 +900,120 @@ MLParameter ProcessManagerPrivate::create_parameter_from_json_object(QJsonObject
     return param;
 }
 
-QJsonObject ProcessManagerPrivate::compute_unique_process_object(MLProcessor P, const QVariantMap& parameters, bool allow_rprv_inputs)
+ResultCache* ProcessManagerPrivate::result_cache()
+{
+    if (!m_result_cache)
+        m_result_cache = new ResultCache(MPDaemon::daemonPath() + "/completed_processes/index.jsonl");
+    return m_result_cache;
+}
+
+QString ProcessManagerPrivate::compute_result_key(MLProcessor P, const QVariantMap& parameters, bool allow_rprv_inputs, QMap<QString, ResultCacheFile>& input_files)
 {
     /*
-     * Returns an object that depends uniquely on the following:
+     * Returns a code that depends only on the following:
      *   1. Version of mountainprocess
      *   2. Processor name and version
      *   3. The paths, sizes, and modification times of the input files (together with their parameter names)
-     *   4. Same for the output files
+     *   4. The paths of the output files
      *   5. The parameters converted to strings
+     * or an empty string if an input file is missing.
+     *
+     * The full fingerprints of the input files (see ResultCache) are compared against the record
+     * instead, since an input that was removed as an intermediate file only has its size and
+     * modification time left in its .rprv file.
      */
 
-    QJsonObject obj;
-
-    obj["mountainprocess_version"] = "0.1";
-    obj["processor_name"] = P.name;
-    obj["processor_version"] = P.version;
-    {
-        QJsonObject inputs;
-        QStringList input_pnames = P.inputs.keys();
-        qSort(input_pnames);
-        foreach (QString input_pname, input_pnames) {
-            QStringList fnames = MLUtil::toStringList(parameters[input_pname]);
-            if (fnames.count() == 1) {
-                inputs[input_pname] = create_file_object(resolve_file_name_p(fnames[0]), allow_rprv_inputs);
-            }
-            else {
-                QJsonArray array;
-                foreach (QString fname0, fnames) {
-                    QString fname = resolve_file_name_p(fname0);
-                    array.append(create_file_object(fname, allow_rprv_inputs));
-                }
-                inputs[input_pname] = array;
+    ResultCache* cache = result_cache();
+    QString str = "mountainprocess 0.2\n" + P.name + " " + P.version + "\n";
+    QStringList input_pnames = P.inputs.keys();
+    qSort(input_pnames);
+    foreach (QString input_pname, input_pnames) {
+        QStringList fnames = MLUtil::toStringList(parameters.value(input_pname));
+        foreach (QString fname0, fnames) {
+            if (fname0.isEmpty())
+                continue;
+            QString fname = resolve_file_name_p(fname0);
+            if (fname.isEmpty())
+                continue;
+            ResultCacheFile F = cache->file(fname);
+            QString identity;
+            if (F.exists) {
+                if (F.is_dir)
+                    identity = F.fingerprint;
+                else
+                    identity = QString("%1 %2").arg(F.size).arg(F.last_modified);
+                input_files[fname] = F;
             }
-        }
-        obj["inputs"] = inputs;
-    }
-    {
-        QJsonObject outputs;
-        QStringList output_pnames = P.outputs.keys();
-        qSort(output_pnames);
-        foreach (QString output_pname, output_pnames) {
-            QStringList fnames = MLUtil::toStringList(parameters[output_pname]);
-            if (fnames.count() == 1) {
-                outputs[output_pname] = create_file_object(resolve_file_name_p(fnames[0]), true);
+            else if ((allow_rprv_inputs) && (QFile::exists(fname + ".rprv"))) {
+                QJsonObject rprv = QJsonDocument::fromJson(TextFile::read(fname + ".rprv").toUtf8()).object();
+                identity = QString("%1 %2").arg((qint64)rprv["original_size"].toDouble()).arg(rprv["original_last_modified"].toString());
             }
             else {
-                QJsonArray array;
-                foreach (QString fname0, fnames) {
-                    QString fname = resolve_file_name_p(fname0);
-                    array.append(create_file_object(fname, true));
-                }
-                outputs[output_pname] = array;
+                return "";
             }
+            str += QString("input %1 %2 %3\n").arg(input_pname).arg(fname).arg(identity);
         }
-        obj["outputs"] = outputs;
     }
-    {
-        QJsonObject parameters0;
-        QStringList pnames = P.parameters.keys();
-        qSort(pnames);
-        foreach (QString pname, pnames) {
-            parameters0[pname] = parameters[pname].toString();
+    QStringList output_pnames = P.outputs.keys();
+    qSort(output_pnames);
+    foreach (QString output_pname, output_pnames) {
+        QStringList fnames = MLUtil::toStringList(parameters.value(output_pname));
+        foreach (QString fname0, fnames) {
+            str += QString("output %1 %2\n").arg(output_pname).arg(resolve_file_name_p(fname0));
         }
-        obj["parameters"] = parameters0;
     }
-    return obj;
+    QStringList pnames = P.parameters.keys();
+    qSort(pnames);
+    foreach (QString pname, pnames) {
+        str += QString("parameter %1 %2\n").arg(pname).arg(parameters.value(pname).toString());
+    }
+    return QString(QCryptographicHash::hash(str.toUtf8(), QCryptographicHash::Sha1).toHex());
 }
 
-bool ProcessManagerPrivate::all_input_and_output_files_exist(MLProcessor P, const QVariantMap& parameters, bool allow_rprv_input_files, bool allow_rprv_output_files)
+QJsonObject ProcessManagerPrivate::create_result_record(MLProcessor P, const QVariantMap& parameters, const QMap<QString, ResultCacheFile>& input_files)
 {
-    QStringList input_file_pnames = P.inputs.keys();
-    QStringList output_file_pnames = P.outputs.keys();
-
-    foreach (QString pname, input_file_pnames) {
-        QStringList fnames = MLUtil::toStringList(parameters.value(pname));
-        foreach (QString fname0, fnames) {
-            if (!fname0.isEmpty()) {
-                QString fname = resolve_file_name_p(fname0);
-                if (!fname.isEmpty()) {
-                    if (!QFile::exists(fname)) {
-                        if (allow_rprv_input_files) {
-                            if (!QFile::exists(fname + ".rprv")) {
-                                return false;
-                            }
-                        }
-                        else {
-                            return false;
-                        }
-                    }
-                }
-            }
-        }
+    ResultCache* cache = result_cache();
+    QJsonObject inputs;
+    foreach (QString path, input_files.keys()) {
+        inputs[path] = input_files[path].fingerprint;
     }
-
-    foreach (QString pname, output_file_pnames) {
-        QStringList fnames = MLUtil::toStringList(parameters.value(pname));
+    QJsonObject outputs;
+    foreach (QString output_pname, P.outputs.keys()) {
+        QStringList fnames = MLUtil::toStringList(parameters.value(output_pname));
         foreach (QString fname0, fnames) {
-            if (!fname0.isEmpty()) {
-                QString fname = resolve_file_name_p(fname0);
-                if (!fname.isEmpty()) {
-                    if (!QFile::exists(fname)) {
-                        if (allow_rprv_output_files) {
-                            if (!QFile::exists(fname + ".rprv")) {
-                                return false;
-                            }
-                        }
-                        else {
-                            return false;
-                        }
-                    }
-                }
-            }
+            QString fname = resolve_file_name_p(fname0);
+            if (fname.isEmpty())
+                continue;
+            ResultCacheFile F = cache->file(fname);
+            QJsonObject obj;
+            obj["fingerprint"] = F.fingerprint;
+            obj["size"] = (double)F.size;
+            obj["last_modified"] = F.last_modified;
+            outputs[fname] = obj;
         }
     }
-
-    return true;
-}
-
-QString ProcessManagerPrivate::compute_unique_object_code(QJsonObject obj)
-{
-    /// Witold I need a string that depends on the json object. However I am worried about the order of the fields. Is there a way to make this canonical?
-    /// Jeremy: You can sort all keys in the dictionary, convert that to string and
-    ///         calculate hash of that. However this is going to be CPU consuming
-    QByteArray json = QJsonDocument(obj).toJson();
-    QCryptographicHash hash(QCryptographicHash::Sha1);
-    hash.addData(json);
-    return QString(hash.result().toHex());
+    QJsonObject record;
+    record["processor_name"] = P.name;
+    record["processor_version"] = P.version;
+    record["inputs"] = inputs;
+    record["outputs"] = outputs;
+    return record;
 }
 
-QJsonObject ProcessManagerPrivate::create_file_object(const QString& fname_in, bool allow_rprv_inputs)
+bool ProcessManagerPrivate::result_is_still_valid(const QJsonObject& record, const QMap<QString, ResultCacheFile>& input_files, bool allow_rprv_outputs)
 {
-    QString fname = resolve_file_name_p(fname_in);
-    QJsonObject obj;
-    if (fname.isEmpty())
-        return obj;
-    obj["path"] = fname;
-    if (!QFile::exists(fname)) {
-        if ((allow_rprv_inputs) && (QFile::exists(fname_in + ".rprv"))) {
-            QString json0 = TextFile::read(fname_in + ".rprv");
-            QJsonObject obj0 = QJsonDocument::fromJson(json0.toUtf8()).object();
-            obj["size"] = obj0["original_size"];
-            obj["last_modified"] = obj0["original_last_modified"];
-        }
-        else {
-            obj["size"] = 0;
-            return obj;
-        }
-    }
-    else {
-        obj["size"] = QFileInfo(fname).size();
-        obj["last_modified"] = QFileInfo(fname).lastModified().toString("yyyy-MM-dd-hh-mm-ss-zzz");
+    //the key only has the size and modification time of the inputs, so check the rest here
+    QJsonObject inputs = record["inputs"].toObject();
+    foreach (QString path, input_files.keys()) {
+        if (inputs[path].toString() != input_files[path].fingerprint)
+            return false;
     }
-    if (QFileInfo(fname).isDir()) {
-        QStringList fnames = QDir(fname).entryList(QDir::Files, QDir::Name);
-        QJsonArray files_array;
-        foreach (QString fname2, fnames) {
-            QJsonObject obj0;
-            obj0["name"] = fname2;
-            obj0["object"] = create_file_object(fname + "/" + fname2, false);
-            files_array.push_back(obj0);
-        }
-        obj["files"] = files_array;
-
-        QStringList dirnames = QDir(fname).entryList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
-        QJsonArray dirs_array;
-        foreach (QString dirname2, dirnames) {
-            QJsonObject obj0;
-            obj0["name"] = dirname2;
-            obj0["object"] = create_file_object(fname + "/" + dirname2, false);
-            dirs_array.push_back(obj0);
-        }
-        obj["directories"] = dirs_array;
+    QJsonObject outputs = record["outputs"].toObject();
+    foreach (QString path, outputs.keys()) {
+        if (!output_still_exists(result_cache(), path, outputs[path].toObject(), allow_rprv_outputs))
+            return false;
     }
-    return obj;
+    return true;
 }
 
 void ProcessManagerPrivate::reload_processors()
@@ -947,3 +1028,61 @@ void ProcessManagerPrivate::reload_processors()
         }
     }
 }
+
+QString ProcessManagerPrivate::plugin_path_for(const QString& path) const
+{
+    //see processorplugin.h
+    if (!m_use_plugins)
+        return "";
+    QFileInfo finfo(path);
+    if (!finfo.isExecutable())
+        return "";
+#ifdef Q_OS_MAC
+    QString ret = finfo.path() + "/lib" + finfo.completeBaseName() + "_plugin.dylib";
+#else
+    QString ret = finfo.path() + "/lib" + finfo.completeBaseName() + "_plugin.so";
+#endif
+    if (!QFile::exists(ret))
+        return "";
+    return ret;
+}
+
+ProcessorPluginRunFunction ProcessManagerPrivate::plugin_run_function(const MLProcessor& P)
+{
+    if ((!m_use_plugins) || (P.plugin_path.isEmpty()))
+        return 0;
+    if (!m_plugins.contains(P.plugin_path)) {
+        QLibrary* lib = new QLibrary(P.plugin_path);
+        if (!lib->load()) {
+            qWarning() << "Unable to load processor plugin: " + P.plugin_path + ": " + lib->errorString();
+            delete lib;
+            lib = 0;
+        }
+        m_plugins[P.plugin_path] = lib;
+    }
+    QLibrary* lib = m_plugins[P.plugin_path];
+    if (!lib)
+        return 0;
+    ProcessorPluginSpecFunction spec_function = (ProcessorPluginSpecFunction)lib->resolve(PROCESSOR_PLUGIN_SPEC_SYMBOL);
+    ProcessorPluginRunFunction run_function = (ProcessorPluginRunFunction)lib->resolve(PROCESSOR_PLUGIN_RUN_SYMBOL);
+    if ((!spec_function) || (!run_function)) {
+        qWarning() << "Processor plugin does not export the expected functions: " + P.plugin_path;
+        return 0;
+    }
+    //only if the library was built from the same code as the executable, which we check by the spec of this processor
+    QJsonArray processors = QJsonDocument::fromJson(QByteArray(spec_function())).object()["processors"].toArray();
+    for (int i = 0; i < processors.count(); i++) {
+        QJsonObject obj = processors[i].toObject();
+        if (obj["name"].toString() == P.name) {
+            QJsonObject spec = P.spec;
+            obj.remove("exe_command");
+            spec.remove("exe_command");
+            if (obj != spec) {
+                qWarning() << "Processor plugin does not match the executable, so not running in-process: " + P.name;
+                return 0;
+            }
+            return run_function;
+        }
+    }
+    return 0;
+}
@@ -36,11 +36,12 @@ struct MLProcessor {
     QJsonObject spec;
 
     QString basepath;
+    QString plugin_path; //a library that can run this processor in-process (see processorplugin.h), if any
 };
 
 struct MonitorStats {
     QDateTime timestamp;
-    int mem_bytes = 0;
+    qint64 mem_bytes = 0;
     double cpu_pct = 0;
 };
 
@@ -70,6 +71,7 @@ public:
     //void setServerBasePath(const QString& path);
 
     void setProcessorPaths(const QStringList& paths);
+    void setUseProcessorPlugins(bool val);
     void reloadProcessors();
 
     QStringList processorNames() const;
@@ -102,6 +104,7 @@ private slots:
     void slot_process_finished();
     void slot_qprocess_output();
     void slot_monitor();
+    void slot_plugin_run_finished(QString id);
 
 private:
     ProcessManagerPrivate* d;
@@ -0,0 +1,287 @@
+/******************************************************
+** See the accompanying README and LICENSE files
+*******************************************************/
+
+#include "resultcache.h"
+#include "mlcommon.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QJsonDocument>
+#include <stdio.h> //for rename
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RESULT_CACHE_SAMPLE_SIZE 65536
+
+struct ResultCacheSample {
+    QString stat_code; //the inode, size and modification time the sample was taken at
+    QString hash;
+};
+
+class ResultCachePrivate {
+public:
+    ResultCache* q;
+    QString m_index_path;
+    bool m_loaded = false;
+    qint64 m_index_inode = 0;
+    qint64 m_index_offset = 0; //how much of the index we have read
+    int m_num_lines = 0;
+    QHash<QString, QJsonObject> m_records;
+    QHash<QString, ResultCacheSample> m_samples; //by path
+
+    void refresh();
+    void read_line(const QByteArray& line);
+    void append(const QJsonObject& line);
+    QString sample_hash(const QString& path, qint64 size);
+    static QString stat_code(const QString& path);
+};
+
+ResultCache::ResultCache(const QString& index_path)
+{
+    d = new ResultCachePrivate;
+    d->q = this;
+    d->m_index_path = index_path;
+}
+
+ResultCache::~ResultCache()
+{
+    delete d;
+}
+
+static qint64 mtime_ns(const struct stat& st)
+{
+#ifdef Q_OS_MAC
+    return ((qint64)st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    return ((qint64)st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+}
+
+ResultCacheFile ResultCache::file(const QString& path)
+{
+    ResultCacheFile ret;
+    struct stat st;
+    if (stat(path.toUtf8().data(), &st) != 0)
+        return ret;
+    if (!d->m_loaded)
+        d->refresh();
+    ret.exists = true;
+    ret.last_modified = QDateTime::fromMSecsSinceEpoch(mtime_ns(st) / 1000000).toString("yyyy-MM-dd-hh-mm-ss-zzz");
+    if (S_ISDIR(st.st_mode)) {
+        ret.is_dir = true;
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        QStringList names = QDir(path).entryList(QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
+        foreach (QString name, names) {
+            hash.addData(QString("%1 %2\n").arg(name).arg(file(path + "/" + name).fingerprint).toUtf8());
+        }
+        ret.fingerprint = "dir " + QString(hash.result().toHex());
+        return ret;
+    }
+    ret.size = st.st_size;
+    QString code = QString("%1 %2 %3").arg((qint64)st.st_ino).arg(ret.size).arg(mtime_ns(st));
+    if (d->m_samples.value(path).stat_code != code) {
+        //not sampled yet at this inode, size and modification time
+        ResultCacheSample S;
+        S.stat_code = code;
+        S.hash = d->sample_hash(path, ret.size);
+        d->m_samples[path] = S;
+        QJsonObject line;
+        line["file"] = path;
+        line["stat"] = S.stat_code;
+        line["sample"] = S.hash;
+        d->append(line);
+    }
+    ret.fingerprint = code + " " + d->m_samples[path].hash;
+    return ret;
+}
+
+QJsonObject ResultCache::record(const QString& key)
+{
+    d->refresh();
+    return d->m_records.value(key);
+}
+
+void ResultCache::insert(const QString& key, const QJsonObject& record)
+{
+    d->refresh();
+    d->m_records[key] = record;
+    QJsonObject line;
+    line["key"] = key;
+    line["record"] = record;
+    d->append(line);
+}
+
+void ResultCache::remove(const QString& key)
+{
+    d->refresh();
+    if (!d->m_records.contains(key))
+        return;
+    d->m_records.remove(key);
+    QJsonObject line;
+    line["key"] = key;
+    line["removed"] = true;
+    d->append(line);
+}
+
+void ResultCache::compact(bool (*is_stale)(ResultCache* cache, const QJsonObject& record))
+{
+    d->refresh();
+    if (is_stale) {
+        QStringList keys = d->m_records.keys();
+        foreach (QString key, keys) {
+            if (is_stale(this, d->m_records[key])) {
+                d->m_records.remove(key);
+            }
+        }
+    }
+    //keep only the samples that are still current
+    QStringList paths = d->m_samples.keys();
+    foreach (QString path, paths) {
+        if (ResultCachePrivate::stat_code(path) != d->m_samples[path].stat_code)
+            d->m_samples.remove(path);
+    }
+    if (d->m_num_lines == d->m_records.count() + d->m_samples.count())
+        return; //nothing to drop
+
+    QByteArray data;
+    foreach (QString key, d->m_records.keys()) {
+        QJsonObject line;
+        line["key"] = key;
+        line["record"] = d->m_records[key];
+        data += QJsonDocument(line).toJson(QJsonDocument::Compact) + "\n";
+    }
+    foreach (QString path, d->m_samples.keys()) {
+        QJsonObject line;
+        line["file"] = path;
+        line["stat"] = d->m_samples[path].stat_code;
+        line["sample"] = d->m_samples[path].hash;
+        data += QJsonDocument(line).toJson(QJsonDocument::Compact) + "\n";
+    }
+    //write a new file and move it into place, so that other instances never see a partial index.
+    //Anything another instance appends in the meantime is lost, which only means that it runs again.
+    QString tmp_path = d->m_index_path + QString(".tmp.%1").arg(getpid());
+    QFile f(tmp_path);
+    if (!f.open(QFile::WriteOnly)) {
+        qWarning() << "Unable to write result cache index: " + tmp_path;
+        return;
+    }
+    f.write(data);
+    f.close();
+    QFile::setPermissions(tmp_path, QFile::permissions(tmp_path) | QFileDevice::ReadGroup | QFileDevice::WriteGroup | QFileDevice::ReadOther | QFileDevice::WriteOther);
+    if (::rename(tmp_path.toUtf8().data(), d->m_index_path.toUtf8().data()) != 0) {
+        qWarning() << "Unable to replace result cache index: " + d->m_index_path;
+        QFile::remove(tmp_path);
+        return;
+    }
+    //read it again from the start, that is cheap now
+    d->m_loaded = false;
+    d->refresh();
+}
+
+void ResultCachePrivate::refresh()
+{
+    m_loaded = true;
+    struct stat st;
+    if (stat(m_index_path.toUtf8().data(), &st) != 0) {
+        //nothing has been recorded yet
+        m_records.clear();
+        m_index_inode = 0;
+        m_index_offset = 0;
+        m_num_lines = 0;
+        return;
+    }
+    if (((qint64)st.st_ino != m_index_inode) || (st.st_size < m_index_offset)) {
+        //replaced by a compaction, so start over. The samples we have are still good.
+        m_records.clear();
+        m_index_inode = st.st_ino;
+        m_index_offset = 0;
+        m_num_lines = 0;
+    }
+    if (st.st_size == m_index_offset)
+        return;
+    QFile f(m_index_path);
+    if (!f.open(QFile::ReadOnly)) {
+        qWarning() << "Unable to read result cache index: " + m_index_path;
+        return;
+    }
+    f.seek(m_index_offset);
+    QByteArray data = f.readAll();
+    //only whole lines -- another instance may be in the middle of appending
+    int ind = data.lastIndexOf('\n');
+    if (ind < 0)
+        return;
+    data.truncate(ind + 1);
+    m_index_offset += data.count();
+    QList<QByteArray> lines = data.split('\n');
+    foreach (QByteArray line, lines) {
+        if (!line.isEmpty())
+            read_line(line);
+    }
+}
+
+void ResultCachePrivate::read_line(const QByteArray& line)
+{
+    QJsonObject obj = QJsonDocument::fromJson(line).object();
+    if (obj.contains("key")) {
+        if (obj["removed"].toBool())
+            m_records.remove(obj["key"].toString());
+        else
+            m_records[obj["key"].toString()] = obj["record"].toObject();
+    }
+    else if (obj.contains("sample")) {
+        ResultCacheSample S;
+        S.stat_code = obj["stat"].toString();
+        S.hash = obj["sample"].toString();
+        m_samples[obj["file"].toString()] = S;
+    }
+    m_num_lines++;
+}
+
+void ResultCachePrivate::append(const QJsonObject& line)
+{
+    bool is_new = !QFile::exists(m_index_path);
+    QFile f(m_index_path);
+    //unbuffered so that the line goes out in a single write, and the lines of different instances do not interleave
+    if (!f.open(QFile::Append | QFile::Unbuffered)) {
+        qWarning() << "Unable to append to result cache index: " + m_index_path;
+        return;
+    }
+    f.write(QJsonDocument(line).toJson(QJsonDocument::Compact) + "\n");
+    f.close();
+    if (is_new) {
+        QFile::setPermissions(m_index_path, QFile::permissions(m_index_path) | QFileDevice::ReadGroup | QFileDevice::WriteGroup | QFileDevice::ReadOther | QFileDevice::WriteOther);
+    }
+}
+
+QString ResultCachePrivate::sample_hash(const QString& path, qint64 size)
+{
+    //the first, middle and last blocks, or everything for a small file
+    QFile f(path);
+    if (!f.open(QFile::ReadOnly))
+        return "";
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    if (size <= 3 * RESULT_CACHE_SAMPLE_SIZE) {
+        hash.addData(f.readAll());
+    }
+    else {
+        qint64 offsets[3] = { 0, (size - RESULT_CACHE_SAMPLE_SIZE) / 2, size - RESULT_CACHE_SAMPLE_SIZE };
+        for (int i = 0; i < 3; i++) {
+            f.seek(offsets[i]);
+            hash.addData(f.read(RESULT_CACHE_SAMPLE_SIZE));
+        }
+    }
+    return QString(hash.result().toHex());
+}
+
+QString ResultCachePrivate::stat_code(const QString& path)
+{
+    struct stat st;
+    if (stat(path.toUtf8().data(), &st) != 0)
+        return "";
+    return QString("%1 %2 %3").arg((qint64)st.st_ino).arg((qint64)st.st_size).arg(mtime_ns(st));
+}
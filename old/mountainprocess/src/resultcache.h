@@ -0,0 +1,52 @@
+/******************************************************
+** See the accompanying README and LICENSE files
+*******************************************************/
+
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <QString>
+#include <QJsonObject>
+
+struct ResultCacheFile {
+    bool exists = false;
+    bool is_dir = false;
+    //inode, size and modification time (in ns) plus a hash of a few sampled blocks
+    //-- for a directory, a hash of the fingerprints of everything in it
+    QString fingerprint;
+    qint64 size = 0;
+    QString last_modified; //"yyyy-MM-dd-hh-mm-ss-zzz", as in the .rprv files
+};
+
+/**
+ * \class ResultCache
+ * @brief Persistent index of completed processes, shared by all mountainprocess instances
+ *
+ * The index is a single append-only file of json lines (key -> record) that each instance reads
+ * once and then only reads what has been appended since, so checking whether a process has
+ * already been run is a hash lookup plus one stat per input and output file. The keys and the
+ * records are up to the caller (see ProcessManager::processAlreadyCompleted).
+ *
+ * Fingerprints of files are cheap: the sampled blocks are only read when the inode, size or
+ * modification time of a file is not already in the index.
+ */
+class ResultCachePrivate;
+class ResultCache {
+public:
+    friend class ResultCachePrivate;
+    ResultCache(const QString& index_path);
+    virtual ~ResultCache();
+
+    ResultCacheFile file(const QString& path);
+
+    QJsonObject record(const QString& key); //empty if there is none
+    void insert(const QString& key, const QJsonObject& record);
+    void remove(const QString& key);
+    ///Removes the records for which is_stale returns true, and rewrites the index without the superseded lines
+    void compact(bool (*is_stale)(ResultCache* cache, const QJsonObject& record) = 0);
+
+private:
+    ResultCachePrivate* d;
+};
+
+#endif // RESULTCACHE_H
@@ -93,7 +93,7 @@ public:
 
     QList<PipelineNode2> m_pipeline_nodes;
 
-    QProcess* queue_process(QString processor_name, const QVariantMap& parameters, bool use_run, bool force_run, bool preserve_tempdir, QString process_output_fname, int request_num_threads);
+    QProcess* queue_process(QString processor_name, const QVariantMap& parameters, bool use_run, bool force_run, bool preserve_tempdir, QString process_output_fname, int request_num_threads, int priority = 0);
     QProcess* run_process(QString processor_name, const QVariantMap& parameters, bool force_run, bool preserve_tempdir, QString process_output_fname, int request_num_threads);
 
     void make_absolute_paths(QVariantMap& fnames);
@@ -106,6 +106,7 @@ public:
     bool get_node_indices_for_outputs(QMap<QString, int>& node_indices_for_outputs);
     bool okay_to_remove_intermediate_file(const QString& path);
     bool create_rprv(const QString& path);
+    int num_steps_waiting_on(int node_index, QMap<int, int>& counts, QSet<int>& visiting);
 };
 
 ScriptController2::ScriptController2()
@@ -444,7 +445,7 @@ void ScriptController2::removeFile(const QString& path)
     QFile::remove(path);
 }
 
-QProcess* ScriptController2Private::queue_process(QString processor_name, const QVariantMap& parameters, bool use_run, bool force_run, bool preserve_tempdir, QString process_output_fname, int request_num_threads)
+QProcess* ScriptController2Private::queue_process(QString processor_name, const QVariantMap& parameters, bool use_run, bool force_run, bool preserve_tempdir, QString process_output_fname, int request_num_threads, int priority)
 {
     QString exe = qApp->applicationFilePath();
     QStringList args;
@@ -475,6 +476,8 @@ QProcess* ScriptController2Private::queue_process(QString processor_name, const
     args << "--_process_output=" + process_output_fname;
     if (request_num_threads)
         args << QString("--_request_num_threads=%1").arg(request_num_threads);
+    if ((priority) && (!use_run))
+        args << QString("--_priority=%1").arg(priority);
     QProcess* P1 = new QProcess;
     P1->setReadChannelMode(QProcess::MergedChannels);
     //P1->start(exe, args);
@@ -688,7 +691,17 @@ bool ScriptController2Private::run_or_queue_node(PipelineNode2* node, const QMap
         }
         else {
             printf("Queuing process from script controller: %s\n", node->processor_name.toLatin1().data());
-            P1 = queue_process(node->processor_name, parameters0, false, m_force_run, m_preserve_tempdir, node->process_output_fname, m_num_threads);
+            //the daemon launches first the processes that have the longest chain of steps waiting on them
+            int priority = 0;
+            {
+                QMap<int, int> counts;
+                QSet<int> visiting;
+                for (int i = 0; i < m_pipeline_nodes.count(); i++) {
+                    if (&m_pipeline_nodes[i] == node)
+                        priority = num_steps_waiting_on(i, counts, visiting);
+                }
+            }
+            P1 = queue_process(node->processor_name, parameters0, false, m_force_run, m_preserve_tempdir, node->process_output_fname, m_num_threads, priority);
             if (!P1) {
                 qWarning() << "Unable to queue process: " + node->processor_name;
                 return false;
@@ -841,6 +854,31 @@ bool ScriptController2Private::get_node_indices_for_outputs(QMap<QString, int>&
     return true;
 }
 
+int ScriptController2Private::num_steps_waiting_on(int node_index, QMap<int, int>& counts, QSet<int>& visiting)
+{
+    //the length of the longest chain of not-yet-completed nodes that use the outputs of this one
+    if (counts.contains(node_index))
+        return counts[node_index];
+    if (visiting.contains(node_index))
+        return 0; //cyclic dependency, reported elsewhere
+    visiting.insert(node_index);
+    QSet<QString> output_paths = m_pipeline_nodes[node_index].output_paths().toSet();
+    int ret = 0;
+    for (int i = 0; i < m_pipeline_nodes.count(); i++) {
+        if ((i == node_index) || (m_pipeline_nodes[i].completed))
+            continue;
+        foreach (QString path, m_pipeline_nodes[i].input_paths()) {
+            if (output_paths.contains(path)) {
+                ret = qMax(ret, 1 + num_steps_waiting_on(i, counts, visiting));
+                break;
+            }
+        }
+    }
+    visiting.remove(node_index);
+    counts[node_index] = ret;
+    return ret;
+}
+
 bool ScriptController2Private::okay_to_remove_intermediate_file(const QString& path)
 {
     for (int i = 0; i < m_pipeline_nodes.count(); i++) {
@@ -4,6 +4,9 @@
 #include <stdio.h>
 #include <math.h>
 #include "isocut5.h"
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 typedef std::vector<std::vector<bigint> > intarray2d;
 void alloc(intarray2d& X, bigint N1, bigint N2)
@@ -23,11 +26,13 @@ bigint compute_max(bigint N, int* labels);
 bigint compute_max(bigint N, bigint* inds);
 void kmeans_multistep(int* labels, bigint M, bigint N, float* X, bigint K1, bigint K2, bigint K3, kmeans_opts opts);
 void kmeans_maxsize(int* labels, bigint M, bigint N, float* X, bigint maxsize, kmeans_opts opts);
+void assign_to_nearest_centroids(int* assignments, bigint M, bigint N, const float* X, const bigint* inds, bigint K, const float* centroids);
 void compare_clusters(double* dip_score, std::vector<bigint>* new_labels1, std::vector<bigint>* new_labels2, bigint M, bigint N1, bigint N2, float* X1, float* X2, float* centroid1, float* centroid2);
-void compute_centroids(float* centroids, bigint M, bigint N, bigint Kmax, float* X, int* labels, std::vector<bigint>& clusters_to_compute_vec);
-void compute_covmats(float* covmats, bigint M, bigint N, bigint Kmax, float* X, int* labels, float* centroids, std::vector<bigint>& clusters_to_compute_vec);
+void compute_cluster_members(intarray2d& members, bigint N, bigint Kmax, int* labels);
+void compute_centroids(float* centroids, bigint M, bigint Kmax, float* X, const intarray2d& members, std::vector<bigint>& clusters_to_compute_vec);
+void compute_covmats(float* covmats, bigint M, bigint Kmax, float* X, const intarray2d& members, float* centroids, std::vector<bigint>& clusters_to_compute_vec);
 void get_pairs_to_compare(std::vector<bigint>* inds1, std::vector<bigint>* inds2, bigint M, bigint K, float* active_centroids, const intarray2d& active_comparisons_made);
-void compare_pairs(std::vector<bigint>* clusters_changed, bigint* total_num_label_changes, bigint M, bigint N, float* X, int* labels, const std::vector<bigint>& inds1, const std::vector<bigint>& inds2, const isosplit5_opts& opts, float* centroids, float* covmats); //the labels are updated
+void compare_pairs(std::vector<bigint>* clusters_changed, bigint* total_num_label_changes, bigint M, float* X, int* labels, intarray2d& members, const std::vector<bigint>& inds1, const std::vector<bigint>& inds2, const isosplit5_opts& opts, float* centroids, float* covmats); //the labels and members are updated
 }
 
 namespace smi {
@@ -187,45 +192,35 @@ void parcelate2(int* labels, bigint M, bigint N, float* X, bigint target_parcel_
 
         bigint p_index = 0;
         while (p_index < (bigint)parcels.size()) {
-            std::vector<bigint> inds = parcels[p_index].indices;
             double rad = parcels[p_index].radius;
             bigint sz = parcels[p_index].indices.size();
             if ((sz > target_parcel_size) && (rad >= target_radius)) {
-                std::vector<bigint> assignments(inds.size());
+                std::vector<bigint> inds;
+                inds.swap(parcels[p_index].indices);
                 std::vector<bigint> iii = p2_randsample(sz, split_factor);
-                for (bigint i = 0; i < (bigint)inds.size(); i++) {
-                    bigint best_pt = -1;
-                    double best_dist = 0;
-                    for (bigint j = 0; j < (bigint)iii.size(); j++) {
-                        double dist = 0;
-                        for (bigint m = 0; m < M; m++) {
-                            double val = X[m + M * inds[iii[j]]] - X[m + M * inds[i]];
-                            dist += val * val;
-                        }
-                        dist = sqrt(dist);
-                        if ((best_pt < 0) || (dist < best_dist)) {
-                            best_dist = dist;
-                            best_pt = j;
-                        }
+                std::vector<float> seeds(M * iii.size());
+                for (bigint j = 0; j < (bigint)iii.size(); j++) {
+                    for (bigint m = 0; m < M; m++) {
+                        seeds[m + M * j] = X[m + M * inds[iii[j]]];
                     }
-                    assignments[i] = best_pt;
                 }
-                parcels[p_index].indices.clear();
+                std::vector<int> assignments(inds.size());
+                ns_isosplit5::assign_to_nearest_centroids(assignments.data(), M, inds.size(), X, inds.data(), iii.size(), seeds.data());
+                intarray2d new_indices(iii.size());
                 for (bigint i = 0; i < (bigint)inds.size(); i++) {
-                    if (assignments[i] == 0) {
-                        parcels[p_index].indices.push_back(inds[i]);
-                        labels[inds[i]] = p_index + 1;
-                    }
+                    new_indices[assignments[i]].push_back(inds[i]);
+                }
+                parcels[p_index].indices.swap(new_indices[0]);
+                for (bigint i = 0; i < (bigint)parcels[p_index].indices.size(); i++) {
+                    labels[parcels[p_index].indices[i]] = p_index + 1;
                 }
                 parcels[p_index].centroid = p2_compute_centroid(M, X, parcels[p_index].indices);
                 parcels[p_index].radius = p2_compute_max_distance(parcels[p_index].centroid, M, X, parcels[p_index].indices);
                 for (bigint jj = 1; jj < (bigint)iii.size(); jj++) {
                     p2_parcel PP;
-                    for (bigint i = 0; i < (bigint)inds.size(); i++) {
-                        if (assignments[i] == jj) {
-                            PP.indices.push_back(inds[i]);
-                            labels[inds[i]] = parcels.size() + 1;
-                        }
+                    PP.indices.swap(new_indices[jj]);
+                    for (bigint i = 0; i < (bigint)PP.indices.size(); i++) {
+                        labels[PP.indices[i]] = parcels.size() + 1;
                     }
                     PP.centroid = p2_compute_centroid(M, X, PP.indices);
                     PP.radius = p2_compute_max_distance(PP.centroid, M, X, PP.indices);
@@ -264,13 +259,18 @@ void isosplit5(int* labels, bigint M, bigint N, float* X, isosplit5_opts opts)
     parcelate2(labels, M, N, X, target_parcel_size, target_num_parcels, p2opts);
     int Kmax = ns_isosplit5::compute_max(N, labels);
 
+    // The indices of the points in each cluster (in increasing order), kept up to date as the labels change,
+    // so that comparisons and centroid/covmat updates only need to touch the members of the clusters involved
+    intarray2d members;
+    ns_isosplit5::compute_cluster_members(members, N, Kmax, labels);
+
     float* centroids = (float*)malloc(sizeof(float) * M * Kmax);
     float* covmats = (float*)malloc(sizeof(float) * M * M * Kmax);
     std::vector<bigint> clusters_to_compute_vec;
     for (bigint k = 0; k < Kmax; k++)
         clusters_to_compute_vec.push_back(1);
-    ns_isosplit5::compute_centroids(centroids, M, N, Kmax, X, labels, clusters_to_compute_vec);
-    ns_isosplit5::compute_covmats(covmats, M, N, Kmax, X, labels, centroids, clusters_to_compute_vec);
+    ns_isosplit5::compute_centroids(centroids, M, Kmax, X, members, clusters_to_compute_vec);
+    ns_isosplit5::compute_covmats(covmats, M, Kmax, X, members, centroids, clusters_to_compute_vec);
 
     // The active labels are those that are still being used -- for now, everything is active
     int active_labels_vec[Kmax];
@@ -337,10 +337,10 @@ void isosplit5(int* labels, bigint M, bigint N, float* X, isosplit5_opts opts)
                     break;
                 }
 
-                // Actually compare the pairs -- in principle this operation could be parallelized
+                // Actually compare the pairs -- the pairs are disjoint, so this is done in parallel
                 std::vector<bigint> clusters_changed;
                 bigint total_num_label_changes = 0;
-                ns_isosplit5::compare_pairs(&clusters_changed, &total_num_label_changes, M, N, X, labels, inds1b, inds2b, opts, centroids, covmats); //the labels are updated
+                ns_isosplit5::compare_pairs(&clusters_changed, &total_num_label_changes, M, X, labels, members, inds1b, inds2b, opts, centroids, covmats); //the labels and members are updated
                 for (bigint i = 0; i < (bigint)clusters_changed.size(); i++) {
                     clusters_changed_vec_in_pass[clusters_changed[i] - 1] = 1;
                     clusters_changed_vec_in_iteration[clusters_changed[i] - 1] = 1;
@@ -353,17 +353,15 @@ void isosplit5(int* labels, bigint M, bigint N, float* X, isosplit5_opts opts)
                 }
 
                 // Recompute the centers for those that have changed in this iteration
-                ns_isosplit5::compute_centroids(centroids, M, N, Kmax, X, labels, clusters_changed_vec_in_iteration);
-                ns_isosplit5::compute_covmats(covmats, M, N, Kmax, X, labels, centroids, clusters_changed_vec_in_iteration);
+                ns_isosplit5::compute_centroids(centroids, M, Kmax, X, members, clusters_changed_vec_in_iteration);
+                ns_isosplit5::compute_covmats(covmats, M, Kmax, X, members, centroids, clusters_changed_vec_in_iteration);
 
                 // For diagnostics
                 //printf ("total num label changes = %d\n",total_num_label_changes);
 
                 // Determine whether something has merged and update the active labels
                 for (bigint i = 0; i < Kmax; i++)
-                    active_labels_vec[i] = 0;
-                for (bigint i = 0; i < N; i++)
-                    active_labels_vec[labels[i] - 1] = 1;
+                    active_labels_vec[i] = (members[i].size() > 0);
                 std::vector<int> new_active_labels;
                 for (bigint i = 0; i < Kmax; i++)
                     if (active_labels_vec[i])
@@ -410,35 +408,36 @@ void isosplit5(int* labels, bigint M, bigint N, float* X, isosplit5_opts opts)
     bigint K = ns_isosplit5::compute_max(N, labels);
 
     if ((opts.refine_clusters) && (K > 1)) {
-        int* labels_split = (int*)malloc(sizeof(int) * N);
         isosplit5_opts opts2 = opts;
         opts2.refine_clusters = true; // Maybe we should provide an option on whether to do recursive refinement
-        bigint k_offset = 0;
+        intarray2d inds;
+        ns_isosplit5::compute_cluster_members(inds, N, K, labels);
+        // The clusters are split independently (in parallel), then the new labels are offset in order of k, so the result doesn't depend on the number of threads
+        std::vector<std::vector<int> > labels_k(K);
+#pragma omp parallel for schedule(dynamic)
         for (bigint k = 1; k <= K; k++) {
-            std::vector<bigint> inds_k;
-            for (bigint i = 0; i < N; i++)
-                if (labels[i] == k)
-                    inds_k.push_back(i);
+            const std::vector<bigint>& inds_k = inds[k - 1];
             if (inds_k.size() > 0) {
-                float* X_k = (float*)malloc(sizeof(float) * M * inds_k.size()); //Warning: this may cause memory problems -- especially for recursive case
-                int* labels_k = (int*)malloc(sizeof(int) * inds_k.size());
+                std::vector<float> X_k(M * inds_k.size()); //Warning: this may cause memory problems -- especially for recursive case
                 for (bigint i = 0; i < (bigint)inds_k.size(); i++) {
                     for (bigint m = 0; m < M; m++) {
                         X_k[m + M * i] = X[m + M * inds_k[i]];
                     }
                 }
-                isosplit5(labels_k, M, inds_k.size(), X_k, opts2);
+                labels_k[k - 1].resize(inds_k.size());
+                isosplit5(labels_k[k - 1].data(), M, inds_k.size(), X_k.data(), opts2);
+            }
+        }
+        bigint k_offset = 0;
+        for (bigint k = 1; k <= K; k++) {
+            const std::vector<bigint>& inds_k = inds[k - 1];
+            if (inds_k.size() > 0) {
                 for (bigint i = 0; i < (bigint)inds_k.size(); i++) {
-                    labels_split[inds_k[i]] = k_offset + labels_k[i];
+                    labels[inds_k[i]] = k_offset + labels_k[k - 1][i];
                 }
-                k_offset += ns_isosplit5::compute_max(inds_k.size(), labels_k);
-                free(labels_k);
-                free(X_k);
+                k_offset += ns_isosplit5::compute_max(inds_k.size(), labels_k[k - 1].data());
             }
         }
-        for (bigint i = 0; i < N; i++)
-            labels[i] = labels_split[i];
-        free(labels_split);
     }
 
     free(centroids);
@@ -575,34 +574,129 @@ void kmeans_initialize(double* centroids, bigint M, bigint N, bigint K, float* X
         }
     }
 }
-double compute_dist(bigint M, float* X, double* Y)
+
+void assign_to_nearest_block(int* best_k, float* best, bigint n, const float* Xt, bigint stride, bigint M, bigint k1, bigint k2, const float* C, const float* Cnorm)
 {
-    double sumsqr = 0;
-    for (bigint m = 0; m < M; m++) {
-        double val = X[m] - Y[m];
-        sumsqr += val * val;
+    // Xt holds the points of the block transposed (stride floats per dimension), so that consecutive points fill the vector lanes
+    bigint i = 0;
+#if defined(__AVX__)
+    for (; i + 8 <= n; i += 8) {
+        __m256 best8 = _mm256_loadu_ps(&best[i]);
+        __m256 bestk8 = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*)&best_k[i]));
+        for (bigint k = k1; k < k2; k++) {
+            const float* c = &C[M * k];
+            __m256 acc = _mm256_setzero_ps();
+            for (bigint m = 0; m < M; m++) {
+                acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(c[m]), _mm256_loadu_ps(&Xt[m * stride + i])));
+            }
+            __m256 score = _mm256_sub_ps(_mm256_set1_ps(Cnorm[k]), _mm256_add_ps(acc, acc));
+            __m256 mask = _mm256_cmp_ps(score, best8, _CMP_LT_OQ);
+            best8 = _mm256_blendv_ps(best8, score, mask);
+            bestk8 = _mm256_blendv_ps(bestk8, _mm256_castsi256_ps(_mm256_set1_epi32(k)), mask);
+        }
+        _mm256_storeu_ps(&best[i], best8);
+        _mm256_storeu_si256((__m256i*)&best_k[i], _mm256_castps_si256(bestk8));
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        __m128 best4 = _mm_loadu_ps(&best[i]);
+        __m128 bestk4 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)&best_k[i]));
+        for (bigint k = k1; k < k2; k++) {
+            const float* c = &C[M * k];
+            __m128 acc = _mm_setzero_ps();
+            for (bigint m = 0; m < M; m++) {
+                acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(c[m]), _mm_loadu_ps(&Xt[m * stride + i])));
+            }
+            __m128 score = _mm_sub_ps(_mm_set1_ps(Cnorm[k]), _mm_add_ps(acc, acc));
+            __m128 mask = _mm_cmplt_ps(score, best4);
+            best4 = _mm_or_ps(_mm_and_ps(mask, score), _mm_andnot_ps(mask, best4));
+            bestk4 = _mm_or_ps(_mm_and_ps(mask, _mm_castsi128_ps(_mm_set1_epi32(k))), _mm_andnot_ps(mask, bestk4));
+        }
+        _mm_storeu_ps(&best[i], best4);
+        _mm_storeu_si128((__m128i*)&best_k[i], _mm_castps_si128(bestk4));
+    }
+#endif
+    for (; i < n; i++) {
+        for (bigint k = k1; k < k2; k++) {
+            const float* c = &C[M * k];
+            float acc = 0;
+            for (bigint m = 0; m < M; m++) {
+                acc += c[m] * Xt[m * stride + i];
+            }
+            float score = Cnorm[k] - (acc + acc);
+            if (score < best[i]) {
+                best[i] = score;
+                best_k[i] = k;
+            }
+        }
     }
-    return sqrt(sumsqr);
 }
 
-bigint kmeans_assign2(bigint M, bigint K, float* X0, double* centroids)
+void assign_to_nearest_centroids(int* assignments, bigint M, bigint N, const float* X, const bigint* inds, bigint K, const float* centroids)
 {
-    bigint ret = 0;
-    double best_dist = 0;
-    for (bigint k = 1; k <= K; k++) {
-        double dist = compute_dist(M, X0, &centroids[M * (k - 1)]);
-        if ((ret == 0) || (dist < best_dist)) {
-            best_dist = dist;
-            ret = k;
+    // assignments[i] (zero-based) is the nearest of the K centroids (M x K) to point inds[i] of X (or point i if inds is null)
+    // We minimize |c|^2 - 2 x.c, which differs from the squared distance by |x|^2 (the same for all centroids),
+    // after shifting everything by the mean centroid to limit the cancellation in single precision
+    if (N == 0)
+        return;
+    if (K <= 1) {
+        for (bigint i = 0; i < N; i++)
+            assignments[i] = 0;
+        return;
+    }
+    std::vector<double> shift(M, 0);
+    for (bigint k = 0; k < K; k++) {
+        for (bigint m = 0; m < M; m++) {
+            shift[m] += centroids[m + M * k];
         }
     }
-    return ret;
+    for (bigint m = 0; m < M; m++)
+        shift[m] /= K;
+    std::vector<float> C(M * K), Cnorm(K);
+    for (bigint k = 0; k < K; k++) {
+        double sumsqr = 0;
+        for (bigint m = 0; m < M; m++) {
+            float val = centroids[m + M * k] - shift[m];
+            C[m + M * k] = val;
+            sumsqr += val * val;
+        }
+        Cnorm[k] = sumsqr;
+    }
+
+    // The points are processed in blocks small enough to stay in cache while all the centroids (in groups) are compared against them
+    const bigint block_size = 256;
+    const bigint centroid_block_size = 64;
+    bigint num_blocks = (N + block_size - 1) / block_size;
+#pragma omp parallel for schedule(static) if (num_blocks > 1)
+    for (bigint b = 0; b < num_blocks; b++) {
+        bigint i1 = b * block_size;
+        bigint n = (i1 + block_size <= N) ? block_size : N - i1;
+        std::vector<float> Xt(M * block_size);
+        std::vector<float> best(block_size, HUGE_VALF);
+        std::vector<int> best_k(block_size, 0);
+        for (bigint i = 0; i < n; i++) {
+            const float* x = &X[M * (inds ? inds[i1 + i] : i1 + i)];
+            for (bigint m = 0; m < M; m++) {
+                Xt[m * block_size + i] = x[m] - shift[m];
+            }
+        }
+        for (bigint k1 = 0; k1 < K; k1 += centroid_block_size) {
+            bigint k2 = (k1 + centroid_block_size <= K) ? k1 + centroid_block_size : K;
+            assign_to_nearest_block(best_k.data(), best.data(), n, Xt.data(), block_size, M, k1, k2, C.data(), Cnorm.data());
+        }
+        for (bigint i = 0; i < n; i++)
+            assignments[i1 + i] = best_k[i];
+    }
 }
+
 void kmeans_assign(int* labels, bigint M, bigint N, bigint K, float* X, double* centroids)
 {
-    for (bigint i = 0; i < N; i++) {
-        labels[i] = kmeans_assign2(M, K, &X[M * i], centroids);
-    }
+    std::vector<float> centroidsf(M * K);
+    for (bigint i = 0; i < M * K; i++)
+        centroidsf[i] = centroids[i];
+    assign_to_nearest_centroids(labels, M, N, X, 0, K, centroidsf.data());
+    for (bigint i = 0; i < N; i++)
+        labels[i]++;
 }
 void kmeans_centroids(double* centroids, bigint M, bigint N, bigint K, float* X, int* labels)
 {
@@ -663,13 +757,11 @@ void kmeans_maxsize(int* labels, bigint M, bigint N, float* X, bigint maxsize, k
     int* labels1 = (int*)malloc(sizeof(int) * N);
     kmeans(labels1, M, N, X, K, opts);
     bigint L1 = compute_max(N, labels1);
+    intarray2d members;
+    compute_cluster_members(members, N, L1, labels1);
     bigint current_max_k = 0;
     for (bigint k = 1; k <= L1; k++) {
-        std::vector<bigint> inds_k;
-        for (bigint i = 0; i < N; i++) {
-            if (labels1[i] == k)
-                inds_k.push_back(i);
-        }
+        const std::vector<bigint>& inds_k = members[k - 1];
         if (inds_k.size() > 0) {
             float* X2 = (float*)malloc(sizeof(float) * M * inds_k.size());
             int* labels2 = (int*)malloc(sizeof(int) * inds_k.size());
@@ -694,13 +786,11 @@ void kmeans_multistep(int* labels, bigint M, bigint N, float* X, bigint K1, bigi
             labels1[i] = 0;
         kmeans_multistep(labels1, M, N, X, K2, K3, 0, opts);
         bigint L1 = compute_max(N, labels1);
+        intarray2d members;
+        compute_cluster_members(members, N, L1, labels1);
         bigint current_max_k = 0;
         for (bigint k = 1; k <= L1; k++) {
-            std::vector<bigint> inds_k;
-            for (bigint i = 0; i < N; i++) {
-                if (labels1[i] == k)
-                    inds_k.push_back(i);
-            }
+            const std::vector<bigint>& inds_k = members[k - 1];
             if (inds_k.size() > 0) {
                 float* X2 = (float*)malloc(sizeof(float) * M * inds_k.size());
                 int* labels2 = (int*)malloc(sizeof(int) * inds_k.size());
@@ -775,76 +865,73 @@ void compare_clusters(double* dip_score, std::vector<bigint>* new_labels1, std::
     free(V);
 }
 
-void compute_centroids(float* centroids, bigint M, bigint N, bigint Kmax, float* X, int* labels, std::vector<bigint>& cluster_to_compute_vec)
+void compute_cluster_members(intarray2d& members, bigint N, bigint Kmax, int* labels)
 {
-    std::vector<double> C(M * Kmax);
-    for (bigint jj = 0; jj < M * Kmax; jj++)
-        C[jj] = 0;
-    std::vector<double> counts(Kmax);
-    for (bigint k = 0; k < Kmax; k++)
-        counts[k] = 0;
+    members.clear();
+    members.resize(Kmax);
     for (bigint i = 0; i < N; i++) {
-        bigint k0 = labels[i];
-        bigint i0 = k0 - 1;
-        if (cluster_to_compute_vec[i0]) {
-            for (bigint m = 0; m < M; m++) {
-                C[m + M * i0] += X[m + M * i];
-            }
-            counts[i0]++;
-        }
+        members[labels[i] - 1].push_back(i);
     }
+}
+
+void compute_centroids(float* centroids, bigint M, bigint Kmax, float* X, const intarray2d& members, std::vector<bigint>& cluster_to_compute_vec)
+{
+    // Only the members of the clusters to compute are visited, in increasing order, so the sums are the same as when looping over all the points
+#pragma omp parallel for schedule(dynamic)
     for (bigint k = 0; k < Kmax; k++) {
         if (cluster_to_compute_vec[k]) {
-            if (counts[k]) {
+            const std::vector<bigint>& inds = members[k];
+            std::vector<double> C(M, 0);
+            double count = inds.size();
+            for (bigint j = 0; j < (bigint)inds.size(); j++) {
+                const float* x = &X[M * inds[j]];
                 for (bigint m = 0; m < M; m++) {
-                    C[m + M * k] /= counts[k];
+                    C[m] += x[m];
+                }
+            }
+            if (count) {
+                for (bigint m = 0; m < M; m++) {
+                    C[m] /= count;
                 }
             }
-        }
-    }
-    for (bigint k = 0; k < Kmax; k++) {
-        if (cluster_to_compute_vec[k]) {
             for (bigint m = 0; m < M; m++) {
-                centroids[m + k * M] = C[m + k * M];
+                centroids[m + k * M] = C[m];
             }
         }
     }
 }
 
-void compute_covmats(float* covmats, bigint M, bigint N, bigint Kmax, float* X, int* labels, float* centroids, std::vector<bigint>& clusters_to_compute_vec)
+void compute_covmats(float* covmats, bigint M, bigint Kmax, float* X, const intarray2d& members, float* centroids, std::vector<bigint>& clusters_to_compute_vec)
 {
-    std::vector<double> C(M * M * Kmax);
-    for (bigint jj = 0; jj < M * M * Kmax; jj++)
-        C[jj] = 0;
-    std::vector<double> counts(Kmax);
-    for (bigint k = 0; k < Kmax; k++)
-        counts[k] = 0;
-    for (bigint i = 0; i < N; i++) {
-        bigint i0 = labels[i] - 1;
-        if (clusters_to_compute_vec[i0]) {
-            for (bigint m1 = 0; m1 < M; m1++) {
-                for (bigint m2 = 0; m2 < M; m2++) {
-                    C[m1 + M * m2 + M * M * i0] += (X[m1 + M * i] - centroids[m1 + i0 * M]) * (X[m2 + M * i] - centroids[m2 + i0 * M]);
-                }
-            }
-            counts[i0]++;
-        }
-    }
+#pragma omp parallel for schedule(dynamic)
     for (bigint k = 0; k < Kmax; k++) {
         if (clusters_to_compute_vec[k]) {
-            if (counts[k]) {
-                for (bigint m1 = 0; m1 < M; m1++) {
-                    for (bigint m2 = 0; m2 < M; m2++) {
-                        C[m1 + m2 * M + M * M * k] /= counts[k];
+            const std::vector<bigint>& inds = members[k];
+            std::vector<double> C(M * M, 0);
+            std::vector<float> diff(M);
+            const float* centroid = &centroids[k * M];
+            double count = inds.size();
+            for (bigint j = 0; j < (bigint)inds.size(); j++) {
+                const float* x = &X[M * inds[j]];
+                for (bigint m = 0; m < M; m++) {
+                    diff[m] = x[m] - centroid[m];
+                }
+                for (bigint m2 = 0; m2 < M; m2++) {
+                    double* C0 = &C[M * m2];
+                    float d2 = diff[m2];
+#pragma omp simd
+                    for (bigint m1 = 0; m1 < M; m1++) {
+                        C0[m1] += diff[m1] * d2;
                     }
                 }
             }
-        }
-    }
-    for (bigint k = 0; k < Kmax; k++) {
-        if (clusters_to_compute_vec[k]) {
+            if (count) {
+                for (bigint mm = 0; mm < M * M; mm++) {
+                    C[mm] /= count;
+                }
+            }
             for (bigint mm = 0; mm < M * M; mm++) {
-                covmats[mm + k * M * M] = C[mm + k * M * M];
+                covmats[mm + k * M * M] = C[mm];
             }
         }
     }
@@ -1057,36 +1144,22 @@ bool merge_test(std::vector<bigint>* L12, bigint M, bigint N1, bigint N2, float*
     return do_merge;
 }
 
-void compare_pairs(std::vector<bigint>* clusters_changed, bigint* total_num_label_changes, bigint M, bigint N, float* X, int* labels, const std::vector<bigint>& k1s, const std::vector<bigint>& k2s, const isosplit5_opts& opts, float* centroids, float* covmats)
+void compare_pairs(std::vector<bigint>* clusters_changed, bigint* total_num_label_changes, bigint M, float* X, int* labels, intarray2d& members, const std::vector<bigint>& k1s, const std::vector<bigint>& k2s, const isosplit5_opts& opts, float* centroids, float* covmats)
 {
-    bigint Kmax = ns_isosplit5::compute_max(N, labels);
-    std::vector<bigint> clusters_changed_vec(Kmax);
-    for (bigint i = 0; i < Kmax; i++)
-        clusters_changed_vec[i] = 0;
-    int* new_labels = (int*)malloc(sizeof(bigint) * N);
-    *total_num_label_changes = 0;
-    for (bigint i = 0; i < N; i++)
-        new_labels[i] = labels[i];
-    for (bigint i1 = 0; i1 < (bigint)k1s.size(); i1++) {
+    bigint Kmax = members.size();
+    bigint num_pairs = k1s.size();
+    // The pairs are disjoint, so each comparison only reads and writes the labels and members of its own two clusters.
+    // The per-pair results are combined afterwards, so the outcome doesn't depend on the number of threads.
+    std::vector<bigint> num_label_changes(num_pairs, 0);
+    std::vector<int> pair_changed(num_pairs, 0);
+#pragma omp parallel for schedule(dynamic)
+    for (bigint i1 = 0; i1 < num_pairs; i1++) {
         int k1 = k1s[i1];
         int k2 = k2s[i1];
-        std::vector<bigint> inds1, inds2;
-        for (bigint i = 0; i < N; i++) {
-            if (labels[i] == k1)
-                inds1.push_back(i);
-            if (labels[i] == k2)
-                inds2.push_back(i);
-        }
+        std::vector<bigint> inds1 = members[k1 - 1];
+        std::vector<bigint> inds2 = members[k2 - 1];
         if ((inds1.size() > 0) && (inds2.size() > 0)) {
-            std::vector<bigint> inds12;
-            inds12.insert(inds12.end(), inds1.begin(), inds1.end());
-            inds12.insert(inds12.end(), inds2.begin(), inds2.end());
-            std::vector<bigint> L12_old(inds12.size());
-            for (bigint i = 0; i < (bigint)inds1.size(); i++)
-                L12_old[i] = 1;
-            for (bigint i = 0; i < (bigint)inds2.size(); i++)
-                L12_old[inds1.size() + i] = 2;
-            std::vector<bigint> L12(inds12.size());
+            std::vector<bigint> L12(inds1.size() + inds2.size());
 
             bool do_merge;
             if (((bigint)inds1.size() < opts.min_cluster_size) || ((bigint)inds2.size() < opts.min_cluster_size)) {
@@ -1103,43 +1176,63 @@ void compare_pairs(std::vector<bigint>* clusters_changed, bigint* total_num_labe
             }
             if (do_merge) {
                 for (bigint i = 0; i < (bigint)inds2.size(); i++) {
-                    new_labels[inds2[i]] = k1;
+                    labels[inds2[i]] = k1;
                 }
-                *total_num_label_changes += inds2.size();
-                clusters_changed_vec[k1 - 1] = 1;
-                clusters_changed_vec[k2 - 1] = 1;
+                num_label_changes[i1] += inds2.size();
+                pair_changed[i1] = 1;
             }
             else {
                 //redistribute
                 bool something_was_redistributed = false;
                 for (bigint i = 0; i < (bigint)inds1.size(); i++) {
                     if (L12[i] == 2) {
-                        new_labels[inds1[i]] = k2;
-                        (*total_num_label_changes)++;
+                        labels[inds1[i]] = k2;
+                        num_label_changes[i1]++;
                         something_was_redistributed = true;
                     }
                 }
                 for (bigint i = 0; i < (bigint)inds2.size(); i++) {
                     if (L12[inds1.size() + i] == 1) {
-                        new_labels[inds2[i]] = k1;
-                        (*total_num_label_changes)++;
+                        labels[inds2[i]] = k1;
+                        num_label_changes[i1]++;
                         something_was_redistributed = true;
                     }
                 }
                 if (something_was_redistributed) {
-                    clusters_changed_vec[k1 - 1] = 1;
-                    clusters_changed_vec[k2 - 1] = 1;
+                    pair_changed[i1] = 1;
+                }
+            }
+            if (pair_changed[i1]) {
+                // rebuild the member lists of the two clusters, keeping them in increasing order
+                members[k1 - 1].clear();
+                members[k2 - 1].clear();
+                bigint j1 = 0, j2 = 0;
+                while ((j1 < (bigint)inds1.size()) || (j2 < (bigint)inds2.size())) {
+                    bigint ind;
+                    if ((j2 >= (bigint)inds2.size()) || ((j1 < (bigint)inds1.size()) && (inds1[j1] < inds2[j2])))
+                        ind = inds1[j1++];
+                    else
+                        ind = inds2[j2++];
+                    members[labels[ind] - 1].push_back(ind);
                 }
             }
         }
     }
+    std::vector<bigint> clusters_changed_vec(Kmax);
+    for (bigint i = 0; i < Kmax; i++)
+        clusters_changed_vec[i] = 0;
+    *total_num_label_changes = 0;
+    for (bigint i1 = 0; i1 < num_pairs; i1++) {
+        *total_num_label_changes += num_label_changes[i1];
+        if (pair_changed[i1]) {
+            clusters_changed_vec[k1s[i1] - 1] = 1;
+            clusters_changed_vec[k2s[i1] - 1] = 1;
+        }
+    }
     clusters_changed->clear();
     for (int k = 0; k < Kmax; k++)
         if (clusters_changed_vec[k])
             clusters_changed->push_back(k + 1);
-    for (bigint i = 0; i < N; i++)
-        labels[i] = new_labels[i];
-    free(new_labels);
 }
 }
 
@@ -263,12 +263,16 @@ HEADERS += utils/get_sort_indices.h \
     utils/msmisc.h \
     utils/get_pca_features.h \
     utils/compute_templates_0.h \
+    utils/template_accumulator.h \
+    utils/blas_kernels.h \
     utils/eigenvalue_decomposition.h
 
 SOURCES += utils/get_sort_indices.cpp \
     utils/matrix_mda.cpp \
     utils/get_pca_features.cpp \
     utils/compute_templates_0.cpp \
+    utils/template_accumulator.cpp \
+    utils/blas_kernels.cpp \
     utils/msmisc.cpp
 
 HEADERS += utils/svm.h
@@ -0,0 +1,111 @@
+/******************************************************
+** See the accompanying README and LICENSE files
+*******************************************************/
+
+#include "blas_kernels.h"
+#include <string.h>
+#include <vector>
+
+#ifdef USE_BLAS
+#include <cblas.h>
+#endif
+
+namespace BlasKernels {
+void add_upper_to_symmetric(bigint M, const float* upper, double* C);
+}
+
+void blas_sgemm(bigint M, bigint N, bigint K, const float* A, const float* B, float* C, bool accumulate)
+{
+#ifdef USE_BLAS
+    cblas_sgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, M, N, K, 1.0f, A, M, B, K, accumulate ? 1.0f : 0.0f, C, M);
+#else
+    if (!accumulate)
+        memset(C, 0, sizeof(float) * M * N);
+    //Work through A in panels of columns small enough to stay in L2 while we sweep over all the columns of B and C.
+    //Within a panel, each column of C gets four columns of A at a time so it is loaded/stored a quarter as often.
+    bigint panel_size = qMax((bigint)4, ((bigint)(16 * 1024) / qMax(M, (bigint)1)) / 4 * 4);
+    for (bigint k1 = 0; k1 < K; k1 += panel_size) {
+        bigint k2 = qMin(K, k1 + panel_size);
+        for (bigint n = 0; n < N; n++) {
+            float* c = C + M * n;
+            const float* b = B + K * n;
+            bigint k = k1;
+            for (; k + 4 <= k2; k += 4) {
+                const float* a0 = A + M * k;
+                const float* a1 = a0 + M;
+                const float* a2 = a1 + M;
+                const float* a3 = a2 + M;
+                float b0 = b[k], b1 = b[k + 1], b2 = b[k + 2], b3 = b[k + 3];
+#pragma omp simd
+                for (bigint m = 0; m < M; m++)
+                    c[m] += a0[m] * b0 + a1[m] * b1 + a2[m] * b2 + a3[m] * b3;
+            }
+            for (; k < k2; k++) {
+                const float* a0 = A + M * k;
+                float b0 = b[k];
+#pragma omp simd
+                for (bigint m = 0; m < M; m++)
+                    c[m] += a0[m] * b0;
+            }
+        }
+    }
+#endif
+}
+
+void blas_ssyrk_accumulate(bigint M, bigint K, const float* A, double* C)
+{
+    //The products are summed in single precision over blocks of columns, and the blocks are summed in double,
+    //so that accuracy doesn't degrade with the length of the chunk
+    std::vector<float> upper(M * M);
+#ifdef USE_BLAS
+    bigint block_size = 4096;
+    for (bigint k1 = 0; k1 < K; k1 += block_size) {
+        bigint k2 = qMin(K, k1 + block_size);
+        cblas_ssyrk(CblasColMajor, CblasUpper, CblasNoTrans, M, k2 - k1, 1.0f, A + M * k1, M, 0.0f, upper.data(), M);
+        BlasKernels::add_upper_to_symmetric(M, upper.data(), C);
+    }
+#else
+    //the block of A (M x block_size) should stay in L2 while we sweep over the columns of the upper triangle
+    bigint block_size = qMax((bigint)16, ((bigint)(64 * 1024) / qMax(M, (bigint)1)) / 4 * 4);
+    for (bigint k1 = 0; k1 < K; k1 += block_size) {
+        bigint k2 = qMin(K, k1 + block_size);
+        std::fill(upper.begin(), upper.end(), 0);
+        for (bigint m2 = 0; m2 < M; m2++) {
+            float* c = upper.data() + M * m2;
+            bigint k = k1;
+            for (; k + 4 <= k2; k += 4) {
+                const float* x0 = A + M * k;
+                const float* x1 = x0 + M;
+                const float* x2 = x1 + M;
+                const float* x3 = x2 + M;
+                float y0 = x0[m2], y1 = x1[m2], y2 = x2[m2], y3 = x3[m2];
+#pragma omp simd
+                for (bigint m1 = 0; m1 <= m2; m1++)
+                    c[m1] += x0[m1] * y0 + x1[m1] * y1 + x2[m1] * y2 + x3[m1] * y3;
+            }
+            for (; k < k2; k++) {
+                const float* x0 = A + M * k;
+                float y0 = x0[m2];
+#pragma omp simd
+                for (bigint m1 = 0; m1 <= m2; m1++)
+                    c[m1] += x0[m1] * y0;
+            }
+        }
+        BlasKernels::add_upper_to_symmetric(M, upper.data(), C);
+    }
+#endif
+}
+
+namespace BlasKernels {
+void add_upper_to_symmetric(bigint M, const float* upper, double* C)
+{
+    for (bigint m2 = 0; m2 < M; m2++) {
+        for (bigint m1 = 0; m1 < m2; m1++) {
+            double val = upper[m1 + M * m2];
+            C[m1 + M * m2] += val;
+            C[m2 + M * m1] += val;
+        }
+        C[m2 + M * m2] += upper[m2 + M * m2];
+    }
+}
+}
@@ -0,0 +1,28 @@
+/******************************************************
+** See the accompanying README and LICENSE files
+*******************************************************/
+
+#ifndef BLAS_KERNELS_H
+#define BLAS_KERNELS_H
+
+#include "mlcommon.h"
+
+/*
+  Single-precision matrix kernels for the hot loops of the processors.
+  All matrices are column-major and contiguous (leading dimension = number of rows),
+  which is the layout of Mda32.
+
+  When compiled with USE_BLAS (see mountainsort2.pro) these call cblas; otherwise
+  a cache-blocked fallback is used. Both are meant to be called from within
+  a worker thread on a single chunk, so neither spawns threads of its own.
+*/
+
+// C = A*B, or C += A*B if accumulate
+// A: MxK, B: KxN, C: MxN
+void blas_sgemm(bigint M, bigint N, bigint K, const float* A, const float* B, float* C, bool accumulate);
+
+// C += A*A'
+// A: MxK, C: MxM (the full symmetric matrix is updated). Accumulated in double.
+void blas_ssyrk_accumulate(bigint M, bigint K, const float* A, double* C);
+
+#endif // BLAS_KERNELS_H
@@ -9,7 +9,7 @@
 #include "mlcommon.h"
 #include <math.h>
 #include "get_sort_indices.h"
-#include "omp.h"
+#include "template_accumulator.h"
 
 Mda compute_templates_0(const DiskReadMda& X, Mda& firings, int clip_size)
 {
@@ -49,11 +49,11 @@ Mda compute_templates_0(const DiskReadMda& X, const QVector<double>& times, cons
     QList<int> counts;
     for (int k = 0; k < K; k++)
         counts << 0;
+    Mda X0; //readChunk reuses the buffer from one clip to the next
     for (int i = 0; i < L; i++) {
         int k = labels[i];
         int t0 = (int)(times[i] + 0.5);
         if (k >= 1) {
-            Mda X0;
             X.readChunk(X0, 0, t0 - Tmid, M, T);
             double* Xptr = X0.dataPtr();
             double* Tptr = templates.dataPtr(0, 0, k - 1);
@@ -76,115 +76,36 @@ Mda compute_templates_0(const DiskReadMda& X, const QVector<double>& times, cons
     return templates;
 }
 
-void get_sums_and_counts_for_templates(Mda& sums, Mda& counts, const Mda32& X, bigint t_offset, const QVector<double>& times, const QVector<int>& labels, int clip_size, int K)
-{
-    int M = X.N1();
-    bigint N = X.N2();
-    int T = clip_size;
-    int Tmid = (int)((T + 1) / 2) - 1;
-    sums.allocate(M, T, K);
-    counts.allocate(1, K);
-    for (bigint i = 0; i < times.count(); i++) {
-        bigint t = times[i] - t_offset;
-        if ((t >= clip_size) && (t < N - clip_size)) {
-            int k = labels[i];
-            if ((k >= 1) && (k <= K)) {
-                Mda32 clip;
-                X.getChunk(clip, 0, t - Tmid, M, T);
-                for (int t = 0; t < T; t++) {
-                    for (int m = 0; m < M; m++) {
-                        sums.setValue(sums.value(m, t, k - 1) + clip.value(m, t), m, t, k - 1);
-                    }
-                }
-                counts.set(counts.get(k - 1) + 1, k - 1);
-            }
-        }
-    }
-}
-
 Mda32 compute_templates_in_parallel(const DiskReadMda32& X, const QVector<double>& times, const QVector<int>& labels, int clip_size)
 {
     int M = X.N1();
-    bigint N = X.N2();
     int T = clip_size;
     int K = MLCompute::max<int>(labels);
 
-    Mda sums(M, T, K);
-    Mda counts(1, K);
-
-    bigint chunk_size = 1e5;
-#pragma omp parallel for
-    for (bigint t = 0; t < N; t += chunk_size) {
-        Mda32 chunk;
-#pragma omp critical
-        {
-            X.readChunk(chunk, 0, t - clip_size, M, chunk_size + 2 * clip_size);
-        }
-        Mda sums0;
-        Mda counts0;
-        get_sums_and_counts_for_templates(sums0, counts0, chunk, t - clip_size, times, labels, clip_size, K);
-#pragma omp critical
-        {
-            for (bigint i = 0; i < M * T * K; i++) {
-                sums.set(sums.get(i) + sums0.get(i), i);
-            }
-            for (int i = 0; i < K; i++) {
-                counts.set(counts.get(i) + counts0.get(i), i);
-            }
-        }
-    }
-    Mda32 ret(M, T, K);
-    for (int k = 0; k < K; k++) {
-        if (counts.get(k)) {
-            for (int t = 0; t < T; t++) {
-                for (int m = 0; m < M; m++) {
-                    ret.setValue(sums.value(m, t, k) / counts.get(k), m, t, k);
-                }
-            }
-        }
+    //unlike compute_templates_0, the clips start at floor(t)-Tmid and events outside the timeseries are left out
+    TemplateAccumulatorOpts opts;
+    opts.clip_alignment = TemplateAccumulatorOpts::FlooredTime;
+    opts.skip_events_outside = true;
+    TemplateAccumulator accumulator(M, T, K, opts);
+    if (!accumulator.addClipsFromTimeseries(X, times, labels)) {
+        qWarning() << "Problem reading timeseries in compute_templates_in_parallel";
     }
-    return ret;
+    accumulator.finalize();
+    return accumulator.templates();
 }
 
 Mda32 compute_templates_0(const DiskReadMda32& X, const QVector<double>& times, const QVector<int>& labels, int clip_size)
 {
     int M = X.N1();
     int T = clip_size;
-    int L = times.count();
-
     int K = MLCompute::max<int>(labels);
 
-    int Tmid = (int)((T + 1) / 2) - 1;
-
-    Mda32 templates(M, T, K);
-    QList<int> counts;
-    for (int k = 0; k < K; k++)
-        counts << 0;
-    for (int i = 0; i < L; i++) {
-        int k = labels[i];
-        int t0 = (int)(times[i] + 0.5);
-        if (k >= 1) {
-            Mda32 X0;
-            X.readChunk(X0, 0, t0 - Tmid, M, T);
-            dtype32* Xptr = X0.dataPtr();
-            dtype32* Tptr = templates.dataPtr(0, 0, k - 1);
-            for (int i = 0; i < M * T; i++) {
-                Tptr[i] += Xptr[i];
-            }
-            counts[k - 1]++;
-        }
-    }
-    for (int k = 0; k < K; k++) {
-        for (int t = 0; t < T; t++) {
-            for (int m = 0; m < M; m++) {
-                if (counts[k]) {
-                    templates.set(templates.get(m, t, k) / counts[k], m, t, k);
-                }
-            }
-        }
+    TemplateAccumulator accumulator(M, T, K);
+    if (!accumulator.addClipsFromTimeseries(X, times, labels)) {
+        qWarning() << "Problem reading timeseries in compute_templates_0";
     }
-
-    return templates;
+    accumulator.finalize();
+    return accumulator.templates();
 }
 
 void compute_templates_stdevs(Mda& templates, Mda& stdevs, DiskReadMda& X, const QVector<double>& times, const QVector<int>& labels, int clip_size)
@@ -202,11 +123,11 @@ void compute_templates_stdevs(Mda& templates, Mda& stdevs, DiskReadMda& X, const
     QList<int> counts;
     for (int k = 0; k < K; k++)
         counts << 0;
+    Mda X0; //readChunk reuses the buffer from one clip to the next
     for (int i = 0; i < L; i++) {
         int k = labels[i];
         int t0 = (int)(times[i] + 0.5);
         if (k >= 1) {
-            Mda X0;
             X.readChunk(X0, 0, t0 - Tmid, M, T);
             double* Xptr = X0.dataPtr();
             double* sum_ptr = sums.dataPtr(0, 0, k - 1);
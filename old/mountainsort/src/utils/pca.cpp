@@ -6,13 +6,16 @@
 
 #include "pca.h"
 #include "mlcommon.h"
+#include "blas_kernels.h"
 #include <cstring>
 #include <math.h>
+#include <algorithm>
+#include <vector>
 
+void pca_power_iteration(Mda& C, Mda& F, Mda& sigma, const Mda& X, bigint num_features, bool subtract_mean);
+void pca_power_iteration(Mda32& C, Mda32& F, Mda32& sigma, const Mda32& X, bigint num_features, bool subtract_mean);
 void iterate_to_get_top_component(Mda& C, double& sigma, Mda& X, bigint num_iterations);
 void iterate_to_get_top_component(Mda32& C, double& sigma, Mda32& X, bigint num_iterations);
-void iterate_XXt_to_get_top_component(Mda& C, double& sigma, Mda& XXt, bigint num_iterations);
-void iterate_XXt_to_get_top_component(Mda32& C, double& sigma, Mda32& XXt, bigint num_iterations);
 Mda mult_AB(const Mda& A, const Mda& B);
 Mda32 mult_AB(const Mda32& A, const Mda32& B);
 Mda mult_AtransB(const Mda& A, const Mda& B);
@@ -20,13 +23,83 @@ Mda32 mult_AtransB(const Mda32& A, const Mda32& B);
 Mda mult_ABtrans(const Mda& A, const Mda& B);
 void subtract_out_rank_1(Mda& X, Mda& C);
 void subtract_out_rank_1(Mda32& X, Mda32& C);
-void subtract_out_rank_1_from_XXt(Mda& X, Mda& C);
-void subtract_out_rank_1_from_XXt(Mda32& X, Mda32& C);
 void normalize_vector(Mda& V);
 void pca_subtract_mean(Mda& X);
 void pca_subtract_mean(Mda32& X);
 
-void pca(Mda& C, Mda& F, Mda& sigma, const Mda& X, bigint num_features, bool subtract_mean)
+namespace PCA {
+template <typename T>
+void compute_components(T* C, T* sigma, const T* X, bigint M, bigint N, bigint K, const PcaOpts& opts);
+template <typename T>
+void compute_XXt(double* XXt, const T* X, bigint M, bigint N);
+template <typename T>
+void compute_XXtQ(double* Y, const T* X, bigint M, bigint N, const double* Q, bigint L);
+template <typename T>
+void project(T* F, const T* C, const T* X, bigint M, bigint N, bigint K);
+template <typename T>
+void components_from_XXt(T* C, T* sigma, const T* XXt, bigint M, bigint K);
+void symmetric_eigen(bigint n, double* V, double* d);
+void orthonormalize(bigint M, bigint L, double* Q);
+void normalize_signs(bigint M, bigint K, double* C);
+bigint choose_block_size(bigint M);
+bigint num_partial_sums(bigint num_blocks, bigint partial_size);
+void gemm(bigint M, bigint N, bigint K, const float* A, const float* B, float* C);
+void gemm(bigint M, bigint N, bigint K, const double* A, const double* B, double* C);
+void syrk_accumulate(bigint M, bigint K, const float* A, double* C);
+void syrk_accumulate(bigint M, bigint K, const double* A, double* C);
+}
+
+void pca(Mda& C, Mda& F, Mda& sigma, const Mda& X, bigint num_features, bool subtract_mean, const PcaOpts& opts)
+{
+    if (opts.method == PcaOpts::PowerIteration) {
+        pca_power_iteration(C, F, sigma, X, num_features, subtract_mean);
+        return;
+    }
+    bigint M = X.N1();
+    bigint N = X.N2();
+    bigint K = num_features;
+
+    C.allocate(M, K);
+    sigma.allocate(K, 1);
+    if (subtract_mean) {
+        Mda Xw = X; //working data
+        pca_subtract_mean(Xw);
+        PCA::compute_components(C.dataPtr(), sigma.dataPtr(), Xw.constDataPtr(), M, N, K, opts);
+    }
+    else {
+        PCA::compute_components(C.dataPtr(), sigma.dataPtr(), X.constDataPtr(), M, N, K, opts);
+    }
+
+    F.allocate(K, N);
+    PCA::project(F.dataPtr(), C.constDataPtr(), X.constDataPtr(), M, N, K);
+}
+
+void pca(Mda32& C, Mda32& F, Mda32& sigma, const Mda32& X, bigint num_features, bool subtract_mean, const PcaOpts& opts)
+{
+    if (opts.method == PcaOpts::PowerIteration) {
+        pca_power_iteration(C, F, sigma, X, num_features, subtract_mean);
+        return;
+    }
+    bigint M = X.N1();
+    bigint N = X.N2();
+    bigint K = num_features;
+
+    C.allocate(M, K);
+    sigma.allocate(K, 1);
+    if (subtract_mean) {
+        Mda32 Xw = X; //working data
+        pca_subtract_mean(Xw);
+        PCA::compute_components(C.dataPtr(), sigma.dataPtr(), Xw.constDataPtr(), M, N, K, opts);
+    }
+    else {
+        PCA::compute_components(C.dataPtr(), sigma.dataPtr(), X.constDataPtr(), M, N, K, opts);
+    }
+
+    F.allocate(K, N);
+    PCA::project(F.dataPtr(), C.constDataPtr(), X.constDataPtr(), M, N, K);
+}
+
+void pca_power_iteration(Mda& C, Mda& F, Mda& sigma, const Mda& X, bigint num_features, bool subtract_mean)
 {
     bigint M = X.N1();
     //bigint N = X.N2();
@@ -56,7 +129,7 @@ void pca(Mda& C, Mda& F, Mda& sigma, const Mda& X, bigint num_features, bool sub
     F = mult_AtransB(C, X);
 }
 
-void pca(Mda32& C, Mda32& F, Mda32& sigma, const Mda32& X, bigint num_features, bool subtract_mean)
+void pca_power_iteration(Mda32& C, Mda32& F, Mda32& sigma, const Mda32& X, bigint num_features, bool subtract_mean)
 {
     bigint M = X.N1();
     //bigint N = X.N2();
@@ -87,7 +160,7 @@ void pca(Mda32& C, Mda32& F, Mda32& sigma, const Mda32& X, bigint num_features,
     F = mult_AtransB(C, X);
 }
 
-void pca_subsampled(Mda32& components, Mda32& features, Mda32& sigma, const Mda32& X, bigint num_features, bool subtract_mean, bigint max_samples)
+void pca_subsampled(Mda32& components, Mda32& features, Mda32& sigma, const Mda32& X, bigint num_features, bool subtract_mean, bigint max_samples, const PcaOpts& opts)
 {
     bigint M = X.N1();
     bigint N = X.N2();
@@ -95,7 +168,7 @@ void pca_subsampled(Mda32& components, Mda32& features, Mda32& sigma, const Mda3
     qDebug().noquote() << QString("PCA %1x%2x%3 (max_samples=%4)").arg(M).arg(N).arg(num_features).arg(max_samples);
 
     if (N <= max_samples) {
-        pca(components, features, sigma, X, num_features, subtract_mean);
+        pca(components, features, sigma, X, num_features, subtract_mean, opts);
         return;
     }
     double increment = N * 1.0 / max_samples;
@@ -105,28 +178,30 @@ void pca_subsampled(Mda32& components, Mda32& features, Mda32& sigma, const Mda3
     }
     bigint N2 = indices_to_use.count();
     Mda32 X2(M, N2);
-    for (bigint j = 0; j < indices_to_use.count(); j++) {
-        for (bigint m = 0; m < M; m++) {
-            X2.setValue(X.value(m, indices_to_use[j]), m, j);
-        }
+    const dtype32* Xptr = X.constDataPtr();
+    dtype32* X2ptr = X2.dataPtr();
+    for (bigint j = 0; j < N2; j++) {
+        std::memcpy(&X2ptr[M * j], &Xptr[M * indices_to_use[j]], sizeof(dtype32) * M);
     }
     Mda32 features2;
-    pca(components, features2, sigma, X2, num_features, subtract_mean);
+    pca(components, features2, sigma, X2, num_features, subtract_mean, opts);
 
     // (MxK)' * MxN -> KxN
-    features = mult_AtransB(components, X);
+    features.allocate(num_features, N);
+    PCA::project(features.dataPtr(), components.constDataPtr(), X.constDataPtr(), M, N, num_features);
 }
 
 void pca_subtract_mean(Mda& X)
 {
     bigint M = X.N1();
     bigint N = X.N2();
+    double* Xptr = X.dataPtr();
     QVector<double> mean0(M);
     for (bigint m = 0; m < M; m++)
         mean0[m] = 0;
     for (bigint i = 0; i < N; i++) {
         for (bigint m = 0; m < M; m++)
-            mean0[m] += X.value(m, i);
+            mean0[m] += Xptr[m + M * i];
     }
     if (N) {
         for (bigint m = 0; m < M; m++)
@@ -134,7 +209,7 @@ void pca_subtract_mean(Mda& X)
     }
     for (bigint i = 0; i < N; i++) {
         for (bigint m = 0; m < M; m++)
-            X.setValue(X.value(m, i) - mean0[m], m, i);
+            Xptr[m + M * i] -= mean0[m];
     }
 }
 
@@ -142,12 +217,13 @@ void pca_subtract_mean(Mda32& X)
 {
     bigint M = X.N1();
     bigint N = X.N2();
+    dtype32* Xptr = X.dataPtr();
     QVector<double> mean0(M);
     for (bigint m = 0; m < M; m++)
         mean0[m] = 0;
     for (bigint i = 0; i < N; i++) {
         for (bigint m = 0; m < M; m++)
-            mean0[m] += X.value(m, i);
+            mean0[m] += Xptr[m + M * i];
     }
     if (N) {
         for (bigint m = 0; m < M; m++)
@@ -155,7 +231,7 @@ void pca_subtract_mean(Mda32& X)
     }
     for (bigint i = 0; i < N; i++) {
         for (bigint m = 0; m < M; m++)
-            X.setValue(X.value(m, i) - mean0[m], m, i);
+            Xptr[m + M * i] -= mean0[m];
     }
 }
 
@@ -163,48 +239,18 @@ void pca_from_XXt(Mda& C, Mda& sigma, const Mda& XXt, bigint num_features)
 {
     bigint M = XXt.N1();
     bigint K = num_features;
-    bigint num_iterations_per_component = 10; //hard-coded for now
-
-    Mda XXtw = XXt; //working data
-
     C.allocate(M, K);
     sigma.allocate(K, 1);
-
-    for (bigint k = 0; k < K; k++) {
-        // C will be Mx1, F will be 1xN
-        Mda C0;
-        double sigma0;
-        iterate_XXt_to_get_top_component(C0, sigma0, XXtw, num_iterations_per_component);
-        for (bigint m = 0; m < M; m++) {
-            C.set(C0.get(m), m, k); //think about speeding this up
-        }
-        sigma.set(sigma0, k);
-        subtract_out_rank_1_from_XXt(XXtw, C0);
-    }
+    PCA::components_from_XXt(C.dataPtr(), sigma.dataPtr(), XXt.constDataPtr(), M, K);
 }
 
 void pca_from_XXt(Mda32& C, Mda32& sigma, const Mda32& XXt, bigint num_features)
 {
     bigint M = XXt.N1();
     bigint K = num_features;
-    bigint num_iterations_per_component = 10; //hard-coded for now
-
-    Mda32 XXtw = XXt; //working data
-
     C.allocate(M, K);
     sigma.allocate(K, 1);
-
-    for (bigint k = 0; k < K; k++) {
-        // C will be Mx1, F will be 1xN
-        Mda32 C0;
-        double sigma0;
-        iterate_XXt_to_get_top_component(C0, sigma0, XXtw, num_iterations_per_component);
-        for (bigint m = 0; m < M; m++) {
-            C.set(C0.get(m), m, k); //think about speeding this up
-        }
-        sigma.set(sigma0, k);
-        subtract_out_rank_1_from_XXt(XXtw, C0);
-    }
+    PCA::components_from_XXt(C.dataPtr(), sigma.dataPtr(), XXt.constDataPtr(), M, K);
 }
 
 Mda mult_AB(Mda& A, Mda& B) // gemm for two 2D MDAs.   inner part should be BLAS3 call
@@ -395,54 +441,6 @@ void subtract_out_rank_1(Mda32& X, Mda32& C)
     }
 }
 
-void subtract_out_rank_1_from_XXt(Mda& XXt, Mda& C)
-{
-    bigint M = XXt.N1();
-    if ((C.N1() != M) || (C.N2() != 1)) {
-        qCritical() << "Incorrect dimensions in subtract_out_rank_1_from_XXt" << M << C.N1() << C.N2();
-        abort();
-    }
-
-    // X -> (1-CC')X
-    // XXt -> (1-CC')XXt(1-CC')
-
-    Mda B(M, M); //1-CC'
-    for (bigint j = 0; j < M; j++) {
-        for (bigint i = 0; i < M; i++) {
-            if (i == j)
-                B.setValue(1 - C.value(i) * C.value(j), i, j);
-            else
-                B.setValue(-C.value(i) * C.value(j), i, j);
-        }
-    }
-    Mda tmp = mult_AB(XXt, B);
-    XXt = mult_AB(B, tmp);
-}
-
-void subtract_out_rank_1_from_XXt(Mda32& XXt, Mda32& C)
-{
-    bigint M = XXt.N1();
-    if ((C.N1() != M) || (C.N2() != 1)) {
-        qCritical() << "Incorrect dimensions in subtract_out_rank_1_from_XXt" << M << C.N1() << C.N2();
-        abort();
-    }
-
-    // X -> (1-CC')X
-    // XXt -> (1-CC')XXt(1-CC')
-
-    Mda32 B(M, M); //1-CC'
-    for (bigint j = 0; j < M; j++) {
-        for (bigint i = 0; i < M; i++) {
-            if (i == j)
-                B.setValue(1 - C.value(i) * C.value(j), i, j);
-            else
-                B.setValue(-C.value(i) * C.value(j), i, j);
-        }
-    }
-    Mda32 tmp = mult_AB(XXt, B);
-    XXt = mult_AB(B, tmp);
-}
-
 void normalize_vector(Mda& V)
 {
     bigint N = V.totalSize();
@@ -528,42 +526,6 @@ void iterate_to_get_top_component(Mda32& C, double& sigma, Mda32& X, bigint num_
     }
 }
 
-void iterate_XXt_to_get_top_component(Mda& C, double& sigma, Mda& XXt, bigint num_iterations)
-{
-    bigint M = XXt.N1();
-    C.allocate(M, 1);
-    for (bigint i = 0; i < M; i++) {
-        C.set(sin(i + 1), i); //pseudo-random  - ahb fixed so the M=1 case isn't the zero vector
-    }
-    normalize_vector(C);
-    for (bigint it = 0; it < num_iterations; it++) {
-        // V = X*X'*V
-        Mda tmp(M, 1);
-        matvec(M, M, tmp.dataPtr(), XXt.dataPtr(), C.dataPtr()); //V is Mx1
-        C = tmp;
-        sigma = MLCompute::norm(M, C.dataPtr());
-        normalize_vector(C);
-    }
-}
-
-void iterate_XXt_to_get_top_component(Mda32& C, double& sigma, Mda32& XXt, bigint num_iterations)
-{
-    bigint M = XXt.N1();
-    C.allocate(M, 1);
-    for (bigint i = 0; i < M; i++) {
-        C.set(sin(i + 1), i); //pseudo-random  - ahb fixed so the M=1 case isn't the zero vector
-    }
-    normalize_vector(C);
-    for (bigint it = 0; it < num_iterations; it++) {
-        // V = X*X'*V
-        Mda32 tmp(M, 1);
-        matvec(M, M, tmp.dataPtr(), XXt.dataPtr(), C.dataPtr()); //V is Mx1
-        C = tmp;
-        sigma = MLCompute::norm(M, C.dataPtr());
-        normalize_vector(C);
-    }
-}
-
 double rand01()
 {
     double ret = ((qrand() % 100000) + 0.5) * 1.0 / 100000;
@@ -630,7 +592,7 @@ void whitening_matrix_from_XXt(Mda& W, const Mda& XXt)
     Mda D(M, M); // build a diagonal matrix D = 1/sqrt(eigvals)
     for (bigint i = 0; i < M; i++) {
         double val = 0;
-        if (sigma.get(i))
+        if (sigma.get(i) > 0) //the eigenvalues of a nearly singular XXt can come out slightly negative
             val = 1 / sqrt(sigma.get(i));
         D.setValue(val, i, i);
     }
@@ -648,7 +610,7 @@ void whitening_matrix_from_XXt(Mda32& W, const Mda32& XXt)
     Mda32 D(M, M); // build a diagonal matrix D = 1/sqrt(eigvals)
     for (bigint i = 0; i < M; i++) {
         double val = 0;
-        if (sigma.get(i))
+        if (sigma.get(i) > 0) //the eigenvalues of a nearly singular XXt can come out slightly negative
             val = 1 / sqrt(sigma.get(i));
         D.setValue(val, i, i);
     }
@@ -656,3 +618,448 @@ void whitening_matrix_from_XXt(Mda32& W, const Mda32& XXt)
     Mda32 tmp = mult_AB(components, D);
     W = mult_ABtrans(tmp, components); // output U.D.U^T is symmetric
 }
+
+namespace PCA {
+
+template <typename T>
+void compute_components(T* C, T* sigma, const T* X, bigint M, bigint N, bigint K, const PcaOpts& opts)
+{
+    bigint K0 = qMin(K, M); //there are at most M components, the remaining ones are left at zero
+    bigint L = qMin(M, K0 + opts.oversampling);
+    bigint num_iterations = opts.num_power_iterations;
+    std::vector<double> C0(M * K0), sigma0(K0);
+
+    PcaOpts::Method method = opts.method;
+    if (method == PcaOpts::Auto) {
+        //X*X' costs M*M*N/2 flops and is followed by an MxM eigendecomposition,
+        //whereas each pass of the randomized method costs about 4*L*M*N
+        if ((L >= M) || (M <= qMin((bigint)1000, 8 * (num_iterations + 1) * L)))
+            method = PcaOpts::Covariance;
+        else
+            method = PcaOpts::Randomized;
+    }
+
+    if (method == PcaOpts::Covariance) {
+        std::vector<double> V(M * M), lambda(M);
+        compute_XXt(V.data(), X, M, N);
+        symmetric_eigen(M, V.data(), lambda.data());
+        std::copy(V.begin(), V.begin() + M * K0, C0.begin());
+        std::copy(lambda.begin(), lambda.begin() + K0, sigma0.begin());
+    }
+    else {
+        //randomized subspace iteration: Q <- orth(X*X'*Q), then Rayleigh-Ritz on the final subspace
+        std::vector<double> Q(M * L), Y(M * L), B(L * L), lambda(L);
+        //deterministic pseudo-random start (note that sin(i+1) as in the power iteration would only span two dimensions)
+        quint64 state = 1;
+        for (bigint i = 0; i < M * L; i++) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            Q[i] = ((state >> 11) * (1.0 / 9007199254740992.0)) - 0.5;
+        }
+        orthonormalize(M, L, Q.data());
+        for (bigint it = 0; it < num_iterations; it++) {
+            compute_XXtQ(Y.data(), X, M, N, Q.data(), L);
+            Q.swap(Y);
+            orthonormalize(M, L, Q.data());
+        }
+        compute_XXtQ(Y.data(), X, M, N, Q.data(), L);
+        // B = Q'*X*X'*Q (LxL)
+        for (bigint j = 0; j < L; j++) {
+            for (bigint i = 0; i < L; i++) {
+                double val = 0;
+                for (bigint m = 0; m < M; m++)
+                    val += Q[m + M * i] * Y[m + M * j];
+                B[i + L * j] = val;
+            }
+        }
+        for (bigint j = 0; j < L; j++) {
+            for (bigint i = 0; i < j; i++) {
+                double val = (B[i + L * j] + B[j + L * i]) / 2;
+                B[i + L * j] = B[j + L * i] = val;
+            }
+        }
+        symmetric_eigen(L, B.data(), lambda.data());
+        // C = Q*V, using the top K0 eigenvectors of B
+        for (bigint k = 0; k < K0; k++) {
+            for (bigint l = 0; l < L; l++) {
+                double v = B[l + L * k];
+                for (bigint m = 0; m < M; m++)
+                    C0[m + M * k] += Q[m + M * l] * v;
+            }
+            sigma0[k] = lambda[k];
+        }
+    }
+    normalize_signs(M, K0, C0.data());
+
+    for (bigint i = 0; i < M * K; i++)
+        C[i] = (i < M * K0) ? C0[i] : 0;
+    for (bigint k = 0; k < K; k++)
+        sigma[k] = (k < K0) ? sigma0[k] : 0;
+}
+
+template <typename T>
+void compute_XXt(double* XXt, const T* X, bigint M, bigint N)
+{
+    bigint block_size = 4096;
+    bigint num_blocks = (N + block_size - 1) / block_size;
+    bigint num_groups = num_partial_sums(num_blocks, M * M);
+    std::vector<std::vector<double> > partials(num_groups);
+#pragma omp parallel for schedule(dynamic)
+    for (bigint g = 0; g < num_groups; g++) {
+        std::vector<double> local(M * M, 0);
+        for (bigint b = g * num_blocks / num_groups; b < (g + 1) * num_blocks / num_groups; b++) {
+            bigint n1 = b * block_size;
+            bigint n2 = qMin(N, n1 + block_size);
+            syrk_accumulate(M, n2 - n1, X + M * n1, local.data());
+        }
+        partials[g].swap(local);
+    }
+    std::fill(XXt, XXt + M * M, 0);
+    for (bigint g = 0; g < num_groups; g++) {
+        for (bigint i = 0; i < M * M; i++)
+            XXt[i] += partials[g][i];
+    }
+}
+
+template <typename T>
+void compute_XXtQ(double* Y, const T* X, bigint M, bigint N, const double* Q, bigint L)
+{
+    //Y = X*(X'*Q), one block of columns of X at a time so that each block is read from memory once
+    std::vector<T> Qt(L * M);
+    for (bigint l = 0; l < L; l++) {
+        for (bigint m = 0; m < M; m++)
+            Qt[l + L * m] = Q[m + M * l];
+    }
+    bigint block_size = choose_block_size(M);
+    bigint num_blocks = (N + block_size - 1) / block_size;
+    bigint num_groups = num_partial_sums(num_blocks, M * L);
+    std::vector<std::vector<double> > partials(num_groups);
+#pragma omp parallel for schedule(dynamic)
+    for (bigint g = 0; g < num_groups; g++) {
+        std::vector<double> local(M * L, 0);
+        std::vector<T> P(L * block_size), Pt(block_size * L), Yb(M * L);
+        for (bigint b = g * num_blocks / num_groups; b < (g + 1) * num_blocks / num_groups; b++) {
+            bigint n1 = b * block_size;
+            bigint nb = qMin(N, n1 + block_size) - n1;
+            const T* Xb = X + M * n1;
+            gemm(L, nb, M, Qt.data(), Xb, P.data()); // P = Q'*Xb
+            for (bigint n = 0; n < nb; n++) {
+                for (bigint l = 0; l < L; l++)
+                    Pt[n + nb * l] = P[l + L * n];
+            }
+            gemm(M, L, nb, Xb, Pt.data(), Yb.data()); // Yb = Xb*P'
+            for (bigint i = 0; i < M * L; i++)
+                local[i] += Yb[i];
+        }
+        partials[g].swap(local);
+    }
+    std::fill(Y, Y + M * L, 0);
+    for (bigint g = 0; g < num_groups; g++) {
+        for (bigint i = 0; i < M * L; i++)
+            Y[i] += partials[g][i];
+    }
+}
+
+template <typename T>
+void project(T* F, const T* C, const T* X, bigint M, bigint N, bigint K)
+{
+    // F = C'*X
+    std::vector<T> Ct(K * M);
+    for (bigint k = 0; k < K; k++) {
+        for (bigint m = 0; m < M; m++)
+            Ct[k + K * m] = C[m + M * k];
+    }
+    bigint block_size = choose_block_size(M);
+    bigint num_blocks = (N + block_size - 1) / block_size;
+#pragma omp parallel for schedule(dynamic)
+    for (bigint b = 0; b < num_blocks; b++) {
+        bigint n1 = b * block_size;
+        bigint nb = qMin(N, n1 + block_size) - n1;
+        gemm(K, nb, M, Ct.data(), X + M * n1, F + K * n1);
+    }
+}
+
+template <typename T>
+void components_from_XXt(T* C, T* sigma, const T* XXt, bigint M, bigint K)
+{
+    std::vector<double> V(XXt, XXt + M * M), lambda(M);
+    symmetric_eigen(M, V.data(), lambda.data());
+    normalize_signs(M, qMin(K, M), V.data());
+    for (bigint k = 0; k < K; k++) {
+        for (bigint m = 0; m < M; m++)
+            C[m + M * k] = (k < M) ? V[m + M * k] : 0;
+        sigma[k] = (k < M) ? lambda[k] : 0;
+    }
+}
+
+void symmetric_eigen(bigint n, double* V, double* d)
+{
+    //Eigendecomposition of the symmetric nxn matrix V (column-major): Householder reduction to
+    //tridiagonal form followed by the implicit QL method (tred2/tql2 from EISPACK, as in JAMA).
+    //On return the columns of V are the eigenvectors and d the eigenvalues, in decreasing order.
+    if (n <= 0)
+        return;
+    std::vector<double> e(n);
+#define PCA_V(i, j) V[(i) + n * (j)]
+
+    //tred2
+    for (bigint j = 0; j < n; j++)
+        d[j] = PCA_V(n - 1, j);
+    for (bigint i = n - 1; i > 0; i--) {
+        double scale = 0, h = 0;
+        for (bigint k = 0; k < i; k++)
+            scale += fabs(d[k]);
+        if (scale == 0) {
+            e[i] = d[i - 1];
+            for (bigint j = 0; j < i; j++) {
+                d[j] = PCA_V(i - 1, j);
+                PCA_V(i, j) = 0;
+                PCA_V(j, i) = 0;
+            }
+        }
+        else {
+            for (bigint k = 0; k < i; k++) {
+                d[k] /= scale;
+                h += d[k] * d[k];
+            }
+            double f = d[i - 1];
+            double g = sqrt(h);
+            if (f > 0)
+                g = -g;
+            e[i] = scale * g;
+            h = h - f * g;
+            d[i - 1] = f - g;
+            for (bigint j = 0; j < i; j++)
+                e[j] = 0;
+            for (bigint j = 0; j < i; j++) {
+                f = d[j];
+                PCA_V(j, i) = f;
+                g = e[j] + PCA_V(j, j) * f;
+                for (bigint k = j + 1; k <= i - 1; k++) {
+                    g += PCA_V(k, j) * d[k];
+                    e[k] += PCA_V(k, j) * f;
+                }
+                e[j] = g;
+            }
+            f = 0;
+            for (bigint j = 0; j < i; j++) {
+                e[j] /= h;
+                f += e[j] * d[j];
+            }
+            double hh = f / (h + h);
+            for (bigint j = 0; j < i; j++)
+                e[j] -= hh * d[j];
+            for (bigint j = 0; j < i; j++) {
+                f = d[j];
+                g = e[j];
+                for (bigint k = j; k <= i - 1; k++)
+                    PCA_V(k, j) -= (f * e[k] + g * d[k]);
+                d[j] = PCA_V(i - 1, j);
+                PCA_V(i, j) = 0;
+            }
+        }
+        d[i] = h;
+    }
+    for (bigint i = 0; i < n - 1; i++) {
+        PCA_V(n - 1, i) = PCA_V(i, i);
+        PCA_V(i, i) = 1;
+        double h = d[i + 1];
+        if (h != 0) {
+            for (bigint k = 0; k <= i; k++)
+                d[k] = PCA_V(k, i + 1) / h;
+            for (bigint j = 0; j <= i; j++) {
+                double g = 0;
+                for (bigint k = 0; k <= i; k++)
+                    g += PCA_V(k, i + 1) * PCA_V(k, j);
+                for (bigint k = 0; k <= i; k++)
+                    PCA_V(k, j) -= g * d[k];
+            }
+        }
+        for (bigint k = 0; k <= i; k++)
+            PCA_V(k, i + 1) = 0;
+    }
+    for (bigint j = 0; j < n; j++) {
+        d[j] = PCA_V(n - 1, j);
+        PCA_V(n - 1, j) = 0;
+    }
+    PCA_V(n - 1, n - 1) = 1;
+    e[0] = 0;
+
+    //tql2
+    for (bigint i = 1; i < n; i++)
+        e[i - 1] = e[i];
+    e[n - 1] = 0;
+    double f = 0, tst1 = 0;
+    double eps = pow(2.0, -52.0);
+    for (bigint l = 0; l < n; l++) {
+        tst1 = qMax(tst1, fabs(d[l]) + fabs(e[l]));
+        bigint m = l;
+        while (m < n - 1) {
+            if (fabs(e[m]) <= eps * tst1)
+                break;
+            m++;
+        }
+        if (m > l) {
+            bigint iter = 0;
+            do {
+                iter++;
+                double g = d[l];
+                double p = (d[l + 1] - g) / (2 * e[l]);
+                double r = hypot(p, 1.0);
+                if (p < 0)
+                    r = -r;
+                d[l] = e[l] / (p + r);
+                d[l + 1] = e[l] * (p + r);
+                double dl1 = d[l + 1];
+                double h = g - d[l];
+                for (bigint i = l + 2; i < n; i++)
+                    d[i] -= h;
+                f += h;
+                p = d[m];
+                double c = 1, c2 = 1, c3 = 1;
+                double el1 = e[l + 1];
+                double s = 0, s2 = 0;
+                for (bigint i = m - 1; i >= l; i--) {
+                    c3 = c2;
+                    c2 = c;
+                    s2 = s;
+                    g = c * e[i];
+                    h = c * p;
+                    r = hypot(p, e[i]);
+                    e[i + 1] = s * r;
+                    s = e[i] / r;
+                    c = p / r;
+                    p = c * d[i] - s * g;
+                    d[i + 1] = h + s * (c * g + s * d[i]);
+                    for (bigint k = 0; k < n; k++) {
+                        h = PCA_V(k, i + 1);
+                        PCA_V(k, i + 1) = s * PCA_V(k, i) + c * h;
+                        PCA_V(k, i) = c * PCA_V(k, i) - s * h;
+                    }
+                }
+                p = -s * s2 * c3 * el1 * e[l] / dl1;
+                e[l] = s * p;
+                d[l] = c * p;
+            } while ((fabs(e[l]) > eps * tst1) && (iter < 100));
+        }
+        d[l] = d[l] + f;
+        e[l] = 0;
+    }
+#undef PCA_V
+
+    //sort in decreasing order of eigenvalue
+    std::vector<bigint> order(n);
+    for (bigint i = 0; i < n; i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](bigint a, bigint b) { return d[a] > d[b]; });
+    std::vector<double> V0(V, V + n * n), d0(d, d + n);
+    for (bigint j = 0; j < n; j++) {
+        d[j] = d0[order[j]];
+        std::copy(V0.begin() + n * order[j], V0.begin() + n * (order[j] + 1), V + n * j);
+    }
+}
+
+void orthonormalize(bigint M, bigint L, double* Q)
+{
+    //modified Gram-Schmidt, with a second pass for numerical stability.
+    //Columns that are (numerically) in the span of the previous ones are set to zero.
+    for (bigint j = 0; j < L; j++) {
+        double* q = Q + M * j;
+        double norm0 = 0;
+        for (bigint m = 0; m < M; m++)
+            norm0 += q[m] * q[m];
+        for (int pass = 0; pass < 2; pass++) {
+            for (bigint i = 0; i < j; i++) {
+                const double* q0 = Q + M * i;
+                double dp = 0;
+                for (bigint m = 0; m < M; m++)
+                    dp += q0[m] * q[m];
+                for (bigint m = 0; m < M; m++)
+                    q[m] -= dp * q0[m];
+            }
+        }
+        double norm = 0;
+        for (bigint m = 0; m < M; m++)
+            norm += q[m] * q[m];
+        if ((norm == 0) || (norm <= 1e-20 * norm0)) {
+            std::fill(q, q + M, 0);
+            continue;
+        }
+        norm = sqrt(norm);
+        for (bigint m = 0; m < M; m++)
+            q[m] /= norm;
+    }
+}
+
+void normalize_signs(bigint M, bigint K, double* C)
+{
+    //make the entry of largest magnitude positive, so the output doesn't depend on the method
+    for (bigint k = 0; k < K; k++) {
+        double* c = C + M * k;
+        bigint best_m = 0;
+        for (bigint m = 1; m < M; m++) {
+            if (fabs(c[m]) > fabs(c[best_m]))
+                best_m = m;
+        }
+        if ((M) && (c[best_m] < 0)) {
+            for (bigint m = 0; m < M; m++)
+                c[m] = -c[m];
+        }
+    }
+}
+
+bigint choose_block_size(bigint M)
+{
+    //a block of columns should fit comfortably in L2
+    return qMax((bigint)64, (bigint)(64 * 1024) / qMax(M, (bigint)1));
+}
+
+bigint num_partial_sums(bigint num_blocks, bigint partial_size)
+{
+    //The blocks are summed in a fixed number of groups of consecutive blocks, whatever the number of threads,
+    //and the groups are added up in order. So the result (and everything downstream of the features) is the same from run to run.
+    //All the partial sums are held at once, so for many channels there are fewer groups (but the count still depends only on the sizes)
+    bigint budget_bytes = 64 * 1024 * 1024;
+    bigint max_groups = qMax((bigint)1, budget_bytes / qMax((bigint)1, partial_size * (bigint)sizeof(double)));
+    return qMin(num_blocks, qMin((bigint)32, max_groups));
+}
+
+void gemm(bigint M, bigint N, bigint K, const float* A, const float* B, float* C)
+{
+    blas_sgemm(M, N, K, A, B, C, false);
+}
+
+void gemm(bigint M, bigint N, bigint K, const double* A, const double* B, double* C)
+{
+    std::fill(C, C + M * N, 0);
+    for (bigint n = 0; n < N; n++) {
+        double* c = C + M * n;
+        const double* b = B + K * n;
+        for (bigint k = 0; k < K; k++) {
+            const double* a = A + M * k;
+            double bk = b[k];
+#pragma omp simd
+            for (bigint m = 0; m < M; m++)
+                c[m] += a[m] * bk;
+        }
+    }
+}
+
+void syrk_accumulate(bigint M, bigint K, const float* A, double* C)
+{
+    blas_ssyrk_accumulate(M, K, A, C);
+}
+
+void syrk_accumulate(bigint M, bigint K, const double* A, double* C)
+{
+    for (bigint k = 0; k < K; k++) {
+        const double* x = A + M * k;
+        for (bigint m2 = 0; m2 < M; m2++) {
+            double* c = C + M * m2;
+            double y = x[m2];
+#pragma omp simd
+            for (bigint m1 = 0; m1 < M; m1++)
+                c[m1] += x[m1] * y;
+        }
+    }
+}
+}
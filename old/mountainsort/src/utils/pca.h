@@ -10,10 +10,22 @@
 #include "mda.h"
 #include "mda32.h"
 
+struct PcaOpts {
+    enum Method {
+        Auto, // Covariance when M is small compared with the number of components, otherwise Randomized
+        Covariance, // eigendecomposition of X*X'
+        Randomized, // randomized subspace iteration, all components together
+        PowerIteration // the original method: one component at a time with rank-1 deflation (kept for comparison)
+    };
+    Method method = Auto;
+    bigint oversampling = 10; // extra dimensions of the randomized subspace
+    bigint num_power_iterations = 2; // passes of X*X' applied to the randomized subspace
+};
+
 // see info below
-void pca(Mda& components, Mda& features, Mda& sigma, const Mda& X, bigint num_features, bool subtract_mean);
-void pca(Mda32& components, Mda32& features, Mda32& sigma, const Mda32& X, bigint num_features, bool subtract_mean);
-void pca_subsampled(Mda32& components, Mda32& features, Mda32& sigma, const Mda32& X, bigint num_features, bool subtract_mean, bigint max_samples);
+void pca(Mda& components, Mda& features, Mda& sigma, const Mda& X, bigint num_features, bool subtract_mean, const PcaOpts& opts = PcaOpts());
+void pca(Mda32& components, Mda32& features, Mda32& sigma, const Mda32& X, bigint num_features, bool subtract_mean, const PcaOpts& opts = PcaOpts());
+void pca_subsampled(Mda32& components, Mda32& features, Mda32& sigma, const Mda32& X, bigint num_features, bool subtract_mean, bigint max_samples, const PcaOpts& opts = PcaOpts());
 
 // same as pca, except input it X*X', and features are not computed (because how could they be?)
 void pca_from_XXt(Mda& components, Mda& sigma, const Mda& XXt, bigint num_features);
@@ -50,6 +62,10 @@ void pca_unit_test();
 
   sigma(1)>=...>=sigma(K)
 
+  Both Covariance and Randomized work with the full set of K components at once, one pass over
+  blocks of columns of X per product (X*X' or X*X'*Q), multithreaded with OpenMP. The signs of the
+  components are chosen so that the entry of largest magnitude is positive.
+
   if (K=M) then
   C'*C=C*C'=eye(M,M)
   X*X' = C * diag(sigma) * C' is the svd of X*X'
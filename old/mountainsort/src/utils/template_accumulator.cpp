@@ -0,0 +1,349 @@
+/******************************************************
+** See the accompanying README and LICENSE files
+*******************************************************/
+
+#include "template_accumulator.h"
+#include "chunkpipeline.h"
+
+#include <QMutex>
+#include <QThread>
+#include <algorithm>
+#include <map>
+#include <math.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+struct TemplateAccumulatorReservoir {
+    std::vector<std::pair<quint64, bigint> > heap; //(key,slot), max-heap on the key
+    std::vector<float> clips; //one M*T slot per sampled clip
+};
+
+struct TemplateAccumulatorPartial {
+    std::vector<bigint> clusters; //the 0-based cluster of each slot, or empty if slot k is cluster k (all K clusters)
+    std::vector<bigint> counts; //one per slot
+    std::vector<double> means; //M*T per slot
+    std::vector<double> M2s; //M*T per slot, sums of squared deviations from the mean (Welford)
+    std::vector<TemplateAccumulatorReservoir> reservoirs; //one per slot
+};
+
+class TemplateAccumulatorPrivate {
+public:
+    TemplateAccumulator* q;
+    bigint m_M, m_T, m_K;
+    TemplateAccumulatorOpts m_opts;
+    QVector<TemplateAccumulatorPartial> m_partials; //one per thread, allocated on first use
+    TemplateAccumulatorPartial m_result; //the merged partials, after finalize()
+
+    void allocate(TemplateAccumulatorPartial& P, bigint num_slots);
+    void add_clip(TemplateAccumulatorPartial& P, bigint slot, const float* clip, bigint i);
+    void merge(TemplateAccumulatorPartial& A, TemplateAccumulatorPartial& B); //A has all K clusters
+    void add_to_reservoir(TemplateAccumulatorReservoir& R, quint64 key, const float* clip);
+};
+
+namespace TemplateAccumulatorUtil {
+quint64 hash_index(bigint i);
+}
+
+TemplateAccumulator::TemplateAccumulator(bigint M, bigint T, bigint K, const TemplateAccumulatorOpts& opts)
+{
+    d = new TemplateAccumulatorPrivate;
+    d->q = this;
+    d->m_M = M;
+    d->m_T = T;
+    d->m_K = K;
+    d->m_opts = opts;
+    if (d->m_opts.num_threads <= 0)
+        d->m_opts.num_threads = qMax(1, QThread::idealThreadCount());
+    d->m_partials.resize(d->m_opts.num_threads);
+}
+
+TemplateAccumulator::~TemplateAccumulator()
+{
+    delete d;
+}
+
+int TemplateAccumulator::numThreads() const
+{
+    return d->m_opts.num_threads;
+}
+
+void TemplateAccumulator::addClip(const float* clip, bigint k, bigint i, int thread_index)
+{
+    TemplateAccumulatorPartial& P = d->m_partials[thread_index];
+    if (P.counts.empty())
+        d->allocate(P, d->m_K);
+    d->add_clip(P, k - 1, clip, i);
+}
+
+void TemplateAccumulator::addClips(const Mda32& clips, const QVector<int>& labels)
+{
+    bigint MT = d->m_M * d->m_T;
+    const float* ptr = clips.constDataPtr();
+    for (bigint i = 0; i < clips.N3(); i++) {
+        int k = labels[i];
+        if ((k >= 1) && (k <= d->m_K))
+            addClip(ptr + MT * i, k, i);
+    }
+}
+
+bool TemplateAccumulator::addClipsFromTimeseries(const DiskReadMda32& X, const QVector<double>& times, const QVector<bigint>& labels)
+{
+    bigint M = d->m_M;
+    bigint T = d->m_T;
+    bigint N = X.N2();
+    bigint Tmid = (bigint)((T + 1) / 2) - 1;
+
+    //the events to add, sorted by time, so that each chunk handles a contiguous range
+    QVector<bigint> inds, outside_inds;
+    QVector<bigint> event_times(times.count());
+    for (bigint i = 0; i < times.count(); i++) {
+        if (d->m_opts.clip_alignment == TemplateAccumulatorOpts::TruncatedStart)
+            event_times[i] = (bigint)(times[i] - Tmid) + Tmid;
+        else if (d->m_opts.clip_alignment == TemplateAccumulatorOpts::FlooredTime)
+            event_times[i] = (bigint)floor(times[i]);
+        else
+            event_times[i] = (bigint)(times[i] + 0.5);
+        if ((labels[i] < 1) || (labels[i] > d->m_K))
+            continue;
+        if ((event_times[i] >= 0) && (event_times[i] < N))
+            inds << i;
+        else if (!d->m_opts.skip_events_outside)
+            outside_inds << i;
+    }
+
+    //the few events outside X, one read each (zero-padded)
+    foreach (bigint i, outside_inds) {
+        Mda32 clip;
+        if (!X.readChunk(clip, 0, event_times[i] - Tmid, M, T))
+            return false;
+        addClip(clip.constDataPtr(), labels[i], i);
+    }
+    std::stable_sort(inds.begin(), inds.end(), [&event_times](bigint a, bigint b) {
+        return event_times[a] < event_times[b];
+    });
+    QVector<bigint> sorted_times(inds.count());
+    for (bigint j = 0; j < inds.count(); j++)
+        sorted_times[j] = event_times[inds[j]];
+
+    //Each chunk gets its own partial, holding just the clusters that occur in it, and these are merged in chunk order.
+    //So the result does not depend on the number of threads or on which thread handled which chunk.
+    TemplateAccumulatorPartial chunks_result;
+    d->allocate(chunks_result, d->m_K);
+    std::map<bigint, TemplateAccumulatorPartial> pending; //finished chunks waiting for the earlier ones to be merged
+    bigint next_index = 0;
+    QMutex mutex;
+
+    ChunkPipelineOpts pipeline_opts;
+    pipeline_opts.chunk_size = qMax(d->m_opts.chunk_size, 10 * T);
+    pipeline_opts.overlap_size = T;
+    pipeline_opts.num_threads = numThreads();
+    pipeline_opts.verbose = false;
+    ChunkPipeline pipeline(X, pipeline_opts);
+    bool ok = pipeline.run([&](ChunkPipelineChunk& chunk) {
+        bigint j1 = std::lower_bound(sorted_times.begin(), sorted_times.end(), chunk.t1) - sorted_times.begin();
+        bigint j2 = std::lower_bound(sorted_times.begin(), sorted_times.end(), chunk.t1 + chunk.size) - sorted_times.begin();
+        TemplateAccumulatorPartial P;
+        std::vector<bigint> slots(d->m_K, -1);
+        for (bigint j = j1; j < j2; j++) {
+            bigint k = labels[inds[j]] - 1;
+            if (slots[k] < 0) {
+                slots[k] = P.clusters.size();
+                P.clusters.push_back(k);
+            }
+        }
+        d->allocate(P, P.clusters.size());
+        const float* data_ptr = chunk.data.constDataPtr();
+        for (bigint j = j1; j < j2; j++) {
+            //the chunk data starts at timepoint t1-overlap_size
+            bigint offset = sorted_times[j] - Tmid - (chunk.t1 - T);
+            d->add_clip(P, slots[labels[inds[j]] - 1], data_ptr + M * offset, inds[j]);
+        }
+        QMutexLocker locker(&mutex);
+        pending[chunk.index] = std::move(P);
+        while (pending.count(next_index)) {
+            d->merge(chunks_result, pending[next_index]);
+            pending.erase(next_index);
+            next_index++;
+        }
+        return true;
+    });
+    if (!ok)
+        return false;
+    TemplateAccumulatorPartial& P0 = d->m_partials[0];
+    if (P0.counts.empty())
+        d->allocate(P0, d->m_K);
+    d->merge(P0, chunks_result);
+    return true;
+}
+
+bool TemplateAccumulator::addClipsFromTimeseries(const DiskReadMda32& X, const QVector<double>& times, const QVector<int>& labels)
+{
+    QVector<bigint> labels2(labels.count());
+    for (bigint i = 0; i < labels.count(); i++)
+        labels2[i] = labels[i];
+    return addClipsFromTimeseries(X, times, labels2);
+}
+
+void TemplateAccumulator::finalize()
+{
+    d->m_result = TemplateAccumulatorPartial();
+    d->allocate(d->m_result, d->m_K);
+    for (int j = 0; j < d->m_partials.count(); j++) {
+        if (!d->m_partials[j].counts.empty())
+            d->merge(d->m_result, d->m_partials[j]);
+        d->m_partials[j] = TemplateAccumulatorPartial();
+    }
+}
+
+bigint TemplateAccumulator::count(bigint k) const
+{
+    return d->m_result.counts[k - 1];
+}
+
+Mda32 TemplateAccumulator::templates() const
+{
+    Mda32 ret(d->m_M, d->m_T, d->m_K);
+    float* ptr = ret.dataPtr();
+    for (bigint j = 0; j < ret.totalSize(); j++)
+        ptr[j] = d->m_result.means[j];
+    return ret;
+}
+
+Mda32 TemplateAccumulator::stdevs() const
+{
+    bigint MT = d->m_M * d->m_T;
+    Mda32 ret(d->m_M, d->m_T, d->m_K);
+    if (!d->m_opts.compute_stdevs) {
+        qWarning() << "TemplateAccumulator::stdevs() called without compute_stdevs";
+        return ret;
+    }
+    float* ptr = ret.dataPtr();
+    for (bigint k = 0; k < d->m_K; k++) {
+        bigint n = d->m_result.counts[k];
+        if (n > 1) {
+            for (bigint j = MT * k; j < MT * (k + 1); j++)
+                ptr[j] = sqrt(d->m_result.M2s[j] / (n - 1));
+        }
+    }
+    return ret;
+}
+
+Mda32 TemplateAccumulator::medians() const
+{
+    bigint MT = d->m_M * d->m_T;
+    Mda32 ret(d->m_M, d->m_T, d->m_K);
+    float* ptr = ret.dataPtr();
+    for (bigint k = 0; k < d->m_K; k++) {
+        const TemplateAccumulatorReservoir& R = d->m_result.reservoirs[k];
+        bigint n = R.heap.size();
+        if (!n)
+            continue;
+        std::vector<float> vals(n);
+        for (bigint j = 0; j < MT; j++) {
+            for (bigint a = 0; a < n; a++)
+                vals[a] = R.clips[MT * a + j];
+            std::nth_element(vals.begin(), vals.begin() + n / 2, vals.end());
+            double val = vals[n / 2];
+            if (n % 2 == 0)
+                val = (val + *std::max_element(vals.begin(), vals.begin() + n / 2)) / 2;
+            ptr[MT * k + j] = val;
+        }
+    }
+    return ret;
+}
+
+void TemplateAccumulatorPrivate::allocate(TemplateAccumulatorPartial& P, bigint num_slots)
+{
+    bigint MTS = m_M * m_T * num_slots;
+    P.counts.assign(num_slots, 0);
+    P.means.assign(MTS, 0);
+    if (m_opts.compute_stdevs)
+        P.M2s.assign(MTS, 0);
+    if (m_opts.num_median_samples > 0)
+        P.reservoirs.resize(num_slots);
+}
+
+void TemplateAccumulatorPrivate::add_clip(TemplateAccumulatorPartial& P, bigint slot, const float* clip, bigint i)
+{
+    bigint MT = m_M * m_T;
+    bigint n = ++P.counts[slot];
+    double* mean = &P.means[MT * slot];
+    double inv_n = 1.0 / n;
+    if (m_opts.compute_stdevs) {
+        double* M2 = &P.M2s[MT * slot];
+        for (bigint j = 0; j < MT; j++) {
+            double delta = clip[j] - mean[j];
+            mean[j] += delta * inv_n;
+            M2[j] += delta * (clip[j] - mean[j]);
+        }
+    }
+    else {
+        for (bigint j = 0; j < MT; j++) {
+            mean[j] += (clip[j] - mean[j]) * inv_n;
+        }
+    }
+    if (m_opts.num_median_samples > 0)
+        add_to_reservoir(P.reservoirs[slot], TemplateAccumulatorUtil::hash_index(i), clip);
+}
+
+void TemplateAccumulatorPrivate::merge(TemplateAccumulatorPartial& A, TemplateAccumulatorPartial& B)
+{
+    //Chan et al. pairwise combination of the means and the sums of squared deviations
+    bigint MT = m_M * m_T;
+    for (bigint s = 0; s < (bigint)B.counts.size(); s++) {
+        bigint k = B.clusters.empty() ? s : B.clusters[s];
+        double na = A.counts[k], nb = B.counts[s];
+        if (nb == 0)
+            continue;
+        double n = na + nb;
+        double* meanA = &A.means[MT * k];
+        const double* meanB = &B.means[MT * s];
+        for (bigint j = 0; j < MT; j++) {
+            double delta = meanB[j] - meanA[j];
+            if (m_opts.compute_stdevs)
+                A.M2s[MT * k + j] += B.M2s[MT * s + j] + delta * delta * na * nb / n;
+            meanA[j] += delta * nb / n;
+        }
+        A.counts[k] += B.counts[s];
+        if (m_opts.num_median_samples > 0) {
+            const TemplateAccumulatorReservoir& RB = B.reservoirs[s];
+            for (bigint a = 0; a < (bigint)RB.heap.size(); a++) {
+                add_to_reservoir(A.reservoirs[k], RB.heap[a].first, &RB.clips[MT * RB.heap[a].second]);
+            }
+        }
+    }
+}
+
+void TemplateAccumulatorPrivate::add_to_reservoir(TemplateAccumulatorReservoir& R, quint64 key, const float* clip)
+{
+    //keep the clips with the smallest keys
+    bigint MT = m_M * m_T;
+    bigint slot;
+    if ((bigint)R.heap.size() < m_opts.num_median_samples) {
+        slot = R.heap.size();
+        R.clips.resize(MT * (slot + 1));
+    }
+    else if (key < R.heap.front().first) {
+        std::pop_heap(R.heap.begin(), R.heap.end());
+        slot = R.heap.back().second;
+        R.heap.pop_back();
+    }
+    else {
+        return;
+    }
+    memcpy(&R.clips[MT * slot], clip, sizeof(float) * MT);
+    R.heap.push_back(std::make_pair(key, slot));
+    std::push_heap(R.heap.begin(), R.heap.end());
+}
+
+namespace TemplateAccumulatorUtil {
+quint64 hash_index(bigint i)
+{
+    //splitmix64
+    quint64 z = (quint64)i + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+}
@@ -0,0 +1,63 @@
+/******************************************************
+** See the accompanying README and LICENSE files
+*******************************************************/
+
+#ifndef TEMPLATE_ACCUMULATOR_H
+#define TEMPLATE_ACCUMULATOR_H
+
+#include "mda32.h"
+#include "diskreadmda32.h"
+
+struct TemplateAccumulatorOpts {
+    bool compute_stdevs = false;
+    bigint num_median_samples = 0; //if >0, a uniform random sample of this many clips per cluster is kept for medians()
+    int num_threads = 0; //number of threads reading a timeseries (and of per-thread partial accumulators for addClip), 0 means QThread::idealThreadCount()
+    bigint chunk_size = 100000; //timepoints per chunk when streaming through a timeseries
+    //Where clip i starts, with Tmid=(T+1)/2-1 -- each of the older template routines did it its own way
+    enum ClipAlignment {
+        RoundedTime, //round(times[i])-Tmid, as in compute_templates_0
+        TruncatedStart, //(bigint)(times[i]-Tmid), as in p_compute_templates
+        FlooredTime //floor(times[i])-Tmid, as in compute_templates_in_parallel
+    };
+    ClipAlignment clip_alignment = RoundedTime;
+    bool skip_events_outside = false; //skip the events whose time is outside the timeseries rather than adding their zero-padded clips
+};
+
+class TemplateAccumulatorPrivate;
+/**
+ * \class TemplateAccumulator
+ * @brief Single-pass mean (and optionally standard deviation and median) of the M x T clips of each of K clusters.
+ *
+ * The mean and variance are updated online (Welford) in partial accumulators, which are merged by finalize().
+ * When streaming through a timeseries there is one partial per chunk, merged in chunk order, so the result does not depend on the number of threads.
+ * The median sample is a bottom-k sample on a hash of the event index, so it is uniform and does not depend on the number of threads.
+ */
+class TemplateAccumulator {
+public:
+    friend class TemplateAccumulatorPrivate;
+    TemplateAccumulator(bigint M, bigint T, bigint K, const TemplateAccumulatorOpts& opts = TemplateAccumulatorOpts());
+    virtual ~TemplateAccumulator();
+
+    int numThreads() const;
+
+    ///Add the M x T clip of event i to cluster k (1-based). Calls with different thread indices may be concurrent.
+    void addClip(const float* clip, bigint k, bigint i, int thread_index = 0);
+    ///Add the clips of an M x T x L array, skipping labels outside 1..K
+    void addClips(const Mda32& clips, const QVector<int>& labels);
+    ///Read X sequentially in chunks (in parallel) and add the clip of every event with a label in 1..K, placed according to clip_alignment.
+    ///As with readChunk, clips are zero-padded past either end of X (also for events whose time is outside X, unless skip_events_outside).
+    bool addClipsFromTimeseries(const DiskReadMda32& X, const QVector<double>& times, const QVector<bigint>& labels);
+    bool addClipsFromTimeseries(const DiskReadMda32& X, const QVector<double>& times, const QVector<int>& labels);
+
+    ///Merge the per-thread partial results. Call once, after all the clips have been added.
+    void finalize();
+    bigint count(bigint k) const; //k is 1-based
+    Mda32 templates() const; //M x T x K means (zero for empty clusters)
+    Mda32 stdevs() const; //M x T x K sample standard deviations (zero for clusters with fewer than two clips)
+    Mda32 medians() const; //M x T x K medians of the sampled clips
+
+private:
+    TemplateAccumulatorPrivate* d;
+};
+
+#endif // TEMPLATE_ACCUMULATOR_H
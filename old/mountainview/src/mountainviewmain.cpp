@@ -174,10 +174,14 @@ int main(int argc, char* argv[])
     printf("Setting up object registry...\n");
     ObjectRegistry::addAutoReleasedObject(new IIntCounter("allocated_bytes"));
     ObjectRegistry::addAutoReleasedObject(new IIntCounter("freed_bytes"));
+    ObjectRegistry::addAutoReleasedObject(new IIntCounter("arena_reused_bytes"));
     ObjectRegistry::addAutoReleasedObject(new IIntCounter("remote_processing_time"));
     ObjectRegistry::addAutoReleasedObject(new IIntCounter("bytes_downloaded"));
     ObjectRegistry::addAutoReleasedObject(new IIntCounter("bytes_read"));
     ObjectRegistry::addAutoReleasedObject(new IIntCounter("bytes_written"));
+    ObjectRegistry::addAutoReleasedObject(new IIntCounter("bytes_hashed"));
+    ObjectRegistry::addAutoReleasedObject(new IIntCounter("msec_hashing"));
+    ObjectRegistry::addAutoReleasedObject(new IIntCounter("hash_cache_hits"));
 
     QList<ICounterBase*> counters = ObjectRegistry::getObjects<ICounterBase>();
     counterManager->setCounters(counters);
@@ -116,8 +116,13 @@ void MVStatusBar::slot_update_quantities()
             d->m_bytes_allocated_label.setText(txt);
             IIntCounter* allocatedCounter = static_cast<IIntCounter*>(manager->counter("allocated_bytes"));
             IIntCounter* freedCounter = static_cast<IIntCounter*>(manager->counter("freed_bytes"));
-            if (allocatedCounter && freedCounter)
-                d->m_bytes_allocated_label.setToolTip(QString("Allocated: <b>%1</b><br>Freed: <b>%2</b>").arg(format_num_bytes(allocatedCounter->value())).arg(format_num_bytes(freedCounter->value())));
+            IIntCounter* reusedCounter = static_cast<IIntCounter*>(manager->counter("arena_reused_bytes"));
+            if (allocatedCounter && freedCounter) {
+                QString tip = QString("Allocated: <b>%1</b><br>Freed: <b>%2</b>").arg(format_num_bytes(allocatedCounter->value())).arg(format_num_bytes(freedCounter->value()));
+                if (reusedCounter)
+                    tip += QString("<br>Reused: <b>%1</b>").arg(format_num_bytes(reusedCounter->value()));
+                d->m_bytes_allocated_label.setToolTip(tip);
+            }
         }
     }
 }
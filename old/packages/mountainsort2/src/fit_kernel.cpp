@@ -0,0 +1,197 @@
+#include "fit_kernel.h"
+
+#include <algorithm>
+#include <vector>
+
+struct FitKernelTemplate {
+    std::vector<bigint> span_offsets; //offset of each run within the M x T clip
+    std::vector<bigint> span_lengths;
+    std::vector<float> values; //the template values of the runs, packed
+    double norm2 = 0; //squared norm over the mask
+};
+
+class FitKernelPrivate {
+public:
+    FitKernel* q;
+    bigint m_M = 0, m_T = 0;
+    std::vector<FitKernelTemplate> m_templates;
+
+    double inner_product(const float* X_ptr, const FitKernelTemplate& W) const;
+    void subtract(float* X_ptr, const FitKernelTemplate& W, double alpha) const;
+};
+
+FitKernel::FitKernel(const Mda32& templates, const QList<QList<bigint> >& time_channel_mask)
+{
+    d = new FitKernelPrivate;
+    d->q = this;
+    d->m_M = templates.N1();
+    d->m_T = templates.N2();
+    bigint MT = d->m_M * d->m_T;
+    const float* templates_ptr = templates.constDataPtr();
+    d->m_templates.resize(time_channel_mask.count());
+    for (bigint k = 0; k < time_channel_mask.count(); k++) {
+        const QList<bigint>& mask = time_channel_mask[k];
+        const float* template0 = templates_ptr + MT * k;
+        FitKernelTemplate& W = d->m_templates[k];
+        for (bigint j = 0; j < mask.count(); j++) {
+            bigint ii = mask[j];
+            if ((j > 0) && (ii == mask[j - 1] + 1)) {
+                W.span_lengths.back()++;
+            }
+            else {
+                W.span_offsets.push_back(ii);
+                W.span_lengths.push_back(1);
+            }
+            W.values.push_back(template0[ii]);
+            W.norm2 += (double)template0[ii] * template0[ii];
+        }
+    }
+}
+
+FitKernel::~FitKernel()
+{
+    delete d;
+}
+
+QVector<bigint> FitKernel::run(Mda32& X, const QVector<double>& times, const QVector<bigint>& labels) const
+{
+    bigint M = d->m_M;
+    bigint T = d->m_T;
+    bigint N = X.N2();
+    bigint Tmid = (bigint)((T + 1) / 2) - 1;
+    bigint L = times.count();
+    bigint K = d->m_templates.size();
+    float* X_ptr = X.dataPtr();
+
+    //the start of each clip, or -1 if the event can't be used (no template or out of range)
+    std::vector<bigint> clip_starts(L);
+    for (bigint i = 0; i < L; i++) {
+        bigint tt = (bigint)(times[i] - Tmid + 0.5);
+        bool ok = ((labels[i] > 0) && (labels[i] <= K) && (tt >= 0) && (tt + T <= N));
+        clip_starts[i] = ok ? tt : -1;
+    }
+
+    std::vector<double> scores(L, 0);
+    std::vector<char> needs_score(L, 1);
+    std::vector<bigint> event_inds_to_consider;
+    for (bigint i = 0; i < L; i++) {
+        if (clip_starts[i] >= 0)
+            event_inds_to_consider.push_back(i);
+    }
+    QVector<bigint> event_inds_to_use;
+
+    double scale_min = 1, scale_max = 1; //amplitude scaling for template subtraction, as in fit_stage_kernel
+    bool something_changed = true;
+    while (something_changed) {
+        //score (in a batch) the events that overlap something subtracted on the previous pass
+        for (bigint kk = 0; kk < (bigint)event_inds_to_consider.size(); kk++) {
+            bigint i = event_inds_to_consider[kk];
+            if (needs_score[i]) {
+                const FitKernelTemplate& W = d->m_templates[labels[i] - 1];
+                scores[i] = 2 * d->inner_product(X_ptr + M * clip_starts[i], W) - W.norm2;
+                needs_score[i] = 0;
+            }
+        }
+
+        QVector<bigint> inds_to_try;
+        QVector<double> scores_to_try, times_to_try;
+        for (bigint kk = 0; kk < (bigint)event_inds_to_consider.size(); kk++) {
+            bigint i = event_inds_to_consider[kk];
+            if (scores[i] > 0) {
+                inds_to_try << i;
+                scores_to_try << scores[i];
+                times_to_try << times[i];
+            }
+        }
+        QVector<bigint> to_use = P_fit_kernel::find_events_to_use(times_to_try, scores_to_try, T);
+
+        something_changed = false;
+        std::vector<bigint> new_event_inds_to_consider;
+        for (bigint aa = 0; aa < to_use.count(); aa++) {
+            bigint i = inds_to_try[aa];
+            if (!to_use[aa]) {
+                new_event_inds_to_consider.push_back(i);
+                continue;
+            }
+            something_changed = true;
+            const FitKernelTemplate& W = d->m_templates[labels[i] - 1];
+            float* clip_ptr = X_ptr + M * clip_starts[i];
+            double alpha = 1;
+            if (scale_min < scale_max) {
+                if (W.norm2)
+                    alpha = d->inner_product(clip_ptr, W) / W.norm2;
+                alpha = qMin(scale_max, qMax(scale_min, alpha));
+            }
+            d->subtract(clip_ptr, W, alpha);
+            event_inds_to_use << i;
+            //the neighbours whose clips overlap this one need a new score (times is sorted)
+            double t1 = times[i] - (T + 1), t2 = times[i] + (T + 1);
+            bigint j = std::lower_bound(times.begin(), times.end(), t1) - times.begin();
+            for (; (j < L) && (times[j] <= t2); j++) {
+                if ((clip_starts[j] >= 0) && (qAbs(clip_starts[j] - clip_starts[i]) < T))
+                    needs_score[j] = 1;
+            }
+        }
+        event_inds_to_consider = new_event_inds_to_consider;
+    }
+
+    return event_inds_to_use;
+}
+
+double FitKernelPrivate::inner_product(const float* X_ptr, const FitKernelTemplate& W) const
+{
+    double S12 = 0;
+    const float* w = W.values.data();
+    for (bigint s = 0; s < (bigint)W.span_offsets.size(); s++) {
+        const float* x = X_ptr + W.span_offsets[s];
+        bigint n = W.span_lengths[s];
+#pragma omp simd reduction(+ : S12)
+        for (bigint j = 0; j < n; j++) {
+            S12 += (double)x[j] * w[j];
+        }
+        w += n;
+    }
+    return S12;
+}
+
+void FitKernelPrivate::subtract(float* X_ptr, const FitKernelTemplate& W, double alpha) const
+{
+    const float* w = W.values.data();
+    for (bigint s = 0; s < (bigint)W.span_offsets.size(); s++) {
+        float* x = X_ptr + W.span_offsets[s];
+        bigint n = W.span_lengths[s];
+#pragma omp simd
+        for (bigint j = 0; j < n; j++) {
+            x[j] -= alpha * w[j];
+        }
+        w += n;
+    }
+}
+
+namespace P_fit_kernel {
+QVector<bigint> find_events_to_use(const QVector<double>& times, const QVector<double>& scores, bigint clip_size)
+{
+    bigint L = times.count();
+    QVector<bigint> to_use(L, 0);
+    for (bigint i = 0; i < L; i++) {
+        if (scores[i] > 0) {
+            to_use[i] = 1;
+            for (bigint j = i - 1; (j >= 0) && (times[j] >= times[i] - clip_size); j--) {
+                if (scores[j] >= scores[i]) {
+                    to_use[i] = 0;
+                    break;
+                }
+            }
+            if (!to_use[i])
+                continue;
+            for (bigint j = i + 1; (j < L) && (times[j] <= times[i] + clip_size); j++) {
+                if (scores[j] > scores[i]) {
+                    to_use[i] = 0;
+                    break;
+                }
+            }
+        }
+    }
+    return to_use;
+}
+}
@@ -0,0 +1,35 @@
+#ifndef FIT_KERNEL_H
+#define FIT_KERNEL_H
+
+#include "mda32.h"
+
+class FitKernelPrivate;
+/**
+ * \class FitKernel
+ * @brief Greedy template subtraction for fit_stage, working on contiguous spans of the masked template entries.
+ *
+ * Each template's masked (channel,time) entries are stored as runs of consecutive offsets within an M x T clip,
+ * with the template values packed alongside, so scoring and subtraction are contiguous (vectorized) loops.
+ * The score of an event is the decrease in the squared norm over its mask, 2<x,w>-|w|^2.
+ * After each pass, only the events that overlap a subtracted event are re-scored, found by binary search on the times.
+ * The result is the same as P_fit_stage::fit_stage_kernel.
+ */
+class FitKernel {
+public:
+    friend class FitKernelPrivate;
+    ///templates is M x T x K, time_channel_mask[k-1] holds the masked entries (m+M*t) of template k in increasing order
+    FitKernel(const Mda32& templates, const QList<QList<bigint> >& time_channel_mask);
+    virtual ~FitKernel();
+    ///Returns the indices of the events to use, subtracting their templates from X. The times must be sorted and relative to the start of X.
+    QVector<bigint> run(Mda32& X, const QVector<double>& times, const QVector<bigint>& labels) const;
+
+private:
+    FitKernelPrivate* d;
+};
+
+namespace P_fit_kernel {
+///Flags (0 or 1) the events to use: those with a positive score and no nearby event (within clip_size) with a larger score, or an equal one to the left
+QVector<bigint> find_events_to_use(const QVector<double>& times, const QVector<double>& scores, bigint clip_size);
+}
+
+#endif // FIT_KERNEL_H
@@ -1,24 +1,42 @@
 #include "kdtree.h"
 #include "mlcommon.h"
-#include "get_sort_indices.h"
+
+#include <algorithm>
+#include <vector>
+
+struct KdTreeNode {
+    int i1 = 0, i2 = 0; //the range of points (in tree order) belonging to this node
+    int children[3] = { -1, -1, -1 }; //left, center, right; -1 for a leaf
+    float cutoff_1 = 0;
+    float cutoff_2 = 0;
+    bigint direction_offset = 0; //into m_directions
+    float direction_normsqr = 0;
+};
+
+struct KdTreeCandidate {
+    double distsqr;
+    int pos; //position in tree order
+    bool operator<(const KdTreeCandidate& other) const
+    {
+        if (distsqr != other.distsqr)
+            return distsqr < other.distsqr;
+        return pos < other.pos;
+    }
+};
 
 class KdTreePrivate {
 public:
     KdTree* q;
 
-    QList<int> m_leaf_indices;
-    KdTree* m_left_tree = 0;
-    KdTree* m_center_tree = 0;
-    KdTree* m_right_tree = 0;
-    float m_cutoff_1 = 0;
-    float m_cutoff_2 = 0;
-    QVector<float> m_projection_direction;
-    int m_num_datapoints = 0;
-
-    void create(const Mda32& X, const QList<int>& indices);
-    static QVector<float> get_projection_direction(const Mda32& X);
+    int m_M = 0;
+    std::vector<KdTreeNode> m_nodes; //m_nodes[0] is the root
+    std::vector<int> m_indices; //original index of the point at each tree position
+    std::vector<float> m_points; //M x N, the points in tree order
+    std::vector<float> m_directions; //M per internal node
+
+    void get_projection_direction(float* ret, const KdTreeNode& node);
+    void find_candidates(std::vector<KdTreeCandidate>& candidates, const float* p, int K, int exhaustive_search_num, int node_index) const;
     static double compute_distsqr(int M, const float* x, const float* y);
-    static QList<int> find_closest_K_candidates(const Mda32& X, const QVector<float>& p, int K, const QList<int>& indices);
 };
 
 KdTree::KdTree()
@@ -29,152 +47,234 @@ KdTree::KdTree()
 
 KdTree::~KdTree()
 {
-    if (d->m_left_tree)
-        delete d->m_left_tree;
-    if (d->m_center_tree)
-        delete d->m_center_tree;
-    if (d->m_right_tree)
-        delete d->m_right_tree;
     delete d;
 }
 
 void KdTree::create(const Mda32& X)
 {
-    QList<int> indices;
-    for (int i = 0; i < X.N2(); i++)
-        indices << i;
-    d->create(X, indices);
-}
+    int M = X.N1();
+    int N = X.N2();
+    d->m_M = M;
+    d->m_nodes.clear();
+    d->m_directions.clear();
+    d->m_indices.resize(N);
+    for (int i = 0; i < N; i++)
+        d->m_indices[i] = i;
+    if (!N) {
+        d->m_points.clear();
+        return;
+    }
 
-QList<int> KdTree::allIndices() const
-{
-    if ((!d->m_left_tree) && (!d->m_center_tree) && (!d->m_right_tree)) {
-        //leaf node
-        return d->m_leaf_indices;
+    //Built one level at a time: the projections of all points of the level are computed in one parallel loop,
+    //then the nodes of the level are split in parallel (each owns a disjoint range of m_indices)
+    const int min_bucket_size = 8; //smaller nodes are left as leaves and searched exhaustively
+    const float* ptr = X.constDataPtr();
+    std::vector<float> vals(N);
+    std::vector<int> node_of_position(N, 0);
+    KdTreeNode root;
+    root.i1 = 0;
+    root.i2 = N;
+    d->m_nodes.push_back(root);
+    std::vector<int> level;
+    if (N > min_bucket_size)
+        level.push_back(0);
+    else
+        std::fill(node_of_position.begin(), node_of_position.end(), -1);
+    while (!level.empty()) {
+        for (size_t a = 0; a < level.size(); a++) {
+            KdTreeNode& node = d->m_nodes[level[a]];
+            node.direction_offset = d->m_directions.size();
+            d->m_directions.resize(d->m_directions.size() + M);
+            d->get_projection_direction(&d->m_directions[node.direction_offset], node);
+            node.direction_normsqr = MLCompute::dotProduct(M, &d->m_directions[node.direction_offset], &d->m_directions[node.direction_offset]);
+        }
+#pragma omp parallel for
+        for (int i = 0; i < N; i++) {
+            int nn = node_of_position[i];
+            if (nn >= 0)
+                vals[i] = MLCompute::dotProduct(M, &d->m_directions[d->m_nodes[nn].direction_offset], &ptr[d->m_indices[i] * (bigint)M]);
+        }
+        std::vector<int> counts(level.size() * 3);
+#pragma omp parallel for schedule(dynamic)
+        for (int a = 0; a < (int)level.size(); a++) {
+            KdTreeNode& node = d->m_nodes[level[a]];
+            int n = node.i2 - node.i1;
+            //the cutoffs are the 3/7 and 4/7 quantiles
+            std::vector<float> vals_sorted(vals.begin() + node.i1, vals.begin() + node.i2);
+            std::nth_element(vals_sorted.begin(), vals_sorted.begin() + n * 3 / 7, vals_sorted.end());
+            node.cutoff_1 = vals_sorted[n * 3 / 7];
+            std::nth_element(vals_sorted.begin() + n * 3 / 7, vals_sorted.begin() + n * 4 / 7, vals_sorted.end());
+            node.cutoff_2 = vals_sorted[n * 4 / 7];
+            //stable three-way partition of the range
+            std::vector<int> parts[3];
+            std::vector<float> part_vals[3];
+            for (int i = node.i1; i < node.i2; i++) {
+                int b = (vals[i] < node.cutoff_1) ? 0 : ((vals[i] < node.cutoff_2) ? 1 : 2);
+                parts[b].push_back(d->m_indices[i]);
+                part_vals[b].push_back(vals[i]);
+            }
+            int i0 = node.i1;
+            for (int b = 0; b < 3; b++) {
+                std::copy(parts[b].begin(), parts[b].end(), d->m_indices.begin() + i0);
+                i0 += parts[b].size();
+                counts[3 * a + b] = parts[b].size();
+            }
+        }
+        //if one of the parts is empty then the node is effectively a leaf
+        std::vector<int> next_level;
+        for (size_t a = 0; a < level.size(); a++) {
+            int nn = level[a];
+            int* cc = &counts[3 * a];
+            if ((!cc[0]) || (!cc[1]) || (!cc[2])) {
+                std::fill(node_of_position.begin() + d->m_nodes[nn].i1, node_of_position.begin() + d->m_nodes[nn].i2, -1);
+                continue;
+            }
+            int i0 = d->m_nodes[nn].i1;
+            for (int b = 0; b < 3; b++) {
+                KdTreeNode child;
+                child.i1 = i0;
+                child.i2 = i0 + cc[b];
+                i0 = child.i2;
+                d->m_nodes[nn].children[b] = d->m_nodes.size();
+                d->m_nodes.push_back(child);
+                int child_index = d->m_nodes[nn].children[b];
+                bool split_child = (cc[b] > min_bucket_size);
+                std::fill(node_of_position.begin() + child.i1, node_of_position.begin() + child.i2, split_child ? child_index : -1);
+                if (split_child)
+                    next_level.push_back(child_index);
+            }
+        }
+        level.swap(next_level);
     }
-    else {
-        QList<int> ret;
-        if (d->m_left_tree)
-            ret.append(d->m_left_tree->allIndices());
-        if (d->m_center_tree)
-            ret.append(d->m_center_tree->allIndices());
-        if (d->m_right_tree)
-            ret.append(d->m_right_tree->allIndices());
-        return ret;
+
+    d->m_points.resize(M * (bigint)N);
+#pragma omp parallel for
+    for (int i = 0; i < N; i++) {
+        std::copy(ptr + d->m_indices[i] * (bigint)M, ptr + (d->m_indices[i] + 1) * (bigint)M, d->m_points.begin() + i * (bigint)M);
     }
 }
 
-void KdTreePrivate::create(const Mda32& X, const QList<int>& indices)
+QList<int> KdTree::allIndices() const
 {
-    if (indices.isEmpty())
-        return;
-
-    m_num_datapoints = indices.count();
-
-    int M = X.N1();
-    //define the projection direction
-    m_projection_direction = get_projection_direction(X);
-    //compute the inner product of the points with the projection direction
-    const float* ptr = X.constDataPtr();
-    QVector<float> vals(indices.count());
-    for (int i = 0; i < indices.count(); i++) {
-        vals[i] = MLCompute::dotProduct(M, m_projection_direction.data(), &ptr[indices[i] * M]);
-    }
-    //sort the values and create the cutoff as the median value
-    QVector<float> vals_sorted = vals;
-    qSort(vals_sorted);
-    m_cutoff_1 = vals_sorted.value(vals_sorted.count() * 3 / 7);
-    m_cutoff_2 = vals_sorted.value(vals_sorted.count() * 4 / 7);
-    //decide which points go to the left and right
-    QList<int> indices_left;
-    QList<int> indices_center;
-    QList<int> indices_right;
-    for (int i = 0; i < indices.count(); i++) {
-        if (vals.value(i) < m_cutoff_1)
-            indices_left << indices[i];
-        else if (vals.value(i) < m_cutoff_2)
-            indices_center << indices[i];
-        else
-            indices_right << indices[i];
-    }
-    //if one of these is the empty set, then we are done -- effectively a leaf node
-    if ((indices_left.isEmpty()) || (indices_center.isEmpty()) || (indices_right.isEmpty())) {
-        m_leaf_indices = indices;
-        return;
-    }
-    //create the left and right trees
-    m_left_tree = new KdTree;
-    m_left_tree->d->create(X, indices_left);
-    m_center_tree = new KdTree;
-    m_center_tree->d->create(X, indices_center);
-    m_right_tree = new KdTree;
-    m_right_tree->d->create(X, indices_right);
+    QList<int> ret;
+    for (size_t i = 0; i < d->m_indices.size(); i++)
+        ret << d->m_indices[i];
+    return ret;
 }
 
-QList<int> KdTreePrivate::find_closest_K_candidates(const Mda32& X, const QVector<float>& p, int K, const QList<int>& indices)
+QList<int> KdTree::findApproxKNearestNeighbors(const Mda32& X, const QVector<float>& p, int K, int exhaustive_search_num) const
 {
-    int M = X.N1();
-    const float* ptr = X.constDataPtr();
-    int num = indices.count(); //should be same as m_num_datapoints
-    QVector<double> distsqrs(num);
-    for (int i = 0; i < num; i++) {
-        distsqrs[i] = compute_distsqr(M, p.data(), &ptr[indices[i] * M]);
-    }
-    QList<int> inds = get_sort_indices(distsqrs);
+    Q_UNUSED(X)
     QList<int> ret;
-    for (int i = 0; (i < inds.count()) && (i < K); i++) {
-        ret << indices[inds[i]];
+    if (d->m_nodes.empty())
+        return ret;
+    std::vector<KdTreeCandidate> candidates;
+    d->find_candidates(candidates, p.data(), K, exhaustive_search_num, 0);
+    for (size_t i = 0; i < candidates.size(); i++)
+        ret << d->m_indices[candidates[i].pos];
+    return ret;
+}
+
+QVector<int> KdTree::findApproxKNearestNeighborsOfAllPoints(int K, int exhaustive_search_num) const
+{
+    int M = d->m_M;
+    int N = d->m_indices.size();
+    QVector<int> ret(K * N, -1);
+    if (d->m_nodes.empty())
+        return ret;
+    int* ret_ptr = ret.data();
+#pragma omp parallel
+    {
+        std::vector<KdTreeCandidate> candidates;
+        candidates.reserve(3 * K + exhaustive_search_num);
+        //in tree order, so that consecutive queries touch the same nodes
+#pragma omp for schedule(dynamic, 64)
+        for (int i = 0; i < N; i++) {
+            candidates.clear();
+            d->find_candidates(candidates, &d->m_points[i * (bigint)M], K, exhaustive_search_num, 0);
+            int* r = ret_ptr + K * (bigint)d->m_indices[i];
+            for (size_t a = 0; a < candidates.size(); a++)
+                r[a] = d->m_indices[candidates[a].pos];
+        }
     }
     return ret;
 }
 
-QList<int> KdTree::findApproxKNearestNeighbors(const Mda32& X, const QVector<float>& p, int K, int exhaustive_search_num) const
+void KdTreePrivate::find_candidates(std::vector<KdTreeCandidate>& candidates, const float* p, int K, int exhaustive_search_num, int node_index) const
 {
-    int M = X.N1();
-    //const float *ptr=X.constDataPtr();
-    if ((d->m_num_datapoints <= exhaustive_search_num) || (!d->m_left_tree) || (!d->m_right_tree) || (!d->m_center_tree)) {
-        //we are now going to do an exaustive search
-        QList<int> indices = allIndices();
-        return d->find_closest_K_candidates(X, p, K, indices);
+    //appends the (at most K) closest points found under the node to candidates, closest first.
+    //The children append theirs to the same buffer, so a query doesn't allocate once the buffer has grown
+    const KdTreeNode& node = m_nodes[node_index];
+    size_t start = candidates.size();
+    if ((node.i2 - node.i1 <= exhaustive_search_num) || (node.children[0] < 0)) {
+        //exhaustive search, keeping the K closest in a max-heap
+        for (int i = node.i1; i < node.i2; i++) {
+            KdTreeCandidate cc;
+            cc.distsqr = compute_distsqr(m_M, p, &m_points[i * (bigint)m_M]);
+            cc.pos = i;
+            if ((int)(candidates.size() - start) < K) {
+                candidates.push_back(cc);
+                std::push_heap(candidates.begin() + start, candidates.end());
+            }
+            else if (cc < candidates[start]) {
+                std::pop_heap(candidates.begin() + start, candidates.end());
+                candidates.back() = cc;
+                std::push_heap(candidates.begin() + start, candidates.end());
+            }
+        }
+        std::sort_heap(candidates.begin() + start, candidates.end());
+        return;
     }
     else {
-        float val = MLCompute::dotProduct(M, p.data(), d->m_projection_direction.data());
-        QList<int> candidates;
-        if (val < d->m_cutoff_1) {
-            candidates.append(d->m_left_tree->findApproxKNearestNeighbors(X, p, K, exhaustive_search_num));
-            candidates.append(d->m_center_tree->findApproxKNearestNeighbors(X, p, K, exhaustive_search_num));
+        float val = MLCompute::dotProduct(m_M, p, &m_directions[node.direction_offset]);
+        //the nearest part first, then the neighboring part(s) of the original three-way scheme. A part can be
+        //skipped when the K candidates so far are all closer than any of its points can be: the distance to a
+        //point is at least the difference in projections divided by the norm of the direction
+        int order[3];
+        double gaps[3];
+        int num_parts = 0;
+        if (val < node.cutoff_1) {
+            order[num_parts] = 0, gaps[num_parts++] = 0;
+            order[num_parts] = 1, gaps[num_parts++] = node.cutoff_1 - val;
         }
-        else if (val < d->m_cutoff_2) {
-            candidates.append(d->m_left_tree->findApproxKNearestNeighbors(X, p, K, exhaustive_search_num));
-            candidates.append(d->m_center_tree->findApproxKNearestNeighbors(X, p, K, exhaustive_search_num));
-            candidates.append(d->m_right_tree->findApproxKNearestNeighbors(X, p, K, exhaustive_search_num));
+        else if (val < node.cutoff_2) {
+            order[num_parts] = 1, gaps[num_parts++] = 0;
+            order[num_parts] = 0, gaps[num_parts++] = val - node.cutoff_1;
+            order[num_parts] = 2, gaps[num_parts++] = node.cutoff_2 - val;
         }
         else {
-            candidates.append(d->m_right_tree->findApproxKNearestNeighbors(X, p, K, exhaustive_search_num));
-            candidates.append(d->m_right_tree->findApproxKNearestNeighbors(X, p, K, exhaustive_search_num));
+            order[num_parts] = 2, gaps[num_parts++] = 0;
+            order[num_parts] = 1, gaps[num_parts++] = val - node.cutoff_2;
+        }
+        for (int a = 0; a < num_parts; a++) {
+            if ((int)(candidates.size() - start) >= K) {
+                if (node.direction_normsqr * candidates[start + K - 1].distsqr < gaps[a] * gaps[a])
+                    continue;
+            }
+            find_candidates(candidates, p, K, exhaustive_search_num, node.children[order[a]]);
+            if ((int)(candidates.size() - start) > K) {
+                std::partial_sort(candidates.begin() + start, candidates.begin() + start + K, candidates.end());
+                candidates.resize(start + K);
+            }
+            else {
+                std::sort(candidates.begin() + start, candidates.end());
+            }
         }
-        return d->find_closest_K_candidates(X, p, K, candidates);
     }
 }
 
-QVector<float> KdTreePrivate::get_projection_direction(const Mda32& X)
+void KdTreePrivate::get_projection_direction(float* ret, const KdTreeNode& node)
 {
-    int M = X.N1();
-    QVector<float> ret(M);
-    for (int i = 0; i < M; i++) {
-        double randval = (qrand() % RAND_MAX) * 1.0 / RAND_MAX;
+    //random direction, seeded from the node's range (unique per node) so that the tree
+    //doesn't depend on the order in which the nodes are built
+    quint64 state = ((quint64)node.i1 << 32) ^ (quint64)node.i2 ^ 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < m_M; i++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        double randval = (state >> 11) * (1.0 / 9007199254740992.0);
         ret[i] = randval * 2 - 1;
     }
-    return ret;
-    /*
-    Mda32 CC, FF, sig;
-    pca(CC, FF, sig, X, 1, false);
-    QVector<float> ret;
-    for (int i = 0; i < X.N1(); i++)
-        ret << CC.value(i);
-    return ret;
-    */
 }
+
 double KdTreePrivate::compute_distsqr(int M, const float* x, const float* y)
 {
     double ret = 0;
@@ -3,6 +3,15 @@
 
 #include "mda32.h"
 
+/*
+  Approximate K-nearest-neighbor search over the columns of an MxN matrix.
+
+  Each node splits its points into three parts at the 3/7 and 4/7 quantiles of a random projection,
+  and a query descends into the part(s) near its own projection, searching exhaustively once a node
+  holds at most exhaustive_search_num points. The tree is stored flat: the points are copied in tree
+  order so every node (in particular every leaf bucket) is a contiguous range.
+*/
+
 class KdTreePrivate;
 class KdTree {
 public:
@@ -11,7 +20,10 @@ public:
     virtual ~KdTree();
     void create(const Mda32& X);
     QList<int> allIndices() const;
+    //X must be the matrix the tree was created from. Returns up to K indices, closest first
     QList<int> findApproxKNearestNeighbors(const Mda32& X, const QVector<float>& p, int K, int exhaustive_search_num) const;
+    //the above for every point of the tree at once, in parallel. Returns KxN indices (column i for point i, closest first, padded with -1)
+    QVector<int> findApproxKNearestNeighborsOfAllPoints(int K, int exhaustive_search_num) const;
 
 private:
     KdTreePrivate* d;
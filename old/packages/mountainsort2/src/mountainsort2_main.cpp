@@ -13,7 +13,9 @@
 #include "p_extract_neighborhood_timeseries.h"
 #include "p_extract_segment_timeseries.h"
 #include "p_bandpass_filter.h"
+#include "p_bandpass_filter_stream.h"
 #include "p_detect_events.h"
+#include "p_filter_whiten_detect.h"
 #include "p_extract_clips.h"
 #include "p_sort_clips.h"
 #include "p_consolidate_clusters.h"
@@ -33,8 +35,12 @@
 #include "p_extract_time_interval.h"
 #include "p_isolation_metrics.h"
 #include "p_generate_background_dataset.h"
+#include "p_benchmarks.h"
 
 #include "omp.h"
+#include "mdaarena.h"
+#include "icounter.h"
+#include "objectregistry.h"
 #include "p_confusion_matrix.h"
 
 QJsonObject get_spec()
@@ -80,6 +86,17 @@ QJsonObject get_spec()
         X.addOptionalParameter("testcode", "", "");
         processors.push_back(X.get_spec());
     }
+    {
+        ProcessorSpec X("mountainsort.bandpass_filter_stream", "0.1");
+        X.addInputs("timeseries");
+        X.addOutputs("timeseries_out");
+        X.addRequiredParameters("samplerate", "freq_min", "freq_max");
+        X.addOptionalParameter("method", "iir or fir", "iir");
+        X.addOptionalParameter("filter_order", "", 4);
+        X.addOptionalParameter("fir_length", "0 means automatic", 0);
+        X.addOptionalParameter("quantization_unit", "", 0);
+        processors.push_back(X.get_spec());
+    }
     {
         ProcessorSpec X("mountainsort.whiten", "0.1");
         X.addInputs("timeseries");
@@ -120,6 +137,18 @@ QJsonObject get_spec()
         X.addOptionalParameter("subsample_factor", "", 1);
         processors.push_back(X.get_spec());
     }
+    {
+        ProcessorSpec X("mountainsort.filter_whiten_detect", "0.1");
+        X.addInputs("timeseries");
+        X.addOutputs("timeseries_out", "event_times_out");
+        X.addRequiredParameters("samplerate", "freq_min", "freq_max");
+        X.addOptionalParameter("freq_wid", "", 1000);
+        X.addOptionalParameter("whitening_subsample_size", "Number of timepoints used to estimate the covariance", 1e6);
+        X.addOptionalParameter("quantization_unit", "", 0);
+        X.addRequiredParameters("central_channel", "detect_threshold", "detect_interval", "sign");
+        X.addOptionalParameter("subsample_factor", "", 1);
+        processors.push_back(X.get_spec());
+    }
     {
         ProcessorSpec X("mountainsort.extract_clips", "0.11");
         X.addInputs("timeseries", "event_times");
@@ -140,6 +169,7 @@ QJsonObject get_spec()
         ProcessorSpec X("mountainsort.sort_clips", "0.11a");
         X.addInputs("clips");
         X.addOutputs("labels_out");
+        X.setMemoryEstimate(0.2, 3); //the clips, the reshaped subsets and the features
         //X.addRequiredParameters();
         processors.push_back(X.get_spec());
     }
@@ -156,6 +186,7 @@ QJsonObject get_spec()
         X.addOutputs("labels_out");
         X.addRequiredParameters("central_channel");
         X.addOptionalParameter("consolidation_factor", "", 0.9);
+        X.setMemoryEstimate(0.2, 2);
         processors.push_back(X.get_spec());
     }
     {
@@ -209,6 +240,8 @@ QJsonObject get_spec()
         X.addOutputs("metrics_out");
         X.addOptionalOutputs("pair_metrics_out");
         X.addOptionalParameter("compute_bursting_parents", "", "false");
+        X.addOptionalParameter("cache_dir", "", "");
+        X.setMemoryEstimate(1.5); //mostly the sampled clip cache (clip_cache_mb)
         processors.push_back(X.get_spec());
     }
     {
@@ -260,6 +293,35 @@ QJsonObject get_spec()
         X.addOptionalParameters("num_read_bytes", "num_write_bytes", "num_cpu_ops");
         processors.push_back(X.get_spec());
     }
+    {
+        ProcessorSpec X("mountainsort.benchmark_read_backends", "0.1");
+        X.addInputs("timeseries");
+        X.addOutputs("stats_out");
+        X.addOptionalParameter("clip_size", "", 50);
+        X.addOptionalParameter("num_clips", "", 10000);
+        X.addOptionalParameter("chunk_size", "", 20000);
+        X.addOptionalParameter("chunk_overlap", "", 2000);
+        processors.push_back(X.get_spec());
+    }
+    {
+        ProcessorSpec X("mountainsort.benchmark_fit_kernel", "0.1");
+        X.addOutputs("stats_out");
+        X.addOptionalParameter("M", "", 16);
+        X.addOptionalParameter("clip_size", "", 50);
+        X.addOptionalParameter("K", "", 20);
+        X.addOptionalParameter("N", "", 1000000);
+        X.addOptionalParameter("num_events", "", 10000);
+        processors.push_back(X.get_spec());
+    }
+    {
+        ProcessorSpec X("mountainsort.benchmark_pca", "0.1");
+        X.addOutputs("stats_out");
+        X.addOptionalParameter("M", "", 200);
+        X.addOptionalParameter("N", "", 100000);
+        X.addOptionalParameter("K", "", 10);
+        X.addOptionalParameter("rank", "", 15);
+        processors.push_back(X.get_spec());
+    }
     {
         ProcessorSpec X("mountainsort.misc_test", "0.1");
         X.addInput("dir");
@@ -301,21 +363,10 @@ QJsonObject get_spec()
     return ret;
 }
 
-int main(int argc, char* argv[])
+static int run_processor(const CLParams& CLP)
 {
-    QCoreApplication app(argc, argv);
-
-    CLParams CLP(argc, argv);
-
     QString arg1 = CLP.unnamed_parameters.value(0);
 
-    if (arg1 == "spec") {
-        QJsonObject spec = get_spec();
-        QString json = QJsonDocument(spec).toJson(QJsonDocument::Indented);
-        printf("%s\n", json.toUtf8().data());
-        return 0;
-    }
-
     bool ret = false;
 
     if (CLP.named_parameters.contains("_request_num_threads")) {
@@ -326,6 +377,15 @@ int main(int argc, char* argv[])
         }
     }
 
+    if (CLP.named_parameters.contains("_mda_arena_mb")) {
+        //opt-in pooling of the Mda/Mda32 buffers, with the given limit (in MB) per thread
+        double arena_mb = CLP.named_parameters.value("_mda_arena_mb", 0).toDouble();
+        if (arena_mb > 0) {
+            MdaArena::setMaxCachedBytesPerThread((bigint)(arena_mb * 1024 * 1024));
+            MdaArena::setEnabled(true);
+        }
+    }
+
     if (arg1 == "mountainsort.extract_neighborhood_timeseries") {
         QString timeseries = CLP.named_parameters["timeseries"].toString();
         QString timeseries_out = CLP.named_parameters["timeseries_out"].toString();
@@ -373,6 +433,19 @@ int main(int argc, char* argv[])
         opts.testcode = CLP.named_parameters.value("testcode", "").toString();
         ret = p_bandpass_filter(timeseries, timeseries_out, opts);
     }
+    else if (arg1 == "mountainsort.bandpass_filter_stream") {
+        QString timeseries = CLP.named_parameters["timeseries"].toString();
+        QString timeseries_out = CLP.named_parameters["timeseries_out"].toString();
+        Bandpass_filter_stream_opts opts;
+        opts.samplerate = CLP.named_parameters["samplerate"].toDouble();
+        opts.freq_min = CLP.named_parameters["freq_min"].toDouble();
+        opts.freq_max = CLP.named_parameters["freq_max"].toDouble();
+        opts.method = CLP.named_parameters.value("method", "iir").toString();
+        opts.filter_order = CLP.named_parameters.value("filter_order", 4).toInt();
+        opts.fir_length = CLP.named_parameters.value("fir_length", 0).toInt();
+        opts.quantization_unit = CLP.named_parameters.value("quantization_unit").toDouble();
+        ret = p_bandpass_filter_stream(timeseries, timeseries_out, opts);
+    }
     else if (arg1 == "mountainsort.whiten") {
         QString timeseries = CLP.named_parameters["timeseries"].toString();
         QString timeseries_out = CLP.named_parameters["timeseries_out"].toString();
@@ -415,6 +488,24 @@ int main(int argc, char* argv[])
         opts.subsample_factor = CLP.named_parameters["subsample_factor"].toDouble();
         ret = p_detect_events(timeseries, event_times_out, opts);
     }
+    else if (arg1 == "mountainsort.filter_whiten_detect") {
+        QString timeseries = CLP.named_parameters["timeseries"].toString();
+        QString timeseries_out = CLP.named_parameters["timeseries_out"].toString();
+        QString event_times_out = CLP.named_parameters["event_times_out"].toString();
+        P_filter_whiten_detect_opts opts;
+        opts.samplerate = CLP.named_parameters["samplerate"].toDouble();
+        opts.freq_min = CLP.named_parameters["freq_min"].toDouble();
+        opts.freq_max = CLP.named_parameters["freq_max"].toDouble();
+        opts.freq_wid = CLP.named_parameters.value("freq_wid", 1000).toDouble();
+        opts.whitening_subsample_size = CLP.named_parameters.value("whitening_subsample_size", 1e6).toDouble();
+        opts.quantization_unit = CLP.named_parameters.value("quantization_unit").toDouble();
+        opts.central_channel = CLP.named_parameters["central_channel"].toInt();
+        opts.detect_threshold = CLP.named_parameters["detect_threshold"].toDouble();
+        opts.detect_interval = CLP.named_parameters["detect_interval"].toDouble();
+        opts.sign = CLP.named_parameters["sign"].toInt();
+        opts.subsample_factor = CLP.named_parameters.value("subsample_factor", 1).toDouble();
+        ret = p_filter_whiten_detect(timeseries, timeseries_out, event_times_out, opts);
+    }
     else if (arg1 == "mountainsort.extract_clips") {
         QStringList timeseries_list = MLUtil::toStringList(CLP.named_parameters["timeseries"]);
         QString event_times = CLP.named_parameters["event_times"].toString();
@@ -511,6 +602,8 @@ int main(int argc, char* argv[])
         QString pair_metrics_out = CLP.named_parameters["pair_metrics_out"].toString();
         P_isolation_metrics_opts opts;
         opts.compute_bursting_parents = (CLP.named_parameters["compute_bursting_parents"].toString() == "true");
+        //if a cache_dir is given, re-runs during curation only recompute the clusters that changed (the caller owns and cleans up that directory)
+        opts.cache_dir = CLP.named_parameters.value("cache_dir").toString();
         ret = p_isolation_metrics(timeseries_list, firings, metrics_out, pair_metrics_out, opts);
     }
     else if (arg1 == "mountainsort.combine_cluster_metrics") {
@@ -556,6 +649,35 @@ int main(int argc, char* argv[])
         opts.num_write_bytes = CLP.named_parameters["num_write_bytes"].toDouble();
         ret = p_load_test(stats_out, opts);
     }
+    else if (arg1 == "mountainsort.benchmark_read_backends") {
+        QString timeseries = CLP.named_parameters["timeseries"].toString();
+        QString stats_out = CLP.named_parameters["stats_out"].toString();
+        P_benchmark_read_backends_opts opts;
+        opts.clip_size = CLP.named_parameters.value("clip_size", 50).toDouble();
+        opts.num_clips = CLP.named_parameters.value("num_clips", 10000).toDouble();
+        opts.chunk_size = CLP.named_parameters.value("chunk_size", 20000).toDouble();
+        opts.chunk_overlap = CLP.named_parameters.value("chunk_overlap", 2000).toDouble();
+        ret = p_benchmark_read_backends(timeseries, stats_out, opts);
+    }
+    else if (arg1 == "mountainsort.benchmark_fit_kernel") {
+        QString stats_out = CLP.named_parameters["stats_out"].toString();
+        P_benchmark_fit_kernel_opts opts;
+        opts.M = CLP.named_parameters.value("M", 16).toDouble();
+        opts.clip_size = CLP.named_parameters.value("clip_size", 50).toDouble();
+        opts.K = CLP.named_parameters.value("K", 20).toDouble();
+        opts.N = CLP.named_parameters.value("N", 1000000).toDouble();
+        opts.num_events = CLP.named_parameters.value("num_events", 10000).toDouble();
+        ret = p_benchmark_fit_kernel(stats_out, opts);
+    }
+    else if (arg1 == "mountainsort.benchmark_pca") {
+        QString stats_out = CLP.named_parameters["stats_out"].toString();
+        P_benchmark_pca_opts opts;
+        opts.M = CLP.named_parameters.value("M", 200).toDouble();
+        opts.N = CLP.named_parameters.value("N", 100000).toDouble();
+        opts.K = CLP.named_parameters.value("K", 10).toDouble();
+        opts.rank = CLP.named_parameters.value("rank", 15).toDouble();
+        ret = p_benchmark_pca(stats_out, opts);
+    }
     else if (arg1 == "mountainsort.misc_test") {
         QString dir = CLP.named_parameters["dir"].toString();
         QString info_out = CLP.named_parameters["info_out"].toString();
@@ -606,12 +728,72 @@ int main(int argc, char* argv[])
         return -1;
     }
 
+    if (MdaArena::isEnabled()) {
+        qDebug().noquote() << QString("Mda arena: reused %1 of %2 MB allocated").arg(MdaArena::reusedBytes() * 1.0 / (1024 * 1024), 0, 'f', 1).arg(MdaArena::acquiredBytes() * 1.0 / (1024 * 1024), 0, 'f', 1);
+    }
+
     if (!ret)
         return -1;
 
     return 0;
 }
 
+#ifdef MOUNTAINSORT2_PLUGIN
+
+extern "C" {
+
+Q_DECL_EXPORT const char* mountainprocess_plugin_spec()
+{
+    static QByteArray json = QJsonDocument(get_spec()).toJson(QJsonDocument::Indented);
+    return json.constData();
+}
+
+Q_DECL_EXPORT int mountainprocess_plugin_run(int argc, char* argv[])
+{
+    //runs on a worker thread of mountainprocess, which may run other processors on it later
+    CLParams CLP(argc, argv);
+    int ret = run_processor(CLP);
+    if (MdaArena::isEnabled()) {
+        MdaArena::releaseThreadCache();
+        MdaArena::setEnabled(false);
+    }
+    return ret;
+}
+}
+
+#else
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    CLParams CLP(argc, argv);
+
+    QString arg1 = CLP.unnamed_parameters.value(0);
+
+    if (arg1 == "spec") {
+        QJsonObject spec = get_spec();
+        QString json = QJsonDocument(spec).toJson(QJsonDocument::Indented);
+        printf("%s\n", json.toUtf8().data());
+        return 0;
+    }
+
+    if (CLP.named_parameters.value("_mda_arena_mb", 0).toDouble() > 0) {
+        //run_processor enables the arena, so register the counter that the Mda buffers report their reuse to
+        ObjectRegistry registry;
+        CounterManager* counterManager = new CounterManager;
+        registry.addAutoReleasedObject(counterManager);
+        IIntCounter* reusedCounter = new IIntCounter("arena_reused_bytes");
+        registry.addAutoReleasedObject(reusedCounter);
+        counterManager->addCounter(reusedCounter);
+        return run_processor(CLP);
+    }
+
+    return run_processor(CLP);
+}
+
+#endif
+
 QJsonObject ProcessorSpecFile::get_spec()
 {
     QJsonObject ret;
@@ -747,6 +929,12 @@ void ProcessorSpec::addOptionalParameter(QString name, QString description, QVar
     parameters.append(X);
 }
 
+void ProcessorSpec::setMemoryEstimate(double base_gb, double per_input_gb)
+{
+    memory_base_gb = base_gb;
+    memory_per_input_gb = per_input_gb;
+}
+
 QJsonObject ProcessorSpec::get_spec()
 {
     QJsonObject ret;
@@ -768,6 +956,12 @@ QJsonObject ProcessorSpec::get_spec()
         parameters0.push_back(parameters[i].get_spec());
     }
     ret["parameters"] = parameters0;
+    if ((memory_base_gb) || (memory_per_input_gb)) {
+        QJsonObject memory_estimate;
+        memory_estimate["base_gb"] = memory_base_gb;
+        memory_estimate["per_input_gb"] = memory_per_input_gb;
+        ret["memory_estimate"] = memory_estimate;
+    }
     ret["exe_command"] = qApp->applicationFilePath() + " " + processor_name + " $(arguments)";
     return ret;
 }
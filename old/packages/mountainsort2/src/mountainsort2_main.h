@@ -41,6 +41,9 @@ struct ProcessorSpec {
     QList<ProcessorSpecFile> inputs;
     QList<ProcessorSpecFile> outputs;
     QList<ProcessorSpecParam> parameters;
+    //optional estimate of the peak memory, base_gb + per_input_gb * (total size of the input files in GB), used by the daemon's scheduler
+    double memory_base_gb = 0;
+    double memory_per_input_gb = 0;
 
     void addInputs(QString name1, QString name2 = "", QString name3 = "", QString name4 = "", QString name5 = "");
     void addOptionalInputs(QString name1, QString name2 = "", QString name3 = "", QString name4 = "", QString name5 = "");
@@ -53,6 +56,7 @@ struct ProcessorSpec {
 
     void addInput(QString name, QString description = "", bool optional = false);
     void addOutput(QString name, QString description = "", bool optional = false);
+    void setMemoryEstimate(double base_gb, double per_input_gb = 0);
 
     QJsonObject get_spec();
 };
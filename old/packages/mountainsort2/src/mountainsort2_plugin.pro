@@ -0,0 +1,13 @@
+#The same processors as mountainsort2.mp, as a library that mountainprocess can load
+#to run them in-process (see processorplugin.h in mlcommon)
+
+include(mountainsort2.pri)
+
+DEFINES += MOUNTAINSORT2_PLUGIN
+
+DESTDIR = ../bin
+OBJECTS_DIR = ../build_plugin
+MOC_DIR=../build_plugin
+TARGET = mountainsort2_plugin
+TEMPLATE = lib
+CONFIG += plugin
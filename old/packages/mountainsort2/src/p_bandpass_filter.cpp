@@ -3,15 +3,19 @@
 #include <QTime>
 #include <diskreadmda32.h>
 #include <diskwritemda.h>
+#include <chunkpipeline.h>
 #include "omp.h"
 #include "fftw3.h"
 #include <QFile>
 #include <QFileInfo>
 #include <QCoreApplication>
+#include <unistd.h>
+#include "mlcommon.h"
 
 namespace P_bandpass_filter {
 void define_kernel(bigint N, double* kernel, double samplefreq, double freq_min, double freq_max, double freq_wid);
 void multiply_by_factor(bigint N, float* X, double factor);
+QString fftw_wisdom_path();
 struct Kernel_runner {
     Kernel_runner()
     {
@@ -19,74 +23,76 @@ struct Kernel_runner {
 
     ~Kernel_runner()
     {
-        fftw_free(data_in);
-        fftw_free(data_out);
+        fftwf_free(data_in);
+        fftwf_free(data_out);
         free(kernel0);
-        //delete p_fft;
-        //delete p_ifft;
+        //the plans are destroyed in the main thread (see destroy_plans), since the fftw planner is not thread-safe
     }
+    //must be called from one thread at a time (fftw planning is not thread-safe)
     void init(bigint M_in, bigint N_in, double samplerate, double freq_min, double freq_max, double freq_wid)
     {
         M = M_in;
         N = N_in;
         MN = M * N;
-        /*
-        p_fft=new fftw_plan; //this nonsense is necessary because we cannot instantiate fftw plans in multiple threads simultaneously
-        p_ifft=new fftw_plan;
-        */
+        N2 = N / 2 + 1; //real-to-complex: only the non-negative frequencies are stored
 
-        data_in = (fftw_complex*)fftw_malloc(sizeof(fftw_complex) * MN);
-        data_out = (fftw_complex*)fftw_malloc(sizeof(fftw_complex) * MN);
-        kernel0 = (double*)malloc(sizeof(double) * N);
+        data_in = (float*)fftwf_malloc(sizeof(float) * MN);
+        data_out = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * M * N2);
+        kernel0 = (float*)malloc(sizeof(float) * N2);
 
-        define_kernel(N, kernel0, samplerate, freq_min, freq_max, freq_wid);
+        //the kernel is real and symmetric, so we only need the half-spectrum. Fold the 1/N normalization into it.
+        double* kernel_full = (double*)malloc(sizeof(double) * N);
+        define_kernel(N, kernel_full, samplerate, freq_min, freq_max, freq_wid);
+        for (bigint i = 0; i < N2; i++) {
+            kernel0[i] = kernel_full[i] / N;
+        }
+        free(kernel_full);
 
-        bigint rank = 1;
+        //the chunk is M x N column-major, so channel m is the strided sequence m, m+M, m+2M, ...
+        int rank = 1;
         int n[] = { (int)N };
-        bigint howmany = M;
-        int* inembed = n;
-        bigint istride = M;
-        bigint idist = 1;
-        int* onembed = n;
-        bigint ostride = M;
-        bigint odist = 1;
-        unsigned flags = FFTW_ESTIMATE;
-        p_fft = fftw_plan_many_dft(rank, n, howmany, data_in, inembed, istride, idist, data_out, onembed, ostride, odist, FFTW_FORWARD, flags);
-        p_ifft = fftw_plan_many_dft(rank, n, howmany, data_out, inembed, istride, idist, data_in, onembed, ostride, odist, FFTW_BACKWARD, flags);
+        int nhat[] = { (int)N2 };
+        int howmany = M;
+        int stride = M;
+        int dist = 1;
+        //FFTW_MEASURE is cheap once the wisdom has been saved from a previous run
+        unsigned flags = FFTW_MEASURE;
+        p_fft = fftwf_plan_many_dft_r2c(rank, n, howmany, data_in, n, stride, dist, data_out, nhat, stride, dist, flags);
+        p_ifft = fftwf_plan_many_dft_c2r(rank, n, howmany, data_out, nhat, stride, dist, data_in, n, stride, dist, flags);
+    }
+    void destroy_plans()
+    {
+        fftwf_destroy_plan(p_fft);
+        fftwf_destroy_plan(p_ifft);
     }
     void apply(Mda32& chunk)
     {
         //set input data
-        for (bigint i = 0; i < MN; i++) {
-            data_in[i][0] = chunk.get(i);
-            data_in[i][1] = 0;
-        }
+        memcpy(data_in, chunk.constDataPtr(), sizeof(float) * MN);
         //fft
-        fftw_execute(p_fft);
+        fftwf_execute(p_fft);
         //multiply by kernel
-        double factor = 1.0 / N;
         bigint aa = 0;
-        for (bigint i = 0; i < N; i++) {
+        for (bigint i = 0; i < N2; i++) {
+            float k0 = kernel0[i];
             for (bigint m = 0; m < M; m++) {
-                data_out[aa][0] *= kernel0[i] * factor;
-                data_out[aa][1] *= kernel0[i] * factor;
+                data_out[aa][0] *= k0;
+                data_out[aa][1] *= k0;
                 aa++;
             }
         }
-        fftw_execute(p_ifft);
+        fftwf_execute(p_ifft);
         //set the output data
-        for (bigint i = 0; i < MN; i++) {
-            chunk.set(data_in[i][0], i);
-        }
+        memcpy(chunk.dataPtr(), data_in, sizeof(float) * MN);
     }
 
     bigint M;
-    bigint N, MN;
-    fftw_complex* data_in;
-    fftw_complex* data_out;
-    double* kernel0;
-    fftw_plan p_fft;
-    fftw_plan p_ifft;
+    bigint N, N2, MN;
+    float* data_in;
+    fftwf_complex* data_out;
+    float* kernel0;
+    fftwf_plan p_fft;
+    fftwf_plan p_ifft;
 };
 Mda32 bandpass_filter_kernel(Mda32& X, double samplerate, double freq_min, double freq_max, double freq_wid);
 }
@@ -116,81 +122,137 @@ bool p_bandpass_filter(QString timeseries, QString timeseries_out, Bandpass_filt
     }
     DiskWriteMda Y(dtype, timeseries_out, M, N);
 
-    QTime timer_status;
-    timer_status.start();
-
     bigint num_threads = omp_get_max_threads();
 
-    //bigint memory_size = 0.1 * 1e9;
-    //bigint chunk_size = memory_size * 1.0 / (M * 4 * num_threads);
-    //chunk_size = qMin(N * 1.0, qMax(1e4 * 1.0, chunk_size * 1.0));
-    //bigint overlap_size = chunk_size / 5;
-
-    bigint chunk_size = 20000;
-    bigint overlap_size = 2000;
+    bigint chunk_size, overlap_size;
+    P_bandpass_filter::choose_chunk_size(M, N, num_threads, chunk_size, overlap_size);
     printf("************+++ Using chunk size / overlap size: %ld / %ld (num threads=%ld)\n", chunk_size, overlap_size, num_threads);
     qDebug().noquote() << "samplerate/freq_min/freq_max/freq_wid:" << opts.samplerate << opts.freq_min << opts.freq_max << opts.freq_wid;
 
-    bool ret = true;
-#pragma omp parallel
-    {
-        // one kernel runner for each parallel thread so they don't intersect
-        P_bandpass_filter::Kernel_runner KR;
-#pragma omp critical(lock1)
-        {
-            KR.init(M, chunk_size + 2 * overlap_size, opts.samplerate, opts.freq_min, opts.freq_max, opts.freq_wid);
+    ChunkPipelineOpts pipeline_opts;
+    pipeline_opts.chunk_size = chunk_size;
+    pipeline_opts.overlap_size = overlap_size;
+    pipeline_opts.num_threads = num_threads;
+    ChunkPipeline pipeline(X, pipeline_opts);
+    if (do_write)
+        pipeline.setOutput(&Y);
+
+    // one kernel runner for each pipeline thread so they don't intersect
+    QList<P_bandpass_filter::Kernel_runner*> runners = P_bandpass_filter::create_kernel_runners(num_threads, M, chunk_size + 2 * overlap_size, opts.samplerate, opts.freq_min, opts.freq_max, opts.freq_wid);
+    bool nokernel = opts.testcode.split(",").contains("nokernel");
+
+    bool ret = pipeline.run([&](ChunkPipelineChunk& chunk) {
+        if (!nokernel) {
+            P_bandpass_filter::apply_kernel_runner(runners[chunk.thread_index], chunk.data);
+            //chunk.data = P_bandpass_filter::bandpass_filter_kernel(chunk.data, opts.samplerate, opts.freq_min, opts.freq_max, opts.freq_wid);
         }
-        bigint num_timepoints_handled = 0;
-#pragma omp for
-        for (bigint timepoint = 0; timepoint < N; timepoint += chunk_size) {
-            Mda32 chunk;
-#pragma omp critical(lock1)
-            {
-                if (!X.readChunk(chunk, 0, timepoint - overlap_size, M, chunk_size + 2 * overlap_size)) {
-                    qWarning() << "Error reading chunk";
-                    ret = false;
-                }
-            }
-            if (!opts.testcode.split(",").contains("nokernel")) {
-                QTime kernel_timer;
-                kernel_timer.start();
-                KR.apply(chunk);
-                //chunk = P_bandpass_filter::bandpass_filter_kernel(chunk, opts.samplerate, opts.freq_min, opts.freq_max, opts.freq_wid);
-                //qDebug().noquote() << "Kernel timer elapsed: " << kernel_timer.elapsed() << " for chunk at " << timepoint << " of " << N;
+        if (do_write) {
+            chunk.data.getChunk(chunk.output, 0, overlap_size, M, chunk.size);
+            if (opts.quantization_unit) {
+                P_bandpass_filter::multiply_by_factor(chunk.output.totalSize(), chunk.output.dataPtr(), 1.0 / opts.quantization_unit);
             }
-            Mda32 chunk2;
-            {
-                chunk.getChunk(chunk2, 0, overlap_size, M, chunk_size);
-            }
-#pragma omp critical(lock1)
-            {
-                {
-                    if (do_write) {
-                        if (opts.quantization_unit) {
-                            P_bandpass_filter::multiply_by_factor(chunk2.totalSize(), chunk2.dataPtr(), 1.0 / opts.quantization_unit);
-                        }
-                        if (!Y.writeChunk(chunk2, 0, timepoint)) {
-                            qWarning() << "Error writing chunk";
-                            ret = false;
-                        }
-                    }
-                }
-                num_timepoints_handled += qMin((bigint)chunk_size, N - timepoint);
-                if ((timer_status.elapsed() > 5000) || (num_timepoints_handled == N) || (timepoint == 0)) {
-                    printf("%ld/%ld (%d%%) -- using %d threads.\n",
-                        num_timepoints_handled, N,
-                        (int)(num_timepoints_handled * 1.0 / N * 100),
-                        omp_get_num_threads());
-                    timer_status.restart();
-                }
+        }
+        return true;
+    });
+    P_bandpass_filter::free_kernel_runners(runners);
+
+    return ret;
+}
+
+namespace P_bandpass_filter {
+
+bigint next_fast_fft_size(bigint n)
+{
+    //smallest size >= n of the form 2^a 3^b 5^c 7^d, for which fftw is fastest
+    bigint best = 1;
+    while (best < n)
+        best *= 2;
+    for (bigint p7 = 1; p7 < best; p7 *= 7) {
+        for (bigint p5 = p7; p5 < best; p5 *= 5) {
+            for (bigint p3 = p5; p3 < best; p3 *= 3) {
+                bigint val = p3;
+                while (val < n)
+                    val *= 2;
+                if (val < best)
+                    best = val;
             }
         }
     }
+    return best;
+}
 
+bigint cache_size_bytes(int name, bigint default_size)
+{
+    long ret = sysconf(name);
+    if (ret <= 0)
+        return default_size;
     return ret;
 }
 
-namespace P_bandpass_filter {
+void choose_chunk_size(bigint M, bigint N, bigint num_threads, bigint& chunk_size, bigint& overlap_size)
+{
+    //Each kernel thread works on M x L floats plus M x (L/2+1) complex floats, where L = chunk_size + 2 * overlap_size.
+    //Pick L so that this fits in the thread's share of L3 (but at least L2), while keeping the overlap
+    //a small enough fraction of the chunk that we are not wasting most of our time on it.
+    overlap_size = 2000;
+    bigint L2 = cache_size_bytes(_SC_LEVEL2_CACHE_SIZE, 1024 * 1024);
+    bigint L3 = cache_size_bytes(_SC_LEVEL3_CACHE_SIZE, 8 * 1024 * 1024);
+    bigint budget = qMax(L2, L3 / qMax(num_threads, (bigint)1));
+    bigint bytes_per_timepoint = M * (sizeof(float) + sizeof(fftwf_complex) / 2);
+    bigint L = budget / qMax(bytes_per_timepoint, (bigint)1);
+    L = qMax(L, 8 * overlap_size); //at least 75% of each transform is useful output
+    L = qMin(L, (bigint)(1 << 18));
+    L = next_fast_fft_size(L);
+    chunk_size = L - 2 * overlap_size;
+    if (chunk_size > N) {
+        chunk_size = qMax(N, (bigint)1);
+    }
+}
+
+QString fftw_wisdom_path()
+{
+    return MLUtil::tempPath() + "/fftwf_wisdom.txt";
+}
+
+QList<Kernel_runner*> create_kernel_runners(bigint num_threads, bigint M, bigint N, double samplerate, double freq_min, double freq_max, double freq_wid)
+{
+    // (created up front, because we cannot instantiate fftw plans in multiple threads simultaneously)
+    QString wisdom_path = fftw_wisdom_path();
+    bool have_wisdom = fftwf_import_wisdom_from_filename(wisdom_path.toUtf8().data());
+    QList<Kernel_runner*> runners;
+    for (bigint j = 0; j < num_threads; j++) {
+        Kernel_runner* KR = new Kernel_runner;
+        KR->init(M, N, samplerate, freq_min, freq_max, freq_wid);
+        runners << KR;
+    }
+    {
+        //save the (possibly extended) wisdom for next time. Write to a temporary file first since other processes may be reading it.
+        QString tmp_path = wisdom_path + QString(".%1.tmp").arg(QCoreApplication::applicationPid());
+        if (fftwf_export_wisdom_to_filename(tmp_path.toUtf8().data())) {
+            QFile::remove(wisdom_path);
+            if (!QFile::rename(tmp_path, wisdom_path))
+                QFile::remove(tmp_path);
+        }
+        else {
+            qWarning() << "Unable to save fftw wisdom to" << tmp_path << "(had wisdom:" << have_wisdom << ")";
+        }
+    }
+    return runners;
+}
+
+void apply_kernel_runner(Kernel_runner* KR, Mda32& chunk)
+{
+    KR->apply(chunk);
+}
+
+void free_kernel_runners(QList<Kernel_runner*>& runners)
+{
+    foreach (Kernel_runner* KR, runners) {
+        KR->destroy_plans();
+    }
+    qDeleteAll(runners);
+    runners.clear();
+}
 
 void multiply_by_factor(bigint N, float* X, double factor)
 {
@@ -2,6 +2,8 @@
 #define P_BANDPASS_FILTER_H
 
 #include <QString>
+#include "mlcommon.h"
+#include "mda32.h"
 
 struct Bandpass_filter_opts {
     double samplerate = 0;
@@ -14,4 +16,15 @@ struct Bandpass_filter_opts {
 
 bool p_bandpass_filter(QString timeseries, QString timeseries_out, Bandpass_filter_opts opts);
 
+//For processors that run the same filter on their own chunks (see p_filter_whiten_detect)
+namespace P_bandpass_filter {
+struct Kernel_runner;
+//chunks are chunk_size + 2 * overlap_size timepoints, of which the middle chunk_size are kept
+void choose_chunk_size(bigint M, bigint N, bigint num_threads, bigint& chunk_size, bigint& overlap_size);
+//one runner per thread, each filtering M x N chunks in place. Create and free them all from one thread (fftw planning is not thread-safe)
+QList<Kernel_runner*> create_kernel_runners(bigint num_threads, bigint M, bigint N, double samplerate, double freq_min, double freq_max, double freq_wid);
+void apply_kernel_runner(Kernel_runner* KR, Mda32& chunk);
+void free_kernel_runners(QList<Kernel_runner*>& runners);
+}
+
 #endif // P_BANDPASS_FILTER_H
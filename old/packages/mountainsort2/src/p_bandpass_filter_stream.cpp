@@ -0,0 +1,358 @@
+#include "p_bandpass_filter_stream.h"
+
+#include <QTime>
+#include <QFile>
+#include <QFileInfo>
+#include <diskreadmda32.h>
+#include <diskwritemda.h>
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include "omp.h"
+
+namespace P_bandpass_filter_stream {
+struct Biquad {
+    //normalized so that a0=1
+    double b0 = 1, b1 = 0, b2 = 0, a1 = 0, a2 = 0;
+};
+QList<Biquad> design_butterworth_bandpass(double samplerate, double freq_min, double freq_max, int order);
+bigint iir_settle_length(const QList<Biquad>& sections, double tol);
+QVector<float> design_fir_bandpass(double samplerate, double freq_min, double freq_max, bigint length);
+void iir_filter(const QList<Biquad>& sections, bigint M, bigint N, float* X, double* state, bool reverse);
+void fir_filter(const QVector<float>& h, bigint M, bigint num_out, const float* X, float* Y);
+bigint choose_chunk_size(bigint M);
+void multiply_by_factor(bigint N, float* X, double factor);
+bool run_iir(const DiskReadMda32& X, DiskWriteMda& Y, const Bandpass_filter_stream_opts& opts);
+bool run_fir(const DiskReadMda32& X, DiskWriteMda& Y, const Bandpass_filter_stream_opts& opts);
+}
+
+bool p_bandpass_filter_stream(QString timeseries, QString timeseries_out, Bandpass_filter_stream_opts opts)
+{
+    if (opts.freq_max == 0) {
+        return QFile::copy(timeseries, timeseries_out);
+    }
+
+    DiskReadMda32 X;
+    if (QFileInfo(timeseries).isDir())
+        X.setConcatDirectory(2, timeseries);
+    else
+        X.setPath(timeseries);
+    //a single pass from start to end, so map the file and tell the kernel to read ahead (and drop pages behind)
+    X.setMemoryMapped(true);
+    X.setAccessPattern(DiskReadMda32::SequentialAccess);
+
+    const bigint M = X.N1();
+    const bigint N = X.N2();
+
+    bigint dtype = MDAIO_TYPE_FLOAT32;
+    if (opts.quantization_unit) {
+        dtype = MDAIO_TYPE_INT16;
+    }
+    DiskWriteMda Y(dtype, timeseries_out, M, N);
+
+    qDebug().noquote() << "method/samplerate/freq_min/freq_max:" << opts.method << opts.samplerate << opts.freq_min << opts.freq_max;
+
+    bool ret;
+    if (opts.method == "iir") {
+        ret = P_bandpass_filter_stream::run_iir(X, Y, opts);
+    }
+    else if (opts.method == "fir") {
+        ret = P_bandpass_filter_stream::run_fir(X, Y, opts);
+    }
+    else {
+        qWarning() << "Unrecognized filter method: " + opts.method;
+        return false;
+    }
+    Y.close();
+
+    return ret;
+}
+
+namespace P_bandpass_filter_stream {
+
+bool run_iir(const DiskReadMda32& X, DiskWriteMda& Y, const Bandpass_filter_stream_opts& opts)
+{
+    bigint M = X.N1();
+    bigint N = X.N2();
+
+    QList<Biquad> sections = design_butterworth_bandpass(opts.samplerate, opts.freq_min, opts.freq_max, opts.filter_order);
+    bigint S = sections.count();
+
+    //The forward pass is exact across chunk boundaries (the state carries over).
+    //The backward pass of chunk k needs the forward output of the beginning of chunk k+1, long enough for the
+    //filter response to die out, so we hold one chunk back and only ever read each timepoint once.
+    bigint lookahead = iir_settle_length(sections, 1e-6);
+    bigint chunk_size = qMax(choose_chunk_size(M), lookahead);
+    printf("Using chunk size / lookahead: %ld / %ld (%ld biquad sections)\n", chunk_size, lookahead, S);
+
+    std::vector<double> forward_state(2 * S * M, 0);
+    std::vector<double> backward_state(2 * S * M, 0);
+    double factor = 1;
+    if (opts.quantization_unit)
+        factor = 1.0 / opts.quantization_unit;
+
+    QTime timer;
+    timer.start();
+    Mda32 prev; //forward filtered, waiting for the next chunk
+    bigint prev_t1 = 0, prev_size = 0;
+    bigint num_chunks = (N + chunk_size - 1) / chunk_size;
+    //one extra iteration at the end to flush the last chunk
+    for (bigint k = 0; k <= num_chunks; k++) {
+        bigint t1 = k * chunk_size;
+        bigint size = 0;
+        Mda32 cur;
+        if (k < num_chunks) {
+            size = qMin(chunk_size, N - t1);
+            if (!X.readChunk(cur, 0, t1, M, size)) {
+                qWarning() << "Problem reading chunk in bandpass_filter_stream";
+                return false;
+            }
+            iir_filter(sections, M, size, cur.dataPtr(), forward_state.data(), false);
+        }
+        if (prev_size) {
+            bigint L = qMin(lookahead, size);
+            Mda32 buf(M, prev_size + L);
+            memcpy(buf.dataPtr(), prev.constDataPtr(), sizeof(float) * M * prev_size);
+            if (L)
+                memcpy(buf.dataPtr() + M * prev_size, cur.constDataPtr(), sizeof(float) * M * L);
+            std::fill(backward_state.begin(), backward_state.end(), 0);
+            iir_filter(sections, M, prev_size + L, buf.dataPtr(), backward_state.data(), true);
+            Mda32 out;
+            buf.getChunk(out, 0, 0, M, prev_size);
+            if (factor != 1)
+                multiply_by_factor(out.totalSize(), out.dataPtr(), factor);
+            if (!Y.writeChunk(out, 0, prev_t1)) {
+                qWarning() << "Problem writing chunk in bandpass_filter_stream";
+                return false;
+            }
+            if ((timer.elapsed() > 5000) || (prev_t1 + prev_size == N)) {
+                printf("%ld/%ld (%d%%)\n", prev_t1 + prev_size, N, (int)((prev_t1 + prev_size) * 1.0 / N * 100));
+                timer.restart();
+            }
+        }
+        prev = cur;
+        prev_t1 = t1;
+        prev_size = size;
+    }
+
+    return true;
+}
+
+bool run_fir(const DiskReadMda32& X, DiskWriteMda& Y, const Bandpass_filter_stream_opts& opts)
+{
+    bigint M = X.N1();
+    bigint N = X.N2();
+
+    bigint K = opts.fir_length;
+    if (K <= 0) {
+        //hamming window: transition width is about 3.3*samplerate/K
+        double transition_width = (opts.freq_min > 0) ? opts.freq_min : opts.freq_max / 4;
+        K = (bigint)ceil(3.3 * opts.samplerate / transition_width);
+        if (K > 4001) {
+            qWarning() << "Limiting fir length to 4001 (was" << K << ")";
+            K = 4001;
+        }
+    }
+    if (K % 2 == 0)
+        K++;
+    QVector<float> h = design_fir_bandpass(opts.samplerate, opts.freq_min, opts.freq_max, K);
+    bigint delay = (K - 1) / 2; //linear phase: compensated by shifting the output
+
+    bigint chunk_size = choose_chunk_size(M);
+    printf("Using chunk size / fir length: %ld / %ld\n", chunk_size, K);
+
+    double factor = 1;
+    if (opts.quantization_unit)
+        factor = 1.0 / opts.quantization_unit;
+
+    //overlap-save: the first K-1 columns of ext hold the last K-1 input timepoints of the previous chunk (zeros before the start)
+    Mda32 ext(M, K - 1 + chunk_size);
+    Mda32 out(M, chunk_size);
+    QTime timer;
+    timer.start();
+    //feed delay timepoints past the end (readChunk zero-pads) to flush the filter
+    for (bigint t1 = 0; t1 < N + delay; t1 += chunk_size) {
+        bigint size = qMin(chunk_size, N + delay - t1);
+        Mda32 in;
+        if (!X.readChunk(in, 0, t1, M, size)) {
+            qWarning() << "Problem reading chunk in bandpass_filter_stream";
+            return false;
+        }
+        memcpy(ext.dataPtr() + M * (K - 1), in.constDataPtr(), sizeof(float) * M * size);
+        //output column c is timepoint t1+c-delay
+        fir_filter(h, M, size, ext.constDataPtr(), out.dataPtr());
+        bigint c0 = qMax((bigint)0, delay - t1);
+        if (c0 < size) {
+            Mda32 out0;
+            out.getChunk(out0, 0, c0, M, size - c0);
+            if (factor != 1)
+                multiply_by_factor(out0.totalSize(), out0.dataPtr(), factor);
+            if (!Y.writeChunk(out0, 0, t1 + c0 - delay)) {
+                qWarning() << "Problem writing chunk in bandpass_filter_stream";
+                return false;
+            }
+        }
+        memmove(ext.dataPtr(), ext.constDataPtr() + M * size, sizeof(float) * M * (K - 1));
+        if ((timer.elapsed() > 5000) || (t1 + size == N + delay)) {
+            bigint num_done = qMin(N, t1 + size);
+            printf("%ld/%ld (%d%%)\n", num_done, N, (int)(num_done * 1.0 / N * 100));
+            timer.restart();
+        }
+    }
+
+    return true;
+}
+
+QList<Biquad> design_butterworth_bandpass(double samplerate, double freq_min, double freq_max, int order)
+{
+    //cascade of second-order sections with the butterworth Q factors (bilinear transform, RBJ cookbook formulas)
+    int num_sections = qMax(1, (order + 1) / 2);
+    int n = 2 * num_sections;
+    QList<Biquad> ret;
+    for (int pass = 0; pass < 2; pass++) {
+        bool highpass = (pass == 0);
+        double f0 = highpass ? freq_min : freq_max;
+        if ((f0 <= 0) || (f0 >= samplerate / 2))
+            continue;
+        double w0 = 2 * M_PI * f0 / samplerate;
+        double cosw0 = cos(w0);
+        for (int k = 0; k < num_sections; k++) {
+            double Q = 1.0 / (2 * cos(M_PI * (2 * k + 1) / (2 * n)));
+            double alpha = sin(w0) / (2 * Q);
+            double a0 = 1 + alpha;
+            Biquad B;
+            if (highpass) {
+                B.b0 = (1 + cosw0) / 2 / a0;
+                B.b1 = -(1 + cosw0) / a0;
+                B.b2 = (1 + cosw0) / 2 / a0;
+            }
+            else {
+                B.b0 = (1 - cosw0) / 2 / a0;
+                B.b1 = (1 - cosw0) / a0;
+                B.b2 = (1 - cosw0) / 2 / a0;
+            }
+            B.a1 = -2 * cosw0 / a0;
+            B.a2 = (1 - alpha) / a0;
+            ret << B;
+        }
+    }
+    return ret;
+}
+
+bigint iir_settle_length(const QList<Biquad>& sections, double tol)
+{
+    //number of samples for the slowest pole to decay to tol
+    double rmax = 0;
+    foreach (Biquad B, sections) {
+        double disc = B.a1 * B.a1 - 4 * B.a2;
+        double r;
+        if (disc < 0)
+            r = sqrt(B.a2);
+        else
+            r = qMax(fabs((-B.a1 + sqrt(disc)) / 2), fabs((-B.a1 - sqrt(disc)) / 2));
+        rmax = qMax(rmax, r);
+    }
+    bigint max_len = 1e6;
+    if (rmax <= 0)
+        return 1;
+    if (rmax >= 1)
+        return max_len;
+    //factor 2 to account for the cascade of sections sharing similar poles
+    double len = 2 * log(tol) / log(rmax);
+    return qMax((bigint)1, qMin(max_len, (bigint)ceil(len)));
+}
+
+QVector<float> design_fir_bandpass(double samplerate, double freq_min, double freq_max, bigint length)
+{
+    //hamming-windowed sinc: lowpass at freq_max minus lowpass at freq_min
+    QVector<float> h(length);
+    bigint D = (length - 1) / 2;
+    double f1 = freq_min / samplerate;
+    double f2 = freq_max / samplerate;
+    for (bigint i = 0; i < length; i++) {
+        double n = i - D;
+        double lp2 = (n == 0) ? 2 * f2 : sin(2 * M_PI * f2 * n) / (M_PI * n);
+        double lp1 = (n == 0) ? 2 * f1 : sin(2 * M_PI * f1 * n) / (M_PI * n);
+        double w = 0.54 - 0.46 * cos(2 * M_PI * i / (length - 1));
+        h[i] = (lp2 - lp1) * w;
+    }
+    return h;
+}
+
+void iir_filter(const QList<Biquad>& sections, bigint M, bigint N, float* X, double* state, bool reverse)
+{
+    //transposed direct form II, sample-major: the inner loop runs across channels so it vectorizes.
+    //state holds z1,z2 (each of length M) for each section and carries over between calls.
+    bigint S = sections.count();
+    std::vector<double> coeffs;
+    foreach (Biquad B, sections) {
+        coeffs.push_back(B.b0);
+        coeffs.push_back(B.b1);
+        coeffs.push_back(B.b2);
+        coeffs.push_back(B.a1);
+        coeffs.push_back(B.a2);
+    }
+    //split the channels among the threads in blocks that are a multiple of the vector width
+    bigint num_threads = omp_get_max_threads();
+    bigint block_size = qMax((bigint)16, (((M + num_threads - 1) / num_threads + 15) / 16) * 16);
+#pragma omp parallel for
+    for (bigint m1 = 0; m1 < M; m1 += block_size) {
+        bigint m2 = qMin(M, m1 + block_size);
+        for (bigint ii = 0; ii < N; ii++) {
+            bigint t = reverse ? (N - 1 - ii) : ii;
+            float* x = X + M * t;
+            for (bigint s = 0; s < S; s++) {
+                const double b0 = coeffs[5 * s], b1 = coeffs[5 * s + 1], b2 = coeffs[5 * s + 2], a1 = coeffs[5 * s + 3], a2 = coeffs[5 * s + 4];
+                double* z1 = state + (2 * s) * M;
+                double* z2 = state + (2 * s + 1) * M;
+#pragma omp simd
+                for (bigint m = m1; m < m2; m++) {
+                    double in = x[m];
+                    double out = b0 * in + z1[m];
+                    z1[m] = b1 * in - a1 * out + z2[m];
+                    z2[m] = b2 * in - a2 * out;
+                    x[m] = out;
+                }
+            }
+        }
+    }
+}
+
+void fir_filter(const QVector<float>& h, bigint M, bigint num_out, const float* X, float* Y)
+{
+    //Y(:,c) = sum_j h[j] X(:,c+K-1-j), using the symmetry of h to halve the multiplies
+    bigint K = h.count();
+    bigint D = (K - 1) / 2;
+    const float* hptr = h.constData();
+#pragma omp parallel for
+    for (bigint c = 0; c < num_out; c++) {
+        float* y = Y + M * c;
+        const float* xmid = X + M * (c + K - 1 - D);
+        float hmid = hptr[D];
+#pragma omp simd
+        for (bigint m = 0; m < M; m++)
+            y[m] = hmid * xmid[m];
+        for (bigint j = 0; j < D; j++) {
+            const float* xa = X + M * (c + K - 1 - j);
+            const float* xb = X + M * (c + j);
+            float hj = hptr[j];
+#pragma omp simd
+            for (bigint m = 0; m < M; m++)
+                y[m] += hj * (xa[m] + xb[m]);
+        }
+    }
+}
+
+bigint choose_chunk_size(bigint M)
+{
+    //about 16 MB of float32 per chunk
+    bigint chunk_size = (16 * 1024 * 1024) / (M * sizeof(float));
+    return qMax((bigint)4096, qMin((bigint)(1 << 20), chunk_size));
+}
+
+void multiply_by_factor(bigint N, float* X, double factor)
+{
+    for (bigint i = 0; i < N; i++)
+        X[i] *= factor;
+}
+}
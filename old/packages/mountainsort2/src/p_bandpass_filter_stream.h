@@ -0,0 +1,19 @@
+#ifndef P_BANDPASS_FILTER_STREAM_H
+#define P_BANDPASS_FILTER_STREAM_H
+
+#include <QString>
+
+struct Bandpass_filter_stream_opts {
+    double samplerate = 0;
+    double freq_min = 0;
+    double freq_max = 0;
+    QString method = "iir"; //"iir" (zero-phase forward-backward butterworth biquads) or "fir" (linear-phase windowed sinc, delay compensated)
+    int filter_order = 4; //iir only: butterworth order of each band edge (rounded up to even)
+    int fir_length = 0; //fir only: number of taps (made odd), 0 means choose from freq_min
+    double quantization_unit = 0;
+};
+
+//Streaming alternative to p_bandpass_filter: a single sequential pass over the file, processing sample-major across channels
+bool p_bandpass_filter_stream(QString timeseries, QString timeseries_out, Bandpass_filter_stream_opts opts);
+
+#endif // P_BANDPASS_FILTER_STREAM_H
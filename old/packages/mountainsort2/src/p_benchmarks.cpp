@@ -0,0 +1,341 @@
+#include "p_benchmarks.h"
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTime>
+#include "diskreadmda32.h"
+#include "p_fit_stage.h"
+#include "fit_kernel.h"
+#include "pca.h"
+#include <math.h>
+
+namespace P_benchmarks {
+QVector<bigint> random_clip_times(bigint N, bigint clip_size, bigint num_clips);
+double extract_clips(const DiskReadMda32& X, const QVector<bigint>& times, bigint clip_size, bool use_view);
+double chunked_filter(const DiskReadMda32& X, bigint chunk_size, bigint overlap, bool use_view);
+void record(QJsonObject& stats, QString name, int elapsed_msec, double num_bytes, double checksum);
+double randn();
+}
+
+bool p_benchmark_read_backends(QString timeseries, QString stats_out, P_benchmark_read_backends_opts opts)
+{
+    DiskReadMda32 X_buffered(timeseries);
+    DiskReadMda32 X_mapped(timeseries);
+    X_mapped.setMemoryMapped(true);
+
+    bigint M = X_buffered.N1();
+    bigint N = X_buffered.N2();
+    bigint T = opts.clip_size;
+    if ((!M) || (N < T)) {
+        qWarning() << "Timeseries is empty or shorter than the clip size" << M << N << T;
+        return false;
+    }
+
+    QVector<bigint> times = P_benchmarks::random_clip_times(N, T, opts.num_clips);
+    double clip_bytes = 1.0 * times.count() * M * T * sizeof(dtype32);
+    double filter_bytes = 1.0 * M * N * sizeof(dtype32);
+
+    //warm the page cache so that both backends are measured on the same footing
+    P_benchmarks::chunked_filter(X_buffered, opts.chunk_size, opts.chunk_overlap, false);
+
+    QJsonObject stats;
+    stats["M"] = (long long)M;
+    stats["N"] = (long long)N;
+    stats["clip_size"] = (long long)T;
+    stats["num_clips"] = times.count();
+    stats["chunk_size"] = (long long)opts.chunk_size;
+    stats["chunk_overlap"] = (long long)opts.chunk_overlap;
+
+    {
+        QTime timer;
+        timer.start();
+        double checksum = P_benchmarks::extract_clips(X_buffered, times, T, false);
+        P_benchmarks::record(stats, "clips_buffered", timer.elapsed(), clip_bytes, checksum);
+    }
+    {
+        X_mapped.setAccessPattern(DiskReadMda32::RandomAccess);
+        QTime timer;
+        timer.start();
+        double checksum = P_benchmarks::extract_clips(X_mapped, times, T, false);
+        P_benchmarks::record(stats, "clips_mmap", timer.elapsed(), clip_bytes, checksum);
+    }
+    {
+        QTime timer;
+        timer.start();
+        double checksum = P_benchmarks::extract_clips(X_mapped, times, T, true);
+        P_benchmarks::record(stats, "clips_mmap_view", timer.elapsed(), clip_bytes, checksum);
+    }
+    {
+        QTime timer;
+        timer.start();
+        double checksum = P_benchmarks::chunked_filter(X_buffered, opts.chunk_size, opts.chunk_overlap, false);
+        P_benchmarks::record(stats, "filter_buffered", timer.elapsed(), filter_bytes, checksum);
+    }
+    {
+        X_mapped.setAccessPattern(DiskReadMda32::SequentialAccess);
+        QTime timer;
+        timer.start();
+        double checksum = P_benchmarks::chunked_filter(X_mapped, opts.chunk_size, opts.chunk_overlap, false);
+        P_benchmarks::record(stats, "filter_mmap", timer.elapsed(), filter_bytes, checksum);
+    }
+    {
+        QTime timer;
+        timer.start();
+        double checksum = P_benchmarks::chunked_filter(X_mapped, opts.chunk_size, opts.chunk_overlap, true);
+        P_benchmarks::record(stats, "filter_mmap_view", timer.elapsed(), filter_bytes, checksum);
+    }
+
+    QString json = QJsonDocument(stats).toJson(QJsonDocument::Indented);
+    printf("%s\n", json.toUtf8().data());
+    return TextFile::write(stats_out, json);
+}
+
+bool p_benchmark_fit_kernel(QString stats_out, P_benchmark_fit_kernel_opts opts)
+{
+    bigint M = opts.M;
+    bigint T = opts.clip_size;
+    bigint K = opts.K;
+    bigint N = opts.N;
+    bigint L = opts.num_events;
+    bigint Tmid = (bigint)((T + 1) / 2) - 1;
+    if ((M <= 0) || (T <= 0) || (K <= 0) || (N < T)) {
+        qWarning() << "Invalid benchmark dimensions" << M << T << K << N;
+        return false;
+    }
+
+    //deterministic synthetic data: spike-like templates with random channel amplitudes, ~70% of them added to unit white noise
+    qsrand(1);
+    Mda32 templates(M, T, K);
+    for (bigint k = 0; k < K; k++) {
+        for (bigint m = 0; m < M; m++) {
+            double amp = 4 * P_benchmarks::randn();
+            for (bigint t = 0; t < T; t++) {
+                double val = amp * exp(-(t - Tmid) * (t - Tmid) / 9.0) + 0.1 * P_benchmarks::randn();
+                templates.setValue(val, m, t, k);
+            }
+        }
+    }
+    QVector<double> times(L);
+    for (bigint i = 0; i < L; i++) {
+        times[i] = (bigint)(((qrand() * 1.0) / RAND_MAX) * (N - 1));
+    }
+    qSort(times);
+    QVector<bigint> labels(L);
+    Mda32 X(M, N);
+    float* X_ptr = X.dataPtr();
+    for (bigint i = 0; i < M * N; i++) {
+        X_ptr[i] = P_benchmarks::randn();
+    }
+    for (bigint i = 0; i < L; i++) {
+        labels[i] = 1 + qrand() % K;
+        bigint tt = (bigint)times[i] - Tmid;
+        if ((tt >= 0) && (tt + T <= N) && (qrand() % 10 < 7)) {
+            const float* W_ptr = templates.constDataPtr() + M * T * (labels[i] - 1);
+            for (bigint j = 0; j < M * T; j++) {
+                X_ptr[M * tt + j] += W_ptr[j];
+            }
+        }
+    }
+    Mda32 stdevs(M, T);
+    for (bigint j = 0; j < M * T; j++) {
+        stdevs.set(1, j);
+    }
+    QList<QList<bigint> > time_channel_mask;
+    for (bigint k = 0; k < K; k++) {
+        Mda32 template0;
+        templates.getChunk(template0, 0, 0, k, M, T, 1);
+        time_channel_mask << P_fit_stage::get_time_channel_mask(template0, stdevs, 0.5);
+    }
+
+    QJsonObject stats;
+    stats["M"] = (long long)M;
+    stats["clip_size"] = (long long)T;
+    stats["K"] = (long long)K;
+    stats["N"] = (long long)N;
+    stats["num_events"] = (long long)L;
+
+    QVector<bigint> inds_reference, inds_fit_kernel;
+    {
+        Mda32 X0 = X;
+        Fit_stage_opts fit_opts;
+        fit_opts.clip_size = T;
+        QTime timer;
+        timer.start();
+        inds_reference = P_fit_stage::fit_stage_kernel(X0, templates, times, labels, fit_opts, time_channel_mask);
+        stats["reference_elapsed_msec"] = timer.elapsed();
+    }
+    {
+        Mda32 X0 = X;
+        QTime timer;
+        timer.start();
+        FitKernel fit_kernel(templates, time_channel_mask);
+        inds_fit_kernel = fit_kernel.run(X0, times, labels);
+        stats["fit_kernel_elapsed_msec"] = timer.elapsed();
+    }
+    stats["reference_num_used"] = inds_reference.count();
+    stats["fit_kernel_num_used"] = inds_fit_kernel.count();
+    stats["identical"] = (inds_reference == inds_fit_kernel);
+
+    QString json = QJsonDocument(stats).toJson(QJsonDocument::Indented);
+    printf("%s\n", json.toUtf8().data());
+    return TextFile::write(stats_out, json);
+}
+
+bool p_benchmark_pca(QString stats_out, P_benchmark_pca_opts opts)
+{
+    bigint M = opts.M;
+    bigint N = opts.N;
+    bigint K = opts.K;
+    bigint R = opts.rank;
+    if ((M <= 0) || (N <= 0) || (K <= 0)) {
+        qWarning() << "Invalid benchmark dimensions" << M << N << K;
+        return false;
+    }
+
+    //deterministic synthetic data: a rank-R signal with decaying amplitudes plus unit white noise
+    qsrand(1);
+    Mda32 U(M, R);
+    for (bigint i = 0; i < M * R; i++) {
+        U.set(P_benchmarks::randn(), i);
+    }
+    Mda32 X(M, N);
+    float* X_ptr = X.dataPtr();
+    const float* U_ptr = U.constDataPtr();
+    for (bigint n = 0; n < N; n++) {
+        float* x = X_ptr + M * n;
+        for (bigint r = 0; r < R; r++) {
+            double amp = P_benchmarks::randn() * 10 / (r + 1);
+            for (bigint m = 0; m < M; m++)
+                x[m] += amp * U_ptr[m + M * r];
+        }
+        for (bigint m = 0; m < M; m++)
+            x[m] += P_benchmarks::randn();
+    }
+
+    QJsonObject stats;
+    stats["M"] = (long long)M;
+    stats["N"] = (long long)N;
+    stats["K"] = (long long)K;
+    stats["rank"] = (long long)R;
+
+    QList<PcaOpts::Method> methods;
+    methods << PcaOpts::PowerIteration << PcaOpts::Covariance << PcaOpts::Randomized << PcaOpts::Auto;
+    QStringList names;
+    names << "power_iteration"
+          << "covariance"
+          << "randomized"
+          << "auto";
+    QVector<double> reference_sigma;
+    for (int i = 0; i < methods.count(); i++) {
+        PcaOpts pca_opts;
+        pca_opts.method = methods[i];
+        Mda32 CC, FF, sigma;
+        QTime timer;
+        timer.start();
+        pca(CC, FF, sigma, X, K, false, pca_opts);
+        QJsonObject result;
+        result["elapsed_msec"] = timer.elapsed();
+        //the variance captured by the components, trace(C'*X*X'*C), is maximal for the exact top-K subspace
+        double captured = 0;
+        const float* FF_ptr = FF.constDataPtr();
+        for (bigint j = 0; j < FF.totalSize(); j++)
+            captured += FF_ptr[j] * FF_ptr[j];
+        result["captured_variance"] = captured;
+        QJsonArray sigma_list;
+        double max_sigma_error = 0;
+        for (bigint k = 0; k < K; k++) {
+            sigma_list.append(sigma.value(k));
+            if (methods[i] == PcaOpts::Covariance)
+                reference_sigma << sigma.value(k);
+        }
+        result["sigma"] = sigma_list;
+        if (!reference_sigma.isEmpty()) {
+            for (bigint k = 0; k < K; k++) {
+                if (reference_sigma[k])
+                    max_sigma_error = qMax(max_sigma_error, fabs(sigma.value(k) - reference_sigma[k]) / reference_sigma[k]);
+            }
+            //relative to the exact eigenvalues from the covariance method
+            result["max_relative_sigma_error"] = max_sigma_error;
+        }
+        stats[names[i]] = result;
+    }
+
+    QString json = QJsonDocument(stats).toJson(QJsonDocument::Indented);
+    printf("%s\n", json.toUtf8().data());
+    return TextFile::write(stats_out, json);
+}
+
+namespace P_benchmarks {
+QVector<bigint> random_clip_times(bigint N, bigint clip_size, bigint num_clips)
+{
+    //deterministic, so that repeated runs touch the same pages
+    qsrand(1);
+    QVector<bigint> times(num_clips);
+    for (bigint i = 0; i < num_clips; i++) {
+        times[i] = (bigint)(((qrand() * 1.0) / RAND_MAX) * (N - clip_size));
+    }
+    return times;
+}
+
+double extract_clips(const DiskReadMda32& X, const QVector<bigint>& times, bigint clip_size, bool use_view)
+{
+    bigint M = X.N1();
+    double checksum = 0;
+    Mda32 clip;
+    for (bigint i = 0; i < times.count(); i++) {
+        const dtype32* ptr = 0;
+        if (use_view) {
+            ptr = X.readChunkView(M * times[i], M * clip_size);
+        }
+        if (!ptr) {
+            X.readChunk(clip, 0, times[i], M, clip_size);
+            ptr = clip.constDataPtr();
+        }
+        for (bigint j = 0; j < M * clip_size; j++) {
+            checksum += ptr[j];
+        }
+    }
+    return checksum;
+}
+
+double chunked_filter(const DiskReadMda32& X, bigint chunk_size, bigint overlap, bool use_view)
+{
+    //a first-difference "filter" over padded chunks -- enough arithmetic to touch every entry once
+    bigint M = X.N1();
+    bigint N = X.N2();
+    double checksum = 0;
+    Mda32 chunk;
+    for (bigint t = 0; t < N; t += chunk_size) {
+        bigint t1 = qMax(t - overlap, (bigint)0);
+        bigint t2 = qMin(t + chunk_size + overlap, N);
+        const dtype32* ptr = 0;
+        if (use_view) {
+            ptr = X.readChunkView(M * t1, M * (t2 - t1));
+        }
+        if (!ptr) {
+            X.readChunk(chunk, 0, t1, M, t2 - t1);
+            ptr = chunk.constDataPtr();
+        }
+        for (bigint j = M; j < M * (t2 - t1); j++) {
+            checksum += ptr[j] - ptr[j - M];
+        }
+    }
+    return checksum;
+}
+
+void record(QJsonObject& stats, QString name, int elapsed_msec, double num_bytes, double checksum)
+{
+    stats[name + "_elapsed_msec"] = elapsed_msec;
+    stats[name + "_mbps"] = (num_bytes / 1e6) / (qMax(elapsed_msec, 1) * 1.0 / 1000);
+    stats[name + "_checksum"] = checksum;
+}
+
+double randn()
+{
+    //Box-Muller on qrand, so that the synthetic data is reproducible
+    double u1 = (qrand() + 1.0) / (RAND_MAX + 2.0);
+    double u2 = (qrand() * 1.0) / RAND_MAX;
+    return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+}
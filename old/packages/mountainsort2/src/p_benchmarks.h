@@ -0,0 +1,37 @@
+#ifndef P_BENCHMARKS_H
+#define P_BENCHMARKS_H
+
+#include "mlcommon.h"
+
+struct P_benchmark_read_backends_opts {
+    bigint clip_size = 50;
+    bigint num_clips = 10000;
+    bigint chunk_size = 20000;
+    bigint chunk_overlap = 2000;
+};
+
+//compares the buffered (fseeko/fread) and memory-mapped DiskReadMda32 backends on clip-extraction and chunked-filter style workloads
+bool p_benchmark_read_backends(QString timeseries, QString stats_out, P_benchmark_read_backends_opts opts);
+
+struct P_benchmark_fit_kernel_opts {
+    bigint M = 16;
+    bigint clip_size = 50;
+    bigint K = 20;
+    bigint N = 1000000;
+    bigint num_events = 10000;
+};
+
+//compares FitKernel with the reference fit_stage_kernel on synthetic data (templates added to white noise), checking that they keep the same events
+bool p_benchmark_fit_kernel(QString stats_out, P_benchmark_fit_kernel_opts opts);
+
+struct P_benchmark_pca_opts {
+    bigint M = 200;
+    bigint N = 100000;
+    bigint K = 10;
+    bigint rank = 15;
+};
+
+//times the PCA methods (power iteration, covariance, randomized) on synthetic low-rank data plus noise and compares them with the exact eigenvalues
+bool p_benchmark_pca(QString stats_out, P_benchmark_pca_opts opts);
+
+#endif // P_BENCHMARKS_H
@@ -1,8 +1,8 @@
 #include "p_compute_templates.h"
 
-#include <QTime>
 #include <diskreadmda.h>
 #include <diskreadmda32.h>
+#include "template_accumulator.h"
 #include "mlcommon.h"
 
 bool p_compute_templates(QStringList timeseries_list, QString firings_path, QString templates_out, int clip_size, const QList<int>& clusters_in)
@@ -56,47 +56,22 @@ bool p_compute_templates(QStringList timeseries_list, QString firings_path, QStr
 
     bigint K0 = clusters.count();
 
-    Mda templates(M, T, K0);
-    QVector<double> counts(K0);
-    counts.fill(0);
-
-    double* templates_ptr = templates.dataPtr();
+    //the index of each event's cluster in the output (1-based)
+    QVector<bigint> labels_out(labels.count());
+    for (bigint i = 0; i < labels.count(); i++) {
+        labels_out[i] = label_map[labels[i]] + 1;
+    }
 
-    bigint Tmid = (bigint)((T + 1) / 2) - 1;
     printf("computing templates (M=%ld,T=%ld,K=%ld,L=%d)...\n", M, T, K0, times.count());
-    QTime timer;
-    timer.start();
-    for (bigint i = 0; i < times.count(); i++) {
-        bigint t1 = times[i] - Tmid;
-        //bigint t2 = t1 + T - 1;
-        int k = label_map[labels[i]];
-        if (timer.elapsed() > 3000) {
-            qDebug().noquote() << QString("Compute templates: processing event %1 of %2").arg(i).arg(times.count());
-            timer.restart();
-        }
-        {
-            Mda32 tmp;
-            tmp.allocate(M, T);
-            if (!X.readChunk(tmp, 0, t1, M, T)) {
-                qWarning() << "Problem reading chunk of timeseries list:" << t1;
-                return false;
-            }
-            float* tmp_ptr = tmp.dataPtr();
-            bigint offset = M * T * k;
-            for (bigint aa = 0; aa < M * T; aa++) {
-                templates_ptr[offset + aa] += tmp_ptr[aa];
-            }
-            counts[k]++;
-        }
-    }
-    bigint bb = 0;
-    for (bigint k = 0; k < K0; k++) {
-        for (bigint aa = 0; aa < M * T; aa++) {
-            if (counts[k])
-                templates_ptr[bb] /= counts[k];
-            bb++;
-        }
+    TemplateAccumulatorOpts accumulator_opts;
+    accumulator_opts.clip_alignment = TemplateAccumulatorOpts::TruncatedStart; //the clips that compute_templates has always used
+    TemplateAccumulator accumulator(M, T, K0, accumulator_opts);
+    if (!accumulator.addClipsFromTimeseries(X, times, labels_out)) {
+        qWarning() << "Problem reading timeseries list";
+        return false;
     }
+    accumulator.finalize();
+    Mda32 templates = accumulator.templates();
 
     return templates.write32(templates_out);
 }
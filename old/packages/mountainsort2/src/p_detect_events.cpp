@@ -1,12 +1,22 @@
 #include "p_detect_events.h"
 
 #include <diskreadmda32.h>
+#include <diskwritemda.h>
+#include <chunkpipeline.h>
 #include <mda.h>
+#include <QFile>
 #include "mlcommon.h"
+#include "omp.h"
 
 namespace P_detect_events {
-QVector<double> detect_events(const QVector<double>& X, double detect_threshold, double detect_interval, int sign);
-QVector<double> subsample_events(const QVector<double>& X, double subsample_factor);
+struct Detector_state {
+    bigint last_best_ind = 0;
+    double last_best_val = 0;
+};
+template <typename T>
+Signal_stats compute_signal_stats_of(bigint N, const T* X);
+template <typename T>
+void detect_events_in_chunk(const T* X, bigint t1, bigint N, double mean, double threshold2, double detect_interval, int sign, Detector_state& state, QVector<double>& times);
 }
 
 bool p_detect_events(QString timeseries, QString event_times_out, P_detect_events_opts opts)
@@ -15,55 +25,50 @@ bool p_detect_events(QString timeseries, QString event_times_out, P_detect_event
     bigint M = X.N1();
     bigint N = X.N2();
 
-    QVector<double> data(N);
-    printf("Collecting data vector...\n");
-    if (opts.detect_rms_window > 0) {
-        printf("Collecting data vector & computing RMS...\n");
-        /*assert (M == 1) * not for multichannel */
-        for (bigint i = 0; i < N; i++) {
-            double val = 0;
-            for (int wind = 0; wind < opts.detect_rms_window; wind++) {
-                val += X.value(1, i + wind) * X.value(1, i + wind);
-            }
-            data[i] = sqrt(val);
-        }
-        double datamean = MLCompute::mean(data); /*zero mean*/
-        for (bigint i = 0; i < N; i++) {
-            data[i] = data[i] - datamean;
-        }
+    if ((opts.detect_rms_window <= 0) && (opts.central_channel - 1 >= M)) {
+        qWarning() << "Central channel is out of range:" << opts.central_channel << M;
+        return false;
     }
-    else {
-        if (opts.central_channel > 0) {
-            if (opts.central_channel - 1 >= M) {
-                qWarning() << "Central channel is out of range:" << opts.central_channel << M;
-                return false;
-            }
-            for (bigint i = 0; i < N; i++) {
-                data[i] = X.value(opts.central_channel - 1, i);
-            }
+
+    //Pass 1: compute the 1xN detection signal chunk by chunk in parallel, along with its mean and variance.
+    //The signal goes to a temporary file so that memory use doesn't depend on the length of the recording.
+    printf("Computing detection signal...\n");
+    QString signal_path = MLUtil::tempPath() + "/detect_events_signal_" + MLUtil::makeRandomId(10) + ".mda";
+    P_detect_events::Signal_stats stats;
+    {
+        DiskWriteMda signal(MDAIO_TYPE_FLOAT32, signal_path, 1, N);
+        ChunkPipelineOpts pipeline_opts;
+        pipeline_opts.chunk_size = qMax((bigint)1000, qMin((bigint)1e5, (bigint)(1e8 / qMax(M, (bigint)1) / 4))); //about 100 MB per chunk at most
+        pipeline_opts.overlap_size = qMax(opts.detect_rms_window, 0); //the rms window looks ahead
+        pipeline_opts.num_threads = omp_get_max_threads();
+        ChunkPipeline pipeline(X, pipeline_opts);
+        pipeline.setOutput(&signal);
+        //combined in chunk order afterwards, so that the mean and stdev do not depend on the thread scheduling
+        QVector<P_detect_events::Signal_stats> stats_per_chunk((N + pipeline_opts.chunk_size - 1) / pipeline_opts.chunk_size);
+        bool ok = pipeline.run([&](ChunkPipelineChunk& chunk) {
+            chunk.output.allocate(1, chunk.size);
+            P_detect_events::compute_detection_signal(M, chunk.size, chunk.data.constDataPtr() + M * pipeline_opts.overlap_size, chunk.output.dataPtr(), opts);
+            stats_per_chunk[chunk.index] = P_detect_events::compute_signal_stats(chunk.size, chunk.output.constDataPtr());
+            return true;
+        });
+        signal.close();
+        if (!ok) {
+            qWarning() << "Problem computing detection signal";
+            QFile::remove(signal_path);
+            return false;
         }
-        else {
-            for (bigint i = 0; i < N; i++) {
-                double best_value = 0;
-                bigint best_m = 0;
-                for (bigint m = 0; m < M; m++) {
-                    double val = X.value(m, i);
-                    if (opts.sign < 0)
-                        val = -val;
-                    if (opts.sign == 0)
-                        val = fabs(val);
-                    if (val > best_value) {
-                        best_value = val;
-                        best_m = m;
-                    }
-                }
-                data[i] = X.value(best_m, i);
-            }
+        for (int j = 0; j < stats_per_chunk.count(); j++) {
+            P_detect_events::combine_signal_stats(stats, stats_per_chunk[j]);
         }
     }
 
+    //Pass 2: run the detector sequentially over the (much smaller) signal
     printf("Detecting events...\n");
-    QVector<double> event_times = P_detect_events::detect_events(data, opts.detect_threshold, opts.detect_interval, opts.sign);
+    QVector<double> event_times;
+    bool ok = P_detect_events::detect_events_in_signal(signal_path, stats, opts, event_times);
+    QFile::remove(signal_path);
+    if (!ok)
+        return false;
 
     printf("%d events detected.\n", event_times.count());
 
@@ -82,49 +87,174 @@ bool p_detect_events(QString timeseries, QString event_times_out, P_detect_event
 }
 
 namespace P_detect_events {
-QVector<double> detect_events(const QVector<double>& X, double detect_threshold, double detect_interval, int sign)
+template <typename T>
+Signal_stats compute_signal_stats_of(bigint N, const T* X)
 {
-    double mean = MLCompute::mean(X);
-    double stdev = MLCompute::stdev(X);
-    double threshold2 = detect_threshold * stdev;
+    //two passes, which avoids the cancellation in sumsqr - sum*sum/N
+    Signal_stats ret;
+    ret.count = N;
+    if (!N)
+        return ret;
+    double sum = 0;
+    for (bigint i = 0; i < N; i++)
+        sum += X[i];
+    ret.mean = sum / N;
+    for (bigint i = 0; i < N; i++) {
+        double diff = X[i] - ret.mean;
+        ret.sumsqr_dev += diff * diff;
+    }
+    return ret;
+}
 
-    bigint N = X.count();
-    QVector<bigint> to_use(N);
-    to_use.fill(0);
-    bigint last_best_ind = 0;
-    double last_best_val = 0;
+Signal_stats compute_signal_stats(bigint N, const float* X)
+{
+    return compute_signal_stats_of(N, X);
+}
+
+void combine_signal_stats(Signal_stats& stats, const Signal_stats& other)
+{
+    //Chan et al., pairwise update of the mean and the sum of squared deviations
+    if (!other.count)
+        return;
+    if (!stats.count) {
+        stats = other;
+        return;
+    }
+    bigint count = stats.count + other.count;
+    double delta = other.mean - stats.mean;
+    stats.mean += delta * other.count / count;
+    stats.sumsqr_dev += other.sumsqr_dev + delta * delta * ((double)stats.count * other.count / count);
+    stats.count = count;
+}
+
+static double signal_stdev(const Signal_stats& stats)
+{
+    if (stats.count < 2)
+        return 0;
+    return sqrt(stats.sumsqr_dev / (stats.count - 1));
+}
+
+bool detect_events_in_signal(const QString& signal_path, const Signal_stats& stats, const P_detect_events_opts& opts, QVector<double>& event_times)
+{
+    //the state of the detector is carried across chunks, so the result does not depend on the chunk size
+    DiskReadMda32 signal(signal_path);
+    signal.setAccessPattern(DiskReadMda32::SequentialAccess);
+    bigint N = signal.N2();
+    double threshold2 = opts.detect_threshold * signal_stdev(stats);
+    Detector_state state;
+    bigint chunk_size = 1e6;
+    for (bigint t1 = 0; t1 < N; t1 += chunk_size) {
+        bigint size = qMin(chunk_size, N - t1);
+        Mda32 chunk;
+        if (!signal.readChunk(chunk, 0, t1, 1, size)) {
+            qWarning() << "Problem reading detection signal";
+            return false;
+        }
+        detect_events_in_chunk(chunk.constDataPtr(), t1, size, stats.mean, threshold2, opts.detect_interval, opts.sign, state, event_times);
+    }
+    return true;
+}
+
+void compute_detection_signal(bigint M, bigint N, const float* X, float* out, const P_detect_events_opts& opts)
+{
+    //X is M x (N + detect_rms_window)
+    if (opts.detect_rms_window > 0) {
+        /*assert (M == 1) * not for multichannel */
+        //(uses channel index 1, as before)
+        for (bigint i = 0; i < N; i++) {
+            double val = 0;
+            if (M > 1) {
+                for (int wind = 0; wind < opts.detect_rms_window; wind++) {
+                    double v = X[1 + M * (i + wind)];
+                    val += v * v;
+                }
+            }
+            out[i] = sqrt(val);
+        }
+        //the mean is subtracted by the detector
+    }
+    else if (opts.central_channel > 0) {
+        for (bigint i = 0; i < N; i++) {
+            out[i] = X[opts.central_channel - 1 + M * i];
+        }
+    }
+    else {
+        //the channel with the largest (signed/absolute) value; the first one in case of ties, or channel 0 if none is positive
+        for (bigint i = 0; i < N; i++) {
+            const float* x = X + M * i;
+            float best_value = 0;
+            if (opts.sign < 0) {
+#pragma omp simd reduction(max : best_value)
+                for (bigint m = 0; m < M; m++)
+                    best_value = qMax(best_value, -x[m]);
+            }
+            else if (opts.sign > 0) {
+#pragma omp simd reduction(max : best_value)
+                for (bigint m = 0; m < M; m++)
+                    best_value = qMax(best_value, x[m]);
+            }
+            else {
+#pragma omp simd reduction(max : best_value)
+                for (bigint m = 0; m < M; m++)
+                    best_value = qMax(best_value, fabsf(x[m]));
+            }
+            bigint best_m = 0;
+            if (best_value > 0) {
+                for (bigint m = 0; m < M; m++) {
+                    float val = (opts.sign < 0) ? -x[m] : ((opts.sign > 0) ? x[m] : fabsf(x[m]));
+                    if (val == best_value) {
+                        best_m = m;
+                        break;
+                    }
+                }
+            }
+            out[i] = x[best_m];
+        }
+    }
+}
+
+//detect events on timepoints t1..t1+N-1 of the signal, continuing from (and updating) state. Appends to times.
+template <typename T>
+void detect_events_in_chunk(const T* X, bigint t1, bigint N, double mean, double threshold2, double detect_interval, int sign, Detector_state& state, QVector<double>& times)
+{
+    //Only the values above threshold can change the state. The reset (after detect_interval) is applied lazily, which is equivalent
+    //since it only depends on the distance to last_best_ind. The current best event is always the last one in times.
     for (bigint n = 0; n < N; n++) {
         double val = (X[n] - mean);
         if (sign < 0)
             val = -val;
         else if (sign == 0)
             val = fabs(val);
-        if (n - last_best_ind > detect_interval)
-            last_best_val = 0;
         if (val >= threshold2) {
-            if (last_best_val > 0) {
-                if (val > last_best_val) {
-                    to_use[n] = 1;
-                    to_use[last_best_ind] = 0;
-                    last_best_ind = n;
-                    last_best_val = val;
+            bigint t = t1 + n;
+            if (t - state.last_best_ind > detect_interval)
+                state.last_best_val = 0;
+            if (state.last_best_val > 0) {
+                if (val > state.last_best_val) {
+                    times.last() = t;
+                    state.last_best_ind = t;
+                    state.last_best_val = val;
                 }
             }
             else {
                 if (val > 0) {
-                    to_use[n] = 1;
-                    last_best_ind = n;
-                    last_best_val = val;
+                    times << t;
+                    state.last_best_ind = t;
+                    state.last_best_val = val;
                 }
             }
         }
     }
+}
+
+QVector<double> detect_events(const QVector<double>& X, double detect_threshold, double detect_interval, int sign)
+{
+    Signal_stats stats = compute_signal_stats_of(X.count(), X.constData());
+    double threshold2 = detect_threshold * signal_stdev(stats);
+
+    Detector_state state;
     QVector<double> times;
-    for (bigint n = 0; n < N; n++) {
-        if (to_use[n]) {
-            times << n;
-        }
-    }
+    detect_events_in_chunk(X.constData(), 0, X.count(), stats.mean, threshold2, detect_interval, sign, state, times);
     return times;
 }
 
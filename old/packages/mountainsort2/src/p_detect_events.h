@@ -2,6 +2,7 @@
 #define P_DETECT_EVENTS_H
 
 #include <QString>
+#include <QVector>
 #include "mlcommon.h"
 
 struct P_detect_events_opts {
@@ -15,4 +16,22 @@ struct P_detect_events_opts {
 
 bool p_detect_events(QString timeseries, QString event_times_out, P_detect_events_opts opts);
 
+namespace P_detect_events {
+QVector<double> detect_events(const QVector<double>& X, double detect_threshold, double detect_interval, int sign);
+QVector<double> subsample_events(const QVector<double>& X, double subsample_factor);
+
+//For processors that compute the detection signal on their own chunks (see p_filter_whiten_detect): run compute_detection_signal
+//on each chunk, write the signal to a 1xN file, combine the Signal_stats of the chunks in chunk order, then call detect_events_in_signal
+struct Signal_stats {
+    bigint count = 0;
+    double mean = 0;
+    double sumsqr_dev = 0; //sum of the squared deviations from the mean
+};
+Signal_stats compute_signal_stats(bigint N, const float* X);
+void combine_signal_stats(Signal_stats& stats, const Signal_stats& other);
+//X is M x (N + detect_rms_window), out is 1 x N
+void compute_detection_signal(bigint M, bigint N, const float* X, float* out, const P_detect_events_opts& opts);
+bool detect_events_in_signal(const QString& signal_path, const Signal_stats& stats, const P_detect_events_opts& opts, QVector<double>& event_times);
+}
+
 #endif // P_DETECT_EVENTS_H
@@ -0,0 +1,206 @@
+#include "p_filter_whiten_detect.h"
+#include "p_bandpass_filter.h"
+#include "p_detect_events.h"
+#include "p_whiten.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <diskreadmda32.h>
+#include <diskwritemda.h>
+#include <chunkpipeline.h>
+#include <mda.h>
+#include "pca.h"
+#include "blas_kernels.h"
+#include "omp.h"
+
+namespace P_filter_whiten_detect {
+bool compute_whitening_matrix(Mda32& WW, const DiskReadMda32& X, const QList<P_bandpass_filter::Kernel_runner*>& runners, bigint chunk_size, bigint overlap_size, bigint subsample_size);
+}
+
+bool p_filter_whiten_detect(QString timeseries, QString timeseries_out, QString event_times_out, P_filter_whiten_detect_opts opts)
+{
+    DiskReadMda32 X;
+    if (QFileInfo(timeseries).isDir())
+        X.setConcatDirectory(2, timeseries);
+    else
+        X.setPath(timeseries);
+
+    const bigint M = X.N1();
+    const bigint N = X.N2();
+
+    if (opts.central_channel - 1 >= M) {
+        qWarning() << "Central channel is out of range:" << opts.central_channel << M;
+        return false;
+    }
+
+    //as in bandpass_filter, freq_max=0 means no filtering
+    bool do_filter = (opts.freq_max != 0);
+    bigint num_threads = omp_get_max_threads();
+    bigint chunk_size, overlap_size;
+    P_bandpass_filter::choose_chunk_size(M, N, num_threads, chunk_size, overlap_size);
+    if (!do_filter)
+        overlap_size = 0;
+    printf("Using chunk size / overlap size: %ld / %ld (num threads=%ld)\n", chunk_size, overlap_size, num_threads);
+
+    QList<P_bandpass_filter::Kernel_runner*> runners;
+    if (do_filter)
+        runners = P_bandpass_filter::create_kernel_runners(num_threads, M, chunk_size + 2 * overlap_size, opts.samplerate, opts.freq_min, opts.freq_max, opts.freq_wid);
+
+    //First pass: the covariance of a subsample of the filtered data
+    printf("Computing whitening matrix...\n");
+    Mda32 WW;
+    if (!P_filter_whiten_detect::compute_whitening_matrix(WW, X, runners, chunk_size, overlap_size, opts.whitening_subsample_size)) {
+        P_bandpass_filter::free_kernel_runners(runners);
+        return false;
+    }
+
+    //Second pass: filter, whiten and write. The detection signal of each chunk goes to a temporary file, as in detect_events,
+    //so that memory use doesn't depend on the length of the recording
+    printf("Filtering and whitening...\n");
+    int dtype = MDAIO_TYPE_FLOAT32;
+    if (opts.quantization_unit > 0)
+        dtype = MDAIO_TYPE_INT16;
+    DiskWriteMda Y(dtype, timeseries_out, M, N);
+
+    P_detect_events_opts detect_opts;
+    detect_opts.central_channel = opts.central_channel;
+    detect_opts.detect_threshold = opts.detect_threshold;
+    detect_opts.detect_interval = opts.detect_interval;
+    detect_opts.sign = opts.sign;
+    QString signal_path = MLUtil::tempPath() + "/filter_whiten_detect_signal_" + MLUtil::makeRandomId(10) + ".mda";
+    DiskWriteMda signal(MDAIO_TYPE_FLOAT32, signal_path, 1, N);
+    QMutex signal_mutex;
+    QVector<P_detect_events::Signal_stats> stats_per_chunk((N + chunk_size - 1) / chunk_size); //combined in chunk order below
+
+    ChunkPipelineOpts pipeline_opts;
+    pipeline_opts.chunk_size = chunk_size;
+    pipeline_opts.overlap_size = overlap_size;
+    pipeline_opts.num_threads = num_threads;
+    ChunkPipeline pipeline(X, pipeline_opts);
+    pipeline.setOutput(&Y);
+    bool ok = pipeline.run([&](ChunkPipelineChunk& chunk) {
+        if (do_filter)
+            P_bandpass_filter::apply_kernel_runner(runners[chunk.thread_index], chunk.data);
+        Mda32 filtered;
+        chunk.data.getChunk(filtered, 0, overlap_size, M, chunk.size);
+        chunk.output.allocate(M, chunk.size);
+        blas_sgemm(M, chunk.size, M, WW.constDataPtr(), filtered.constDataPtr(), chunk.output.dataPtr(), false); // WW is symmetric, so no need to transpose
+        // same as in whiten, for deterministic output
+        P_whiten::quantize(chunk.output.totalSize(), chunk.output.dataPtr(), 0.0001);
+
+        Mda32 signal_chunk(1, chunk.size);
+        P_detect_events::compute_detection_signal(M, chunk.size, chunk.output.constDataPtr(), signal_chunk.dataPtr(), detect_opts);
+        stats_per_chunk[chunk.index] = P_detect_events::compute_signal_stats(chunk.size, signal_chunk.constDataPtr());
+        {
+            QMutexLocker locker(&signal_mutex);
+            if (!signal.writeChunk(signal_chunk, 0, chunk.t1)) {
+                qWarning() << "Problem writing detection signal";
+                return false;
+            }
+        }
+
+        if (opts.quantization_unit > 0) {
+            P_whiten::scale_for_quantization(chunk.output, opts.quantization_unit);
+        }
+        return true;
+    });
+    P_bandpass_filter::free_kernel_runners(runners);
+    Y.close();
+    signal.close();
+    if (!ok) {
+        qWarning() << "Problem filtering and whitening in filter_whiten_detect";
+        QFile::remove(signal_path);
+        return false;
+    }
+
+    printf("Detecting events...\n");
+    P_detect_events::Signal_stats stats;
+    for (int j = 0; j < stats_per_chunk.count(); j++) {
+        P_detect_events::combine_signal_stats(stats, stats_per_chunk[j]);
+    }
+    QVector<double> event_times;
+    ok = P_detect_events::detect_events_in_signal(signal_path, stats, detect_opts, event_times);
+    QFile::remove(signal_path);
+    if (!ok)
+        return false;
+
+    printf("%d events detected.\n", event_times.count());
+
+    if ((opts.subsample_factor) && (opts.subsample_factor < 1)) {
+        printf("Subsampling by factor %g...\n", opts.subsample_factor);
+        event_times = P_detect_events::subsample_events(event_times, opts.subsample_factor);
+    }
+
+    Mda ret(1, event_times.count());
+    for (bigint j = 0; j < event_times.count(); j++) {
+        ret.setValue(event_times[j], j);
+    }
+    return ret.write64(event_times_out);
+}
+
+namespace P_filter_whiten_detect {
+
+bool compute_whitening_matrix(Mda32& WW, const DiskReadMda32& X, const QList<P_bandpass_filter::Kernel_runner*>& runners, bigint chunk_size, bigint overlap_size, bigint subsample_size)
+{
+    bigint M = X.N1();
+    bigint N = X.N2();
+
+    //use chunks evenly spaced over the recording
+    bigint num_chunks = (N + chunk_size - 1) / chunk_size;
+    bigint num_chunks_to_use = qMin(num_chunks, qMax((bigint)1, (subsample_size + chunk_size - 1) / chunk_size));
+    qDebug().noquote() << QString("Using %1 of %2 chunks for the covariance").arg(num_chunks_to_use).arg(num_chunks);
+
+    bigint num_threads = omp_get_max_threads();
+    QVector<Mda> XXt_per_thread(num_threads);
+    for (bigint j = 0; j < num_threads; j++) {
+        XXt_per_thread[j].allocate(M, M);
+    }
+    bigint num_timepoints = 0;
+    bool ok = true;
+#pragma omp parallel for
+    for (bigint j = 0; j < num_chunks_to_use; j++) {
+        int thread_index = omp_get_thread_num();
+        bigint t1 = ((j * num_chunks) / num_chunks_to_use) * chunk_size;
+        bigint size = qMin(chunk_size, N - t1);
+        Mda32 chunk;
+        if (!X.readChunk(chunk, 0, t1 - overlap_size, M, chunk_size + 2 * overlap_size)) {
+#pragma omp critical(lock1)
+            {
+                qWarning() << "Problem reading chunk in filter_whiten_detect";
+                ok = false;
+            }
+            continue;
+        }
+        if (!runners.isEmpty())
+            P_bandpass_filter::apply_kernel_runner(runners[thread_index], chunk);
+        blas_ssyrk_accumulate(M, size, chunk.constDataPtr() + M * overlap_size, XXt_per_thread[thread_index].dataPtr());
+#pragma omp atomic
+        num_timepoints += size;
+    }
+    if (!ok)
+        return false;
+
+    Mda XXt(M, M);
+    double* XXtptr = XXt.dataPtr();
+    for (bigint j = 0; j < num_threads; j++) {
+        const double* XXt0ptr = XXt_per_thread[j].constDataPtr();
+        for (bigint bb = 0; bb < M * M; bb++) {
+            XXtptr[bb] += XXt0ptr[bb];
+        }
+    }
+    if (num_timepoints > 1) {
+        for (bigint ii = 0; ii < M * M; ii++) {
+            XXtptr[ii] /= (num_timepoints - 1);
+        }
+    }
+
+    Mda WW0;
+    whitening_matrix_from_XXt(WW0, XXt); // the result is symmetric
+    WW.allocate(M, M);
+    for (bigint ii = 0; ii < M * M; ii++) {
+        WW.set(WW0.get(ii), ii);
+    }
+    return true;
+}
+}
@@ -0,0 +1,28 @@
+#ifndef P_FILTER_WHITEN_DETECT_H
+#define P_FILTER_WHITEN_DETECT_H
+
+#include <QString>
+#include "mlcommon.h"
+
+struct P_filter_whiten_detect_opts {
+    //bandpass_filter
+    double samplerate = 0;
+    double freq_min = 0;
+    double freq_max = 0;
+    double freq_wid = 1000;
+    //whiten
+    bigint whitening_subsample_size = 1e6; //number of (filtered) timepoints, spread over the recording, used to estimate the covariance
+    double quantization_unit = 0;
+    //detect_events
+    int central_channel = 0;
+    double detect_threshold = 3.5;
+    double detect_interval = 10;
+    int sign = 0;
+    double subsample_factor = 1;
+};
+
+//Equivalent to bandpass_filter -> whiten -> detect_events, but the raw timeseries is streamed once (plus a subsample for the covariance)
+//and neither the filtered timeseries nor the whitened one needs to be read back
+bool p_filter_whiten_detect(QString timeseries, QString timeseries_out, QString event_times_out, P_filter_whiten_detect_opts opts);
+
+#endif // P_FILTER_WHITEN_DETECT_H
@@ -5,7 +5,12 @@
 #include <diskreadmda32.h>
 #include <mda.h>
 #include <mda32.h>
+#include <chunkpipeline.h>
+#include <algorithm>
+#include "omp.h"
 #include "get_sort_indices.h"
+#include "template_accumulator.h"
+#include "fit_kernel.h"
 #include "mlcommon.h"
 
 typedef QList<bigint> IntList;
@@ -13,8 +18,6 @@ typedef QList<bigint> IntList;
 namespace P_fit_stage {
 Mda sort_firings_by_time(const Mda& firings);
 void compute_templates(Mda32& templates_out, Mda32& templates_stdevs_out, const DiskReadMda32& X, const QVector<double>& times, const QVector<bigint>& labels, bigint clip_size);
-QVector<bigint> fit_stage_kernel(Mda32& X, Mda32& templates, QVector<double>& times, QVector<bigint>& labels, const Fit_stage_opts& opts, const QList<IntList>& time_channel_mask);
-QList<bigint> get_time_channel_mask(const Mda32& template0, const Mda32& template0_stdev, double thresh);
 }
 
 bool p_fit_stage(QString timeseries_path, QString firings_path, QString firings_out_path, Fit_stage_opts opts)
@@ -73,63 +76,48 @@ bool p_fit_stage(QString timeseries_path, QString firings_path, QString firings_
 
     QList<bigint> inds_to_use;
     printf("Starting fit stage...\n");
-    QTime timer;
-    timer.start();
     {
-        bigint num_timepoints_handled = 0;
-#pragma omp parallel for
-        for (bigint timepoint = 0; timepoint < N; timepoint += chunk_size) {
-            //for (bigint timepoint = 0; timepoint < N; timepoint += N) { //for debugging
-            //QMap<QString, bigint> elapsed_times_local;
-            Mda32 chunk; //this will be the chunk we are working on
-            Mda32 local_templates; //just a local copy of the templates
-            QVector<double> local_times; //the times that fall in this time range
-            QVector<bigint> local_labels; //the corresponding labels
-            QList<bigint> local_inds; //the corresponding event indices
-            Fit_stage_opts local_opts; //a local copy of the opts
-            QList<IntList> local_time_channel_mask;
-#pragma omp critical(lock1)
-            {
-                //build the variables above
-                local_templates = templates;
-                local_opts = opts;
-                local_time_channel_mask = time_channel_mask;
-                if (!X.readChunk(chunk, 0, timepoint - overlap_size, M, chunk_size + 2 * overlap_size)) {
-                    qWarning() << "Problem reading chunk in fit_stage";
-                }
-                for (bigint jj = 0; jj < L; jj++) {
-                    if ((timepoint - overlap_size <= times[jj]) && (times[jj] < timepoint - overlap_size + chunk_size + 2 * overlap_size)) {
-                        local_times << times[jj] - (timepoint - overlap_size);
-                        local_labels << labels[jj];
-                        local_inds << jj;
-                    }
-                }
+        ChunkPipelineOpts pipeline_opts;
+        pipeline_opts.chunk_size = chunk_size;
+        pipeline_opts.overlap_size = overlap_size;
+        pipeline_opts.num_threads = omp_get_max_threads();
+        ChunkPipeline pipeline(X, pipeline_opts);
+        //each pipeline thread collects the events it decides to keep; these are merged (and sorted) below
+        QVector<QList<bigint>> inds_to_use_per_thread(pipeline.numThreads());
+        //The fit kernel (templates and masks) and the (sorted) times are shared read-only by all the chunks
+        FitKernel fit_kernel(templates, time_channel_mask);
+        bool ok = pipeline.run([&](ChunkPipelineChunk& chunk) {
+            bigint timepoint = chunk.t1;
+            //times is sorted, so the events of this chunk (including overlap) are the contiguous range [jj1,jj2)
+            double chunk_t1 = timepoint - overlap_size;
+            double chunk_t2 = timepoint - overlap_size + chunk_size + 2 * overlap_size;
+            bigint jj1 = std::lower_bound(times.begin(), times.end(), chunk_t1) - times.begin();
+            bigint jj2 = std::lower_bound(times.begin() + jj1, times.end(), chunk_t2) - times.begin();
+            QVector<double> local_times(jj2 - jj1); //the times relative to the start of the chunk data
+            for (bigint jj = jj1; jj < jj2; jj++) {
+                local_times[jj - jj1] = times[jj] - chunk_t1;
             }
+            QVector<bigint> local_labels = labels.mid(jj1, jj2 - jj1); //the corresponding labels
             //Our real task is to decide which of these events to keep. Those will be stored in local_inds_to_use
             //"Local" means this chunk in this thread
-            QVector<bigint> local_inds_to_use;
-            {
-                //This is the main kernel operation!!
-                local_inds_to_use = P_fit_stage::fit_stage_kernel(chunk, local_templates, local_times, local_labels, local_opts, time_channel_mask);
-            }
-#pragma omp critical(lock1)
-            {
-                {
-                    for (bigint ii = 0; ii < local_inds_to_use.count(); ii++) {
-                        bigint ind0 = local_inds[local_inds_to_use[ii]];
-                        double t0 = times[ind0];
-                        if ((timepoint <= t0) && (t0 < timepoint + chunk_size)) {
-                            inds_to_use << ind0;
-                        }
-                    }
-                }
-
-                num_timepoints_handled += qMin(chunk_size, N - timepoint);
-                if (timer.elapsed() > 5000) {
-                    qDebug().noquote() << QString("--- Handled %1% of timepoints").arg((int)(num_timepoints_handled * 100.0 / N)) << timer.elapsed();
-                    timer.restart();
+            //This is the main kernel operation!!
+            QVector<bigint> local_inds_to_use = fit_kernel.run(chunk.data, local_times, local_labels);
+            QList<bigint>& thread_inds_to_use = inds_to_use_per_thread[chunk.thread_index];
+            for (bigint ii = 0; ii < local_inds_to_use.count(); ii++) {
+                bigint ind0 = jj1 + local_inds_to_use[ii];
+                double t0 = times[ind0];
+                if ((timepoint <= t0) && (t0 < timepoint + chunk_size)) {
+                    thread_inds_to_use << ind0;
                 }
             }
+            return true;
+        });
+        if (!ok) {
+            qWarning() << "Problem running fit stage";
+            return false;
+        }
+        for (int j = 0; j < inds_to_use_per_thread.count(); j++) {
+            inds_to_use.append(inds_to_use_per_thread[j]);
         }
     }
 
@@ -173,56 +161,17 @@ void compute_templates(Mda32& templates_out, Mda32& templates_stdevs_out, const
 {
     bigint M = X.N1();
     bigint T = clip_size;
-    bigint L = times.count();
-
     bigint K = MLCompute::max<bigint>(labels);
 
-    bigint Tmid = (bigint)((T + 1) / 2) - 1;
-
-    Mda sums(M, T, K);
-    Mda sumsqrs(M, T, K);
-    QList<bigint> counts;
-    for (bigint k = 0; k < K; k++)
-        counts << 0;
-    for (bigint i = 0; i < L; i++) {
-        bigint k = labels[i];
-        bigint t0 = (bigint)(times[i] + 0.5);
-        if (k >= 1) {
-            Mda32 X0;
-            if (!X.readChunk(X0, 0, t0 - Tmid, M, T)) {
-                qWarning() << "Problem reading chunk in compute_templates of fit_stage";
-            }
-            dtype32* Xptr = X0.dataPtr();
-            double* sums_ptr = sums.dataPtr(0, 0, k - 1);
-            double* sumsqrs_ptr = sumsqrs.dataPtr(0, 0, k - 1);
-            for (bigint i = 0; i < M * T; i++) {
-                sums_ptr[i] += Xptr[i];
-                sumsqrs_ptr[i] += Xptr[i] * Xptr[i];
-            }
-            counts[k - 1]++;
-        }
-    }
-    templates_out.allocate(M, T, K);
-    templates_stdevs_out.allocate(M, T, K);
-    for (bigint k = 0; k < K; k++) {
-        for (bigint t = 0; t < T; t++) {
-            for (bigint m = 0; m < M; m++) {
-                double n = counts[k];
-                double s1 = sums.get(m, t, k);
-                double s2 = sumsqrs.get(m, t, k);
-                double mu = 0;
-                if (n) {
-                    mu = s1 / n;
-                    templates_out.set(mu, m, t, k);
-                }
-                if (n > 1) {
-                    double val = sqrt((s2 - 2 * mu * s1 + n * mu * mu) / (n - 1));
-                    templates_stdevs_out.set(val, m, t, k);
-                }
-                //finish
-            }
-        }
+    TemplateAccumulatorOpts opts;
+    opts.compute_stdevs = true;
+    TemplateAccumulator accumulator(M, T, K, opts);
+    if (!accumulator.addClipsFromTimeseries(X, times, labels)) {
+        qWarning() << "Problem reading timeseries in compute_templates of fit_stage";
     }
+    accumulator.finalize();
+    templates_out = accumulator.templates();
+    templates_stdevs_out = accumulator.stdevs();
 }
 
 QList<bigint> get_time_channel_mask(const Mda32& template0, const Mda32& template0_stdev, double thresh)
@@ -245,10 +194,10 @@ QList<bigint> get_time_channel_mask(const Mda32& template0, const Mda32& templat
     return ret;
 }
 
-bool is_dirty(float* dirty_ptr, const QList<bigint>& tchmask)
+bool is_dirty(const float* dirty_ptr, const QList<bigint>& tchmask)
 {
     for (bigint i = 0; i < tchmask.count(); i++) {
-        if (dirty_ptr[i])
+        if (dirty_ptr[tchmask[i]])
             return true;
     }
     return false;
@@ -267,7 +216,7 @@ double compute_score(bigint N, float* X, float* template0)
 }
 */
 
-double compute_score(bigint M, bigint T, float* X_ptr, float* template0, const QList<bigint>& tchmask)
+double compute_score(bigint M, bigint T, const float* X_ptr, const float* template0, const QList<bigint>& tchmask)
 {
     (void)M;
     (void)T;
@@ -299,7 +248,7 @@ void subtract_scaled_template(bigint N, double* X, double* template0, double sca
     }
 }
 
-void subtract_scaled_template(bigint M, bigint T, float* X_ptr, float* dirty_ptr, float* template0, const QList<bigint>& tchmask, double scale_min, double scale_max)
+void subtract_scaled_template(bigint M, bigint T, float* X_ptr, float* dirty_ptr, const float* template0, const QList<bigint>& tchmask, double scale_min, double scale_max)
 {
     (void)M;
     (void)T;
@@ -320,41 +269,7 @@ void subtract_scaled_template(bigint M, bigint T, float* X_ptr, float* dirty_ptr
     }
 }
 
-QVector<bigint> find_events_to_use(const QVector<double>& times, const QVector<double>& scores, const Fit_stage_opts& opts)
-{
-    QVector<bigint> to_use;
-    bigint L = times.count();
-    for (bigint i = 0; i < L; i++)
-        to_use << 0; //start out not using any
-    for (bigint i = 0; i < L; i++) {
-        if (scores[i] > 0) { //score has to at least be positive
-            to_use[i] = 1; //for now we say we are using it
-            {
-                // but let's check nearby events that may have a larger score
-
-                bigint j = i;
-                while ((j >= 0) && (times[j] >= times[i] - opts.clip_size)) {
-                    if ((i != j) && (scores[j] >= scores[i])) {
-                        to_use[i] = 0; //actually not using it because there is something bigger to the left
-                    }
-                    j--;
-                }
-            }
-            {
-                bigint j = i;
-                while ((j < times.count()) && (times[j] <= times[i] + opts.clip_size)) {
-                    if (scores[j] > scores[i]) {
-                        to_use[i] = 0; //actually not using it because there is something bigger to the right
-                    }
-                    j++;
-                }
-            }
-        }
-    }
-    return to_use;
-}
-
-QVector<bigint> fit_stage_kernel(Mda32& X, Mda32& templates, QVector<double>& times, QVector<bigint>& labels, const Fit_stage_opts& opts, const QList<IntList>& time_channel_mask)
+QVector<bigint> fit_stage_kernel(Mda32& X, const Mda32& templates, const QVector<double>& times, const QVector<bigint>& labels, const Fit_stage_opts& opts, const QList<IntList>& time_channel_mask)
 {
     bigint M = X.N1(); //the number of dimensions
     bigint T = opts.clip_size; //the clip size
@@ -366,7 +281,7 @@ QVector<bigint> fit_stage_kernel(Mda32& X, Mda32& templates, QVector<double>& ti
     QVector<double> template_norms;
     template_norms << 0;
     for (bigint k = 1; k <= K; k++) {
-        template_norms << MLCompute::norm(M * T, templates.dataPtr(0, 0, k - 1));
+        template_norms << MLCompute::norm(M * T, templates.constDataPtr() + M * T * (k - 1));
     }
 
     //keep passing through the data until nothing changes anymore
@@ -406,7 +321,7 @@ QVector<bigint> fit_stage_kernel(Mda32& X, Mda32& templates, QVector<double>& ti
                 bigint tt = (bigint)(t0 - Tmid + 0.5); //start time of clip
                 double score0 = 0;
                 if ((tt >= 0) && (tt + T <= X.N2())) { //make sure we are in range
-                    IntList tchmask = time_channel_mask[k0 - 1];
+                    const IntList& tchmask = time_channel_mask[k0 - 1];
                     if (!is_dirty(dirty.dataPtr(0, tt), tchmask)) {
                         // we don't need to recompute the score
                         score0 = scores[i];
@@ -415,7 +330,7 @@ QVector<bigint> fit_stage_kernel(Mda32& X, Mda32& templates, QVector<double>& ti
                         //we do need to recompute it.
 
                         //The score will be how much something like the L2-norm is decreased
-                        score0 = compute_score(M, T, X.dataPtr(0, tt), templates.dataPtr(0, 0, k0 - 1), tchmask);
+                        score0 = compute_score(M, T, X.dataPtr(0, tt), templates.constDataPtr() + M * T * (k0 - 1), tchmask);
                         num_score_computes++;
                         /*
                         if (score0 < template_norms[k0] * template_norms[k0] * 0.1)
@@ -440,7 +355,7 @@ QVector<bigint> fit_stage_kernel(Mda32& X, Mda32& templates, QVector<double>& ti
             }
         }
         //Look at those events to try and see if we should use them
-        QVector<bigint> to_use = find_events_to_use(times_to_try, scores_to_try, opts);
+        QVector<bigint> to_use = P_fit_kernel::find_events_to_use(times_to_try, scores_to_try, opts.clip_size);
 
         //at this point, nothing is dirty
         for (bigint i = 0; i < dirty.totalSize(); i++) {
@@ -456,11 +371,11 @@ QVector<bigint> fit_stage_kernel(Mda32& X, Mda32& templates, QVector<double>& ti
         bigint num_added = 0;
         for (bigint aa = 0; aa < to_use.count(); aa++) {
             if (to_use[aa] == 1) {
-                IntList tchmask = time_channel_mask[labels_to_try[aa] - 1];
+                const IntList& tchmask = time_channel_mask[labels_to_try[aa] - 1];
                 something_changed = true;
                 num_added++;
                 bigint tt = (bigint)(times_to_try[aa] - Tmid + 0.5);
-                subtract_scaled_template(M, T, X.dataPtr(0, tt), dirty.dataPtr(0, tt), templates.dataPtr(0, 0, labels_to_try[aa] - 1), tchmask, scale_min, scale_max);
+                subtract_scaled_template(M, T, X.dataPtr(0, tt), dirty.dataPtr(0, tt), templates.constDataPtr() + M * T * (labels_to_try[aa] - 1), tchmask, scale_min, scale_max);
                 event_inds_to_use << inds_to_try[aa];
                 num_to_use++;
             }
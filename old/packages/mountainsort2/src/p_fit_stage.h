@@ -3,6 +3,7 @@
 
 #include <QString>
 #include "mlcommon.h"
+#include "mda32.h"
 
 struct Fit_stage_opts {
     int clip_size = 50;
@@ -10,4 +11,10 @@ struct Fit_stage_opts {
 
 bool p_fit_stage(QString timeseries, QString firings, QString firings_out, Fit_stage_opts opts);
 
+namespace P_fit_stage {
+//The original greedy kernel, on lists of masked entries -- kept as the reference for mountainsort.benchmark_fit_kernel (fit_stage uses FitKernel)
+QVector<bigint> fit_stage_kernel(Mda32& X, const Mda32& templates, const QVector<double>& times, const QVector<bigint>& labels, const Fit_stage_opts& opts, const QList<QList<bigint> >& time_channel_mask);
+QList<bigint> get_time_channel_mask(const Mda32& template0, const Mda32& template0_stdev, double thresh);
+}
+
 #endif // P_FIT_STAGE_H
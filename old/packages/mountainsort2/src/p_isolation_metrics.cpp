@@ -1,30 +1,65 @@
 #include "p_isolation_metrics.h"
 #include "get_sort_indices.h"
 
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
 #include <QJsonArray>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QMutex>
 #include <QTime>
 #include <QVector>
+#include <string.h>
 #include <diskreadmda.h>
 #include <diskreadmda32.h>
 #include <mda.h>
 #include <mda32.h>
+#include <clipextractor.h>
 #include "pca.h"
+#include "omp.h"
 #include "kdtree.h"
 #include "compute_templates_0.h"
 
 namespace P_isolation_metrics {
+//Clips of the sampled events of each cluster (sample(times, max_num_to_use)), shared by the threads so that
+//the cluster and pair metrics don't read the same clips from disk over and over. Least recently used
+//entries are dropped once the total size exceeds the budget.
+class SampledClipCache {
+public:
+    SampledClipCache(bigint clip_size, double max_mb);
+    //the first num clips of cluster k, if they are cached
+    bool get(int k, bigint num, Mda32& clips);
+    void insert(int k, const Mda32& clips);
+
+private:
+    QMutex m_mutex;
+    bigint m_clip_size;
+    bigint m_max_bytes;
+    bigint m_num_bytes = 0;
+    QMap<int, Mda32> m_clips;
+    QList<int> m_lru; //most recently used last
+};
+
 Mda32 extract_clips(const DiskReadMda32& X, const QVector<double>& times, int clip_size);
 Mda32 compute_mean_clip(const Mda32& clips);
-QJsonObject get_cluster_metrics(const DiskReadMda32& X, const QVector<double>& times, P_isolation_metrics_opts opts);
-QJsonObject get_pair_metrics(const DiskReadMda32& X, const QVector<double>& times_k1, const QVector<double>& times_k2, P_isolation_metrics_opts opts);
+QJsonObject get_cluster_metrics(const DiskReadMda32& X, int k, const QVector<double>& times, SampledClipCache* clip_cache, P_isolation_metrics_opts opts);
+QJsonObject get_pair_metrics(const DiskReadMda32& X, int k1, const QVector<double>& times_k1, int k2, const QVector<double>& times_k2, SampledClipCache* clip_cache, P_isolation_metrics_opts opts);
 QSet<QString> get_pairs_to_compare(const Mda32& templates0, bigint num_comparisons_per_cluster, const QList<int>& cluster_numbers, P_isolation_metrics_opts opts);
-double compute_overlap(const DiskReadMda32& X, const QVector<double>& times1, const QVector<double>& times2, P_isolation_metrics_opts opts);
+double compute_overlap(const DiskReadMda32& X, int k1, const QVector<double>& times1, int k2, const QVector<double>& times2, SampledClipCache* clip_cache, P_isolation_metrics_opts opts);
+Mda32 get_sampled_clips(const DiskReadMda32& X, int k, const QVector<double>& times, bigint num, SampledClipCache* clip_cache, P_isolation_metrics_opts opts);
+QList<bigint> sample_indices(bigint N, bigint num);
+Mda32 concatenate_clips(const Mda32& clips1, const Mda32& clips2);
 bool is_bursting_parent_candidate(const Mda32& template0, const Mda32& template0_parent, P_isolation_metrics_opts opts);
 bool test_bursting_timing(const QVector<double>& times, const QVector<double>& times_parent, P_isolation_metrics_opts opts, bool verbose);
+QString get_cache_context(const QStringList& timeseries_list, const P_isolation_metrics_opts& opts);
+QString compute_times_hash(const QVector<double>& times);
+bool read_cached_metrics(const QString& cache_dir, const QString& key, QJsonObject& metrics);
+void write_cached_metrics(const QString& cache_dir, const QString& key, const QJsonObject& metrics);
 struct ClusterData {
     QVector<double> times;
+    QString times_hash;
     QJsonObject cluster_metrics;
     double isolation = 1;
     int overlap_cluster = 0;
@@ -61,6 +96,18 @@ bool p_isolation_metrics(QStringList timeseries_list, QString firings_path, QStr
     QList<int> cluster_numbers = used_cluster_numbers_set.toList();
     qSort(cluster_numbers);
 
+    //Cached results are keyed on the event times of the cluster(s), the timeseries and the options,
+    //so after a merge or split only the clusters (and pairs) whose membership changed are recomputed
+    QString cache_context;
+    if (!opts.cache_dir.isEmpty()) {
+        if (QDir().mkpath(opts.cache_dir))
+            cache_context = P_isolation_metrics::get_cache_context(timeseries_list, opts);
+        else
+            qWarning() << "Unable to create cache directory, not caching:" << opts.cache_dir;
+    }
+    int num_cached_clusters = 0, num_cached_pairs = 0;
+    P_isolation_metrics::SampledClipCache clip_cache(opts.clip_size, opts.clip_cache_mb);
+
     qDebug().noquote() << "Computing cluster metrics...";
 #pragma omp parallel for
     for (int jj = 0; jj < cluster_numbers.count(); jj++) {
@@ -79,12 +126,27 @@ bool p_isolation_metrics(QStringList timeseries_list, QString firings_path, QStr
             opts0 = opts;
         }
 
-        QJsonObject tmp = P_isolation_metrics::get_cluster_metrics(X0, times_k, opts0);
+        QString times_hash = P_isolation_metrics::compute_times_hash(times_k);
+        QString cache_key;
+        QJsonObject tmp;
+        bool cached = false;
+        if (!cache_context.isEmpty()) {
+            cache_key = MLUtil::computeSha1SumOfString("cluster:" + cache_context + ":" + times_hash);
+            cached = P_isolation_metrics::read_cached_metrics(opts0.cache_dir, cache_key, tmp);
+        }
+        if (!cached) {
+            tmp = P_isolation_metrics::get_cluster_metrics(X0, k, times_k, &clip_cache, opts0);
+            if (!cache_key.isEmpty())
+                P_isolation_metrics::write_cached_metrics(opts0.cache_dir, cache_key, tmp);
+        }
 
 #pragma omp critical
         {
+            if (cached)
+                num_cached_clusters++;
             P_isolation_metrics::ClusterData CD;
             CD.times = times_k;
+            CD.times_hash = times_hash;
             CD.cluster_metrics = tmp;
             cluster_data[k] = CD;
         }
@@ -119,6 +181,7 @@ bool p_isolation_metrics(QStringList timeseries_list, QString firings_path, QStr
 #pragma omp parallel for
     for (int jj = 0; jj < pairs_to_compare_list.count(); jj++) {
         QString pairstr;
+        QString cache_key;
         int k1, k2;
         QVector<double> times_k1, times_k2;
         P_isolation_metrics_opts opts0;
@@ -131,14 +194,26 @@ bool p_isolation_metrics(QStringList timeseries_list, QString firings_path, QStr
             k2 = vals[1].toInt();
             times_k1 = cluster_data.value(k1).times;
             times_k2 = cluster_data.value(k2).times;
+            if (!cache_context.isEmpty())
+                cache_key = MLUtil::computeSha1SumOfString("pair:" + cache_context + ":" + cluster_data.value(k1).times_hash + ":" + cluster_data.value(k2).times_hash);
             opts0 = opts;
             X0 = X;
         }
 
-        QJsonObject pair_metrics = P_isolation_metrics::get_pair_metrics(X0, times_k1, times_k2, opts0);
+        QJsonObject pair_metrics;
+        bool cached = false;
+        if (!cache_key.isEmpty())
+            cached = P_isolation_metrics::read_cached_metrics(opts0.cache_dir, cache_key, pair_metrics);
+        if (!cached) {
+            pair_metrics = P_isolation_metrics::get_pair_metrics(X0, k1, times_k1, k2, times_k2, &clip_cache, opts0);
+            if (!cache_key.isEmpty())
+                P_isolation_metrics::write_cached_metrics(opts0.cache_dir, cache_key, pair_metrics);
+        }
 
 #pragma omp critical
         {
+            if (cached)
+                num_cached_pairs++;
             QJsonObject tmp;
             tmp["label"] = QString("%1,%2").arg(k1).arg(k2);
             tmp["metrics"] = pair_metrics;
@@ -155,6 +230,9 @@ bool p_isolation_metrics(QStringList timeseries_list, QString firings_path, QStr
         }
     }
 
+    if (!cache_context.isEmpty())
+        qDebug().noquote() << QString("Used cached metrics for %1 of %2 clusters and %3 of %4 pairs").arg(num_cached_clusters).arg(cluster_numbers.count()).arg(num_cached_pairs).arg(pairs_to_compare_list.count());
+
     if (opts.compute_bursting_parents) {
         qDebug().noquote() << "Computing bursting parents...";
         for (int jj = 0; jj < cluster_numbers.count(); jj++) {
@@ -210,6 +288,48 @@ bool p_isolation_metrics(QStringList timeseries_list, QString firings_path, QStr
 }
 
 namespace P_isolation_metrics {
+QString get_cache_context(const QStringList& timeseries_list, const P_isolation_metrics_opts& opts)
+{
+    //bump the version when the metrics computation changes, so that old entries are not reused
+    QString ret = "isolation_metrics_v1";
+    foreach (QString path, timeseries_list) {
+        QFileInfo info(path);
+        ret += QString(":%1,%2,%3").arg(info.canonicalFilePath()).arg(info.size()).arg(info.lastModified().toMSecsSinceEpoch());
+    }
+    ret += QString(":%1,%2,%3,%4,%5,%6").arg(opts.clip_size).arg(opts.num_features).arg(opts.K_nearest).arg(opts.exhaustive_search_num).arg(opts.max_num_to_use).arg(opts.min_num_to_use);
+    return ret;
+}
+
+QString compute_times_hash(const QVector<double>& times)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData((const char*)times.constData(), times.count() * sizeof(double));
+    return QString(hash.result().toHex());
+}
+
+bool read_cached_metrics(const QString& cache_dir, const QString& key, QJsonObject& metrics)
+{
+    QString path = cache_dir + "/" + key + ".json";
+    if (!QFile::exists(path))
+        return false;
+    QJsonParseError error;
+    QJsonDocument doc = QJsonDocument::fromJson(TextFile::read(path).toUtf8(), &error);
+    if ((error.error != QJsonParseError::NoError) || (!doc.isObject())) {
+        qWarning() << "Ignoring invalid cache entry:" << path;
+        return false;
+    }
+    metrics = doc.object();
+    return true;
+}
+
+void write_cached_metrics(const QString& cache_dir, const QString& key, const QJsonObject& metrics)
+{
+    //TextFile::write goes through a temporary file, so a concurrent run never reads a partial entry
+    QString path = cache_dir + "/" + key + ".json";
+    if (!TextFile::write(path, QJsonDocument(metrics).toJson(QJsonDocument::Compact)))
+        qWarning() << "Unable to write cache entry:" << path;
+}
+
 bigint random_time(bigint N, bigint clip_size)
 {
     if (N <= clip_size * 2)
@@ -217,15 +337,22 @@ bigint random_time(bigint N, bigint clip_size)
     return clip_size + (qrand() % (N - clip_size * 2));
 }
 
-QVector<double> sample(const QVector<double>& times, bigint num)
+QList<bigint> sample_indices(bigint N, bigint num)
 {
-    QVector<double> random_values(times.count());
-    for (bigint i = 0; i < times.count(); i++) {
+    //a fixed pseudo-random order, so sample(times, n) is the first n of sample(times, m) for m>=n
+    QVector<double> random_values(N);
+    for (bigint i = 0; i < N; i++) {
         random_values[i] = sin(i * 12 + i * i);
     }
     QList<bigint> inds = get_sort_indices_bigint(random_values);
+    return inds.mid(0, num);
+}
+
+QVector<double> sample(const QVector<double>& times, bigint num)
+{
+    QList<bigint> inds = sample_indices(times.count(), num);
     QVector<double> ret;
-    for (bigint i = 0; (i < num) && (i < inds.count()); i++) {
+    for (bigint i = 0; i < inds.count(); i++) {
         ret << times[inds[i]];
     }
     return ret;
@@ -291,39 +418,35 @@ void regress_out_noise_shape(Mda32& clips, const Mda32& shape)
     }
 }
 
-double compute_noise_overlap(const DiskReadMda32& X, const QVector<double>& times, P_isolation_metrics_opts opts, bool debug)
+double compute_noise_overlap(const DiskReadMda32& X, const Mda32& clips, P_isolation_metrics_opts opts, bool debug)
 {
+    //clips are those of the sampled events of the cluster
     QTime timer;
     timer.start();
 
     QList<bigint> elapsed_times;
 
-    bigint num_to_use = qMin(opts.max_num_to_use, times.count());
-    QVector<double> times_subset = sample(times, num_to_use);
+    bigint num_to_use = clips.N3();
 
     QVector<bigint> labels_subset;
-    for (bigint i = 0; i < times_subset.count(); i++) {
+    for (bigint i = 0; i < num_to_use; i++) {
         labels_subset << 1;
     }
     //equal amount of random clips
     QVector<double> noise_times;
     QVector<bigint> noise_labels;
-    for (bigint i = 0; i < times_subset.count(); i++) {
+    for (bigint i = 0; i < num_to_use; i++) {
         noise_times << random_time(X.N2(), opts.clip_size);
         noise_labels << 0;
     }
 
     elapsed_times << timer.restart();
 
-    QVector<double> all_times = times_subset;
     QVector<bigint> all_labels = labels_subset; //0 and 1
-
-    all_times.append(noise_times);
     all_labels.append(noise_labels);
 
-    Mda32 clips = extract_clips(X, times_subset, opts.clip_size);
-    //Mda32 noise_clips = extract_clips(X, noise_times, opts.clip_size);
-    Mda32 all_clips = extract_clips(X, all_times, opts.clip_size);
+    Mda32 noise_clips = extract_clips(X, noise_times, opts.clip_size);
+    Mda32 all_clips = concatenate_clips(clips, noise_clips);
 
     elapsed_times << timer.restart();
 
@@ -361,13 +484,10 @@ double compute_noise_overlap(const DiskReadMda32& X, const QVector<double>& time
     tree.create(FF);
     double num_correct = 0;
     double num_total = 0;
+    QVector<int> neighbors = tree.findApproxKNearestNeighborsOfAllPoints(opts.K_nearest, opts.exhaustive_search_num);
     for (bigint i = 0; i < FF.N2(); i++) {
-        QVector<float> p;
-        for (bigint j = 0; j < FF.N1(); j++) {
-            p << FF.value(j, i);
-        }
-        QList<int> indices = tree.findApproxKNearestNeighbors(FF, p, opts.K_nearest, opts.exhaustive_search_num);
-        for (bigint a = 0; a < indices.count(); a++) {
+        const int* indices = neighbors.constData() + opts.K_nearest * i;
+        for (bigint a = 0; (a < opts.K_nearest) && (indices[a] >= 0); a++) {
             if (indices[a] != i) {
                 if (all_labels[indices[a]] == all_labels[i])
                     num_correct++;
@@ -386,27 +506,23 @@ double compute_noise_overlap(const DiskReadMda32& X, const QVector<double>& time
     return 1 - (num_correct * 1.0 / num_total);
 }
 
-double compute_overlap(const DiskReadMda32& X, const QVector<double>& times1, const QVector<double>& times2, P_isolation_metrics_opts opts)
+double compute_overlap(const DiskReadMda32& X, int k1, const QVector<double>& times1, int k2, const QVector<double>& times2, SampledClipCache* clip_cache, P_isolation_metrics_opts opts)
 {
     bigint num_to_use = qMin(qMin(opts.max_num_to_use, times1.count()), times2.count());
     if (num_to_use < opts.min_num_to_use)
         return 0;
-    QVector<double> times1_subset = sample(times1, num_to_use);
-    QVector<double> times2_subset = sample(times2, num_to_use);
+    Mda32 clips1 = get_sampled_clips(X, k1, times1, num_to_use, clip_cache, opts);
+    Mda32 clips2 = get_sampled_clips(X, k2, times2, num_to_use, clip_cache, opts);
 
-    QVector<double> all_times;
     QVector<bigint> all_labels; //1 and 2
-
-    for (bigint i = 0; i < times1_subset.count(); i++) {
-        all_times << times1_subset[i];
+    for (bigint i = 0; i < num_to_use; i++) {
         all_labels << 1;
     }
-    for (bigint i = 0; i < times2_subset.count(); i++) {
-        all_times << times2_subset[i];
+    for (bigint i = 0; i < num_to_use; i++) {
         all_labels << 2;
     }
 
-    Mda32 all_clips = extract_clips(X, all_times, opts.clip_size);
+    Mda32 all_clips = concatenate_clips(clips1, clips2);
 
     Mda32 all_clips_reshaped(all_clips.N1() * all_clips.N2(), all_clips.N3());
     bigint NNN = all_clips.totalSize();
@@ -423,13 +539,10 @@ double compute_overlap(const DiskReadMda32& X, const QVector<double>& times1, co
     tree.create(FF);
     double num_correct = 0;
     double num_total = 0;
-    for (bigint i = 0; i < all_times.count(); i++) {
-        QVector<float> p;
-        for (bigint j = 0; j < FF.N1(); j++) {
-            p << FF.value(j, i);
-        }
-        QList<int> indices = tree.findApproxKNearestNeighbors(FF, p, opts.K_nearest, opts.exhaustive_search_num);
-        for (bigint a = 0; a < indices.count(); a++) {
+    QVector<int> neighbors = tree.findApproxKNearestNeighborsOfAllPoints(opts.K_nearest, opts.exhaustive_search_num);
+    for (bigint i = 0; i < all_labels.count(); i++) {
+        const int* indices = neighbors.constData() + opts.K_nearest * i;
+        for (bigint a = 0; (a < opts.K_nearest) && (indices[a] >= 0); a++) {
             if (indices[a] != i) {
                 if (all_labels[indices[a]] == all_labels[i])
                     num_correct++;
@@ -503,21 +616,80 @@ QSet<QString> get_pairs_to_compare(const Mda32& templates0, bigint num_compariso
     return ret;
 }
 
+Mda32 get_sampled_clips(const DiskReadMda32& X, int k, const QVector<double>& times, bigint num, SampledClipCache* clip_cache, P_isolation_metrics_opts opts)
+{
+    Mda32 clips;
+    if ((clip_cache) && (clip_cache->get(k, num, clips)))
+        return clips;
+    //extract the full sample, so that any later request for this cluster is served from the cache
+    Mda32 all_clips = extract_clips(X, sample(times, opts.max_num_to_use), opts.clip_size);
+    if (clip_cache)
+        clip_cache->insert(k, all_clips);
+    all_clips.getChunk(clips, 0, 0, 0, all_clips.N1(), all_clips.N2(), num);
+    return clips;
+}
+
+Mda32 concatenate_clips(const Mda32& clips1, const Mda32& clips2)
+{
+    bigint clip_total_size = clips1.N1() * clips1.N2();
+    Mda32 ret(clips1.N1(), clips1.N2(), clips1.N3() + clips2.N3());
+    memcpy(ret.dataPtr(), clips1.constDataPtr(), sizeof(float) * clip_total_size * clips1.N3());
+    memcpy(ret.dataPtr() + clip_total_size * clips1.N3(), clips2.constDataPtr(), sizeof(float) * clip_total_size * clips2.N3());
+    return ret;
+}
+
+SampledClipCache::SampledClipCache(bigint clip_size, double max_mb)
+{
+    m_clip_size = clip_size;
+    m_max_bytes = max_mb * 1e6;
+}
+
+bool SampledClipCache::get(int k, bigint num, Mda32& clips)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_clips.contains(k))
+        return false;
+    const Mda32& all_clips = m_clips[k];
+    if (all_clips.N3() < num)
+        return false;
+    m_lru.removeOne(k);
+    m_lru << k;
+    if (all_clips.N3() == num)
+        clips = all_clips; //implicitly shared
+    else
+        all_clips.getChunk(clips, 0, 0, 0, all_clips.N1(), all_clips.N2(), num);
+    return true;
+}
+
+void SampledClipCache::insert(int k, const Mda32& clips)
+{
+    bigint num_bytes = clips.totalSize() * sizeof(float);
+    if ((clips.N2() != m_clip_size) || (num_bytes > m_max_bytes))
+        return;
+    QMutexLocker locker(&m_mutex);
+    if (m_clips.contains(k)) {
+        m_num_bytes -= m_clips[k].totalSize() * sizeof(float);
+        m_lru.removeOne(k);
+    }
+    m_clips[k] = clips;
+    m_lru << k;
+    m_num_bytes += num_bytes;
+    while ((m_num_bytes > m_max_bytes) && (!m_lru.isEmpty())) {
+        int k0 = m_lru.takeFirst();
+        m_num_bytes -= m_clips[k0].totalSize() * sizeof(float);
+        m_clips.remove(k0);
+    }
+}
+
 Mda32 extract_clips(const DiskReadMda32& X, const QVector<double>& times, int clip_size)
 {
-    bigint M = X.N1();
-    bigint T = clip_size;
-    bigint Tmid = (bigint)((T + 1) / 2) - 1;
-    bigint L = times.count();
-    Mda32 clips(M, T, L);
-    for (bigint i = 0; i < L; i++) {
-        bigint t1 = times.value(i) - Tmid;
-        //bigint t2 = t1 + T - 1;
-        Mda32 tmp;
-        if (!X.readChunk(tmp, 0, t1, M, T)) {
-            qWarning() << "Problem reading chunk in extract_clips of isolation_metrics";
-        }
-        clips.setChunk(tmp, 0, 0, i);
+    Mda32 clips;
+    ClipExtractorOpts opts;
+    if (omp_in_parallel())
+        opts.num_threads = 1; //called from the parallel cluster and pair loops, which already use every core
+    ClipExtractor extractor(X, times, clip_size, opts);
+    if (!extractor.extractClips(clips)) {
+        qWarning() << "Problem extracting clips in extract_clips of isolation_metrics";
     }
     return clips;
 }
@@ -581,13 +753,22 @@ Mda32 compute_stdev_clip(const Mda32& clips)
     }
     return stdevs;
 }
-QJsonObject get_cluster_metrics(const DiskReadMda32& X, const QVector<double>& times, P_isolation_metrics_opts opts)
+QJsonObject get_cluster_metrics(const DiskReadMda32& X, int k, const QVector<double>& times, SampledClipCache* clip_cache, P_isolation_metrics_opts opts)
 {
     QJsonObject ret;
     Mda32 clips_k = extract_clips(X, times, opts.clip_size);
     Mda32 template_k = compute_mean_clip(clips_k);
     Mda32 stdev_k = compute_stdev_clip(clips_k);
-    double noise_overlap0 = compute_noise_overlap(X, times, opts, false);
+    //the sampled clips (for the noise overlap here and the pair overlaps later) are a subset of these
+    QList<bigint> inds = sample_indices(times.count(), opts.max_num_to_use);
+    bigint clip_total_size = clips_k.N1() * clips_k.N2();
+    Mda32 sampled_clips(clips_k.N1(), clips_k.N2(), inds.count());
+    for (bigint i = 0; i < inds.count(); i++) {
+        memcpy(sampled_clips.dataPtr() + clip_total_size * i, clips_k.constDataPtr() + clip_total_size * inds[i], sizeof(float) * clip_total_size);
+    }
+    if (clip_cache)
+        clip_cache->insert(k, sampled_clips);
+    double noise_overlap0 = compute_noise_overlap(X, sampled_clips, opts, false);
     {
         double min0 = template_k.minimum();
         double max0 = template_k.maximum();
@@ -611,10 +792,10 @@ QJsonObject get_cluster_metrics(const DiskReadMda32& X, const QVector<double>& t
     }
     return ret;
 }
-QJsonObject get_pair_metrics(const DiskReadMda32& X, const QVector<double>& times_k1, const QVector<double>& times_k2, P_isolation_metrics_opts opts)
+QJsonObject get_pair_metrics(const DiskReadMda32& X, int k1, const QVector<double>& times_k1, int k2, const QVector<double>& times_k2, SampledClipCache* clip_cache, P_isolation_metrics_opts opts)
 {
     QJsonObject pair_metrics;
-    double overlap = P_isolation_metrics::compute_overlap(X, times_k1, times_k2, opts);
+    double overlap = P_isolation_metrics::compute_overlap(X, k1, times_k1, k2, times_k2, clip_cache, opts);
     pair_metrics["overlap"] = overlap;
     return pair_metrics;
 }
@@ -17,6 +17,8 @@ struct P_isolation_metrics_opts {
     double bursting_parent_window = 50 * 30; //in timepoints
     double bursting_parent_factor = 2;
     double bursting_parent_z_threshold = 8;
+    double clip_cache_mb = 1000; //memory budget for the sampled clips shared between the cluster and pair metrics
+    QString cache_dir; //where per-cluster and per-pair results are cached between runs (empty for no caching)
 };
 
 bool p_isolation_metrics(QStringList timeseries_list, QString firings, QString metrics_out, QString pair_metrics_out, P_isolation_metrics_opts opts);
@@ -3,12 +3,15 @@
 #include <QTime>
 #include <mda32.h>
 #include "pca.h"
+#include "template_accumulator.h"
 #include "isosplit5.h"
 #include "mlcommon.h"
 #include <QCoreApplication>
+#include <string.h>
+#include "omp.h"
 
 namespace P_sort_clips {
-QVector<int> sort_clips_subset(const Mda32& clips, const QVector<bigint>& indices, Sort_clips_opts opts);
+QVector<int> sort_clips_subset(const Mda32& clips, const QVector<bigint>& indices, Sort_clips_opts opts, bigint wide_min_size);
 Mda32 dimension_reduce_clips(Mda32& clips, bigint num_features_per_channel, bigint max_samples);
 Mda32 compute_templates(Mda32& clips, const QVector<int>& labels);
 }
@@ -33,7 +36,10 @@ bool p_sort_clips(QString clips_path, QString labels_out, Sort_clips_opts opts)
     }
 
     qDebug().noquote() << "Sorting clips...";
-    QVector<int> labels = P_sort_clips::sort_clips_subset(clips, indices, opts);
+    //subsets of at least this size are sorted one at a time with all threads working on the PCA and isosplit,
+    //smaller ones become tasks that each run on a single thread
+    bigint wide_min_size = L / qMax(1, omp_get_max_threads());
+    QVector<int> labels = P_sort_clips::sort_clips_subset(clips, indices, opts, wide_min_size);
 
     if (opts.remove_outliers) {
         qDebug().noquote() << "Computing templates...";
@@ -99,6 +105,8 @@ Mda32 dimension_reduce_clips(Mda32& clips, bigint num_features_per_channel, bigi
 
     Mda32 ret(M, num_features_per_channel, L);
     float* retptr = ret.dataPtr();
+    //with fewer channels than threads it is better to let each pca use all the threads
+#pragma omp parallel for schedule(dynamic) if (M >= omp_get_max_threads())
     for (bigint m = 0; m < M; m++) {
         Mda32 reshaped(T, L);
         float* reshaped_ptr = reshaped.dataPtr();
@@ -131,7 +139,7 @@ Mda32 dimension_reduce_clips(Mda32& clips, bigint num_features_per_channel, bigi
     return ret;
 }
 
-QVector<int> sort_clips_subset(const Mda32& clips, const QVector<bigint>& indices, Sort_clips_opts opts)
+QVector<int> sort_clips_subset(const Mda32& clips, const QVector<bigint>& indices, Sort_clips_opts opts, bigint wide_min_size)
 {
     bigint M = clips.N1();
     bigint T = clips.N2();
@@ -142,15 +150,12 @@ QVector<int> sort_clips_subset(const Mda32& clips, const QVector<bigint>& indice
     Mda32 FF;
     {
         // do this inside a code block so memory gets released
+        // each clip is already a contiguous column of M*T values
         Mda32 clips_reshaped(M * T, L0);
-        bigint iii = 0;
+        const float* clips_ptr = clips.constDataPtr();
+        float* reshaped_ptr = clips_reshaped.dataPtr();
         for (bigint ii = 0; ii < L0; ii++) {
-            for (bigint t = 0; t < T; t++) {
-                for (bigint m = 0; m < M; m++) {
-                    clips_reshaped.set(clips.value(m, t, indices[ii]), iii);
-                    iii++;
-                }
-            }
+            memcpy(&reshaped_ptr[M * T * ii], &clips_ptr[M * T * indices[ii]], sizeof(float) * M * T);
         }
 
         Mda32 CC, sigma;
@@ -179,26 +184,61 @@ QVector<int> sort_clips_subset(const Mda32& clips, const QVector<bigint>& indice
     }
     else {
         //branch method
-        QVector<int> labels_new(L0);
-        bigint k_offset = 0;
+        QVector<QVector<bigint> > indices2(K0 + 1), indices2b(K0 + 1);
+        for (bigint a = 0; a < L0; a++) {
+            indices2[labels0[a]] << indices[a];
+            indices2b[labels0[a]] << a;
+        }
+        //Large subsets are sorted right away (if we are not already inside the parallel region), with the
+        //parallelism inside pca and isosplit5. The rest are OpenMP tasks, which idle threads pick up as the
+        //recursion unfolds. The labels are offset in cluster order afterwards, so the result doesn't depend
+        //on the scheduling.
+        QVector<QVector<int> > labels2(K0 + 1);
+        QList<bigint> task_clusters;
         for (bigint k = 1; k <= K0; k++) {
-            QVector<bigint> indices2, indices2b;
-            for (bigint a = 0; a < L0; a++) {
-                if (labels0[a] == k) {
-                    indices2 << indices[a];
-                    indices2b << a;
+            if (indices2[k].isEmpty())
+                continue;
+            if ((!omp_in_parallel()) && (indices2[k].count() >= wide_min_size))
+                labels2[k] = sort_clips_subset(clips, indices2[k], opts, wide_min_size);
+            else
+                task_clusters << k;
+        }
+        if (!task_clusters.isEmpty()) {
+            if (omp_in_parallel()) {
+                for (bigint j = 0; j < task_clusters.count(); j++) {
+                    bigint k = task_clusters[j];
+#pragma omp task default(shared) firstprivate(k)
+                    labels2[k] = sort_clips_subset(clips, indices2[k], opts, wide_min_size);
                 }
+#pragma omp taskwait
             }
-            if (indices2.count() > 0) {
-                QVector<int> labels2 = sort_clips_subset(clips, indices2, opts);
-                bigint K2 = MLCompute::max(labels2);
-                for (bigint bb = 0; bb < indices2.count(); bb++) {
-                    labels_new[indices2b[bb]] = k_offset + labels2[bb];
+            else {
+#pragma omp parallel
+                {
+#pragma omp single
+                    {
+                        for (bigint j = 0; j < task_clusters.count(); j++) {
+                            bigint k = task_clusters[j];
+#pragma omp task default(shared) firstprivate(k)
+                            labels2[k] = sort_clips_subset(clips, indices2[k], opts, wide_min_size);
+                        }
+                    }
                 }
-                k_offset += K2;
             }
         }
 
+        QVector<int> labels_new(L0);
+        bigint k_offset = 0;
+        for (bigint k = 1; k <= K0; k++) {
+            if (indices2[k].isEmpty())
+                continue;
+            bigint K2 = MLCompute::max(labels2[k]);
+            for (bigint bb = 0; bb < indices2b[k].count(); bb++) {
+                labels_new[indices2b[k][bb]] = k_offset + labels2[k][bb];
+            }
+            k_offset += K2;
+        }
+
         return labels_new;
     }
 }
@@ -206,37 +246,13 @@ Mda32 compute_templates(Mda32& clips, const QVector<int>& labels)
 {
     int M = clips.N1();
     int T = clips.N2();
-    bigint L = clips.N3();
     int Kmax = MLCompute::max(labels);
-    Mda sum(M, T, Kmax);
-    QVector<double> counts(Kmax);
-    double* sumptr = sum.dataPtr();
-    float* cptr = clips.dataPtr();
-    bigint aa = 0;
-    for (bigint i = 0; i < L; i++) {
-        int k = labels[i];
-        if (k > 0) {
-            bigint bb = M * T * (k - 1);
-            for (bigint jj = 0; jj < M * T; jj++) {
-                sumptr[bb] += cptr[aa];
-                aa++;
-                bb++;
-            }
-            counts[k - 1]++;
-        }
-    }
-    Mda32 ret(M, T, Kmax);
-    for (int k = 0; k < Kmax; k++) {
-        double factor = 0;
-        if (counts[k])
-            factor = 1.0 / counts[k];
-        for (int t = 0; t < T; t++) {
-            for (int m = 0; m < M; m++) {
-                ret.setValue(sum.value(m, t, k) * factor, m, t, k);
-            }
-        }
-    }
-    return ret;
+    TemplateAccumulatorOpts opts;
+    opts.num_threads = 1;
+    TemplateAccumulator accumulator(M, T, Kmax, opts);
+    accumulator.addClips(clips, labels);
+    accumulator.finalize();
+    return accumulator.templates();
 }
 }
 
@@ -3,14 +3,14 @@
 #include <QTime>
 #include <diskreadmda32.h>
 #include <diskwritemda.h>
+#include <chunkpipeline.h>
 #include <mda.h>
 #include "pca.h"
+#include "blas_kernels.h"
 #include "omp.h"
 
 namespace P_whiten {
 
-void scale_for_quantization(Mda32& X, double quantization_unit);
-
 double quantize(float X, double unit)
 {
     return (floor(X / unit + 0.5)) * unit;
@@ -23,6 +23,8 @@ void quantize(bigint N, float* X, double unit)
     }
 }
 Mda32 extract_channels_from_chunk(const Mda32& X, const QList<int>& channels);
+Mda32 transpose(const Mda32& A);
+void apply_whitening_matrix(ChunkPipelineChunk& chunk, bigint M, const Mda32& WWt, const Whiten_opts& opts);
 }
 
 bool p_whiten(QString timeseries, QString timeseries_out, Whiten_opts opts)
@@ -42,46 +44,29 @@ bool p_whiten(QString timeseries, QString timeseries_out, Whiten_opts opts)
         chunk_size = N;
     }
 
+    ChunkPipelineOpts pipeline_opts;
+    pipeline_opts.chunk_size = chunk_size;
+    pipeline_opts.num_threads = omp_get_max_threads();
+
     {
-        QTime timer;
-        timer.start();
-        bigint num_timepoints_handled = 0;
-#pragma omp parallel for
-        for (bigint timepoint = 0; timepoint < N; timepoint += chunk_size) {
-            Mda32 chunk;
-#pragma omp critical(lock1)
-            {
-                if (!X.readChunk(chunk, 0, timepoint, M, qMin(chunk_size, N - timepoint))) {
-                    qWarning() << "Problem reading chunk in whiten (1)";
-                }
-            }
-            float* chunkptr = chunk.dataPtr();
-            Mda XXt0(M, M);
-            double* XXt0ptr = XXt0.dataPtr();
-            for (bigint i = 0; i < chunk.N2(); i++) {
-                bigint aa = M * i;
-                bigint bb = 0;
-                for (bigint m1 = 0; m1 < M; m1++) {
-                    for (bigint m2 = 0; m2 < M; m2++) {
-                        XXt0ptr[bb] += chunkptr[aa + m1] * chunkptr[aa + m2];
-                        bb++;
-                    }
-                }
-            }
-#pragma omp critical(lock2)
-            {
-                bigint bb = 0;
-                for (bigint m1 = 0; m1 < M; m1++) {
-                    for (bigint m2 = 0; m2 < M; m2++) {
-                        XXtptr[bb] += XXt0ptr[bb];
-                        bb++;
-                    }
-                }
-                num_timepoints_handled += qMin(chunk_size, N - timepoint);
-                if ((timer.elapsed() > 5000) || (num_timepoints_handled == N)) {
-                    printf("%ld/%ld (%d%%)\n", num_timepoints_handled, N, (int)(num_timepoints_handled * 1.0 / N * 100));
-                    timer.restart();
-                }
+        //one partial XXt per pipeline thread, summed at the end
+        ChunkPipeline pipeline(X, pipeline_opts);
+        QVector<Mda> XXt_per_thread(pipeline.numThreads());
+        for (int j = 0; j < XXt_per_thread.count(); j++) {
+            XXt_per_thread[j].allocate(M, M);
+        }
+        bool ok = pipeline.run([&](ChunkPipelineChunk& chunk) {
+            blas_ssyrk_accumulate(M, chunk.size, chunk.data.constDataPtr(), XXt_per_thread[chunk.thread_index].dataPtr());
+            return true;
+        });
+        if (!ok) {
+            qWarning() << "Problem computing XXt in whiten";
+            return false;
+        }
+        for (int j = 0; j < XXt_per_thread.count(); j++) {
+            const double* XXt0ptr = XXt_per_thread[j].constDataPtr();
+            for (bigint bb = 0; bb < M * M; bb++) {
+                XXtptr[bb] += XXt0ptr[bb];
             }
         }
     }
@@ -94,7 +79,11 @@ bool p_whiten(QString timeseries, QString timeseries_out, Whiten_opts opts)
     //Mda AA = get_whitening_matrix(COV);
     Mda WW;
     whitening_matrix_from_XXt(WW, XXt); // the result is symmetric (assumed below)
-    double* WWptr = WW.dataPtr();
+    Mda32 WW32(WW.N1(), WW.N2());
+    for (bigint ii = 0; ii < WW.totalSize(); ii++) {
+        WW32.set(WW.get(ii), ii);
+    }
+    Mda32 WWt32 = P_whiten::transpose(WW32);
 
     DiskWriteMda Y;
     int dtype = MDAIO_TYPE_FLOAT32;
@@ -102,48 +91,15 @@ bool p_whiten(QString timeseries, QString timeseries_out, Whiten_opts opts)
         dtype = MDAIO_TYPE_INT16;
     Y.open(dtype, timeseries_out, M, N);
     {
-        QTime timer;
-        timer.start();
-        bigint num_timepoints_handled = 0;
-#pragma omp parallel for
-        for (bigint timepoint = 0; timepoint < N; timepoint += chunk_size) {
-            Mda32 chunk_in;
-#pragma omp critical(lock1)
-            {
-                if (!X.readChunk(chunk_in, 0, timepoint, M, qMin(chunk_size, N - timepoint))) {
-                    qWarning() << "Problem reading chunk in whiten (2)";
-                }
-            }
-            float* chunk_in_ptr = chunk_in.dataPtr();
-            Mda32 chunk_out(M, chunk_in.N2());
-            float* chunk_out_ptr = chunk_out.dataPtr();
-            for (bigint i = 0; i < chunk_in.N2(); i++) { // explicitly do mat-mat mult ... TODO replace w/ BLAS3
-                bigint aa = M * i;
-                bigint bb = 0;
-                for (bigint m1 = 0; m1 < M; m1++) {
-                    for (bigint m2 = 0; m2 < M; m2++) {
-                        chunk_out_ptr[aa + m1] += chunk_in_ptr[aa + m2] * WWptr[bb]; // actually this does dgemm w/ WW^T
-                        bb++; // but since symmetric, doesn't matter.
-                    }
-                }
-            }
-#pragma omp critical(lock2)
-            {
-                // The following is needed to make the output deterministic, due to a very tricky floating-point problem that I honestly could not track down
-                // It has something to do with multiplying by very small values of WWptr[bb]. But I truly could not pinpoint the exact problem.
-                P_whiten::quantize(chunk_out.totalSize(), chunk_out.dataPtr(), 0.0001);
-                if (opts.quantization_unit > 0) {
-                    P_whiten::scale_for_quantization(chunk_out, opts.quantization_unit);
-                }
-                if (!Y.writeChunk(chunk_out, 0, timepoint)) {
-                    qWarning() << "Problem writing chunk in whiten";
-                }
-                num_timepoints_handled += qMin(chunk_size, N - timepoint);
-                if ((timer.elapsed() > 5000) || (num_timepoints_handled == N)) {
-                    printf("%ld/%ld (%d%%)\n", num_timepoints_handled, N, (int)(num_timepoints_handled * 1.0 / N * 100));
-                    timer.restart();
-                }
-            }
+        ChunkPipeline pipeline(X, pipeline_opts);
+        pipeline.setOutput(&Y);
+        bool ok = pipeline.run([&](ChunkPipelineChunk& chunk) {
+            P_whiten::apply_whitening_matrix(chunk, M, WWt32, opts);
+            return true;
+        });
+        if (!ok) {
+            qWarning() << "Problem applying whitening matrix in whiten";
+            return false;
         }
     }
     Y.close();
@@ -164,7 +120,7 @@ bool p_compute_whitening_matrix(QStringList timeseries_list, const QList<int>& c
     }
     qDebug().noquote() << "Computing whitening matrix: M/N" << M << N;
 
-    bigint processing_chunk_size = 1e7;
+    bigint processing_chunk_size = 1e5;
 
     Mda XXt(M2, M2);
     double* XXtptr = XXt.dataPtr();
@@ -173,55 +129,31 @@ bool p_compute_whitening_matrix(QStringList timeseries_list, const QList<int>& c
         chunk_size = N;
     }
 
-    bigint timepoint = 0;
-    while (timepoint < N) {
-        QList<Mda32> chunks;
-        while ((timepoint < N) && (chunks.count() < omp_get_max_threads())) {
-            Mda32 chunk0;
-            if (!X0.readChunk(chunk0, 0, timepoint, M, qMin(chunk_size, N - timepoint))) {
-                qWarning() << "Problem reading chunk in compute whiten matrix";
-                return false;
-            }
-            if (!channels.isEmpty()) {
-                chunk0 = P_whiten::extract_channels_from_chunk(chunk0, channels);
-            }
-            chunks << chunk0;
-            timepoint += chunk_size;
+    ChunkPipelineOpts pipeline_opts;
+    pipeline_opts.chunk_size = chunk_size;
+    pipeline_opts.num_threads = omp_get_max_threads();
+    ChunkPipeline pipeline(X0, pipeline_opts);
+    //one partial XXt per pipeline thread, summed at the end
+    QVector<Mda> XXt_per_thread(pipeline.numThreads());
+    for (int j = 0; j < XXt_per_thread.count(); j++) {
+        XXt_per_thread[j].allocate(M2, M2);
+    }
+    bool ok = pipeline.run([&](ChunkPipelineChunk& chunk) {
+        Mda32 chunk0 = chunk.data;
+        if (!channels.isEmpty()) {
+            chunk0 = P_whiten::extract_channels_from_chunk(chunk0, channels);
         }
-        bigint num_chunks = chunks.count();
-#pragma omp parallel
-        {
-#pragma omp for
-            for (bigint i = 0; i < num_chunks; i++) {
-                Mda32 chunk0;
-#pragma omp critical
-                {
-                    chunk0 = chunks[i];
-                }
-                Mda XXt0(M2, M2);
-                double* XXt0ptr = XXt0.dataPtr();
-                float* chunkptr = chunk0.dataPtr();
-                for (bigint i = 0; i < chunk0.N2(); i++) {
-                    bigint aa = M2 * i;
-                    bigint bb = 0;
-                    for (bigint m1 = 0; m1 < M2; m1++) {
-                        for (bigint m2 = 0; m2 < M2; m2++) {
-                            XXt0ptr[bb] += chunkptr[aa + m1] * chunkptr[aa + m2];
-                            bb++;
-                        }
-                    }
-                }
-#pragma omp critical(lock2)
-                {
-                    bigint bb = 0;
-                    for (bigint m1 = 0; m1 < M2; m1++) {
-                        for (bigint m2 = 0; m2 < M2; m2++) {
-                            XXtptr[bb] += XXt0ptr[bb];
-                            bb++;
-                        }
-                    }
-                }
-            }
+        blas_ssyrk_accumulate(M2, chunk.size, chunk0.constDataPtr(), XXt_per_thread[chunk.thread_index].dataPtr());
+        return true;
+    });
+    if (!ok) {
+        qWarning() << "Problem computing XXt in compute whiten matrix";
+        return false;
+    }
+    for (int j = 0; j < XXt_per_thread.count(); j++) {
+        const double* XXt0ptr = XXt_per_thread[j].constDataPtr();
+        for (bigint bb = 0; bb < M2 * M2; bb++) {
+            XXtptr[bb] += XXt0ptr[bb];
         }
     }
 
@@ -241,11 +173,11 @@ bool p_compute_whitening_matrix(QStringList timeseries_list, const QList<int>& c
 bool p_whiten_clips(QString clips_path, QString whitening_matrix, QString clips_out_path, Whiten_opts opts)
 {
     (void)opts;
-    Mda WW(whitening_matrix);
+    Mda32 WW32(whitening_matrix);
+    //the matrix comes from the user, so it need not be symmetric -- as always, the clips are multiplied by its transpose
+    Mda32 WWt32 = P_whiten::transpose(WW32);
     DiskReadMda32 clips(clips_path);
 
-    double* WWptr = WW.dataPtr();
-
     bigint M = clips.N1();
     bigint T = clips.N2();
     bigint L = clips.N3();
@@ -263,23 +195,8 @@ bool p_whiten_clips(QString clips_path, QString whitening_matrix, QString clips_
             qWarning() << "Problem reading chunk" << i;
             return false;
         }
-        float* chunk_ptr = chunk.dataPtr();
-
         Mda32 chunk_out(M, T);
-        float* chunk_out_ptr = chunk_out.dataPtr();
-        {
-
-            for (bigint t = 0; t < T; t++) {
-                bigint aa = 0;
-                bigint bb = M * t;
-                for (bigint m1 = 0; m1 < M; m1++) {
-                    for (bigint m2 = 0; m2 < M; m2++) {
-                        chunk_out_ptr[bb + m1] += chunk_ptr[bb + m2] * WWptr[aa]; // actually this does dgemm w/ WW^T
-                        aa++; // but since symmetric, doesn't matter.
-                    }
-                }
-            }
-        }
+        blas_sgemm(M, T, M, WWt32.constDataPtr(), chunk.constDataPtr(), chunk_out.dataPtr(), false);
         if (opts.quantization_unit > 0) {
             P_whiten::scale_for_quantization(chunk_out, opts.quantization_unit);
         }
@@ -292,7 +209,6 @@ bool p_whiten_clips(QString clips_path, QString whitening_matrix, QString clips_
     /*
     {
         // The following is needed to make the output deterministic, due to a very tricky floating-point problem that I honestly could not track down
-        // It has something to do with multiplying by very small values of WWptr[bb]. But I truly could not pinpoint the exact problem.
         P_whiten::quantize(clips_out.totalSize(), clips_out.dataPtr(), 0.0001);
     }
     */
@@ -308,15 +224,15 @@ bool p_apply_whitening_matrix(QString timeseries, QString whitening_matrix, QStr
     bigint M = X.N1();
     bigint N = X.N2();
 
-    bigint processing_chunk_size = 1e7;
+    bigint processing_chunk_size = 1e5;
     bigint chunk_size = processing_chunk_size;
     if (N < processing_chunk_size) {
         chunk_size = N;
     }
 
-    Mda WW(whitening_matrix);
-
-    double* WWptr = WW.dataPtr();
+    Mda32 WW32(whitening_matrix);
+    //the matrix comes from the user, so it need not be symmetric -- as always, the timeseries is multiplied by its transpose
+    Mda32 WWt32 = P_whiten::transpose(WW32);
 
     DiskWriteMda Y;
     int dtype = MDAIO_TYPE_FLOAT32;
@@ -324,48 +240,18 @@ bool p_apply_whitening_matrix(QString timeseries, QString whitening_matrix, QStr
         dtype = MDAIO_TYPE_INT16;
     Y.open(dtype, timeseries_out, M, N);
     {
-        QTime timer;
-        timer.start();
-        bigint num_timepoints_handled = 0;
-#pragma omp parallel for
-        for (bigint timepoint = 0; timepoint < N; timepoint += chunk_size) {
-            Mda32 chunk_in;
-#pragma omp critical(lock1)
-            {
-                if (!X.readChunk(chunk_in, 0, timepoint, M, qMin(chunk_size, N - timepoint))) {
-                    qWarning() << "Problem reading chunk in whiten (3)";
-                }
-            }
-            float* chunk_in_ptr = chunk_in.dataPtr();
-            Mda32 chunk_out(M, chunk_in.N2());
-            float* chunk_out_ptr = chunk_out.dataPtr();
-            for (bigint i = 0; i < chunk_in.N2(); i++) { // explicitly do mat-mat mult ... TODO replace w/ BLAS3
-                bigint aa = M * i;
-                bigint bb = 0;
-                for (bigint m1 = 0; m1 < M; m1++) {
-                    for (bigint m2 = 0; m2 < M; m2++) {
-                        chunk_out_ptr[aa + m1] += chunk_in_ptr[aa + m2] * WWptr[bb]; // actually this does dgemm w/ WW^T
-                        bb++; // but since symmetric, doesn't matter.
-                    }
-                }
-            }
-#pragma omp critical(lock2)
-            {
-                // The following is needed to make the output deterministic, due to a very tricky floating-point problem that I honestly could not track down
-                // It has something to do with multiplying by very small values of WWptr[bb]. But I truly could not pinpoint the exact problem.
-                P_whiten::quantize(chunk_out.totalSize(), chunk_out.dataPtr(), 0.0001);
-                if (opts.quantization_unit > 0) {
-                    P_whiten::scale_for_quantization(chunk_out, opts.quantization_unit);
-                }
-                if (!Y.writeChunk(chunk_out, 0, timepoint)) {
-                    qWarning() << "Problem writing chunk in apply whitening matrix";
-                }
-                num_timepoints_handled += qMin(chunk_size, N - timepoint);
-                if ((timer.elapsed() > 5000) || (num_timepoints_handled == N)) {
-                    printf("%ld/%ld (%d%%)\n", num_timepoints_handled, N, (int)(num_timepoints_handled * 1.0 / N * 100));
-                    timer.restart();
-                }
-            }
+        ChunkPipelineOpts pipeline_opts;
+        pipeline_opts.chunk_size = chunk_size;
+        pipeline_opts.num_threads = omp_get_max_threads();
+        ChunkPipeline pipeline(X, pipeline_opts);
+        pipeline.setOutput(&Y);
+        bool ok = pipeline.run([&](ChunkPipelineChunk& chunk) {
+            P_whiten::apply_whitening_matrix(chunk, M, WWt32, opts);
+            return true;
+        });
+        if (!ok) {
+            qWarning() << "Problem in apply whitening matrix";
+            return false;
         }
     }
     Y.close();
@@ -388,6 +274,29 @@ Mda32 extract_channels_from_chunk(const Mda32& X, const QList<int>& channels)
     return ret;
 }
 
+Mda32 transpose(const Mda32& A)
+{
+    Mda32 ret(A.N2(), A.N1());
+    for (bigint i = 0; i < A.N1(); i++) {
+        for (bigint j = 0; j < A.N2(); j++) {
+            ret.set(A.get(i, j), j, i);
+        }
+    }
+    return ret;
+}
+
+void apply_whitening_matrix(ChunkPipelineChunk& chunk, bigint M, const Mda32& WWt, const Whiten_opts& opts)
+{
+    //WWt is the transpose of the whitening matrix WW, so that this computes WW^T * X as the original code did
+    chunk.output.allocate(M, chunk.size);
+    blas_sgemm(M, chunk.size, M, WWt.constDataPtr(), chunk.data.constDataPtr(), chunk.output.dataPtr(), false);
+    // The following is needed to make the output deterministic, due to a very tricky floating-point problem that I honestly could not track down
+    quantize(chunk.output.totalSize(), chunk.output.dataPtr(), 0.0001);
+    if (opts.quantization_unit > 0) {
+        scale_for_quantization(chunk.output, opts.quantization_unit);
+    }
+}
+
 void scale_for_quantization(Mda32& X, double quantization_unit)
 {
     bigint N = X.totalSize();
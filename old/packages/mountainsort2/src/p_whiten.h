@@ -2,6 +2,8 @@
 #define P_WHITEN_H
 
 #include <QString>
+#include "mlcommon.h"
+#include "mda32.h"
 
 struct Whiten_opts {
     double quantization_unit = 0;
@@ -12,4 +14,12 @@ bool p_compute_whitening_matrix(QStringList timeseries_list, const QList<int>& c
 bool p_apply_whitening_matrix(QString timeseries, QString whitening_matrix, QString timeseries_out, Whiten_opts opts);
 bool p_whiten_clips(QString clips, QString whitening_matrix, QString clips_out, Whiten_opts opts);
 
+//For processors that whiten their own chunks (see p_filter_whiten_detect)
+namespace P_whiten {
+//rounds to a multiple of unit, which makes the whitened output deterministic
+void quantize(bigint N, float* X, double unit);
+//for the int16 output when a quantization_unit is given
+void scale_for_quantization(Mda32& X, double quantization_unit);
+}
+
 #endif // P_WHITEN_H
@@ -1,10 +1,11 @@
 TEMPLATE = subdirs
 #SUBDIRS = mda mlcompute taskprogress \
 
-SUBDIRS =    mda mlcompute taskprogress \
+SUBDIRS =    mda diskreadmda mlcompute taskprogress \
 	     objectregistry \
 	     mlprivate \
 	     componentmanager \
     counters \
     processmanager \
-    signalhandler
+    signalhandler \
+    templateaccumulator
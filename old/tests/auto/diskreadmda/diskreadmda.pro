@@ -0,0 +1,15 @@
+QT       += testlib
+
+QT       -= gui
+
+TARGET = tst_diskreadmdatest
+CONFIG   += console c++11
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+include(../../../mlcommon/mlcommon.pri)
+include(../../../mlcommon/mda.pri)
+
+SOURCES += tst_diskreadmdatest.cpp
+DEFINES += SRCDIR=\\\"$$PWD/\\\"
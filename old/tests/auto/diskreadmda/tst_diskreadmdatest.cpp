@@ -0,0 +1,151 @@
+#include <QString>
+#include <QtTest>
+#include <QTemporaryDir>
+#include "mda/mda.h"
+#include "mda/mda32.h"
+#include "mda/diskreadmda.h"
+#include "mda/diskreadmda32.h"
+#include <objectregistry.h>
+#include <thread>
+#include <vector>
+
+class DiskReadMdaTest : public QObject {
+    Q_OBJECT
+
+public:
+    DiskReadMdaTest();
+
+private Q_SLOTS:
+    void mmap_matches_buffered32();
+    void mmap_converts_float64();
+    void mmap_view();
+    void concurrent_reads();
+
+private:
+    ObjectRegistry m_registry; // prevent warnings about missing registry
+    QTemporaryDir m_dir;
+    Mda32 make_array(bigint N1, bigint N2);
+};
+
+DiskReadMdaTest::DiskReadMdaTest()
+{
+}
+
+Mda32 DiskReadMdaTest::make_array(bigint N1, bigint N2)
+{
+    Mda32 X(N1, N2);
+    for (bigint i = 0; i < X.totalSize(); i++) {
+        X.set(i * 0.5 - 3, i);
+    }
+    return X;
+}
+
+void DiskReadMdaTest::mmap_matches_buffered32()
+{
+    Mda32 X = make_array(4, 1000);
+    QString path = m_dir.path() + "/X32.mda";
+    QVERIFY(X.write32(path));
+
+    DiskReadMda32 A(path);
+    DiskReadMda32 B(path);
+    B.setMemoryMapped(true);
+    QVERIFY(B.isMemoryMapped());
+
+    Mda32 chunkA, chunkB;
+    QVERIFY(A.readChunk(chunkA, 0, 10, 4, 100));
+    QVERIFY(B.readChunk(chunkB, 0, 10, 4, 100));
+    for (bigint i = 0; i < chunkA.totalSize(); i++) {
+        QCOMPARE(chunkB.get(i), chunkA.get(i));
+    }
+
+    //reading past the end pads with zeros for both backends
+    QVERIFY(A.readChunk(chunkA, 0, 990, 4, 20));
+    QVERIFY(B.readChunk(chunkB, 0, 990, 4, 20));
+    for (bigint i = 0; i < chunkA.totalSize(); i++) {
+        QCOMPARE(chunkB.get(i), chunkA.get(i));
+    }
+    QCOMPARE(B.value(3, 999), X.value(3, 999));
+}
+
+void DiskReadMdaTest::mmap_converts_float64()
+{
+    Mda32 X = make_array(3, 500);
+    QString path = m_dir.path() + "/X64.mda";
+    QVERIFY(X.write64(path));
+
+    DiskReadMda32 A(path);
+    A.setMemoryMapped(true);
+    Mda32 chunk;
+    QVERIFY(A.readChunk(chunk, 0, 0, 3, 500));
+    for (bigint i = 0; i < chunk.totalSize(); i++) {
+        QCOMPARE(chunk.get(i), X.get(i));
+    }
+    //types do not match, so there is no zero-copy view
+    QVERIFY(A.readChunkView(0, 10) == 0);
+
+    DiskReadMda B(path);
+    B.setMemoryMapped(true);
+    Mda chunk64;
+    QVERIFY(B.readChunk(chunk64, 0, 7, 3, 10));
+    QCOMPARE(chunk64.get(0), (double)X.get(0, 7));
+}
+
+void DiskReadMdaTest::mmap_view()
+{
+    Mda32 X = make_array(4, 1000);
+    QString path = m_dir.path() + "/X32_view.mda";
+    QVERIFY(X.write32(path));
+
+    DiskReadMda32 A(path);
+    QVERIFY(A.readChunkView(0, 10) == 0); //not memory-mapped
+    A.setMemoryMapped(true);
+    A.setAccessPattern(DiskReadMda32::SequentialAccess);
+    const dtype32* ptr = A.readChunkView(4 * 20, 4 * 30);
+    QVERIFY(ptr != 0);
+    for (bigint i = 0; i < 4 * 30; i++) {
+        QCOMPARE(ptr[i], X.get(4 * 20 + i));
+    }
+    QVERIFY(A.readChunkView(4 * 990, 4 * 20) == 0); //out of range
+
+    DiskReadMda32 B(X);
+    QVERIFY(B.readChunkView(5, 5) != 0); //in-memory arrays always have a view
+}
+
+void DiskReadMdaTest::concurrent_reads()
+{
+    Mda32 X = make_array(8, 20000);
+    QString path = m_dir.path() + "/X32_concurrent.mda";
+    QVERIFY(X.write32(path));
+
+    DiskReadMda32 A(path); //deliberately not opened before the threads start
+    const int num_threads = 8;
+    std::vector<int> num_mismatches(num_threads, 0);
+    std::vector<std::thread> threads;
+    for (int j = 0; j < num_threads; j++) {
+        threads.push_back(std::thread([&A, &X, &num_mismatches, j]() {
+            Mda32 chunk;
+            for (bigint t = j * 100; t + 500 <= 20000; t += 700) {
+                if (!A.readChunk(chunk, 0, t, 8, 500)) {
+                    num_mismatches[j]++;
+                    continue;
+                }
+                for (bigint i = 0; i < chunk.totalSize(); i++) {
+                    if (chunk.get(i) != X.get(8 * t + i))
+                        num_mismatches[j]++;
+                }
+                if (A.value(3, t) != X.get(3, t))
+                    num_mismatches[j]++;
+            }
+        }));
+    }
+    for (size_t j = 0; j < threads.size(); j++) {
+        threads[j].join();
+    }
+    for (int j = 0; j < num_threads; j++) {
+        QCOMPARE(num_mismatches[j], 0);
+    }
+}
+
+QTEST_APPLESS_MAIN(DiskReadMdaTest)
+
+#include "tst_diskreadmdatest.moc"
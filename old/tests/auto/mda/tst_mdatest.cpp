@@ -1,6 +1,7 @@
 #include <QString>
 #include <QtTest>
 #include "mda/mda.h"
+#include "mda/mdaarena.h"
 #include <objectregistry.h>
 
 using VD = QVector<double>;
@@ -19,6 +20,8 @@ private Q_SLOTS:
     void get1();
     void get1_data();
     void invalid_readfile();
+    void reallocate();
+    void arena();
 
 private:
     ObjectRegistry m_registry; // prevent warnings about missing registry
@@ -223,6 +226,48 @@ void MdaTest::invalid_readfile()
     QCOMPARE(mda.N2(), bigint(1));
 }
 
+void MdaTest::reallocate()
+{
+    Mda mda(2, 3);
+    mda.setValue(5, 1, 2);
+    double* ptr = mda.dataPtr();
+    bigint reused_before = MdaArena::reusedBytes();
+    QCOMPARE(mda.reallocate(2, 3), true);
+    QVERIFY2(mda.dataPtr() == ptr, "Same shape should keep the buffer");
+    QCOMPARE(mda.value(1, 2), 5.0);
+    QCOMPARE(MdaArena::reusedBytes() - reused_before, bigint(2 * 3 * sizeof(double))); // counted as reused, like a buffer from the arena
+
+    // a shared buffer must not be modified
+    Mda copy = mda;
+    QCOMPARE(mda.reallocate(2, 3), true);
+    mda.setValue(7, 1, 2);
+    QCOMPARE(copy.value(1, 2), 5.0);
+
+    QCOMPARE(mda.reallocate(4, 5, 6), true);
+    QCOMPARE(mda.N1(), bigint(4));
+    QCOMPARE(mda.N2(), bigint(5));
+    QCOMPARE(mda.N3(), bigint(6));
+    QCOMPARE(mda.totalSize(), bigint(120));
+}
+
+void MdaTest::arena()
+{
+    MdaArena::setEnabled(true);
+    bigint reused_before = MdaArena::reusedBytes();
+    double* ptr = 0;
+    {
+        Mda tmp(100, 100);
+        tmp.setValue(3, 10, 10);
+        ptr = tmp.dataPtr();
+    }
+    Mda mda(100, 100);
+    QVERIFY2(mda.dataPtr() == ptr, "Buffer should come from the free list");
+    QCOMPARE(MdaArena::reusedBytes() - reused_before, bigint(100 * 100 * sizeof(double)));
+    QCOMPARE(mda.maximum(), 0.0); // allocate still zero-fills a reused buffer
+    MdaArena::releaseThreadCache();
+    MdaArena::setEnabled(false);
+}
+
 QTEST_APPLESS_MAIN(MdaTest)
 
 #include "tst_mdatest.moc"
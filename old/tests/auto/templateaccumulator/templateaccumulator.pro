@@ -0,0 +1,20 @@
+QT       += testlib
+
+QT       -= gui
+
+TARGET = tst_templateaccumulatortest
+CONFIG   += console c++11
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+include(../../../mlcommon/mlcommon.pri)
+include(../../../mlcommon/mda.pri)
+
+INCLUDEPATH += ../../../mountainsort/src/utils
+VPATH += ../../../mountainsort/src/utils
+HEADERS += template_accumulator.h compute_templates_0.h
+SOURCES += template_accumulator.cpp compute_templates_0.cpp
+
+SOURCES += tst_templateaccumulatortest.cpp
+DEFINES += SRCDIR=\\\"$$PWD/\\\"
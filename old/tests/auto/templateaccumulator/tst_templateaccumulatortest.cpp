@@ -0,0 +1,224 @@
+#include <QString>
+#include <QtTest>
+#include "mda/mda.h"
+#include "mda/mda32.h"
+#include "mda/diskreadmda32.h"
+#include "compute_templates_0.h"
+#include "template_accumulator.h"
+#include <objectregistry.h>
+#include <math.h>
+
+class TemplateAccumulatorTest : public QObject {
+    Q_OBJECT
+
+public:
+    TemplateAccumulatorTest();
+
+private Q_SLOTS:
+    void templates_in_parallel_matches_baseline();
+    void templates_0_matches_baseline();
+    void deterministic();
+
+private:
+    ObjectRegistry m_registry; // prevent warnings about missing registry
+    Mda32 make_timeseries(bigint M, bigint N);
+    void edge_events(QVector<double>& times, QVector<int>& labels, bigint N);
+    void compare(const Mda32& A, const Mda32& B);
+};
+
+//compute_templates_in_parallel as it was before TemplateAccumulator (without the omp pragmas)
+static void baseline_get_sums_and_counts_for_templates(Mda& sums, Mda& counts, const Mda32& X, bigint t_offset, const QVector<double>& times, const QVector<int>& labels, int clip_size, int K)
+{
+    int M = X.N1();
+    bigint N = X.N2();
+    int T = clip_size;
+    int Tmid = (int)((T + 1) / 2) - 1;
+    sums.allocate(M, T, K);
+    counts.allocate(1, K);
+    for (bigint i = 0; i < times.count(); i++) {
+        bigint t = times[i] - t_offset;
+        if ((t >= clip_size) && (t < N - clip_size)) {
+            int k = labels[i];
+            if ((k >= 1) && (k <= K)) {
+                Mda32 clip;
+                X.getChunk(clip, 0, t - Tmid, M, T);
+                for (int t = 0; t < T; t++) {
+                    for (int m = 0; m < M; m++) {
+                        sums.setValue(sums.value(m, t, k - 1) + clip.value(m, t), m, t, k - 1);
+                    }
+                }
+                counts.set(counts.get(k - 1) + 1, k - 1);
+            }
+        }
+    }
+}
+
+static Mda32 baseline_compute_templates_in_parallel(const DiskReadMda32& X, const QVector<double>& times, const QVector<int>& labels, int clip_size)
+{
+    int M = X.N1();
+    bigint N = X.N2();
+    int T = clip_size;
+    int K = MLCompute::max<int>(labels);
+
+    Mda sums(M, T, K);
+    Mda counts(1, K);
+
+    bigint chunk_size = 1e5;
+    for (bigint t = 0; t < N; t += chunk_size) {
+        Mda32 chunk;
+        X.readChunk(chunk, 0, t - clip_size, M, chunk_size + 2 * clip_size);
+        Mda sums0;
+        Mda counts0;
+        baseline_get_sums_and_counts_for_templates(sums0, counts0, chunk, t - clip_size, times, labels, clip_size, K);
+        for (bigint i = 0; i < M * T * K; i++) {
+            sums.set(sums.get(i) + sums0.get(i), i);
+        }
+        for (int i = 0; i < K; i++) {
+            counts.set(counts.get(i) + counts0.get(i), i);
+        }
+    }
+    Mda32 ret(M, T, K);
+    for (int k = 0; k < K; k++) {
+        if (counts.get(k)) {
+            for (int t = 0; t < T; t++) {
+                for (int m = 0; m < M; m++) {
+                    ret.setValue(sums.value(m, t, k) / counts.get(k), m, t, k);
+                }
+            }
+        }
+    }
+    return ret;
+}
+
+//compute_templates_0 (Mda32 version) as it was before TemplateAccumulator
+static Mda32 baseline_compute_templates_0(const DiskReadMda32& X, const QVector<double>& times, const QVector<int>& labels, int clip_size)
+{
+    int M = X.N1();
+    int T = clip_size;
+    int L = times.count();
+    int K = MLCompute::max<int>(labels);
+    int Tmid = (int)((T + 1) / 2) - 1;
+
+    Mda templates(M, T, K);
+    QList<int> counts;
+    for (int k = 0; k < K; k++)
+        counts << 0;
+    for (int i = 0; i < L; i++) {
+        int k = labels[i];
+        int t0 = (int)(times[i] + 0.5);
+        if (k >= 1) {
+            Mda32 X0;
+            X.readChunk(X0, 0, t0 - Tmid, M, T);
+            for (int j = 0; j < M * T; j++) {
+                templates.set(templates.get(j + M * T * (k - 1)) + X0.get(j), j + M * T * (k - 1));
+            }
+            counts[k - 1]++;
+        }
+    }
+    Mda32 ret(M, T, K);
+    for (int k = 0; k < K; k++) {
+        for (bigint j = 0; j < M * T; j++) {
+            if (counts[k])
+                ret.set(templates.get(j + M * T * k) / counts[k], j + M * T * k);
+        }
+    }
+    return ret;
+}
+
+TemplateAccumulatorTest::TemplateAccumulatorTest()
+{
+}
+
+Mda32 TemplateAccumulatorTest::make_timeseries(bigint M, bigint N)
+{
+    Mda32 X(M, N);
+    for (bigint i = 0; i < X.totalSize(); i++) {
+        X.set(sin(i * 0.37) * 10 + (i % 7), i);
+    }
+    return X;
+}
+
+void TemplateAccumulatorTest::edge_events(QVector<double>& times, QVector<int>& labels, bigint N)
+{
+    //clips hanging over either end, fractional times, and events well outside the timeseries
+    double edge_times[] = { 0, 0.4, 0.7, 1, 2.5, 3, 4, 4.6, 7, 250, 250.5, 501.2, (double)N - 5, N - 4.5, (double)N - 2, N - 1.3, (double)N - 1, -2, -7.5, (double)N + 300000 };
+    int num = sizeof(edge_times) / sizeof(double);
+    for (int i = 0; i < num; i++) {
+        times << edge_times[i];
+        labels << 1 + (i % 3);
+    }
+    //plus many ordinary ones, spread over several chunks
+    for (int i = 0; i < 3000; i++) {
+        times << 10 + ((i * 7919) % (N - 20)) + 0.25 * (i % 4);
+        labels << 1 + (i % 4);
+    }
+}
+
+void TemplateAccumulatorTest::compare(const Mda32& A, const Mda32& B)
+{
+    QCOMPARE(A.N1(), B.N1());
+    QCOMPARE(A.N2(), B.N2());
+    QCOMPARE(A.N3(), B.N3());
+    for (bigint i = 0; i < A.totalSize(); i++) {
+        if (fabs(A.get(i) - B.get(i)) > 1e-4) {
+            QFAIL(qPrintable(QString("Mismatch at %1: %2 <> %3").arg(i).arg(A.get(i)).arg(B.get(i))));
+        }
+    }
+}
+
+void TemplateAccumulatorTest::templates_in_parallel_matches_baseline()
+{
+    bigint N = 250000;
+    DiskReadMda32 X(make_timeseries(4, N));
+    QVector<double> times;
+    QVector<int> labels;
+    edge_events(times, labels, N);
+    compare(compute_templates_in_parallel(X, times, labels, 9), baseline_compute_templates_in_parallel(X, times, labels, 9));
+    compare(compute_templates_in_parallel(X, times, labels, 10), baseline_compute_templates_in_parallel(X, times, labels, 10));
+}
+
+void TemplateAccumulatorTest::templates_0_matches_baseline()
+{
+    bigint N = 250000;
+    DiskReadMda32 X(make_timeseries(4, N));
+    QVector<double> times;
+    QVector<int> labels;
+    edge_events(times, labels, N);
+    compare(compute_templates_0(X, times, labels, 9), baseline_compute_templates_0(X, times, labels, 9));
+    compare(compute_templates_0(X, times, labels, 10), baseline_compute_templates_0(X, times, labels, 10));
+}
+
+void TemplateAccumulatorTest::deterministic()
+{
+    bigint N = 250000;
+    DiskReadMda32 X(make_timeseries(4, N));
+    QVector<double> times;
+    QVector<int> labels;
+    edge_events(times, labels, N);
+    TemplateAccumulatorOpts opts;
+    opts.chunk_size = 1000; //many chunks
+    opts.compute_stdevs = true;
+    Mda32 templates0, stdevs0;
+    for (int pass = 0; pass < 5; pass++) {
+        opts.num_threads = 1 + pass;
+        TemplateAccumulator accumulator(4, 10, 4, opts);
+        QVERIFY(accumulator.addClipsFromTimeseries(X, times, labels));
+        accumulator.finalize();
+        if (pass == 0) {
+            templates0 = accumulator.templates();
+            stdevs0 = accumulator.stdevs();
+        }
+        else {
+            Mda32 templates = accumulator.templates();
+            Mda32 stdevs = accumulator.stdevs();
+            for (bigint i = 0; i < templates.totalSize(); i++) {
+                QCOMPARE(templates.get(i), templates0.get(i));
+                QCOMPARE(stdevs.get(i), stdevs0.get(i));
+            }
+        }
+    }
+}
+
+QTEST_APPLESS_MAIN(TemplateAccumulatorTest)
+
+#include "tst_templateaccumulatortest.moc"